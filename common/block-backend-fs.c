@@ -100,6 +100,20 @@ block_backend_fs_read_block (BlockBackend *bend,
     return (readn (handle->fd, buf, len));
 }
 
+static int
+block_backend_fs_seek_block (BlockBackend *bend,
+                             BHandle *handle,
+                             guint32 offset)
+{
+    if (lseek (handle->fd, (off_t)offset, SEEK_SET) < 0) {
+        syncw_warning ("[block bend] failed to seek in block %s:%s: %s\n",
+                      handle->store_id, handle->block_id, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
 static int
 block_backend_fs_write_block (BlockBackend *bend,
                                 BHandle *handle,
@@ -132,6 +146,34 @@ block_backend_fs_block_handle_free (BlockBackend *bend,
     g_free (handle);
 }
 
+static int
+block_backend_fs_dup_fd (BlockBackend *bend, BHandle *handle)
+{
+    int fd;
+
+    if (handle->rw_type != BLOCK_READ)
+        return -1;
+
+    fd = dup (handle->fd);
+    if (fd < 0) {
+        syncw_warning ("[block bend] failed to dup fd of block %s:%s: %s\n",
+                      handle->store_id, handle->block_id, strerror(errno));
+        return -1;
+    }
+
+    return fd;
+}
+
+static void
+block_backend_fs_get_handle_ids (BlockBackend *bend, BHandle *handle,
+                                 const char **store_id, int *version,
+                                 const char **block_id)
+{
+    *store_id = handle->store_id;
+    *version = handle->version;
+    *block_id = handle->block_id;
+}
+
 static int
 create_parent_path (const char *path)
 {
@@ -472,6 +514,7 @@ block_backend_fs_new (const char *syncw_dir, const char *tmp_dir)
 
     bend->open_block = block_backend_fs_open_block;
     bend->read_block = block_backend_fs_read_block;
+    bend->seek_block = block_backend_fs_seek_block;
     bend->write_block = block_backend_fs_write_block;
     bend->commit_block = block_backend_fs_commit_block;
     bend->close_block = block_backend_fs_close_block;
@@ -480,6 +523,8 @@ block_backend_fs_new (const char *syncw_dir, const char *tmp_dir)
     bend->stat_block = block_backend_fs_stat_block;
     bend->stat_block_by_handle = block_backend_fs_stat_block_by_handle;
     bend->block_handle_free = block_backend_fs_block_handle_free;
+    bend->dup_fd = block_backend_fs_dup_fd;
+    bend->get_handle_ids = block_backend_fs_get_handle_ids;
     bend->foreach_block = block_backend_fs_foreach_block;
     bend->remove_store = block_backend_fs_remove_store;
     bend->copy = block_backend_fs_copy;
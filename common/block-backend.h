@@ -14,6 +14,9 @@ struct BlockBackend {
                             const char *block_id, int rw_type);
 
     int      (*read_block) (BlockBackend *bend, BHandle *handle, void *buf, int len);
+
+    /* Optional. Move the read position of a block opened for read. */
+    int      (*seek_block) (BlockBackend *bend, BHandle *handle, guint32 offset);
     
     int      (*write_block) (BlockBackend *bend, BHandle *handle, const void *buf, int len);
     
@@ -37,6 +40,18 @@ struct BlockBackend {
 
     void     (*block_handle_free) (BlockBackend *bend, BHandle *handle);
 
+    /* Optional. Return a new file descriptor for the data of a block opened
+     * for read, or -1 if blocks are not stored as plain files.
+     */
+    int      (*dup_fd) (BlockBackend *bend, BHandle *handle);
+
+    /* Optional. Get the ids of an open block. The strings are owned
+     * by the handle.
+     */
+    void     (*get_handle_ids) (BlockBackend *bend, BHandle *handle,
+                                const char **store_id, int *version,
+                                const char **block_id);
+
     int      (*foreach_block) (BlockBackend *bend,
                                const char *store_id,
                                int version,
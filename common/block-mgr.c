@@ -18,6 +18,7 @@
 #include <glib/gstdio.h>
 
 #include "block-backend.h"
+#include "exist-index.h"
 
 #define SYNCW_BLOCK_DIR "blocks"
 
@@ -80,6 +81,29 @@ syncw_block_manager_read_block (SyncwBlockManager *mgr,
     return mgr->backend->read_block (mgr->backend, handle, buf, len);
 }
 
+int
+syncw_block_manager_seek_block (SyncwBlockManager *mgr,
+                               BlockHandle *handle,
+                               guint32 offset)
+{
+    char buf[1 << 16];
+    int n;
+
+    if (mgr->backend->seek_block)
+        return mgr->backend->seek_block (mgr->backend, handle, offset);
+
+    /* Read up to the offset if the backend can't seek. */
+    while (offset > 0) {
+        n = mgr->backend->read_block (mgr->backend, handle, buf,
+                                      MIN (offset, sizeof(buf)));
+        if (n <= 0)
+            return -1;
+        offset -= n;
+    }
+
+    return 0;
+}
+
 int
 syncw_block_manager_write_block (SyncwBlockManager *mgr,
                                 BlockHandle *handle,
@@ -102,11 +126,40 @@ syncw_block_manager_block_handle_free (SyncwBlockManager *mgr,
     return mgr->backend->block_handle_free (mgr->backend, handle);
 }
 
+int
+syncw_block_manager_dup_block_fd (SyncwBlockManager *mgr,
+                                 BlockHandle *handle)
+{
+    if (!mgr->backend->dup_fd)
+        return -1;
+
+    return mgr->backend->dup_fd (mgr->backend, handle);
+}
+
+gboolean
+syncw_block_manager_can_dup_block_fd (SyncwBlockManager *mgr)
+{
+    return mgr->backend->dup_fd != NULL;
+}
+
 int
 syncw_block_manager_commit_block (SyncwBlockManager *mgr,
                                  BlockHandle *handle)
 {
-    return mgr->backend->commit_block (mgr->backend, handle);
+    const char *store_id, *block_id;
+    int version;
+
+    if (mgr->backend->commit_block (mgr->backend, handle) < 0)
+        return -1;
+
+    if (mgr->exist_index && mgr->backend->get_handle_ids) {
+        mgr->backend->get_handle_ids (mgr->backend, handle,
+                                      &store_id, &version, &block_id);
+        if (version > 0)
+            exist_index_add (mgr->exist_index, store_id, block_id);
+    }
+
+    return 0;
 }
     
 gboolean syncw_block_manager_block_exists (SyncwBlockManager *mgr,
@@ -121,6 +174,43 @@ gboolean syncw_block_manager_block_exists (SyncwBlockManager *mgr,
     return mgr->backend->exists (mgr->backend, store_id, version, block_id);
 }
 
+static int
+scan_store_blocks (void *scan_data, const char *store_id,
+                   ExistIndexAddFunc add, void *add_data)
+{
+    SyncwBlockManager *mgr = scan_data;
+
+    return syncw_block_manager_foreach_block (mgr, store_id, 1, add, add_data);
+}
+
+int
+syncw_block_manager_enable_exist_index (SyncwBlockManager *mgr)
+{
+    mgr->exist_index = exist_index_new ("block", scan_store_blocks, mgr);
+    if (!mgr->exist_index)
+        return -1;
+
+    return 0;
+}
+
+gboolean
+syncw_block_manager_block_exists_indexed (SyncwBlockManager *mgr,
+                                         const char *store_id,
+                                         int version,
+                                         const char *block_id)
+{
+    if (!store_id || !is_uuid_valid(store_id) ||
+        !block_id || !is_object_id_valid(block_id))
+        return FALSE;
+
+    if (mgr->exist_index && version > 0 &&
+        exist_index_lookup (mgr->exist_index,
+                            store_id, block_id) == EXIST_INDEX_ABSENT)
+        return FALSE;
+
+    return mgr->backend->exists (mgr->backend, store_id, version, block_id);
+}
+
 int
 syncw_block_manager_remove_block (SyncwBlockManager *mgr,
                                  const char *store_id,
@@ -177,12 +267,18 @@ syncw_block_manager_copy_block (SyncwBlockManager *mgr,
     if (strcmp (block_id, EMPTY_SHA1) == 0)
         return 0;
 
-    return mgr->backend->copy (mgr->backend,
-                               src_store_id,
-                               src_version,
-                               dst_store_id,
-                               dst_version,
-                               block_id);
+    if (mgr->backend->copy (mgr->backend,
+                            src_store_id,
+                            src_version,
+                            dst_store_id,
+                            dst_version,
+                            block_id) < 0)
+        return -1;
+
+    if (mgr->exist_index && dst_version > 0)
+        exist_index_add (mgr->exist_index, dst_store_id, block_id);
+
+    return 0;
 }
 
 static gboolean
@@ -264,5 +360,8 @@ int
 syncw_block_manager_remove_store (SyncwBlockManager *mgr,
                                  const char *store_id)
 {
+    if (mgr->exist_index)
+        exist_index_remove_store (mgr->exist_index, store_id);
+
     return mgr->backend->remove_store (mgr->backend, store_id);
 }
@@ -17,6 +17,9 @@ struct _SyncwBlockManager {
     struct _SyncwerkSession *syncw;
 
     struct BlockBackend *backend;
+
+    /* Only created when enabled. */
+    struct ExistIndex *exist_index;
 };
 
 
@@ -55,6 +58,17 @@ syncw_block_manager_read_block (SyncwBlockManager *mgr,
                                BlockHandle *handle,
                                void *buf, int len);
 
+/*
+ * Move the read position of a block opened for read to @offset from the
+ * start of the block, so that the next read starts there.
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int
+syncw_block_manager_seek_block (SyncwBlockManager *mgr,
+                               BlockHandle *handle,
+                               guint32 offset);
+
 /*
  * Write data to a block.
  * The semantics is similar to writen.
@@ -97,12 +111,48 @@ void
 syncw_block_manager_block_handle_free (SyncwBlockManager *mgr,
                                       BlockHandle *handle);
 
+/*
+ * Get a file descriptor for the data of a block opened for read.
+ * The descriptor is owned by the caller and stays valid after the
+ * handle is closed. It can be passed to sendfile() to serve the block
+ * without copying it through user space.
+ *
+ * @handle: Hanlde returned by syncw_block_manager_open_block().
+ *
+ * Returns: a new fd, or -1 if the backend doesn't store blocks as files.
+ */
+int
+syncw_block_manager_dup_block_fd (SyncwBlockManager *mgr,
+                                 BlockHandle *handle);
+
+/* Whether the backend supports syncw_block_manager_dup_block_fd(). */
+gboolean
+syncw_block_manager_can_dup_block_fd (SyncwBlockManager *mgr);
+
 gboolean 
 syncw_block_manager_block_exists (SyncwBlockManager *mgr,
                                  const char *store_id,
                                  int version,
                                  const char *block_id);
 
+/*
+ * Keep an in-memory index of the blocks in each store, so that
+ * syncw_block_manager_block_exists_indexed() can tell most missing blocks
+ * without touching the disk.
+ */
+int
+syncw_block_manager_enable_exist_index (SyncwBlockManager *mgr);
+
+/*
+ * Same as syncw_block_manager_block_exists(), but blocks written by other
+ * processes may not be seen until the index of the store is reloaded.
+ */
+gboolean
+syncw_block_manager_block_exists_indexed (SyncwBlockManager *mgr,
+                                         const char *store_id,
+                                         int version,
+                                         const char *block_id);
+
 int
 syncw_block_manager_remove_block (SyncwBlockManager *mgr,
                                  const char *store_id,
@@ -13,6 +13,10 @@
 #include "branch-mgr.h"
 
 #define BRANCH_DB "branch.db"
+/* Seconds a cached master head is trusted. Branches may be changed by other
+ * processes, e.g. fsck or another server on the same db, which aren't seen.
+ */
+#define MASTER_HEAD_TTL 10
 
 SyncwBranch *
 syncw_branch_new (const char *name, const char *repo_id, const char *commit_id)
@@ -75,10 +79,30 @@ syncw_branch_unref (SyncwBranch *branch)
         syncw_branch_free (branch);
 }
 
+#ifdef SYNCWERK_SERVER
+typedef struct CachedHead {
+    char commit_id[41];
+    /* Cleared when the head has moved to an unknown commit. */
+    gboolean valid;
+    gint64 expire_time;
+    guint64 generation;
+} CachedHead;
+#endif
+
 struct _SyncwBranchManagerPriv {
     sqlite3 *db;
 #ifndef SYNCWERK_SERVER
     pthread_mutex_t db_lock;
+#else
+    /*
+     * Heads of master branches, repo_id -> CachedHead. Repos are added when
+     * first looked up or updated. Each update of a repo gives its entry a new
+     * generation, so that a head read from db before the update is not
+     * cached after it. Generations come from one counter and never repeat.
+     */
+    pthread_rwlock_t head_lock;
+    GHashTable *master_heads;
+    guint64 head_generation;
 #endif
 
 #if defined( SYNCWERK_SERVER ) && defined( FULL_FEATURE )
@@ -107,11 +131,53 @@ syncw_branch_manager_new (struct _SyncwerkSession *syncw)
 
 #ifndef SYNCWERK_SERVER
     pthread_mutex_init (&mgr->priv->db_lock, NULL);
+#else
+    pthread_rwlock_init (&mgr->priv->head_lock, NULL);
+    mgr->priv->master_heads = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, g_free);
 #endif
 
     return mgr;
 }
 
+#ifdef SYNCWERK_SERVER
+
+/*
+ * Move the cached master head of @repo_id from @old_commit_id to @commit_id.
+ * Updates are committed in order but may get here out of order, so the entry
+ * is invalidated if it's at any other commit. It's invalidated as well if
+ * either id is NULL, and reloaded from the db when it's read next.
+ */
+static void
+update_cached_head (SyncwBranchManager *mgr, const char *repo_id,
+                    const char *old_commit_id, const char *commit_id)
+{
+    SyncwBranchManagerPriv *priv = mgr->priv;
+    CachedHead *head;
+
+    pthread_rwlock_wrlock (&priv->head_lock);
+
+    /* Kept even if invalid, to tell loads in progress about the update. */
+    head = g_hash_table_lookup (priv->master_heads, repo_id);
+    if (!head) {
+        head = g_new0 (CachedHead, 1);
+        g_hash_table_insert (priv->master_heads, g_strdup (repo_id), head);
+    }
+    head->generation = ++priv->head_generation;
+
+    if (head->valid && old_commit_id && commit_id &&
+        strcmp (head->commit_id, old_commit_id) == 0) {
+        memcpy (head->commit_id, commit_id, 40);
+        head->expire_time = (gint64)time(NULL) + MASTER_HEAD_TTL;
+    } else {
+        head->valid = FALSE;
+    }
+
+    pthread_rwlock_unlock (&priv->head_lock);
+}
+
+#endif
+
 int
 syncw_branch_manager_init (SyncwBranchManager *mgr)
 {
@@ -249,6 +315,9 @@ syncw_branch_manager_add_branch (SyncwBranchManager *mgr, SyncwBranch *branch)
         if (rc < 0)
             return -1;
     }
+
+    if (strcmp (branch->name, "master") == 0)
+        update_cached_head (mgr, branch->repo_id, NULL, NULL);
     return 0;
 #endif
 }
@@ -276,6 +345,8 @@ syncw_branch_manager_del_branch (SyncwBranchManager *mgr,
     int rc = syncwerk_server_db_statement_query (mgr->syncw->db,
                                       "DELETE FROM Branch WHERE name=? AND repo_id=?",
                                       2, "string", name, "string", repo_id);
+    if (strcmp (name, "master") == 0)
+        update_cached_head (mgr, repo_id, NULL, NULL);
     if (rc < 0)
         return -1;
     return 0;
@@ -308,6 +379,8 @@ syncw_branch_manager_update_branch (SyncwBranchManager *mgr, SyncwBranch *branch
                                       3, "string", branch->commit_id,
                                       "string", branch->name,
                                       "string", branch->repo_id);
+    if (strcmp (branch->name, "master") == 0)
+        update_cached_head (mgr, branch->repo_id, NULL, NULL);
     if (rc < 0)
         return -1;
     return 0;
@@ -353,6 +426,9 @@ publish_repo_update_event (CEvent *event, void *data)
 static void
 on_branch_updated (SyncwBranchManager *mgr, SyncwBranch *branch)
 {
+    /* Clients sync virtual repos too, so they're woken up as well. */
+    syncw_http_server_notify_head_changed (syncw->http_server, branch->repo_id);
+
     if (syncw_repo_manager_is_virtual_repo (syncw->repo_mgr, branch->repo_id))
         return;
 
@@ -424,6 +500,11 @@ syncw_branch_manager_test_and_update_branch (SyncwBranchManager *mgr,
 
     syncwerk_server_db_trans_close (trans);
 
+    /* Before waking up clients, so that they read the new head. */
+    if (strcmp (branch->name, "master") == 0)
+        update_cached_head (mgr, branch->repo_id,
+                            old_commit_id, branch->commit_id);
+
     on_branch_updated (mgr, branch);
 
     return 0;
@@ -548,6 +629,134 @@ syncw_branch_manager_get_branch (SyncwBranchManager *mgr,
     }
 }
 
+static gboolean
+collect_master_heads (SyncwDBRow *row, void *data)
+{
+    GHashTable *heads = data;
+    const char *repo_id = syncwerk_server_db_row_get_column_text (row, 0);
+    const char *commit_id = syncwerk_server_db_row_get_column_text (row, 1);
+
+    g_hash_table_replace (heads, g_strdup (repo_id), g_strdup (commit_id));
+
+    return TRUE;
+}
+
+static int
+load_master_heads (SyncwBranchManager *mgr, const char *id_list,
+                   GHashTable *heads)
+{
+    char *sql;
+    int ret;
+
+    if (syncwerk_server_db_type (mgr->syncw->db) == SYNCW_DB_TYPE_MYSQL)
+        sql = g_strdup_printf ("SELECT repo_id, commit_id FROM Branch WHERE name='master' AND repo_id IN (%s) LOCK IN SHARE MODE",
+                                id_list);
+    else
+        sql = g_strdup_printf ("SELECT repo_id, commit_id FROM Branch WHERE name='master' AND repo_id IN (%s)",
+                                id_list);
+    ret = syncwerk_server_db_statement_foreach_row (mgr->syncw->db, sql,
+                                                    collect_master_heads, heads, 0);
+    g_free (sql);
+
+    return ret < 0 ? -1 : 0;
+}
+
+GHashTable *
+syncw_branch_manager_get_master_heads (SyncwBranchManager *mgr,
+                                      char **repo_ids, int n_ids)
+{
+    SyncwBranchManagerPriv *priv = mgr->priv;
+    GHashTable *heads, *loaded = NULL;
+    GString *missing = NULL;
+    /* Generation of each missing repo when it's looked up, 0 if not cached. */
+    guint64 *generations;
+    GArray *missing_idx;
+    gint64 now = (gint64)time(NULL);
+    CachedHead *head;
+    const char *commit_id;
+    GHashTableIter iter;
+    gpointer key, value;
+    int i, idx;
+
+    heads = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    generations = g_new0 (guint64, n_ids);
+    missing_idx = g_array_new (FALSE, FALSE, sizeof(int));
+
+    pthread_rwlock_rdlock (&priv->head_lock);
+
+    for (i = 0; i < n_ids; ++i) {
+        head = g_hash_table_lookup (priv->master_heads, repo_ids[i]);
+        if (head && head->valid && head->expire_time > now) {
+            g_hash_table_replace (heads, g_strdup (repo_ids[i]),
+                                  g_strdup (head->commit_id));
+            continue;
+        }
+        /* The ids are put into the sql statement. */
+        if (!is_uuid_valid (repo_ids[i]))
+            continue;
+        generations[i] = head ? head->generation : 0;
+        g_array_append_val (missing_idx, i);
+        if (!missing)
+            missing = g_string_new ("");
+        else
+            g_string_append_c (missing, ',');
+        g_string_append_printf (missing, "'%s'", repo_ids[i]);
+    }
+
+    pthread_rwlock_unlock (&priv->head_lock);
+
+    if (!missing)
+        goto out;
+
+    loaded = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    if (load_master_heads (mgr, missing->str, loaded) < 0) {
+        syncw_warning ("[branch mgr] DB error when get master heads.\n");
+        g_hash_table_destroy (heads);
+        heads = NULL;
+        goto out;
+    }
+
+    pthread_rwlock_wrlock (&priv->head_lock);
+    for (i = 0; i < missing_idx->len; ++i) {
+        idx = g_array_index (missing_idx, int, i);
+        commit_id = g_hash_table_lookup (loaded, repo_ids[idx]);
+        if (!commit_id || strlen (commit_id) != 40)
+            continue;
+
+        /* Skip repos updated since they were looked up. */
+        head = g_hash_table_lookup (priv->master_heads, repo_ids[idx]);
+        if (!head) {
+            if (generations[idx] != 0)
+                continue;
+            head = g_new0 (CachedHead, 1);
+            head->generation = ++priv->head_generation;
+            g_hash_table_insert (priv->master_heads,
+                                 g_strdup (repo_ids[idx]), head);
+        } else if (head->generation != generations[idx]) {
+            continue;
+        }
+        memcpy (head->commit_id, commit_id, 40);
+        head->valid = TRUE;
+        head->expire_time = now + MASTER_HEAD_TTL;
+    }
+    pthread_rwlock_unlock (&priv->head_lock);
+
+    g_hash_table_iter_init (&iter, loaded);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        g_hash_table_iter_steal (&iter);
+        g_hash_table_replace (heads, key, value);
+    }
+
+out:
+    if (loaded)
+        g_hash_table_destroy (loaded);
+    if (missing)
+        g_string_free (missing, TRUE);
+    g_array_free (missing_idx, TRUE);
+    g_free (generations);
+    return heads;
+}
+
 #endif  /* not SYNCWERK_SERVER */
 
 gboolean
@@ -60,6 +60,17 @@ int
 syncw_branch_manager_test_and_update_branch (SyncwBranchManager *mgr,
                                             SyncwBranch *branch,
                                             const char *old_commit_id);
+
+/**
+ * Get the head commit ids of the master branches of @repo_ids, as a
+ * repo_id -> commit_id table. Heads are kept in memory once read, and
+ * updated along with the branches, so mostly no db query is needed.
+ * A cached head is reread from the db after a few seconds, since other
+ * processes may change branches too. Repos without a master branch are left out. Returns NULL on db error.
+ */
+GHashTable *
+syncw_branch_manager_get_master_heads (SyncwBranchManager *mgr,
+                                      char **repo_ids, int n_ids);
 #endif
 
 SyncwBranch *
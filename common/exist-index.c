@@ -0,0 +1,440 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "utils.h"
+#include "log.h"
+
+#include "exist-index.h"
+
+/* Power of 2. Stores are spread over the shards by id. */
+#define N_SHARDS 16
+#define MAX_STORES_PER_SHARD 16
+/* Memory of the id sets of all stores in an index. */
+#define MAX_INDEX_BYTES (256 << 20)
+#define INITIAL_SET_SIZE 1024
+#define SCAN_BATCH_SIZE 1024
+/* Stores are loaded in parallel, so a big one doesn't hold up the rest. */
+#define N_SCAN_THREADS 4
+
+/*
+ * Open addressing hash set of raw sha1 ids. The ids are random enough
+ * to be used as their own hash. An all-zero slot is empty, so the
+ * all-zero id is tracked separately.
+ */
+typedef struct IdSet {
+    guint8 *slots;
+    guint32 size;
+    guint32 n_ids;
+    gboolean has_zero;
+} IdSet;
+
+enum {
+    STORE_LOADING,
+    STORE_READY,
+};
+
+typedef struct StoreIndex {
+    char store_id[37];
+    int state;
+    /* Set when the store is dropped while it's being loaded.
+     * The scan thread frees it when done.
+     */
+    gboolean removed;
+    /* Set when the ids are dropped to stay within the memory budget.
+     * Lookups fall back to the storage until the store is evicted.
+     */
+    gboolean too_big;
+    gint64 last_used;
+    IdSet set;
+} StoreIndex;
+
+typedef struct IndexShard {
+    /* Protects @stores and their indexes. */
+    pthread_mutex_t lock;
+    GHashTable *stores;
+} IndexShard;
+
+struct ExistIndex {
+    char *name;
+    ExistIndexScanFunc scan;
+    void *scan_data;
+
+    IndexShard shards[N_SHARDS];
+
+    /* Bytes of all id sets. Taken after a shard lock. */
+    pthread_mutex_t budget_lock;
+    gint64 n_bytes;
+
+    GThreadPool *scan_pool;
+};
+
+static const guint8 zero_id[20];
+
+static inline guint32
+id_hash (const guint8 *id)
+{
+    guint32 h;
+    memcpy (&h, id, sizeof(h));
+    return h;
+}
+
+static gboolean
+id_set_contains (IdSet *set, const guint8 *id)
+{
+    guint32 mask = set->size - 1;
+    guint32 i = id_hash (id) & mask;
+    guint8 *slot;
+
+    if (memcmp (id, zero_id, 20) == 0)
+        return set->has_zero;
+    if (set->size == 0)
+        return FALSE;
+
+    while (1) {
+        slot = set->slots + i * 20;
+        if (memcmp (slot, zero_id, 20) == 0)
+            return FALSE;
+        if (memcmp (slot, id, 20) == 0)
+            return TRUE;
+        i = (i + 1) & mask;
+    }
+}
+
+static void
+id_set_insert_slot (guint8 *slots, guint32 size, const guint8 *id)
+{
+    guint32 mask = size - 1;
+    guint32 i = id_hash (id) & mask;
+    guint8 *slot;
+
+    while (1) {
+        slot = slots + i * 20;
+        if (memcmp (slot, zero_id, 20) == 0) {
+            memcpy (slot, id, 20);
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+static void
+id_set_grow (IdSet *set)
+{
+    guint32 new_size = set->size ? set->size * 2 : INITIAL_SET_SIZE;
+    guint8 *new_slots = g_malloc0 ((gsize)new_size * 20);
+    guint8 *slot;
+    guint32 i;
+
+    for (i = 0; i < set->size; ++i) {
+        slot = set->slots + i * 20;
+        if (memcmp (slot, zero_id, 20) != 0)
+            id_set_insert_slot (new_slots, new_size, slot);
+    }
+
+    g_free (set->slots);
+    set->slots = new_slots;
+    set->size = new_size;
+}
+
+static inline IndexShard *
+get_shard (ExistIndex *index, const char *store_id)
+{
+    return &index->shards[g_str_hash (store_id) & (N_SHARDS - 1)];
+}
+
+static gboolean
+reserve_bytes (ExistIndex *index, gint64 bytes)
+{
+    gboolean ret;
+
+    pthread_mutex_lock (&index->budget_lock);
+    ret = (index->n_bytes + bytes <= MAX_INDEX_BYTES);
+    if (ret)
+        index->n_bytes += bytes;
+    pthread_mutex_unlock (&index->budget_lock);
+
+    return ret;
+}
+
+static void
+release_bytes (ExistIndex *index, gint64 bytes)
+{
+    pthread_mutex_lock (&index->budget_lock);
+    index->n_bytes -= bytes;
+    pthread_mutex_unlock (&index->budget_lock);
+}
+
+static void
+store_index_clear (ExistIndex *index, StoreIndex *si)
+{
+    release_bytes (index, (gint64)si->set.size * 20);
+    g_free (si->set.slots);
+    memset (&si->set, 0, sizeof(si->set));
+}
+
+static void
+store_index_free (ExistIndex *index, StoreIndex *si)
+{
+    store_index_clear (index, si);
+    g_free (si);
+}
+
+/*
+ * Must be called with the shard's lock held. Evicts the least recently used
+ * loaded store other than @keep, only one that holds memory if @need_bytes.
+ * Returns FALSE if there is none.
+ */
+static gboolean
+evict_least_used_store (ExistIndex *index, IndexShard *shard,
+                        StoreIndex *keep, gboolean need_bytes)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    StoreIndex *si, *victim = NULL;
+
+    g_hash_table_iter_init (&iter, shard->stores);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        si = value;
+        if (si == keep || si->state == STORE_LOADING)
+            continue;
+        if (need_bytes && si->set.size == 0)
+            continue;
+        if (!victim || si->last_used < victim->last_used)
+            victim = si;
+    }
+
+    if (!victim)
+        return FALSE;
+
+    g_hash_table_remove (shard->stores, victim->store_id);
+    store_index_free (index, victim);
+    return TRUE;
+}
+
+/*
+ * Must be called with the shard's lock held. Returns FALSE if the store has
+ * been dropped because its set can't grow within the memory budget.
+ */
+static gboolean
+store_add_id (ExistIndex *index, IndexShard *shard, StoreIndex *si,
+              const guint8 *id)
+{
+    IdSet *set = &si->set;
+    gint64 more;
+
+    if (si->too_big)
+        return FALSE;
+
+    if (memcmp (id, zero_id, 20) == 0) {
+        set->has_zero = TRUE;
+        return TRUE;
+    }
+
+    if (id_set_contains (set, id))
+        return TRUE;
+
+    /* Keep load factor under 3/4. */
+    if ((set->n_ids + 1) * 4 > set->size * 3) {
+        more = (gint64)(set->size ? set->size : INITIAL_SET_SIZE) * 20;
+        while (!reserve_bytes (index, more)) {
+            if (!evict_least_used_store (index, shard, si, TRUE)) {
+                syncw_message ("[%s index] Store %s is too big to be indexed.\n",
+                               index->name, si->store_id);
+                store_index_clear (index, si);
+                si->too_big = TRUE;
+                return FALSE;
+            }
+        }
+        id_set_grow (set);
+    }
+
+    id_set_insert_slot (set->slots, set->size, id);
+    ++set->n_ids;
+    return TRUE;
+}
+
+typedef struct ScanData {
+    ExistIndex *index;
+    StoreIndex *si;
+    guint8 batch[SCAN_BATCH_SIZE * 20];
+    int n_batch;
+} ScanData;
+
+/* Returns FALSE if the scan can stop. */
+static gboolean
+flush_scan_batch (ScanData *sd)
+{
+    ExistIndex *index = sd->index;
+    IndexShard *shard = get_shard (index, sd->si->store_id);
+    gboolean ret;
+    int i;
+
+    pthread_mutex_lock (&shard->lock);
+    ret = !sd->si->removed;
+    for (i = 0; ret && i < sd->n_batch; ++i)
+        ret = store_add_id (index, shard, sd->si, sd->batch + i * 20);
+    pthread_mutex_unlock (&shard->lock);
+
+    sd->n_batch = 0;
+    return ret;
+}
+
+static gboolean
+add_scanned_id (const char *store_id, int version,
+                const char *obj_id, void *user_data)
+{
+    ScanData *sd = user_data;
+
+    if (!is_object_id_valid (obj_id))
+        return TRUE;
+
+    hex_to_sha1 (obj_id, sd->batch + sd->n_batch * 20);
+    if (++sd->n_batch < SCAN_BATCH_SIZE)
+        return TRUE;
+
+    return flush_scan_batch (sd);
+}
+
+static void
+scan_thread (void *data, void *user_data)
+{
+    StoreIndex *si = data;
+    ExistIndex *index = user_data;
+    IndexShard *shard = get_shard (index, si->store_id);
+    ScanData *sd = g_new0 (ScanData, 1);
+    int ret;
+
+    sd->index = index;
+    sd->si = si;
+
+    ret = index->scan (index->scan_data, si->store_id, add_scanned_id, sd);
+    if (ret == 0)
+        flush_scan_batch (sd);
+
+    pthread_mutex_lock (&shard->lock);
+    if (!si->removed && ret < 0 && !si->too_big) {
+        syncw_warning ("[%s index] Failed to load objects of store %s.\n",
+                      index->name, si->store_id);
+        g_hash_table_remove (shard->stores, si->store_id);
+        si->removed = TRUE;
+    }
+    if (si->removed) {
+        store_index_free (index, si);
+    } else {
+        si->state = STORE_READY;
+        syncw_debug ("[%s index] Loaded %u objects of store %s.\n",
+                    index->name, si->set.n_ids, si->store_id);
+    }
+    pthread_mutex_unlock (&shard->lock);
+
+    g_free (sd);
+}
+
+ExistIndex *
+exist_index_new (const char *name, ExistIndexScanFunc scan, void *scan_data)
+{
+    ExistIndex *index = g_new0 (ExistIndex, 1);
+    GError *error = NULL;
+    int i;
+
+    index->scan_pool = g_thread_pool_new (scan_thread, index, N_SCAN_THREADS,
+                                          FALSE, &error);
+    if (error) {
+        syncw_warning ("Failed to start index scan threads: %s.\n", error->message);
+        g_clear_error (&error);
+        g_free (index);
+        return NULL;
+    }
+
+    index->name = g_strdup (name);
+    index->scan = scan;
+    index->scan_data = scan_data;
+    for (i = 0; i < N_SHARDS; ++i) {
+        pthread_mutex_init (&index->shards[i].lock, NULL);
+        index->shards[i].stores = g_hash_table_new (g_str_hash, g_str_equal);
+    }
+    pthread_mutex_init (&index->budget_lock, NULL);
+
+    return index;
+}
+
+int
+exist_index_lookup (ExistIndex *index, const char *store_id, const char *obj_id)
+{
+    IndexShard *shard = get_shard (index, store_id);
+    StoreIndex *si;
+    guint8 id[20];
+    int ret;
+
+    if (hex_to_sha1 (obj_id, id) < 0)
+        return EXIST_INDEX_UNKNOWN;
+
+    pthread_mutex_lock (&shard->lock);
+
+    si = g_hash_table_lookup (shard->stores, store_id);
+    if (!si) {
+        if (g_hash_table_size (shard->stores) >= MAX_STORES_PER_SHARD)
+            evict_least_used_store (index, shard, NULL, FALSE);
+
+        si = g_new0 (StoreIndex, 1);
+        memcpy (si->store_id, store_id, 36);
+        si->state = STORE_LOADING;
+        si->last_used = time (NULL);
+        g_hash_table_insert (shard->stores, si->store_id, si);
+
+        g_thread_pool_push (index->scan_pool, si, NULL);
+
+        ret = EXIST_INDEX_UNKNOWN;
+        goto out;
+    }
+
+    si->last_used = time (NULL);
+    if (si->state != STORE_READY || si->too_big) {
+        ret = EXIST_INDEX_UNKNOWN;
+        goto out;
+    }
+
+    ret = id_set_contains (&si->set, id) ? EXIST_INDEX_MAYBE : EXIST_INDEX_ABSENT;
+
+out:
+    pthread_mutex_unlock (&shard->lock);
+    return ret;
+}
+
+void
+exist_index_add (ExistIndex *index, const char *store_id, const char *obj_id)
+{
+    IndexShard *shard = get_shard (index, store_id);
+    StoreIndex *si;
+    guint8 id[20];
+
+    if (hex_to_sha1 (obj_id, id) < 0)
+        return;
+
+    pthread_mutex_lock (&shard->lock);
+    si = g_hash_table_lookup (shard->stores, store_id);
+    if (si)
+        store_add_id (index, shard, si, id);
+    pthread_mutex_unlock (&shard->lock);
+}
+
+void
+exist_index_remove_store (ExistIndex *index, const char *store_id)
+{
+    IndexShard *shard = get_shard (index, store_id);
+    StoreIndex *si;
+
+    pthread_mutex_lock (&shard->lock);
+    si = g_hash_table_lookup (shard->stores, store_id);
+    if (si) {
+        g_hash_table_remove (shard->stores, store_id);
+        if (si->state == STORE_LOADING)
+            si->removed = TRUE;
+        else
+            store_index_free (index, si);
+    }
+    pthread_mutex_unlock (&shard->lock);
+}
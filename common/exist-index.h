@@ -0,0 +1,65 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef EXIST_INDEX_H
+#define EXIST_INDEX_H
+
+#include <glib.h>
+
+/*
+ * In-memory index of the object ids in each store, used to answer
+ * existence queries without a stat() per id.
+ *
+ * The index of a store is built by one of a few background threads the first
+ * time it's queried, and kept up to date by calling exist_index_add() after each write.
+ * Objects deleted by other processes (e.g. GC) are not seen, so the index
+ * can only prove that an object doesn't exist. Ids found in the index must be
+ * checked against the storage.
+ *
+ * Stores are spread over a few shards, each with its own lock. The id sets
+ * of an index share a memory budget: the least recently used stores of a
+ * shard are evicted to make room, and a store that still doesn't fit is
+ * not indexed.
+ */
+
+typedef struct ExistIndex ExistIndex;
+
+typedef gboolean (*ExistIndexAddFunc) (const char *store_id,
+                                       int version,
+                                       const char *obj_id,
+                                       void *user_data);
+
+/* List all objects in a store, calling @add for each of them. */
+typedef int (*ExistIndexScanFunc) (void *scan_data,
+                                   const char *store_id,
+                                   ExistIndexAddFunc add,
+                                   void *add_data);
+
+enum {
+    EXIST_INDEX_UNKNOWN,
+    EXIST_INDEX_ABSENT,
+    EXIST_INDEX_MAYBE,
+};
+
+ExistIndex *
+exist_index_new (const char *name, ExistIndexScanFunc scan, void *scan_data);
+
+/*
+ * Returns EXIST_INDEX_ABSENT if @obj_id is not in the store, EXIST_INDEX_MAYBE
+ * if it's in the index, or EXIST_INDEX_UNKNOWN if the index of the store
+ * is not loaded yet. Loading is started by the first query.
+ */
+int
+exist_index_lookup (ExistIndex *index, const char *store_id, const char *obj_id);
+
+/*
+ * Record a newly written object. It's added to a store that's still being
+ * loaded too, in case the scan has already gone past it. Does nothing if
+ * the store is not indexed.
+ */
+void
+exist_index_add (ExistIndex *index, const char *store_id, const char *obj_id);
+
+void
+exist_index_remove_store (ExistIndex *index, const char *store_id);
+
+#endif
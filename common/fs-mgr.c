@@ -6,6 +6,7 @@
 
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <dirent.h>
 
 #ifndef WIN32
@@ -34,9 +35,30 @@
 
 #define SYNCW_TMP_EXT "~"
 
+/* Max number of blocks in the block offset cache. */
+#define MAX_BLOCK_OFFSET_CACHE_BLOCKS (1 << 20)
+
+typedef struct BlockOffsetEntry {
+    char file_id[41];
+    guint32 n_blocks;
+    /* offsets[i] is where block i starts, offsets[n_blocks] the file size. */
+    guint64 *offsets;
+    GList *lru_link;
+} BlockOffsetEntry;
+
 struct _SyncwFSManagerPriv {
     /* GHashTable      *syncwerk_cache; */
     GHashTable      *bl_cache;
+
+    /* Block offsets of recently used and recently written files, for range
+     * requests and block sizes. They're kept out of the file objects, which
+     * would change the ids of the files.
+     * file_id -> BlockOffsetEntry, least recently used first.
+     */
+    pthread_mutex_t block_offset_lock;
+    GHashTable      *block_offset_cache;
+    GQueue          *block_offset_lru;
+    guint64         n_indexed_blocks;
 };
 
 typedef struct SyncwerkOndisk {
@@ -57,6 +79,10 @@ typedef struct SyncwdirOndisk {
     char    dirents[0];
 } __attribute__((gcc_struct, __packed__)) SyncwdirOndisk;
 
+static void
+add_to_block_offset_cache (SyncwFSManagerPriv *priv, const char *file_id,
+                           guint32 n_blocks, guint64 *offsets);
+
 #ifndef SYNCWERK_SERVER
 uint32_t
 calculate_chunk_size (uint64_t total_size);
@@ -83,6 +109,10 @@ syncw_fs_manager_new (SyncwerkSession *syncw,
 
     mgr->priv = g_new0(SyncwFSManagerPriv, 1);
 
+    pthread_mutex_init (&mgr->priv->block_offset_lock, NULL);
+    mgr->priv->block_offset_cache = g_hash_table_new (g_str_hash, g_str_equal);
+    mgr->priv->block_offset_lru = g_queue_new ();
+
     return mgr;
 }
 
@@ -96,6 +126,11 @@ syncw_fs_manager_init (SyncwFSManager *mgr)
         syncw_warning ("[fs mgr] Failed to init fs object store.\n");
         return -1;
     }
+
+    if (syncw_obj_store_enable_exist_index (mgr->obj_store, "fs") < 0) {
+        syncw_warning ("[fs mgr] Failed to create fs object index.\n");
+        return -1;
+    }
 #else
     if (syncw_obj_store_init (mgr->obj_store, FALSE, NULL) < 0) {
         syncw_warning ("[fs mgr] Failed to init fs object store.\n");
@@ -444,6 +479,43 @@ syncw_fs_manager_calculate_syncwerk_id_json (int repo_version,
     free (data);
 }
 
+/*
+ * Remember the block offsets of a file that was just written, so that they
+ * don't have to be looked up when it's read. The stored sizes of the blocks
+ * may differ from the chunk sizes if the blocks are encrypted.
+ */
+static void
+cache_written_block_offsets (SyncwFSManager *fs_mgr, const char *repo_id,
+                             int version, CDCFileDescriptor *cdc,
+                             const char *file_id)
+{
+    guint64 *offsets;
+    BlockMetadata *bmd;
+    char block_id[41];
+    int i;
+
+    if (cdc->block_nr == 0)
+        return;
+
+    offsets = g_new (guint64, cdc->block_nr + 1);
+    offsets[0] = 0;
+    for (i = 0; i < cdc->block_nr; ++i) {
+        rawdata_to_hex (cdc->blk_sha1s + i * 20, block_id, 20);
+        bmd = syncw_block_manager_stat_block (syncw->block_mgr,
+                                             repo_id, version, block_id);
+        if (!bmd) {
+            g_free (offsets);
+            return;
+        }
+        offsets[i + 1] = offsets[i] + bmd->size;
+        g_free (bmd);
+    }
+
+    pthread_mutex_lock (&fs_mgr->priv->block_offset_lock);
+    add_to_block_offset_cache (fs_mgr->priv, file_id, cdc->block_nr, offsets);
+    pthread_mutex_unlock (&fs_mgr->priv->block_offset_lock);
+}
+
 static int
 write_syncwerk (SyncwFSManager *fs_mgr,
                const char *repo_id,
@@ -485,8 +557,10 @@ write_syncwerk (SyncwFSManager *fs_mgr,
     }
 
 out:
-    if (ret == 0)
+    if (ret == 0) {
         hex_to_rawdata (syncwerk_id, obj_sha1, 20);
+        cache_written_block_offsets (fs_mgr, repo_id, version, cdc, syncwerk_id);
+    }
 
     return ret;
 }
@@ -1401,6 +1475,199 @@ syncwerk_save (SyncwFSManager *fs_mgr,
     return ret;
 }
 
+/* Index of the block that holds @offset, which must be below the file size. */
+static int
+search_block_offsets (const guint64 *offsets, guint32 n_blocks, guint64 offset)
+{
+    guint32 lo = 0, hi = n_blocks, mid;
+
+    /* Find the last block that starts at or before @offset. Empty blocks
+     * start where the next one does, so they're skipped.
+     */
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (offsets[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static void
+free_block_offset_entry (BlockOffsetEntry *entry)
+{
+    g_free (entry->offsets);
+    g_free (entry);
+}
+
+/* Called with block_offset_lock held. */
+static BlockOffsetEntry *
+lookup_block_offset_cache (SyncwFSManagerPriv *priv, Syncwerk *file)
+{
+    BlockOffsetEntry *entry;
+
+    entry = g_hash_table_lookup (priv->block_offset_cache, file->file_id);
+    if (!entry || entry->n_blocks != file->n_blocks)
+        return NULL;
+
+    g_queue_unlink (priv->block_offset_lru, entry->lru_link);
+    g_queue_push_tail_link (priv->block_offset_lru, entry->lru_link);
+
+    return entry;
+}
+
+/* Called with block_offset_lock held. Takes @offsets. */
+static void
+add_to_block_offset_cache (SyncwFSManagerPriv *priv, const char *file_id,
+                           guint32 n_blocks, guint64 *offsets)
+{
+    BlockOffsetEntry *entry;
+
+    if (n_blocks > MAX_BLOCK_OFFSET_CACHE_BLOCKS ||
+        g_hash_table_lookup (priv->block_offset_cache, file_id)) {
+        g_free (offsets);
+        return;
+    }
+
+    while (priv->n_indexed_blocks + n_blocks > MAX_BLOCK_OFFSET_CACHE_BLOCKS) {
+        entry = g_queue_pop_head (priv->block_offset_lru);
+        g_hash_table_remove (priv->block_offset_cache, entry->file_id);
+        priv->n_indexed_blocks -= entry->n_blocks;
+        free_block_offset_entry (entry);
+    }
+
+    entry = g_new0 (BlockOffsetEntry, 1);
+    memcpy (entry->file_id, file_id, 40);
+    entry->n_blocks = n_blocks;
+    entry->offsets = offsets;
+    g_hash_table_insert (priv->block_offset_cache, entry->file_id, entry);
+    g_queue_push_tail (priv->block_offset_lru, entry);
+    entry->lru_link = priv->block_offset_lru->tail;
+    priv->n_indexed_blocks += entry->n_blocks;
+}
+
+/* Start offsets of the blocks, by stat'ing them. */
+static guint64 *
+calculate_block_offsets (const char *store_id, int version, Syncwerk *file)
+{
+    guint64 *offsets;
+    BlockMetadata *bmd;
+    int i;
+
+    offsets = g_new (guint64, file->n_blocks + 1);
+    offsets[0] = 0;
+    for (i = 0; i < file->n_blocks; ++i) {
+        bmd = syncw_block_manager_stat_block (syncw->block_mgr, store_id,
+                                             version, file->blk_sha1s[i]);
+        if (!bmd) {
+            syncw_warning ("Failed to stat block %s:%s.\n",
+                          store_id, file->blk_sha1s[i]);
+            g_free (offsets);
+            return NULL;
+        }
+        offsets[i + 1] = offsets[i] + bmd->size;
+        g_free (bmd);
+    }
+
+    return offsets;
+}
+
+static guint32 *
+offsets_to_sizes (const guint64 *offsets, guint32 n_blocks)
+{
+    guint32 *sizes = g_new (guint32, n_blocks);
+    guint32 i;
+
+    for (i = 0; i < n_blocks; ++i)
+        sizes[i] = (guint32)(offsets[i + 1] - offsets[i]);
+
+    return sizes;
+}
+
+guint32 *
+syncw_fs_manager_get_block_sizes (SyncwFSManager *mgr,
+                                 const char *store_id,
+                                 int version,
+                                 Syncwerk *file)
+{
+    SyncwFSManagerPriv *priv = mgr->priv;
+    BlockOffsetEntry *entry;
+    guint32 *sizes = NULL;
+    guint64 *offsets;
+
+    if (file->n_blocks == 0)
+        return g_new0 (guint32, 1);
+
+    pthread_mutex_lock (&priv->block_offset_lock);
+    entry = lookup_block_offset_cache (priv, file);
+    if (entry)
+        sizes = offsets_to_sizes (entry->offsets, entry->n_blocks);
+    pthread_mutex_unlock (&priv->block_offset_lock);
+
+    if (sizes)
+        return sizes;
+
+    offsets = calculate_block_offsets (store_id, version, file);
+    if (!offsets)
+        return NULL;
+    sizes = offsets_to_sizes (offsets, file->n_blocks);
+
+    pthread_mutex_lock (&priv->block_offset_lock);
+    add_to_block_offset_cache (priv, file->file_id, file->n_blocks, offsets);
+    pthread_mutex_unlock (&priv->block_offset_lock);
+
+    return sizes;
+}
+
+int
+syncw_fs_manager_find_block (SyncwFSManager *mgr,
+                            const char *store_id,
+                            int version,
+                            Syncwerk *file,
+                            guint64 offset,
+                            guint32 *blk_offset)
+{
+    SyncwFSManagerPriv *priv = mgr->priv;
+    BlockOffsetEntry *entry;
+    guint64 *offsets;
+    int idx = -1;
+
+    if (offset >= file->file_size)
+        return -1;
+
+    pthread_mutex_lock (&priv->block_offset_lock);
+    entry = lookup_block_offset_cache (priv, file);
+    if (entry && offset < entry->offsets[entry->n_blocks]) {
+        idx = search_block_offsets (entry->offsets, entry->n_blocks, offset);
+        *blk_offset = (guint32)(offset - entry->offsets[idx]);
+    }
+    pthread_mutex_unlock (&priv->block_offset_lock);
+
+    if (idx >= 0)
+        return idx;
+
+    offsets = calculate_block_offsets (store_id, version, file);
+    if (!offsets)
+        return -1;
+
+    if (offset >= offsets[file->n_blocks]) {
+        syncw_warning ("Blocks of file %s:%s are shorter than the file.\n",
+                      store_id, file->file_id);
+        g_free (offsets);
+        return -1;
+    }
+    idx = search_block_offsets (offsets, file->n_blocks, offset);
+    *blk_offset = (guint32)(offset - offsets[idx]);
+
+    pthread_mutex_lock (&priv->block_offset_lock);
+    add_to_block_offset_cache (priv, file->file_id, file->n_blocks, offsets);
+    pthread_mutex_unlock (&priv->block_offset_lock);
+
+    return idx;
+}
+
 static void compute_dir_id_v0 (SyncwDir *dir, GList *entries)
 {
     SHA_CTX ctx;
@@ -2381,6 +2648,19 @@ syncw_fs_manager_object_exists (SyncwFSManager *mgr,
     return syncw_obj_store_obj_exists (mgr->obj_store, repo_id, version, id);
 }
 
+gboolean
+syncw_fs_manager_object_exists_indexed (SyncwFSManager *mgr,
+                                       const char *repo_id,
+                                       int version,
+                                       const char *id)
+{
+    /* Empty file and dir always exists. */
+    if (memcmp (id, EMPTY_SHA1, 40) == 0)
+        return TRUE;
+
+    return syncw_obj_store_obj_exists_indexed (mgr->obj_store, repo_id, version, id);
+}
+
 void
 syncw_fs_manager_delete_object (SyncwFSManager *mgr,
                                const char *repo_id,
@@ -3053,6 +3333,21 @@ syncw_fs_manager_verify_object (SyncwFSManager *mgr,
     return ret;
 }
 
+gboolean
+syncw_fs_manager_verify_object_data (const char *obj_id,
+                                    int version,
+                                    const void *data,
+                                    int len)
+{
+    if (memcmp (obj_id, EMPTY_SHA1, 40) == 0)
+        return TRUE;
+
+    if (version == 0)
+        return verify_fs_object_v0 (obj_id, (uint8_t *)data, len, TRUE);
+    else
+        return verify_fs_object_json (obj_id, (uint8_t *)data, len);
+}
+
 int
 dir_version_from_repo_version (int repo_version)
 {
@@ -229,6 +229,35 @@ syncw_fs_manager_get_syncwerk (SyncwFSManager *mgr,
                              int version,
                              const char *file_id);
 
+/*
+ * Returns the stored size of each block of @file, to be freed by the caller.
+ * Sizes of files written by this process are known. Otherwise the blocks
+ * are stat'ed once, and their offsets are cached for
+ * syncw_fs_manager_find_block() too.
+ */
+guint32 *
+syncw_fs_manager_get_block_sizes (SyncwFSManager *mgr,
+                                 const char *store_id,
+                                 int version,
+                                 Syncwerk *file);
+
+/*
+ * Find the block of @file that holds byte @offset, and set @blk_offset to
+ * the position in that block. The start offsets of the blocks are indexed
+ * once per file and kept in the same LRU cache as above, so seeking is a
+ * binary search.
+ *
+ * Returns: the block index, or -1 if @offset is beyond the file or the
+ * block sizes can't be got.
+ */
+int
+syncw_fs_manager_find_block (SyncwFSManager *mgr,
+                            const char *store_id,
+                            int version,
+                            Syncwerk *file,
+                            guint64 offset,
+                            guint32 *blk_offset);
+
 SyncwDir *
 syncw_fs_manager_get_syncwdir (SyncwFSManager *mgr,
                              const char *repo_id,
@@ -298,6 +327,13 @@ syncw_fs_manager_object_exists (SyncwFSManager *mgr,
                                int version,
                                const char *id);
 
+/* Check existence with the in-memory object index, see obj-store.h. */
+gboolean
+syncw_fs_manager_object_exists_indexed (SyncwFSManager *mgr,
+                                       const char *repo_id,
+                                       int version,
+                                       const char *id);
+
 void
 syncw_fs_manager_delete_object (SyncwFSManager *mgr,
                                const char *repo_id,
@@ -405,6 +441,13 @@ syncw_fs_manager_verify_object (SyncwFSManager *mgr,
                                gboolean verify_id,
                                gboolean *io_error);
 
+/* Check that @data, not yet written, hashes to @obj_id. */
+gboolean
+syncw_fs_manager_verify_object_data (const char *obj_id,
+                                    int version,
+                                    const void *data,
+                                    int len);
+
 int
 dir_version_from_repo_version (int repo_version);
 
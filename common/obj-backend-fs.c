@@ -447,6 +447,77 @@ obj_backend_fs_copy (ObjBackend *bend,
 #endif
 }
 
+#ifndef WIN32
+static int
+fsync_path (const char *path)
+{
+    int fd, ret;
+
+    fd = open (path, O_RDONLY);
+    if (fd < 0) {
+        syncw_warning ("Failed to open %s: %s.\n", path, strerror(errno));
+        return -1;
+    }
+    ret = fsync_obj_contents (fd);
+    close (fd);
+
+    return ret;
+}
+#endif
+
+/*
+ * Flush objects written without need_sync, then the directories they were
+ * renamed into. Each directory is synced once for the whole batch.
+ */
+static int
+obj_backend_fs_sync_objs (ObjBackend *bend,
+                          const char *repo_id,
+                          int version,
+                          GList *obj_ids)
+{
+#ifndef WIN32
+    FsPriv *priv = bend->priv;
+    char path[SYNCW_PATH_MAX];
+    GHashTable *dirs;
+    GHashTableIter iter;
+    gpointer key;
+    GList *ptr;
+    int ret = 0;
+
+    dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    for (ptr = obj_ids; ptr; ptr = ptr->next) {
+        id_to_path (priv, ptr->data, path, repo_id, version);
+        if (fsync_path (path) < 0) {
+            ret = -1;
+            goto out;
+        }
+        g_hash_table_replace (dirs, g_path_get_dirname (path), NULL);
+    }
+
+    g_hash_table_iter_init (&iter, dirs);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        if (fsync_path (key) < 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    /* Object dirs may have been created for the batch. */
+    if (obj_ids) {
+        char *store_dir = g_build_filename (priv->obj_dir, repo_id, NULL);
+        ret = fsync_path (store_dir);
+        g_free (store_dir);
+    }
+
+out:
+    g_hash_table_destroy (dirs);
+    return ret;
+#else
+    return 0;
+#endif
+}
+
 static int
 obj_backend_fs_remove_store (ObjBackend *bend, const char *store_id)
 {
@@ -518,6 +589,7 @@ obj_backend_fs_new (const char *syncw_dir, const char *obj_type)
     bend->exists = obj_backend_fs_exists;
     bend->delete = obj_backend_fs_delete;
     bend->foreach_obj = obj_backend_fs_foreach_obj;
+    bend->sync_objs = obj_backend_fs_sync_objs;
     bend->copy = obj_backend_fs_copy;
     bend->remove_store = obj_backend_fs_remove_store;
 
@@ -48,6 +48,12 @@ struct ObjBackend {
     int        (*remove_store) (ObjBackend *bend,
                                 const char *store_id);
 
+    /* Optional. Make objects written without need_sync durable. */
+    int        (*sync_objs) (ObjBackend *bend,
+                             const char *repo_id,
+                             int version,
+                             GList *obj_ids);
+
     void *priv;
 };
 
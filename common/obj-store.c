@@ -1,5 +1,7 @@
 #include "common.h"
 
+#include <pthread.h>
+
 #include "log.h"
 
 #include <ccnet/cevent.h>
@@ -9,6 +11,7 @@
 
 #include "obj-backend.h"
 #include "obj-store.h"
+#include "exist-index.h"
 
 #define MAX_READER_THREADS 2
 #define MAX_WRITER_THREADS 2
@@ -33,12 +36,18 @@ typedef struct OSCallbackStruct {
 struct SyncwObjStore {
     ObjBackend   *bend;
 
+    /* Only created when enabled. */
+    ExistIndex   *exist_index;
+
     CEventManager *ev_mgr;
 
-    /* For async read. */
+    /* For async read. Readers may be registered from any thread,
+     * so access to @readers and @next_rd_id is protected by @readers_lock.
+     */
     guint32      next_rd_id;
     GThreadPool *read_tpool;
     GHashTable  *readers;
+    pthread_mutex_t readers_lock;
     guint32      read_ev_id;
 
     /* For async write. */
@@ -110,6 +119,7 @@ async_init (SyncwObjStore *obj_store, CEventManager *ev_mgr)
 
     obj_store->readers = g_hash_table_new_full (g_direct_hash, g_direct_equal,
                                                 NULL, g_free);
+    pthread_mutex_init (&obj_store->readers_lock, NULL);
     obj_store->read_ev_id = cevent_manager_register (ev_mgr,
                                                      on_read_done,
                                                      obj_store);
@@ -194,7 +204,13 @@ syncw_obj_store_write_obj (struct SyncwObjStore *obj_store,
         !obj_id || !is_object_id_valid(obj_id))
         return -1;
 
-    return bend->write (bend, repo_id, version, obj_id, data, len, need_sync);
+    if (bend->write (bend, repo_id, version, obj_id, data, len, need_sync) < 0)
+        return -1;
+
+    if (obj_store->exist_index && version > 0)
+        exist_index_add (obj_store->exist_index, repo_id, obj_id);
+
+    return 0;
 }
 
 gboolean
@@ -212,6 +228,44 @@ syncw_obj_store_obj_exists (struct SyncwObjStore *obj_store,
     return bend->exists (bend, repo_id, version, obj_id);
 }
 
+static int
+scan_store_objs (void *scan_data, const char *store_id,
+                 ExistIndexAddFunc add, void *add_data)
+{
+    SyncwObjStore *obj_store = scan_data;
+
+    return syncw_obj_store_foreach_obj (obj_store, store_id, 1, add, add_data);
+}
+
+int
+syncw_obj_store_enable_exist_index (struct SyncwObjStore *obj_store,
+                                   const char *name)
+{
+    obj_store->exist_index = exist_index_new (name, scan_store_objs, obj_store);
+    if (!obj_store->exist_index)
+        return -1;
+
+    return 0;
+}
+
+gboolean
+syncw_obj_store_obj_exists_indexed (struct SyncwObjStore *obj_store,
+                                   const char *repo_id,
+                                   int version,
+                                   const char *obj_id)
+{
+    if (!repo_id || !is_uuid_valid(repo_id) ||
+        !obj_id || !is_object_id_valid(obj_id))
+        return FALSE;
+
+    if (obj_store->exist_index && version > 0 &&
+        exist_index_lookup (obj_store->exist_index,
+                            repo_id, obj_id) == EXIST_INDEX_ABSENT)
+        return FALSE;
+
+    return syncw_obj_store_obj_exists (obj_store, repo_id, version, obj_id);
+}
+
 void
 syncw_obj_store_delete_obj (struct SyncwObjStore *obj_store,
                            const char *repo_id,
@@ -252,7 +306,13 @@ syncw_obj_store_copy_obj (struct SyncwObjStore *obj_store,
     if (strcmp (obj_id, EMPTY_SHA1) == 0)
         return 0;
 
-    return bend->copy (bend, src_repo_id, src_version, dst_repo_id, dst_version, obj_id);
+    if (bend->copy (bend, src_repo_id, src_version, dst_repo_id, dst_version, obj_id) < 0)
+        return -1;
+
+    if (obj_store->exist_index && dst_version > 0)
+        exist_index_add (obj_store->exist_index, dst_repo_id, obj_id);
+
+    return 0;
 }
 
 static void
@@ -262,13 +322,24 @@ reader_thread (void *data, void *user_data)
     SyncwObjStore *obj_store = user_data;
     ObjBackend *bend = obj_store->bend;
     OSCallbackStruct *callback;
+    char repo_id[37];
+    int version;
+    gboolean found = FALSE;
 
+    pthread_mutex_lock (&obj_store->readers_lock);
     callback = g_hash_table_lookup (obj_store->readers,
                                     (gpointer)(long)(task->rw_id));
     if (callback) {
+        memcpy (repo_id, callback->repo_id, 37);
+        version = callback->version;
+        found = TRUE;
+    }
+    pthread_mutex_unlock (&obj_store->readers_lock);
+
+    if (found) {
         task->success = TRUE;
 
-        if (bend->read (bend, callback->repo_id, callback->version,
+        if (bend->read (bend, repo_id, version,
                         task->obj_id, &task->data, &task->len) < 0)
             task->success = FALSE;
     }
@@ -314,6 +385,9 @@ writer_thread (void *data, void *user_data)
         if (bend->write (bend, callback->repo_id, callback->version,
                          task->obj_id, task->data, task->len, task->need_sync) < 0)
             task->success = FALSE;
+        else if (obj_store->exist_index && callback->version > 0)
+            exist_index_add (obj_store->exist_index,
+                             callback->repo_id, task->obj_id);
     }
 
     cevent_manager_add_event (obj_store->ev_mgr, obj_store->write_ev_id,
@@ -326,18 +400,30 @@ on_read_done (CEvent *event, void *user_data)
     AsyncTask *task = event->data;
     SyncwObjStore *obj_store = user_data;
     OSCallbackStruct *callback;
+    OSAsyncCallback cb = NULL;
+    void *cb_data = NULL;
     OSAsyncResult res;
 
+    /* Don't hold the lock while running the callback, it may register or
+     * unregister readers.
+     */
+    pthread_mutex_lock (&obj_store->readers_lock);
     callback = g_hash_table_lookup (obj_store->readers,
                                     (gpointer)(long)(task->rw_id));
     if (callback) {
+        cb = callback->cb;
+        cb_data = callback->cb_data;
+    }
+    pthread_mutex_unlock (&obj_store->readers_lock);
+
+    if (cb) {
         res.rw_id = task->rw_id;
         memcpy (res.obj_id, task->obj_id, 41);
         res.data = task->data;
         res.len = task->len;
         res.success = task->success;
 
-        callback->cb (&res, callback->cb_data);
+        cb (&res, cb_data);
     }
 
     g_free (task->data);
@@ -399,7 +485,7 @@ syncw_obj_store_register_async_read (struct SyncwObjStore *obj_store,
                                     OSAsyncCallback callback,
                                     void *cb_data)
 {
-    guint32 id = obj_store->next_rd_id++;
+    guint32 id;
     OSCallbackStruct *cb_struct = g_new0 (OSCallbackStruct, 1);
 
     memcpy (cb_struct->repo_id, repo_id, 36);
@@ -407,7 +493,10 @@ syncw_obj_store_register_async_read (struct SyncwObjStore *obj_store,
     cb_struct->cb = callback;
     cb_struct->cb_data = cb_data;
 
+    pthread_mutex_lock (&obj_store->readers_lock);
+    id = obj_store->next_rd_id++;
     g_hash_table_insert (obj_store->readers, (gpointer)(long)id, cb_struct);
+    pthread_mutex_unlock (&obj_store->readers_lock);
 
     return id;
 }
@@ -416,7 +505,9 @@ void
 syncw_obj_store_unregister_async_read (struct SyncwObjStore *obj_store,
                                       guint32 reader_id)
 {
+    pthread_mutex_lock (&obj_store->readers_lock);
     g_hash_table_remove (obj_store->readers, (gpointer)(long)reader_id);
+    pthread_mutex_unlock (&obj_store->readers_lock);
 }
 
 int
@@ -493,7 +584,7 @@ syncw_obj_store_register_async_write (struct SyncwObjStore *obj_store,
                                      OSAsyncCallback callback,
                                      void *cb_data)
 {
-    guint32 id = obj_store->next_rd_id++;
+    guint32 id = obj_store->next_wr_id++;
     OSCallbackStruct *cb_struct = g_new0 (OSCallbackStruct, 1);
 
     memcpy (cb_struct->repo_id, repo_id, 36);
@@ -539,11 +630,28 @@ syncw_obj_store_async_write (struct SyncwObjStore *obj_store,
     return 0;
 }
 
+int
+syncw_obj_store_sync_objs (struct SyncwObjStore *obj_store,
+                          const char *repo_id,
+                          int version,
+                          GList *obj_ids)
+{
+    ObjBackend *bend = obj_store->bend;
+
+    if (!bend->sync_objs)
+        return 0;
+
+    return bend->sync_objs (bend, repo_id, version, obj_ids);
+}
+
 int
 syncw_obj_store_remove_store (struct SyncwObjStore *obj_store,
                              const char *store_id)
 {
     ObjBackend *bend = obj_store->bend;
 
+    if (obj_store->exist_index)
+        exist_index_remove_store (obj_store->exist_index, store_id);
+
     return bend->remove_store (bend, store_id);
 }
@@ -41,6 +41,25 @@ syncw_obj_store_obj_exists (struct SyncwObjStore *obj_store,
                            int version,
                            const char *obj_id);
 
+/*
+ * Keep an in-memory index of the objects in each store, so that
+ * syncw_obj_store_obj_exists_indexed() can tell most missing objects
+ * without touching the disk.
+ */
+int
+syncw_obj_store_enable_exist_index (struct SyncwObjStore *obj_store,
+                                   const char *name);
+
+/*
+ * Same as syncw_obj_store_obj_exists(), but objects written by other
+ * processes may not be seen until the index of the store is reloaded.
+ */
+gboolean
+syncw_obj_store_obj_exists_indexed (struct SyncwObjStore *obj_store,
+                                   const char *repo_id,
+                                   int version,
+                                   const char *obj_id);
+
 void
 syncw_obj_store_delete_obj (struct SyncwObjStore *obj_store,
                            const char *repo_id,
@@ -80,7 +99,11 @@ typedef struct OSAsyncResult {
 
 typedef void (*OSAsyncCallback) (OSAsyncResult *res, void *cb_data);
 
-/* Async read */
+/* Async read.
+ * Readers can be registered and used from any thread. The callback is
+ * always run in the thread of the event manager passed to
+ * syncw_obj_store_init().
+ */
 guint32
 syncw_obj_store_register_async_read (struct SyncwObjStore *obj_store,
                                     const char *repo_id,
@@ -134,6 +157,17 @@ syncw_obj_store_async_stat (struct SyncwObjStore *obj_store,
                            guint32 stat_id,
                            const char *obj_id);
 
+/*
+ * Make objects written with need_sync set to FALSE durable. Used after
+ * writing a batch of objects, so that their directories are synced once.
+ * @obj_ids is a list of object id strings.
+ */
+int
+syncw_obj_store_sync_objs (struct SyncwObjStore *obj_store,
+                          const char *repo_id,
+                          int version,
+                          GList *obj_ids);
+
 int
 syncw_obj_store_remove_store (struct SyncwObjStore *obj_store,
                              const char *store_id);
@@ -481,3 +481,13 @@ syncwerk_decrypt_init (EVP_CIPHER_CTX **ctx,
 
     return 0;
 }
+
+int
+syncwerk_decrypt_restart (EVP_CIPHER_CTX *ctx, const unsigned char *iv)
+{
+    /* Without a cipher and key, the key schedule is kept. */
+    if (EVP_DecryptInit_ex (ctx, NULL, NULL, NULL, iv) == DEC_FAILURE)
+        return -1;
+
+    return 0;
+}
@@ -103,4 +103,11 @@ syncwerk_decrypt_init (EVP_CIPHER_CTX **ctx,
                       const unsigned char *key,
                       const unsigned char *iv);
 
+/*
+ * Reset a context from syncwerk_decrypt_init() to decrypt a new block with
+ * the same key, without allocating a new context.
+ */
+int
+syncwerk_decrypt_restart (EVP_CIPHER_CTX *ctx, const unsigned char *iv);
+
 #endif  /* _SYNCWERK_CRYPT_H */
@@ -21,27 +21,24 @@ int read_file(SyncwerkSession *syncw,
               off_t offset, struct fuse_file_info *info)
 {
     BlockHandle *handle = NULL;;
-    BlockMetadata *bmd;
+    guint32 *blk_sizes;
     char *blkid;
     char *ptr;
     off_t off = 0, nleft;
     int i, n, ret = -EIO;
 
-    for (i = 0; i < file->n_blocks; i++) {
-        blkid = file->blk_sha1s[i];
-
-        bmd = syncw_block_manager_stat_block(syncw->block_mgr, store_id, version, blkid);
-        if (!bmd)
-            return -EIO;
+    blk_sizes = syncw_fs_manager_get_block_sizes (syncw->fs_mgr, store_id,
+                                                 version, file);
+    if (!blk_sizes)
+        return -EIO;
 
-        if (offset < off + bmd->size) {
-            g_free (bmd);
+    for (i = 0; i < file->n_blocks; i++) {
+        if (offset < off + blk_sizes[i])
             break;
-        }
 
-        off += bmd->size;
-        g_free (bmd);
+        off += blk_sizes[i];
     }
+    g_free (blk_sizes);
 
     /* beyond the file size */
     if (i == file->n_blocks)
@@ -1026,6 +1026,10 @@ class SyncwServerThreadedRpcClient(ccnet.RpcClientBase):
     def set_server_config_boolean (group, key, value):
         pass
 
+    @rpcsyncwerk_func("string", [])
+    def get_http_metrics ():
+        pass
+
     @rpcsyncwerk_func("int", ["string", "int"])
     def repo_has_been_shared (repo_id, including_groups):
         pass
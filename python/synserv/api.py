@@ -774,6 +774,13 @@ class SyncwerkAPI(object):
         i_value = 1 if bool(value) else 0
         return syncwserv_threaded_rpc.set_server_config_boolean (group, key, i_value)
 
+    def get_http_metrics (self):
+        """
+        Return a json string with request count, errors, bytes and
+        p50/p95/p99 latency (in microseconds) of each fileserver endpoint.
+        """
+        return syncwserv_threaded_rpc.get_http_metrics ()
+
     def del_org_group_repo(self, repo_id, org_id, group_id):
         syncwserv_threaded_rpc.del_org_group_repo(repo_id, org_id, group_id)
 
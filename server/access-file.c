@@ -16,6 +16,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include <ccnet.h>
 
@@ -28,9 +29,16 @@
 #include "access-file.h"
 #include "zip-download-mgr.h"
 #include "http-server.h"
+#include "http-metrics.h"
+#include "http-admission.h"
+#include "read-ahead.h"
+#include "web-file-cache.h"
 
 #define FILE_TYPE_MAP_DEFAULT_LEN 1
 #define BUFFER_SIZE 1024 * 64
+/* Block files queued at once on the sendfile path. */
+#define SENDFILE_WINDOW_FILES 16
+#define SENDFILE_WINDOW_SIZE (8 << 20)
 #define MULTI_DOWNLOAD_FILE_PREFIX "documents-export-"
 
 struct file_type_map {
@@ -59,12 +67,13 @@ typedef struct SendBlockData {
 typedef struct SendfileData {
     evhtp_request_t *req;
     Syncwerk *file;
-    SyncwerkCrypt *crypt;
-    gboolean enc_init;
-    EVP_CIPHER_CTX *ctx;
-    BlockHandle *handle;
-    size_t remain;
-    int idx;
+    /* Either blocks are read ahead, or sent as file segments from blk_idx. */
+    ReadAhead *ra;
+    /* Waiting for read-ahead to notify that data is ready. */
+    gboolean idle;
+    int blk_idx;
+    /* Content collected for the web file cache, if the file is small. */
+    GByteArray *cache_buf;
 
     char store_id[37];
     int repo_version;
@@ -78,13 +87,25 @@ typedef struct SendfileData {
     void *saved_cb_arg;
 } SendfileData;
 
+typedef struct ByteRange {
+    guint64 start;
+    guint64 end;
+} ByteRange;
+
 typedef struct SendFileRangeData {
     evhtp_request_t *req;
     Syncwerk *file;
+    /* Block cursor, only moves forward. */
     BlockHandle *handle;
     int blk_idx;
-    guint64 start_off;
+    guint32 blk_pos;
+    /* Sorted and disjoint ranges. */
+    GArray *ranges;
+    int range_idx;
     guint64 range_remain;
+    /* Multipart replies only. */
+    char **part_headers;
+    char *trailer;
 
     char store_id[37];
     int repo_version;
@@ -105,6 +126,10 @@ typedef struct SendDirData {
 
     int zipfd;
     char *zipfile;
+    /* Set instead of zipfd when the archive is packed while it's sent. */
+    ZipStream *zs;
+    /* Waiting for the zip stream to notify that data is ready. */
+    gboolean idle;
     char *token;
     char *user;
     char *token_type;
@@ -120,6 +145,16 @@ typedef struct SendDirData {
 
 extern SyncwerkSession *syncw;
 
+static WebFileCache *web_file_cache;
+
+/*
+ * Each worker thread moves read-ahead data through one evbuffer. It's
+ * emptied by bufferevent_write_buffer() before that may call back
+ * recursively, so the recursive calls can use it too.
+ */
+static pthread_once_t fetch_buf_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t fetch_buf_key;
+
 static struct file_type_map ftmap[] = {
     { "txt", "text/plain" },
     { "doc", "application/vnd.ms-word" },
@@ -162,18 +197,14 @@ free_sendblock_data (SendBlockData *data)
 static void
 free_sendfile_data (SendfileData *data)
 {
-    if (data->handle) {
-        syncw_block_manager_close_block(syncw->block_mgr, data->handle);
-        syncw_block_manager_block_handle_free(syncw->block_mgr, data->handle);
-    }
-
-    if (data->enc_init)
-        EVP_CIPHER_CTX_free (data->ctx);
+    if (data->ra)
+        read_ahead_stop (data->ra);
+    if (data->cache_buf)
+        g_byte_array_free (data->cache_buf, TRUE);
 
     syncwerk_unref (data->file);
     g_free (data->user);
     g_free (data->token_type);
-    g_free (data->crypt);
     g_free (data);
 }
 
@@ -186,6 +217,9 @@ free_send_file_range_data (SendFileRangeData *data)
     }
 
     syncwerk_unref (data->file);
+    g_array_free (data->ranges, TRUE);
+    g_strfreev (data->part_headers);
+    g_free (data->trailer);
     g_free (data->user);
     g_free (data->token_type);
     g_free (data);
@@ -194,7 +228,10 @@ free_send_file_range_data (SendFileRangeData *data)
 static void
 free_senddir_data (SendDirData *data)
 {
-    close (data->zipfd);
+    if (data->zs)
+        zip_stream_stop (data->zs);
+    else
+        close (data->zipfd);
 
     zip_download_mgr_del_zip_progress (syncw->zip_download_mgr, data->token);
 
@@ -270,145 +307,191 @@ err:
 }
 
 static void
-write_data_cb (struct bufferevent *bev, void *ctx)
+send_file_download_stat (const char *store_id, char *user,
+                         const char *token_type, guint64 size)
 {
-    SendfileData *data = ctx;
-    char *blk_id;
-    BlockHandle *handle;
-    char buf[1024 * 64];
-    int n;
+    if (g_strcmp0(token_type, "view") != 0) {
+        char *oper = "web-file-download";
+        if (g_strcmp0(token_type, "download-link") == 0)
+            oper = "link-file-download";
 
-next:
-    blk_id = data->file->blk_sha1s[data->idx];
+        send_statistic_msg(store_id, user, oper, size);
+    }
+}
 
-    if (!data->handle) {
-        data->handle = syncw_block_manager_open_block(syncw->block_mgr,
-                                                     data->store_id,
-                                                     data->repo_version,
-                                                     blk_id, BLOCK_READ);
-        if (!data->handle) {
-            syncw_warning ("Failed to open block %s:%s\n", data->store_id, blk_id);
-            goto err;
-        }
+static void
+append_to_cache_buf (GByteArray *cache_buf, struct evbuffer *buf)
+{
+    struct evbuffer_iovec *iov;
+    int n_vec, i;
 
-        BlockMetadata *bmd;
-        bmd = syncw_block_manager_stat_block_by_handle (syncw->block_mgr,
-                                                       data->handle);
-        if (!bmd)
-            goto err;
-        data->remain = bmd->size;
-        g_free (bmd);
-
-        if (data->crypt) {
-            if (syncwerk_decrypt_init (&data->ctx,
-                                      data->crypt->version,
-                                      (unsigned char *)data->crypt->key,
-                                      (unsigned char *)data->crypt->iv) < 0) {
-                syncw_warning ("Failed to init decrypt.\n");
-                goto err;
-            }
-            data->enc_init = TRUE;
-        }
-    }
-    handle = data->handle;
+    n_vec = evbuffer_peek (buf, -1, NULL, NULL, 0);
+    iov = g_new (struct evbuffer_iovec, MAX (n_vec, 1));
+    evbuffer_peek (buf, -1, NULL, iov, n_vec);
 
-    n = syncw_block_manager_read_block(syncw->block_mgr, handle, buf, sizeof(buf));
-    data->remain -= n;
-    if (n < 0) {
-        syncw_warning ("Error when reading from block %s.\n", blk_id);
-        goto err;
-    } else if (n == 0) {
-        /* We've read up the data of this block, finish or try next block. */
+    for (i = 0; i < n_vec; ++i)
+        g_byte_array_append (cache_buf, iov[i].iov_base, iov[i].iov_len);
+
+    g_free (iov);
+}
+
+/* Whether TLS is terminated by us, so that data must pass through openssl. */
+static gboolean
+connection_is_tls (evhtp_request_t *req)
+{
+#ifndef EVHTP_DISABLE_SSL
+    return evhtp_request_get_connection (req)->ssl != NULL;
+#else
+    return FALSE;
+#endif
+}
+
+/*
+ * Queue the next blocks of the file as file segments, so that libevent
+ * sends them with sendfile() and the data never passes through user space.
+ * Only a window of the file is queued at a time to bound the open fds.
+ * Returns 1 when all blocks are queued, -1 on error.
+ */
+static int
+add_block_files (SendfileData *data, struct evbuffer *out)
+{
+    BlockHandle *handle;
+    const char *blk_id;
+    struct stat st;
+    int n_files = 0;
+    int fd;
+
+    while (data->blk_idx < data->file->n_blocks &&
+           n_files < SENDFILE_WINDOW_FILES &&
+           evbuffer_get_length (out) < SENDFILE_WINDOW_SIZE) {
+        blk_id = data->file->blk_sha1s[data->blk_idx];
+        handle = syncw_block_manager_open_block (syncw->block_mgr,
+                                                data->store_id,
+                                                data->repo_version,
+                                                blk_id, BLOCK_READ);
+        if (!handle) {
+            syncw_warning ("Failed to open block %s:%s\n", data->store_id, blk_id);
+            return -1;
+        }
+        fd = syncw_block_manager_dup_block_fd (syncw->block_mgr, handle);
         syncw_block_manager_close_block (syncw->block_mgr, handle);
         syncw_block_manager_block_handle_free (syncw->block_mgr, handle);
-        data->handle = NULL;
-        if (data->crypt != NULL) {
-            EVP_CIPHER_CTX_free (data->ctx);
-            data->enc_init = FALSE;
+        if (fd < 0)
+            return -1;
+
+        if (fstat (fd, &st) < 0) {
+            syncw_warning ("Failed to stat block %s:%s: %s.\n",
+                          data->store_id, blk_id, strerror (errno));
+            close (fd);
+            return -1;
         }
 
-        if (data->idx == data->file->n_blocks - 1) {
-            /* Recover evhtp's callbacks */
-            bev->readcb = data->saved_read_cb;
-            bev->writecb = data->saved_write_cb;
-            bev->errorcb = data->saved_event_cb;
-            bev->cbarg = data->saved_cb_arg;
+        if (st.st_size == 0)
+            close (fd);
+        else if (add_file_segment (out, fd, st.st_size) < 0)
+            return -1;
 
-            /* Resume reading incomming requests. */
-            evhtp_request_resume (data->req);
+        ++data->blk_idx;
+        ++n_files;
+    }
 
-            evhtp_send_reply_end (data->req);
+    return data->blk_idx == data->file->n_blocks ? 1 : 0;
+}
 
-            if (g_strcmp0(data->token_type, "view") != 0) {
-                char *oper = "web-file-download";
-                if (g_strcmp0(data->token_type, "download-link") == 0)
-                    oper = "link-file-download";
+static void
+create_fetch_buf_key (void)
+{
+    if (pthread_key_create (&fetch_buf_key, NULL) != 0)
+        syncw_warning ("Failed to create fetch buffer key.\n");
+}
 
-                send_statistic_msg(data->store_id, data->user, oper,
-                                   (guint64)data->file->file_size);
-            }
+static struct evbuffer *
+get_fetch_buf (void)
+{
+    struct evbuffer *buf;
 
-            free_sendfile_data (data);
-            return;
-        }
+    pthread_once (&fetch_buf_key_once, create_fetch_buf_key);
 
-        ++(data->idx);
-        goto next;
-    }
+    buf = pthread_getspecific (fetch_buf_key);
+    if (buf)
+        return buf;
 
-    /* OK, we've got some data to send. */
-    if (data->crypt != NULL) {
-        char *dec_out;
-        int dec_out_len = -1;
-        struct evbuffer *tmp_buf;
-
-        dec_out = g_new (char, n + 16);
-        if (!dec_out) {
-            syncw_warning ("Failed to alloc memory.\n");
-            goto err;
-        }
+    buf = evbuffer_new ();
+    /* Worker threads never exit, so the buffers are never freed. */
+    pthread_setspecific (fetch_buf_key, buf);
 
-        int ret = EVP_DecryptUpdate (data->ctx,
-                                     (unsigned char *)dec_out,
-                                     &dec_out_len,
-                                     (unsigned char *)buf,
-                                     n);
-        if (ret == 0) {
-            syncw_warning ("Decrypt block %s:%s failed.\n", data->store_id, blk_id);
-            g_free (dec_out);
+    return buf;
+}
+
+static void
+write_data_cb (struct bufferevent *bev, void *ctx)
+{
+    SendfileData *data = ctx;
+    struct evbuffer *buf;
+    int rc;
+
+    if (!data->ra) {
+        /* Plain connection, nothing calls back recursively here. */
+        rc = add_block_files (data, bufferevent_get_output (bev));
+        if (rc < 0)
             goto err;
-        }
+        if (rc == 0)
+            return;
+        goto done;
+    }
 
-        tmp_buf = evbuffer_new ();
+    /* The buffer can't be kept in data: the recursive calls below may free
+     * data while the buffer is being written.
+     */
+    data->idle = FALSE;
+    buf = get_fetch_buf ();
+    rc = read_ahead_fetch (data->ra, buf);
+    if (rc < 0) {
+        evbuffer_drain (buf, evbuffer_get_length (buf));
+        goto err;
+    }
 
-        evbuffer_add (tmp_buf, dec_out, dec_out_len);
+    if (evbuffer_get_length (buf) > 0) {
+        if (data->cache_buf)
+            append_to_cache_buf (data->cache_buf, buf);
 
-        /* If it's the last piece of a block, call decrypt_final()
-         * to decrypt the possible partial block. */
-        if (data->remain == 0) {
-            ret = EVP_DecryptFinal_ex (data->ctx,
-                                       (unsigned char *)dec_out,
-                                       &dec_out_len);
-            if (ret == 0) {
-                syncw_warning ("Decrypt block %s:%s failed.\n", data->store_id, blk_id);
-                evbuffer_free (tmp_buf);
-                g_free (dec_out);
-                goto err;
-            }
-            evbuffer_add (tmp_buf, dec_out, dec_out_len);
-        }
         /* This may call write_data_cb() recursively (by libevent_openssl).
          * SendfileData struct may be free'd in the recursive calls.
          * So don't use "data" variable after here.
          */
-        bufferevent_write_buffer (bev, tmp_buf);
+        bufferevent_write_buffer (bev, buf);
+        return;
+    }
 
-        evbuffer_free (tmp_buf);
-        g_free (dec_out);
-    } else {
-        bufferevent_write (bev, buf, n);
+    if (rc == 0) {
+        /* Nothing is read yet, read_ahead_ready_cb() continues. */
+        data->idle = TRUE;
+        return;
+    }
+
+done:
+    /* Recover evhtp's callbacks */
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
+
+    evhtp_send_reply_end (data->req);
+
+    send_file_download_stat (data->store_id, data->user, data->token_type,
+                             (guint64)data->file->file_size);
+
+    if (data->cache_buf && data->cache_buf->len == data->file->file_size) {
+        guint len = data->cache_buf->len;
+        web_file_cache_add (web_file_cache, data->store_id, data->file->file_id,
+                            (char *)g_byte_array_free (data->cache_buf, FALSE), len);
+        data->cache_buf = NULL;
     }
 
+    free_sendfile_data (data);
     return;
 
 err:
@@ -417,6 +500,17 @@ err:
     return;
 }
 
+/* Called by read-ahead until it's stopped, so data is still alive. */
+static void
+read_ahead_ready_cb (void *ctx)
+{
+    SendfileData *data = ctx;
+
+    /* Otherwise the pending write callback will fetch the data. */
+    if (data->idle)
+        write_data_cb (evhtp_request_get_bev (data->req), data);
+}
+
 static void
 write_dir_data_cb (struct bufferevent *bev, void *ctx)
 {
@@ -458,6 +552,73 @@ write_dir_data_cb (struct bufferevent *bev, void *ctx)
     }
 }
 
+static void
+write_zip_stream_cb (struct bufferevent *bev, void *ctx)
+{
+    SendDirData *data = ctx;
+    evhtp_request_t *req = data->req;
+    struct evbuffer *buf;
+    int rc;
+
+    data->idle = FALSE;
+    buf = evbuffer_new ();
+    rc = zip_stream_fetch (data->zs, buf);
+    if (rc < 0) {
+        syncw_warning ("Failed to pack zip stream for token %s.\n", data->token);
+        evbuffer_free (buf);
+        evhtp_connection_free (evhtp_request_get_connection (req));
+        free_senddir_data (data);
+        return;
+    }
+
+    if (evbuffer_get_length (buf) > 0) {
+        data->total_size += evbuffer_get_length (buf);
+
+        /* This may call write_zip_stream_cb() recursively (by
+         * libevent_openssl), don't use "data" after here. */
+        evhtp_send_reply_chunk (req, buf);
+        evbuffer_free (buf);
+        return;
+    }
+    evbuffer_free (buf);
+
+    if (rc == 0) {
+        /* Nothing is packed yet, zip_stream_ready_cb() continues. */
+        data->idle = TRUE;
+        return;
+    }
+
+    /* Recover evhtp's callbacks */
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (req);
+
+    evhtp_send_reply_chunk_end (req);
+
+    char *oper = "web-file-download";
+    if (g_strcmp0(data->token_type, "download-dir-link") == 0 ||
+        g_strcmp0(data->token_type, "download-multi-link") == 0)
+        oper = "link-file-download";
+
+    send_statistic_msg(data->repo_id, data->user, oper, data->total_size);
+
+    free_senddir_data (data);
+}
+
+/* Called by the zip stream until it's stopped, so data is still alive. */
+static void
+zip_stream_ready_cb (void *ctx)
+{
+    SendDirData *data = ctx;
+
+    if (data->idle)
+        write_zip_stream_cb (evhtp_request_get_bev (data->req), data);
+}
+
 static void
 my_block_event_cb (struct bufferevent *bev, short events, void *ctx)
 {
@@ -635,20 +796,56 @@ do_file(evhtp_request_t *req, SyncwRepo *repo, const char *file_id,
         return 0;
     }
 
+    /* Hot small files are served from memory, without reading blocks. */
+    if (web_file_cache &&
+        web_file_cache_get (web_file_cache, repo->store_id, file_id,
+                            req->buffer_out)) {
+        evhtp_send_reply (req, EVHTP_RES_OK);
+        send_file_download_stat (repo->store_id, (char *)user, operation,
+                                 (guint64)file->file_size);
+        syncwerk_unref (file);
+        g_free (crypt);
+        return 0;
+    }
+
     data = g_new0 (SendfileData, 1);
     data->req = req;
     data->file = file;
-    data->crypt = crypt;
     data->user = g_strdup(user);
     data->token_type = g_strdup (operation);
 
     memcpy (data->store_id, repo->store_id, 36);
     data->repo_version = repo->version;
 
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+
+    /* Small files pass through memory once to be cached. */
+    if (web_file_cache &&
+        web_file_cache_can_hold (web_file_cache, file->file_size))
+        data->cache_buf = g_byte_array_sized_new (file->file_size);
+
+    /* Plain blocks go to the socket with sendfile(), unless openssl has to
+     * see the data. Otherwise they're read and decrypted by the read-ahead
+     * threads.
+     */
+    if (crypt || data->cache_buf || !syncw->http_server->use_sendfile ||
+        connection_is_tls (req) ||
+        !syncw_block_manager_can_dup_block_fd (syncw->block_mgr)) {
+        ThreadWaker *waker = thread_waker_get (bufferevent_get_base (bev));
+        if (!waker) {
+            g_free (crypt);
+            free_sendfile_data (data);
+            return -1;
+        }
+        data->ra = read_ahead_start (repo->store_id, repo->version,
+                                     file->blk_sha1s, file->n_blocks, crypt,
+                                     waker, read_ahead_ready_cb, data);
+    }
+    g_free (crypt);
+
     /* We need to overwrite evhtp's callback functions to
      * write file data piece by piece.
      */
-    struct bufferevent *bev = evhtp_request_get_bev (req);
     data->saved_read_cb = bev->readcb;
     data->saved_write_cb = bev->writecb;
     data->saved_event_cb = bev->errorcb;
@@ -669,68 +866,62 @@ do_file(evhtp_request_t *req, SyncwRepo *repo, const char *file_id,
     return 0;
 }
 
-// get block handle for range start
-static BlockHandle *
-get_start_block_handle (const char *store_id, int version, Syncwerk *file,
-                        guint64 start, int *blk_idx)
+/*
+ * Move the block cursor to @offset of the file. Moving within the current
+ * block seeks forward without reopening it.
+ */
+static int
+seek_file_range (SendFileRangeData *data, guint64 offset)
 {
-    BlockHandle *handle = NULL;
-    BlockMetadata *bmd;
+    guint32 blk_offset;
     char *blkid;
-    guint64 tolsize = 0;
-    int i = 0;
-
-    for (; i < file->n_blocks; i++) {
-        blkid = file->blk_sha1s[i];
-
-        bmd = syncw_block_manager_stat_block(syncw->block_mgr, store_id,
-                                            version, blkid);
-        if (!bmd)
-            return NULL;
+    int i;
 
-        if (start < tolsize + bmd->size) {
-            g_free (bmd);
-            break;
+    i = syncw_fs_manager_find_block (syncw->fs_mgr, data->store_id,
+                                    data->repo_version, data->file,
+                                    offset, &blk_offset);
+    /* beyond the file size */
+    if (i < 0)
+        return -1;
+    blkid = data->file->blk_sha1s[i];
+
+    if (data->handle && i == data->blk_idx && blk_offset >= data->blk_pos) {
+        if (blk_offset > data->blk_pos &&
+            syncw_block_manager_seek_block (syncw->block_mgr, data->handle,
+                                           blk_offset) < 0) {
+            syncw_warning ("Failed to seek in block %s:%s.\n", data->store_id, blkid);
+            return -1;
         }
-        tolsize += bmd->size;
-        g_free (bmd);
+        data->blk_pos = blk_offset;
+        return 0;
     }
 
-    /* beyond the file size */
-    if (i == file->n_blocks)
-        return NULL;
-
-    handle = syncw_block_manager_open_block(syncw->block_mgr,
-                                           store_id, version,
-                                           blkid, BLOCK_READ);
-    if (!handle) {
-        syncw_warning ("Failed to open block %s:%s.\n", store_id, blkid);
-        return NULL;
+    if (data->handle) {
+        syncw_block_manager_close_block(syncw->block_mgr, data->handle);
+        syncw_block_manager_block_handle_free (syncw->block_mgr, data->handle);
+        data->handle = NULL;
     }
 
-    /* trim the offset in a block */
-    if (start > tolsize) {
-        char *tmp = (char *)malloc(sizeof(*tmp) * (start - tolsize));
-        if (!tmp)
-            goto err;
-
-        int n = syncw_block_manager_read_block(syncw->block_mgr, handle,
-                                              tmp, start-tolsize);
-        if (n != start-tolsize) {
-            syncw_warning ("Failed to read block %s:%s.\n", store_id, blkid);
-            free (tmp);
-            goto err;
-        }
-        free (tmp);
+    data->handle = syncw_block_manager_open_block(syncw->block_mgr,
+                                                 data->store_id,
+                                                 data->repo_version,
+                                                 blkid, BLOCK_READ);
+    if (!data->handle) {
+        syncw_warning ("Failed to open block %s:%s.\n", data->store_id, blkid);
+        return -1;
     }
 
-    *blk_idx = i;
-    return handle;
+    /* jump to the offset in the block */
+    if (blk_offset > 0 &&
+        syncw_block_manager_seek_block (syncw->block_mgr, data->handle,
+                                       blk_offset) < 0) {
+        syncw_warning ("Failed to seek in block %s:%s.\n", data->store_id, blkid);
+        return -1;
+    }
 
-err:
-    syncw_block_manager_close_block(syncw->block_mgr, handle);
-    syncw_block_manager_block_handle_free (syncw->block_mgr, handle);
-    return NULL;
+    data->blk_idx = i;
+    data->blk_pos = blk_offset;
+    return 0;
 }
 
 static void
@@ -754,18 +945,40 @@ static void
 write_file_range_cb (struct bufferevent *bev, void *ctx)
 {
     SendFileRangeData *data = ctx;
+    ByteRange *range;
     char *blk_id;
     char buf[BUFFER_SIZE];
     int bsize;
     int n;
 
-    if (data->blk_idx == -1) {
-        // start to send block
-        data->handle = get_start_block_handle (data->store_id, data->repo_version,
-                                               data->file, data->start_off,
-                                               &data->blk_idx);
-        if (!data->handle)
+    if (data->range_remain == 0) {
+        if (data->range_idx == data->ranges->len) {
+            if (data->trailer)
+                bufferevent_write (bev, data->trailer, strlen(data->trailer));
+
+            range = &g_array_index (data->ranges, ByteRange, data->range_idx - 1);
+            if (range->end + 1 >= data->file->file_size) {
+                char *oper = "web-file-download";
+                if (g_strcmp0(data->token_type, "download-link") == 0)
+                    oper = "link-file-download";
+
+                send_statistic_msg (data->store_id, data->user, oper,
+                                    (guint64)data->file->file_size);
+            }
+            finish_file_range_request (bev, data);
+            return;
+        }
+
+        // start to send the next range
+        range = &g_array_index (data->ranges, ByteRange, data->range_idx);
+        if (seek_file_range (data, range->start) < 0)
             goto err;
+        if (data->part_headers) {
+            bufferevent_write (bev, data->part_headers[data->range_idx],
+                               strlen(data->part_headers[data->range_idx]));
+        }
+        data->range_remain = range->end - range->start + 1;
+        ++data->range_idx;
     }
 
 next:
@@ -780,11 +993,11 @@ next:
             syncw_warning ("Failed to open block %s:%s\n", data->store_id, blk_id);
             goto err;
         }
+        data->blk_pos = 0;
     }
 
     bsize = data->range_remain < BUFFER_SIZE ? data->range_remain : BUFFER_SIZE;
     n = syncw_block_manager_read_block(syncw->block_mgr, data->handle, buf, bsize);
-    data->range_remain -= n;
     if (n < 0) {
         syncw_warning ("Error when reading from block %s:%s.\n",
                       data->store_id, blk_id);
@@ -793,22 +1006,17 @@ next:
         syncw_block_manager_close_block (syncw->block_mgr, data->handle);
         syncw_block_manager_block_handle_free (syncw->block_mgr, data->handle);
         data->handle = NULL;
-        ++data->blk_idx;
+        if (++data->blk_idx == data->file->n_blocks) {
+            syncw_warning ("Blocks of file %s:%s are shorter than the file.\n",
+                          data->store_id, data->file->file_id);
+            goto err;
+        }
         goto next;
     }
+    data->blk_pos += n;
+    data->range_remain -= n;
 
     bufferevent_write (bev, buf, n);
-    if (data->range_remain == 0) {
-        if (data->start_off + n >= data->file->file_size) {
-            char *oper = "web-file-download";
-            if (g_strcmp0(data->token_type, "download-link") == 0)
-                oper = "link-file-download";
-
-            send_statistic_msg (data->store_id, data->user, oper,
-                                (guint64)data->file->file_size);
-        }
-        finish_file_range_request (bev, data);
-    }
 
     return;
 
@@ -817,73 +1025,124 @@ err:
     free_send_file_range_data (data);
 }
 
-// parse range offset, only support single range (-num, num-num, num-)
-static gboolean
-parse_range_val (const char *byte_ranges, guint64 *pstart, guint64 *pend,
-                 guint64 fsize)
+#define MAX_BYTE_RANGES 64
+
+/*
+ * Parse one range spec (-num, num-num, num-). Returns -1 if it's malformed,
+ * 0 if it's not satisfiable for a file of @fsize bytes.
+ */
+static int
+parse_one_range (const char *spec, guint64 fsize, ByteRange *range)
 {
-    char *minus;
+    const char *minus;
     char *end_ptr;
-    gboolean error = FALSE;
-    char *ranges_dup = g_strdup (strchr(byte_ranges, '=') + 1);
-    char *tmp = ranges_dup;
     guint64 start;
     guint64 end;
 
-    minus = strchr(tmp, '-');
+    minus = strchr(spec, '-');
     if (!minus)
-        return FALSE;
+        return -1;
 
-    if (minus == tmp) {
-        // -num mode
-        start = strtoll(tmp, &end_ptr, 10);
-        if (start == 0) {
-            // range format is invalid
-            error = TRUE;
-        } else if (*end_ptr == '\0') {
-            end = fsize - 1;
-            start += fsize;
-        } else {
-            error = TRUE;
-        }
-    } else if (*(minus + 1) == '\0') {
-        // num- mode
-        start = strtoll(tmp, &end_ptr, 10);
-        if (end_ptr == minus) {
-            end = fsize - 1;
-        } else {
-            error = TRUE;
-        }
+    if (minus == spec) {
+        // -num mode, the last num bytes
+        guint64 suffix = strtoull(minus + 1, &end_ptr, 10);
+        if (end_ptr == minus + 1 || *end_ptr != '\0')
+            return -1;
+        if (suffix == 0 || fsize == 0)
+            return 0;
+        start = suffix >= fsize ? 0 : fsize - suffix;
+        end = fsize - 1;
     } else {
-        // num-num mode
-        start = strtoll(tmp, &end_ptr, 10);
-        if (end_ptr == minus) {
-            end = strtoll(minus + 1, &end_ptr, 10);
-            if (*end_ptr != '\0') {
-                error = TRUE;
-            }
+        start = strtoull(spec, &end_ptr, 10);
+        if (end_ptr != minus)
+            return -1;
+        if (*(minus + 1) == '\0') {
+            // num- mode
+            end = fsize - 1;
         } else {
-            error = TRUE;
+            // num-num mode
+            end = strtoull(minus + 1, &end_ptr, 10);
+            if (*end_ptr != '\0')
+                return -1;
+            if (end < start)
+                return -1;
         }
     }
 
-    g_free (ranges_dup);
+    if (fsize == 0 || start > fsize - 1)
+        return 0;
+    if (end > fsize - 1)
+        end = fsize - 1;
 
-    if (error)
-        return FALSE;
+    range->start = start;
+    range->end = end;
+    return 1;
+}
 
-    if (end > fsize - 1) {
-        end = fsize - 1;
+static gint
+compare_byte_ranges (gconstpointer a, gconstpointer b)
+{
+    const ByteRange *ra = a, *rb = b;
+
+    if (ra->start < rb->start)
+        return -1;
+    return ra->start > rb->start ? 1 : 0;
+}
+
+/*
+ * Parse a Range header into sorted ranges, with overlapping and adjacent
+ * ones coalesced. Unsatisfiable ranges are dropped. Returns NULL if the
+ * header is malformed or no range is left.
+ */
+static GArray *
+parse_range_val (const char *byte_ranges, guint64 fsize)
+{
+    const char *eq = strchr(byte_ranges, '=');
+    char **specs = NULL;
+    GArray *ranges = NULL;
+    ByteRange range, *last;
+    int i, n = 0;
+    int ret;
+
+    if (!eq || eq - byte_ranges != 5 || strncmp (byte_ranges, "bytes", 5) != 0)
+        return NULL;
+
+    specs = g_strsplit (eq + 1, ",", 0);
+    ranges = g_array_new (FALSE, FALSE, sizeof(ByteRange));
+
+    for (i = 0; specs[i]; ++i) {
+        ret = parse_one_range (g_strstrip (specs[i]), fsize, &range);
+        if (ret < 0 || ++n > MAX_BYTE_RANGES)
+            goto error;
+        if (ret > 0)
+            g_array_append_val (ranges, range);
     }
-    if (start > end) {
-        // Range format is valid, but range number is invalid
-        return FALSE;
+
+    if (ranges->len == 0)
+        goto error;
+
+    g_array_sort (ranges, compare_byte_ranges);
+
+    n = 0;
+    for (i = 1; i < ranges->len; ++i) {
+        last = &g_array_index (ranges, ByteRange, n);
+        range = g_array_index (ranges, ByteRange, i);
+        if (range.start <= last->end + 1) {
+            if (range.end > last->end)
+                last->end = range.end;
+        } else {
+            g_array_index (ranges, ByteRange, ++n) = range;
+        }
     }
+    g_array_set_size (ranges, n + 1);
 
-    *pstart = start;
-    *pend = end;
+    g_strfreev (specs);
+    return ranges;
 
-    return TRUE;
+error:
+    g_strfreev (specs);
+    g_array_free (ranges, TRUE);
+    return NULL;
 }
 
 static void
@@ -922,8 +1181,12 @@ do_file_range (evhtp_request_t *req, SyncwRepo *repo, const char *file_id,
 {
     Syncwerk *file;
     SendFileRangeData *data = NULL;
-    guint64 start;
-    guint64 end;
+    GArray *ranges;
+    ByteRange *range;
+    char **part_headers = NULL;
+    char *trailer = NULL;
+    guint64 con_len_val = 0;
+    int i;
 
     file = syncw_fs_manager_get_syncwerk(syncw->fs_mgr,
                                        repo->store_id, repo->version, file_id);
@@ -937,13 +1200,14 @@ do_file_range (evhtp_request_t *req, SyncwRepo *repo, const char *file_id,
         return 0;
     }
 
-    if (!parse_range_val (byte_ranges, &start, &end, file->file_size)) {
-        syncwerk_unref (file);
+    ranges = parse_range_val (byte_ranges, file->file_size);
+    if (!ranges) {
         char *con_range = g_strdup_printf ("bytes */%"G_GUINT64_FORMAT, file->file_size);
         evhtp_headers_add_header (req->headers_out,
                                   evhtp_header_new("Content-Range", con_range,
                                                    0, 1));
         g_free (con_range);
+        syncwerk_unref (file);
         evhtp_send_reply (req, EVHTP_RES_RANGENOTSC);
         return 0;
     }
@@ -963,22 +1227,53 @@ do_file_range (evhtp_request_t *req, SyncwRepo *repo, const char *file_id,
         content_type = g_strdup ("application/octet-stream");
     }
 
-    evhtp_headers_add_header (req->headers_out,
-                              evhtp_header_new ("Content-Type", content_type, 0, 1));
+    if (ranges->len == 1) {
+        range = &g_array_index (ranges, ByteRange, 0);
+        con_len_val = range->end - range->start + 1;
+
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Type", content_type, 0, 1));
+
+        char *con_range = g_strdup_printf ("%s %"G_GUINT64_FORMAT"-%"G_GUINT64_FORMAT
+                                           "/%"G_GUINT64_FORMAT, "bytes",
+                                           range->start, range->end, file->file_size);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Range", con_range, 0, 1));
+        g_free (con_range);
+    } else {
+        /* Every range is sent as a part with its own headers. */
+        char *boundary = g_strdup_printf ("%08x%08x", g_random_int (), g_random_int ());
+
+        part_headers = g_new0 (char *, ranges->len + 1);
+        for (i = 0; i < ranges->len; ++i) {
+            range = &g_array_index (ranges, ByteRange, i);
+            part_headers[i] = g_strdup_printf ("%s--%s\r\n"
+                                               "Content-Type: %s\r\n"
+                                               "Content-Range: bytes %"G_GUINT64_FORMAT
+                                               "-%"G_GUINT64_FORMAT"/%"G_GUINT64_FORMAT
+                                               "\r\n\r\n",
+                                               i == 0 ? "" : "\r\n", boundary,
+                                               content_type, range->start, range->end,
+                                               file->file_size);
+            con_len_val += strlen (part_headers[i]) + range->end - range->start + 1;
+        }
+        trailer = g_strdup_printf ("\r\n--%s--\r\n", boundary);
+        con_len_val += strlen (trailer);
+
+        char *multipart_type = g_strdup_printf ("multipart/byteranges; boundary=%s",
+                                                boundary);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Type", multipart_type, 0, 1));
+        g_free (multipart_type);
+        g_free (boundary);
+    }
     g_free (content_type);
 
-    char *con_len = g_strdup_printf ("%"G_GUINT64_FORMAT, end-start+1);
+    char *con_len = g_strdup_printf ("%"G_GUINT64_FORMAT, con_len_val);
     evhtp_headers_add_header (req->headers_out,
                               evhtp_header_new("Content-Length", con_len, 0, 1));
     g_free (con_len);
 
-    char *con_range = g_strdup_printf ("%s %"G_GUINT64_FORMAT"-%"G_GUINT64_FORMAT
-                                       "/%"G_GUINT64_FORMAT, "bytes",
-                                       start, end, file->file_size);
-    evhtp_headers_add_header (req->headers_out,
-                              evhtp_header_new ("Content-Range", con_range, 0, 1));
-    g_free (con_range);
-
     set_resp_disposition (req, operation, filename);
 
     if (g_strcmp0 (type, "image/jpg") != 0) {
@@ -988,15 +1283,12 @@ do_file_range (evhtp_request_t *req, SyncwRepo *repo, const char *file_id,
     }
 
     data = g_new0 (SendFileRangeData, 1);
-    if (!data) {
-        syncwerk_unref (file);
-        return -1;
-    }
     data->req = req;
     data->file = file;
     data->blk_idx = -1;
-    data->start_off = start;
-    data->range_remain = end-start+1;
+    data->ranges = ranges;
+    data->part_headers = part_headers;
+    data->trailer = trailer;
     data->user = g_strdup(user);
     data->token_type = g_strdup (operation);
 
@@ -1099,14 +1391,72 @@ start_download_zip_file (evhtp_request_t *req, const char *token,
     return 0;
 }
 
-static gboolean
-can_use_cached_content (evhtp_request_t *req)
+/*
+ * Send the archive while it's packed by a zip thread. Its size isn't known
+ * beforehand, so it's sent in chunked encoding.
+ */
+static int
+start_stream_zip_file (evhtp_request_t *req, const char *token,
+                       const char *zipname,
+                       const char *repo_id, const char *user, const char *token_type)
 {
-    if (evhtp_kv_find (req->headers_in, "If-Modified-Since") != NULL) {
-        evhtp_send_reply (req, EVHTP_RES_NOTMOD);
-        return TRUE;
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    char cont_filename[SYNCW_PATH_MAX];
+    ThreadWaker *waker;
+    SendDirData *data;
+
+    waker = thread_waker_get (bufferevent_get_base (bev));
+    if (!waker)
+        return -1;
+
+    data = g_new0 (SendDirData, 1);
+    data->zs = zip_download_mgr_start_zip_stream (syncw->zip_download_mgr,
+                                                  token, waker,
+                                                  zip_stream_ready_cb, data);
+    if (!data->zs) {
+        g_free (data);
+        return -1;
     }
 
+    evhtp_headers_add_header(req->headers_out,
+                             evhtp_header_new("Content-Type", "application/zip", 1, 1));
+
+    snprintf(cont_filename, SYNCW_PATH_MAX,
+             "attachment;filename=\"%s.zip\"", zipname);
+
+    evhtp_headers_add_header(req->headers_out,
+            evhtp_header_new("Content-Disposition", cont_filename, 1, 1));
+
+    data->req = req;
+    data->zipfd = -1;
+    data->token = g_strdup (token);
+    data->user = g_strdup (user);
+    data->token_type = g_strdup (token_type);
+    snprintf(data->repo_id, sizeof(data->repo_id), "%s", repo_id);
+
+    data->saved_read_cb = bev->readcb;
+    data->saved_write_cb = bev->writecb;
+    data->saved_event_cb = bev->errorcb;
+    data->saved_cb_arg = bev->cbarg;
+    bufferevent_setcb (bev,
+                       NULL,
+                       write_zip_stream_cb,
+                       my_dir_event_cb,
+                       data);
+
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
+
+    evhtp_send_reply_chunk_start (req, EVHTP_RES_OK);
+
+    return 0;
+}
+
+static void
+add_cache_headers (evhtp_request_t *req)
+{
     char http_date[256];
     evhtp_kv_t *kv;
     time_t now = time(NULL);
@@ -1128,6 +1478,66 @@ can_use_cached_content (evhtp_request_t *req)
 
     kv = evhtp_kv_new ("Cache-Control", "max-age=3600", 1, 1);
     evhtp_kvs_add_kv (req->headers_out, kv);
+}
+
+static gboolean
+can_use_cached_content (evhtp_request_t *req)
+{
+    if (evhtp_kv_find (req->headers_in, "If-Modified-Since") != NULL) {
+        evhtp_send_reply (req, EVHTP_RES_NOTMOD);
+        return TRUE;
+    }
+
+    add_cache_headers (req);
+
+    return FALSE;
+}
+
+/* Whether If-None-Match lists @etag, or is "*". */
+static gboolean
+etag_matches (const char *if_none_match, const char *etag)
+{
+    char **tags = g_strsplit (if_none_match, ",", 0);
+    char *tag;
+    gboolean ret = FALSE;
+    int i;
+
+    for (i = 0; tags[i] && !ret; ++i) {
+        tag = g_strstrip (tags[i]);
+        /* Weak comparison, as for GET. */
+        if (g_str_has_prefix (tag, "W/"))
+            tag += 2;
+        if (strcmp (tag, "*") == 0 || strcmp (tag, etag) == 0)
+            ret = TRUE;
+    }
+
+    g_strfreev (tags);
+    return ret;
+}
+
+/*
+ * Like can_use_cached_content(), with the file id as a strong ETag, since
+ * it's the hash of the content. If-None-Match takes precedence over
+ * If-Modified-Since.
+ */
+static gboolean
+can_use_cached_file (evhtp_request_t *req, const char *file_id)
+{
+    const char *if_none_match = evhtp_kv_find (req->headers_in, "If-None-Match");
+    char etag[43];
+
+    snprintf (etag, sizeof(etag), "\"%s\"", file_id);
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("ETag", etag, 1, 1));
+
+    if (!if_none_match)
+        return can_use_cached_content (req);
+
+    add_cache_headers (req);
+    if (etag_matches (if_none_match, etag)) {
+        evhtp_send_reply (req, EVHTP_RES_NOTMOD);
+        return TRUE;
+    }
 
     return FALSE;
 }
@@ -1143,7 +1553,8 @@ access_zip_cb (evhtp_request_t *req, void *arg)
     char *filename = NULL;
     char *repo_id = NULL;
     char *user = NULL;
-    char *zip_file_path;
+    char *zip_file_path = NULL;
+    gboolean streaming;
     char *token_type = NULL;
     const char *error = NULL;
     int error_code;
@@ -1198,8 +1609,10 @@ access_zip_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    zip_file_path = zip_download_mgr_get_zip_file_path (syncw->zip_download_mgr, token);
-    if (!zip_file_path) {
+    streaming = zip_download_mgr_is_streaming (syncw->zip_download_mgr, token);
+    if (!streaming)
+        zip_file_path = zip_download_mgr_get_zip_file_path (syncw->zip_download_mgr, token);
+    if (!streaming && !zip_file_path) {
         g_object_get (info, "repo_id", &repo_id, NULL);
         syncw_warning ("Failed to get zip file path for %s in repo %.8s, token:[%s].\n",
                       filename, repo_id, token);
@@ -1217,7 +1630,11 @@ access_zip_cb (evhtp_request_t *req, void *arg)
     g_object_get (info, "username", &user, NULL);
     g_object_get (info, "repo_id", &repo_id, NULL);
     g_object_get (info, "op", &token_type, NULL);
-    int ret = start_download_zip_file (req, token, filename, zip_file_path, repo_id, user, token_type);
+    int ret;
+    if (streaming)
+        ret = start_stream_zip_file (req, token, filename, repo_id, user, token_type);
+    else
+        ret = start_download_zip_file (req, token, filename, zip_file_path, repo_id, user, token_type);
     if (ret < 0) {
         error = "Internal server error\n";
         error_code = EVHTP_RES_SERVERR;
@@ -1291,7 +1708,7 @@ access_cb(evhtp_request_t *req, void *arg)
         goto bad_req;
     }
 
-    if (can_use_cached_content (req)) {
+    if (can_use_cached_file (req, data)) {
         goto success;
     }
 
@@ -1526,9 +1943,26 @@ bad_req:
 int
 access_file_init (evhtp_t *htp)
 {
-    evhtp_set_regex_cb (htp, "^/files/.*", access_cb, NULL);
-    evhtp_set_regex_cb (htp, "^/blks/.*", access_blks_cb, NULL);
-    evhtp_set_regex_cb (htp, "^/zip/.*", access_zip_cb, NULL);
+    evhtp_callback_t *cb;
+
+    if (read_ahead_init () < 0)
+        return -1;
+
+    /* Called for every acceptor, whose workers may already be serving. */
+    if (!web_file_cache && syncw->http_server->web_cache_size > 0)
+        web_file_cache = web_file_cache_new (syncw->http_server->web_cache_size,
+                                             syncw->http_server->web_cache_max_file_size);
+
+    /* Web tokens may be one-time, so requests are charged to the client. */
+    cb = http_admission_set_regex_cb (htp, "^/files/.*", access_cb, NULL,
+                                      ADMISSION_CHEAP, NULL, NULL);
+    http_metrics_watch (cb, "files");
+    cb = http_admission_set_regex_cb (htp, "^/blks/.*", access_blks_cb, NULL,
+                                      ADMISSION_CHEAP, NULL, NULL);
+    http_metrics_watch (cb, "blks");
+    cb = http_admission_set_regex_cb (htp, "^/zip/.*", access_zip_cb, NULL,
+                                      ADMISSION_ZIP, NULL, NULL);
+    http_metrics_watch (cb, "zip");
 
     return 0;
 }
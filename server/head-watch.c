@@ -0,0 +1,275 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+#include "utils.h"
+#include "log.h"
+
+#include "thread-waker.h"
+#include "head-watch.h"
+
+struct HeadWatch {
+    /* Protects subscribers, and the subscribed and fired flags of waiters. */
+    pthread_mutex_t lock;
+    GHashTable *subscribers;    /* repo_id -> GQueue of HeadWaiter */
+};
+
+/*
+ * Referenced by the request while it's handled, and by the waker while
+ * it's fired but not yet handled.
+ */
+struct HeadWaiter {
+    gint refcnt;
+    HeadWatch *hw;
+    /* Hands the fired waiter to the http worker thread that owns it. */
+    ThreadWaker *waker;
+    char **repo_ids;
+    int n_ids;
+    gboolean subscribed;
+    gboolean fired;
+
+    /* Only used in the http worker thread. */
+    evhtp_request_t *req;
+    gboolean waiting;
+    struct event *timer;
+    HeadWatchFunc callback;
+    void *data;
+    GDestroyNotify free_data;
+
+    bufferevent_data_cb saved_read_cb;
+    bufferevent_data_cb saved_write_cb;
+    bufferevent_event_cb saved_event_cb;
+    void *saved_cb_arg;
+};
+
+static void
+head_waiter_unref (HeadWaiter *waiter)
+{
+    if (!g_atomic_int_dec_and_test (&waiter->refcnt))
+        return;
+
+    if (waiter->free_data)
+        waiter->free_data (waiter->data);
+    g_strfreev (waiter->repo_ids);
+    g_free (waiter);
+}
+
+static void
+unsubscribe (HeadWaiter *waiter)
+{
+    HeadWatch *hw = waiter->hw;
+    GQueue *queue;
+    int i;
+
+    pthread_mutex_lock (&hw->lock);
+
+    if (!waiter->subscribed)
+        goto out;
+    waiter->subscribed = FALSE;
+
+    for (i = 0; i < waiter->n_ids; ++i) {
+        queue = g_hash_table_lookup (hw->subscribers, waiter->repo_ids[i]);
+        if (!queue)
+            continue;
+        g_queue_remove (queue, waiter);
+        if (g_queue_is_empty (queue))
+            g_hash_table_remove (hw->subscribers, waiter->repo_ids[i]);
+    }
+
+out:
+    pthread_mutex_unlock (&hw->lock);
+}
+
+/* Drop the request's reference. */
+static void
+release_waiter (HeadWaiter *waiter)
+{
+    unsubscribe (waiter);
+
+    if (waiter->timer) {
+        event_free (waiter->timer);
+        waiter->timer = NULL;
+    }
+    waiter->req = NULL;
+    waiter->waiting = FALSE;
+
+    head_waiter_unref (waiter);
+}
+
+static void
+finish_waiter (HeadWaiter *waiter, gboolean changed)
+{
+    evhtp_request_t *req = waiter->req;
+    struct bufferevent *bev;
+
+    /* Recover evhtp's callbacks */
+    bev = evhtp_request_get_bev (req);
+    bev->readcb = waiter->saved_read_cb;
+    bev->writecb = waiter->saved_write_cb;
+    bev->errorcb = waiter->saved_event_cb;
+    bev->cbarg = waiter->saved_cb_arg;
+
+    evhtp_request_resume (req);
+
+    waiter->callback (req, changed, waiter->data);
+
+    release_waiter (waiter);
+}
+
+/* Called in the waiter's thread once it's fired. */
+static void
+waiter_fired_cb (void *data)
+{
+    HeadWaiter *waiter = data;
+
+    /* The request may have been replied or closed meanwhile. */
+    if (waiter->waiting)
+        finish_waiter (waiter, TRUE);
+    head_waiter_unref (waiter);
+}
+
+HeadWatch *
+head_watch_new (void)
+{
+    HeadWatch *hw = g_new0 (HeadWatch, 1);
+
+    pthread_mutex_init (&hw->lock, NULL);
+    hw->subscribers = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free,
+                                             (GDestroyNotify)g_queue_free);
+
+    return hw;
+}
+
+HeadWaiter *
+head_watch_subscribe (HeadWatch *hw, evhtp_request_t *req,
+                      char **repo_ids, int n_ids)
+{
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    HeadWaiter *waiter;
+    ThreadWaker *waker;
+    GQueue *queue;
+    int i;
+
+    waker = thread_waker_get (bufferevent_get_base (bev));
+    if (!waker)
+        return NULL;
+
+    waiter = g_new0 (HeadWaiter, 1);
+    waiter->refcnt = 1;
+    waiter->hw = hw;
+    waiter->waker = waker;
+    waiter->req = req;
+    waiter->n_ids = n_ids;
+    waiter->repo_ids = g_new0 (char *, n_ids + 1);
+    for (i = 0; i < n_ids; ++i)
+        waiter->repo_ids[i] = g_strdup (repo_ids[i]);
+
+    pthread_mutex_lock (&hw->lock);
+
+    for (i = 0; i < n_ids; ++i) {
+        queue = g_hash_table_lookup (hw->subscribers, repo_ids[i]);
+        if (!queue) {
+            queue = g_queue_new ();
+            g_hash_table_insert (hw->subscribers, g_strdup (repo_ids[i]), queue);
+        }
+        g_queue_push_tail (queue, waiter);
+    }
+    waiter->subscribed = TRUE;
+
+    pthread_mutex_unlock (&hw->lock);
+
+    return waiter;
+}
+
+void
+head_watch_cancel (HeadWaiter *waiter)
+{
+    release_waiter (waiter);
+}
+
+static void
+waiter_timeout_cb (evutil_socket_t sock, short type, void *ctx)
+{
+    finish_waiter (ctx, FALSE);
+}
+
+static void
+waiter_event_cb (struct bufferevent *bev, short events, void *ctx)
+{
+    HeadWaiter *waiter = ctx;
+
+    waiter->saved_event_cb (bev, events, waiter->saved_cb_arg);
+
+    release_waiter (waiter);
+}
+
+void
+head_watch_wait (HeadWaiter *waiter, int timeout,
+                 HeadWatchFunc callback, void *data,
+                 GDestroyNotify free_data)
+{
+    evhtp_request_t *req = waiter->req;
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    struct timeval tv;
+
+    waiter->callback = callback;
+    waiter->data = data;
+    waiter->free_data = free_data;
+    waiter->waiting = TRUE;
+
+    waiter->saved_read_cb = bev->readcb;
+    waiter->saved_write_cb = bev->writecb;
+    waiter->saved_event_cb = bev->errorcb;
+    waiter->saved_cb_arg = bev->cbarg;
+    bufferevent_setcb (bev,
+                       NULL,
+                       NULL,
+                       waiter_event_cb,
+                       waiter);
+
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
+
+    waiter->timer = evtimer_new (bufferevent_get_base (bev),
+                                 waiter_timeout_cb, waiter);
+    tv.tv_sec = timeout;
+    tv.tv_usec = 0;
+    evtimer_add (waiter->timer, &tv);
+}
+
+void
+head_watch_notify (HeadWatch *hw, const char *repo_id)
+{
+    GQueue *queue;
+    GList *ptr;
+    HeadWaiter *waiter;
+
+    pthread_mutex_lock (&hw->lock);
+
+    queue = g_hash_table_lookup (hw->subscribers, repo_id);
+    if (!queue)
+        goto out;
+
+    for (ptr = queue->head; ptr; ptr = ptr->next) {
+        waiter = ptr->data;
+        if (waiter->fired)
+            continue;
+        waiter->fired = TRUE;
+        g_atomic_int_inc (&waiter->refcnt);
+        thread_waker_post (waiter->waker, waiter_fired_cb, waiter);
+    }
+
+out:
+    pthread_mutex_unlock (&hw->lock);
+}
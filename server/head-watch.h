@@ -0,0 +1,57 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef HEAD_WATCH_H
+#define HEAD_WATCH_H
+
+#include <glib.h>
+#include <evhtp.h>
+
+/*
+ * Long-poll http requests waiting for repo heads to change.
+ *
+ * A waiting request is paused and costs only its socket and a timer. Heads
+ * may be updated in any thread; waiters are handed to their http worker
+ * thread through a pipe watched by that thread's event loop.
+ */
+
+typedef struct HeadWatch HeadWatch;
+typedef struct HeadWaiter HeadWaiter;
+
+/*
+ * Called in the request's thread with the request resumed. It must send the
+ * reply. @changed is FALSE if the wait timed out. Not called if the client
+ * goes away first.
+ */
+typedef void (*HeadWatchFunc) (evhtp_request_t *req, gboolean changed,
+                               void *data);
+
+HeadWatch *
+head_watch_new (void);
+
+/*
+ * Start watching @repo_ids for @req. Heads changed from now on wake the
+ * waiter, so the caller can check the current heads afterwards without
+ * missing an update.
+ */
+HeadWaiter *
+head_watch_subscribe (HeadWatch *hw, evhtp_request_t *req,
+                      char **repo_ids, int n_ids);
+
+/* For a waiter that is not going to wait, e.g. a head already changed. */
+void
+head_watch_cancel (HeadWaiter *waiter);
+
+/*
+ * Pause the request until a watched head changes or @timeout seconds pass.
+ * @data is freed with @free_data when the waiter is released.
+ */
+void
+head_watch_wait (HeadWaiter *waiter, int timeout,
+                 HeadWatchFunc callback, void *data,
+                 GDestroyNotify free_data);
+
+/* Wake the requests watching @repo_id. Can be called from any thread. */
+void
+head_watch_notify (HeadWatch *hw, const char *repo_id);
+
+#endif
@@ -0,0 +1,580 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#define DEBUG_FLAG SYNCWERK_DEBUG_HTTP
+
+#include <pthread.h>
+
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+#include "utils.h"
+#include "log.h"
+
+#include "http-server.h"
+#include "http-status-codes.h"
+#include "http-metrics.h"
+#include "http-admission.h"
+
+#define N_SHARDS 64
+/* Buckets hold this many seconds' worth of requests. */
+#define BURST_SECONDS 10
+#define BUCKET_IDLE_TIME 600    /* 10 minutes */
+
+#define CHEAP_COST 1
+#define EXPENSIVE_COST 4
+/* Added to the deficit of a user in each round, enough for any request. */
+#define QUANTUM EXPENSIVE_COST
+
+#define MAX_QUEUED_PER_USER 64
+#define ADMISSION_POLL_INTERVAL_USEC 10000
+
+typedef struct TokenBucket {
+    double tokens;
+    gint64 last_refill;         /* usec */
+} TokenBucket;
+
+typedef struct BucketShard {
+    pthread_mutex_t lock;
+    GHashTable *buckets;        /* key -> TokenBucket */
+} BucketShard;
+
+typedef struct BucketTable {
+    BucketShard shards[N_SHARDS];
+    double rate;                /* tokens per second, 0 means unlimited */
+    double burst;
+} BucketTable;
+
+/* Expensive requests of a class being served. */
+typedef struct ExpensiveSlots {
+    gint n;
+    gint max;
+} ExpensiveSlots;
+
+typedef struct AdmissionEntry {
+    evhtp_callback_cb cb;
+    void *arg;
+    AdmissionClass cls;
+    AdmissionKeyFunc key_func;
+    void *key_arg;
+    /* Set if PUT requests are admitted when their headers are parsed. */
+    evhtp_hook_headers_cb headers_cb;
+    void *headers_arg;
+} AdmissionEntry;
+
+struct UserQueue;
+
+typedef struct PendingRequest {
+    evhtp_request_t *req;
+    AdmissionEntry *entry;
+    char *user;
+    char *repo_id;
+    int cost;
+    /* Set for expensive requests. */
+    ExpensiveSlots *slots;
+
+    /* Set while the request is queued. */
+    struct UserQueue *uq;
+    bufferevent_data_cb saved_read_cb;
+    bufferevent_data_cb saved_write_cb;
+    bufferevent_event_cb saved_event_cb;
+    void *saved_cb_arg;
+} PendingRequest;
+
+typedef struct UserQueue {
+    char *user;
+    GQueue requests;            /* PendingRequest */
+    int deficit;
+} UserQueue;
+
+/* Requests waiting for admission in one worker thread. */
+typedef struct Scheduler {
+    GHashTable *users;          /* user -> UserQueue */
+    /* Users with queued requests, served round-robin. */
+    GQueue ring;
+    struct event *timer;
+} Scheduler;
+
+static BucketTable user_buckets;
+static BucketTable repo_buckets;
+static ExpensiveSlots expensive_slots[N_ADMISSION_CLASSES];
+static pthread_key_t scheduler_key;
+
+static void
+bucket_table_init (BucketTable *table, int rate)
+{
+    int i;
+
+    for (i = 0; i < N_SHARDS; ++i) {
+        pthread_mutex_init (&table->shards[i].lock, NULL);
+        table->shards[i].buckets = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                          g_free, g_free);
+    }
+    table->rate = rate;
+    table->burst = (double)rate * BURST_SECONDS;
+}
+
+static void
+refill (BucketTable *table, TokenBucket *bucket, gint64 now)
+{
+    bucket->tokens += table->rate * (now - bucket->last_refill) / 1000000;
+    if (bucket->tokens > table->burst)
+        bucket->tokens = table->burst;
+    bucket->last_refill = now;
+}
+
+/* Take @cost tokens from the bucket of @key, if it has them. */
+static gboolean
+bucket_take (BucketTable *table, const char *key, int cost)
+{
+    BucketShard *shard;
+    TokenBucket *bucket;
+    gint64 now;
+    gboolean ret = FALSE;
+
+    if (table->rate <= 0 || !key)
+        return TRUE;
+
+    shard = &table->shards[g_str_hash (key) & (N_SHARDS - 1)];
+    now = get_current_time ();
+
+    pthread_mutex_lock (&shard->lock);
+
+    bucket = g_hash_table_lookup (shard->buckets, key);
+    if (!bucket) {
+        bucket = g_new0 (TokenBucket, 1);
+        bucket->tokens = table->burst;
+        bucket->last_refill = now;
+        g_hash_table_insert (shard->buckets, g_strdup (key), bucket);
+    } else {
+        refill (table, bucket, now);
+    }
+
+    if (bucket->tokens >= cost) {
+        bucket->tokens -= cost;
+        ret = TRUE;
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+
+    return ret;
+}
+
+static void
+bucket_refund (BucketTable *table, const char *key, int cost)
+{
+    BucketShard *shard;
+    TokenBucket *bucket;
+
+    if (table->rate <= 0 || !key)
+        return;
+
+    shard = &table->shards[g_str_hash (key) & (N_SHARDS - 1)];
+
+    pthread_mutex_lock (&shard->lock);
+    bucket = g_hash_table_lookup (shard->buckets, key);
+    if (bucket)
+        bucket->tokens = MIN (bucket->tokens + cost, table->burst);
+    pthread_mutex_unlock (&shard->lock);
+}
+
+static void
+bucket_table_remove_idle (BucketTable *table)
+{
+    BucketShard *shard;
+    GHashTableIter iter;
+    gpointer key, value;
+    TokenBucket *bucket;
+    gint64 now = get_current_time ();
+    int i;
+
+    if (table->rate <= 0)
+        return;
+
+    for (i = 0; i < N_SHARDS; ++i) {
+        shard = &table->shards[i];
+
+        pthread_mutex_lock (&shard->lock);
+        g_hash_table_iter_init (&iter, shard->buckets);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            bucket = value;
+            /* An idle bucket is full, same as a new one. */
+            if (now - bucket->last_refill > (gint64)BUCKET_IDLE_TIME * 1000000)
+                g_hash_table_iter_remove (&iter);
+        }
+        pthread_mutex_unlock (&shard->lock);
+    }
+}
+
+void
+http_admission_remove_idle (void)
+{
+    bucket_table_remove_idle (&user_buckets);
+    bucket_table_remove_idle (&repo_buckets);
+}
+
+int
+http_admission_init (int user_rate, int repo_rate, int max_expensive,
+                     int max_zip)
+{
+    if (pthread_key_create (&scheduler_key, NULL) != 0) {
+        syncw_warning ("Failed to create http admission key.\n");
+        return -1;
+    }
+
+    bucket_table_init (&user_buckets, user_rate);
+    bucket_table_init (&repo_buckets, repo_rate);
+    expensive_slots[ADMISSION_EXPENSIVE].max = max_expensive;
+    expensive_slots[ADMISSION_EXPENSIVE_PUT].max = max_expensive;
+    expensive_slots[ADMISSION_ZIP].max = max_zip;
+
+    return 0;
+}
+
+static gboolean
+take_expensive_slot (ExpensiveSlots *slots)
+{
+    gint n;
+
+    do {
+        n = g_atomic_int_get (&slots->n);
+        if (n >= slots->max)
+            return FALSE;
+    } while (!g_atomic_int_compare_and_exchange (&slots->n, n, n + 1));
+
+    return TRUE;
+}
+
+static evhtp_res
+expensive_request_fini_cb (evhtp_request_t *req, void *arg)
+{
+    ExpensiveSlots *slots = arg;
+
+    g_atomic_int_add (&slots->n, -1);
+    /* This hook replaces the one set by http_metrics_watch(). */
+    http_metrics_request_fini (req);
+    return EVHTP_RES_OK;
+}
+
+static gboolean
+try_admit (PendingRequest *pending)
+{
+    if (pending->slots && !take_expensive_slot (pending->slots))
+        return FALSE;
+
+    if (!bucket_take (&user_buckets, pending->user, pending->cost))
+        goto fail;
+
+    if (!bucket_take (&repo_buckets, pending->repo_id, pending->cost)) {
+        bucket_refund (&user_buckets, pending->user, pending->cost);
+        goto fail;
+    }
+
+    return TRUE;
+
+fail:
+    if (pending->slots)
+        g_atomic_int_add (&pending->slots->n, -1);
+    return FALSE;
+}
+
+static PendingRequest *
+pending_request_new (evhtp_request_t *req, AdmissionEntry *entry)
+{
+    PendingRequest *pending = g_new0 (PendingRequest, 1);
+
+    pending->req = req;
+    pending->entry = entry;
+
+    if (entry->key_func)
+        entry->key_func (req, entry->key_arg, &pending->user, &pending->repo_id);
+    if (!pending->user)
+        pending->user = get_client_ip_addr (req);
+
+    if (entry->cls == ADMISSION_EXPENSIVE || entry->cls == ADMISSION_ZIP ||
+        (entry->cls == ADMISSION_EXPENSIVE_PUT &&
+         evhtp_request_get_method (req) == htp_method_PUT))
+        pending->slots = &expensive_slots[entry->cls];
+    pending->cost = pending->slots ? EXPENSIVE_COST : CHEAP_COST;
+
+    return pending;
+}
+
+static void
+pending_request_free (PendingRequest *pending)
+{
+    g_free (pending->user);
+    g_free (pending->repo_id);
+    g_free (pending);
+}
+
+static void
+run_request (PendingRequest *pending)
+{
+    evhtp_request_t *req = pending->req;
+    AdmissionEntry *entry = pending->entry;
+    struct bufferevent *bev;
+
+    if (pending->uq) {
+        /* Recover evhtp's callbacks */
+        bev = evhtp_request_get_bev (req);
+        bev->readcb = pending->saved_read_cb;
+        bev->writecb = pending->saved_write_cb;
+        bev->errorcb = pending->saved_event_cb;
+        bev->cbarg = pending->saved_cb_arg;
+
+        evhtp_request_resume (req);
+    }
+
+    if (pending->slots)
+        evhtp_set_hook (&req->hooks, evhtp_hook_on_request_fini,
+                        expensive_request_fini_cb, pending->slots);
+
+    pending_request_free (pending);
+
+    entry->cb (req, entry->arg);
+}
+
+static void
+remove_user_queue (Scheduler *sched, UserQueue *uq)
+{
+    g_queue_remove (&sched->ring, uq);
+    g_hash_table_remove (sched->users, uq->user);
+}
+
+static void
+user_queue_free (gpointer data)
+{
+    UserQueue *uq = data;
+
+    g_free (uq->user);
+    g_free (uq);
+}
+
+static void
+schedule_dispatch (Scheduler *sched)
+{
+    struct timeval tv;
+
+    if (g_queue_is_empty (&sched->ring) || evtimer_pending (sched->timer, NULL))
+        return;
+
+    tv.tv_sec = 0;
+    tv.tv_usec = ADMISSION_POLL_INTERVAL_USEC;
+    evtimer_add (sched->timer, &tv);
+}
+
+/* Deficit round-robin over the users with queued requests. */
+static void
+dispatch_cb (evutil_socket_t sock, short type, void *ctx)
+{
+    Scheduler *sched = ctx;
+    UserQueue *uq;
+    PendingRequest *pending;
+    guint n_users = g_queue_get_length (&sched->ring);
+    guint i;
+
+    for (i = 0; i < n_users; ++i) {
+        uq = g_queue_pop_head (&sched->ring);
+        uq->deficit += QUANTUM;
+
+        while ((pending = g_queue_peek_head (&uq->requests)) != NULL &&
+               pending->cost <= uq->deficit) {
+            if (!try_admit (pending))
+                break;
+            uq->deficit -= pending->cost;
+            g_queue_pop_head (&uq->requests);
+            run_request (pending);
+        }
+
+        if (g_queue_is_empty (&uq->requests)) {
+            g_hash_table_remove (sched->users, uq->user);
+            continue;
+        }
+        /* Don't let a blocked user save up for a burst. */
+        uq->deficit = MIN (uq->deficit, QUANTUM);
+        g_queue_push_tail (&sched->ring, uq);
+    }
+
+    schedule_dispatch (sched);
+}
+
+static void
+queued_request_event_cb (struct bufferevent *bev, short events, void *ctx)
+{
+    PendingRequest *pending = ctx;
+    UserQueue *uq = pending->uq;
+    Scheduler *sched = pthread_getspecific (scheduler_key);
+
+    pending->saved_event_cb (bev, events, pending->saved_cb_arg);
+
+    g_queue_remove (&uq->requests, pending);
+    if (g_queue_is_empty (&uq->requests))
+        remove_user_queue (sched, uq);
+    pending_request_free (pending);
+}
+
+static Scheduler *
+get_scheduler (struct event_base *evbase)
+{
+    Scheduler *sched = pthread_getspecific (scheduler_key);
+
+    if (sched)
+        return sched;
+
+    sched = g_new0 (Scheduler, 1);
+    sched->users = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          NULL, user_queue_free);
+    g_queue_init (&sched->ring);
+    sched->timer = evtimer_new (evbase, dispatch_cb, sched);
+    /* Worker threads never exit, so schedulers are never freed. */
+    pthread_setspecific (scheduler_key, sched);
+
+    return sched;
+}
+
+/* Body of an upload that wasn't admitted. */
+static evhtp_res
+drop_body_read_cb (evhtp_request_t *req, evbuf_t *buf, void *arg)
+{
+    evbuffer_drain (buf, evbuffer_get_length (buf));
+    return EVHTP_RES_OK;
+}
+
+static gboolean
+admitted_by_headers (evhtp_request_t *req, AdmissionEntry *entry)
+{
+    return entry->headers_cb != NULL &&
+        evhtp_request_get_method (req) == htp_method_PUT;
+}
+
+static evhtp_res
+admission_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
+{
+    AdmissionEntry *entry = arg;
+    struct bufferevent *bev;
+    Scheduler *sched;
+    PendingRequest *pending;
+
+    if (!admitted_by_headers (req, entry))
+        return entry->headers_cb (req, hdr, entry->headers_arg);
+
+    bev = evhtp_request_get_bev (req);
+    sched = get_scheduler (bufferevent_get_base (bev));
+    pending = pending_request_new (req, entry);
+
+    /* The body is already coming in, so the upload can't be queued. It's
+     * rejected if it can't be admitted now, or if requests of the same user
+     * are queued before it.
+     */
+    if (g_hash_table_lookup (sched->users, pending->user) ||
+        !try_admit (pending)) {
+        syncw_debug ("Rejected upload from %s.\n", pending->user);
+        pending_request_free (pending);
+        /* Close the connection after the reply, so the body isn't read. */
+        req->keepalive = 0;
+        evhtp_send_reply (req, SYNCW_HTTP_RES_TOO_MANY_REQUESTS);
+        evhtp_set_hook (&req->hooks, evhtp_hook_on_read, drop_body_read_cb, NULL);
+        return EVHTP_RES_OK;
+    }
+
+    if (pending->slots)
+        evhtp_set_hook (&req->hooks, evhtp_hook_on_request_fini,
+                        expensive_request_fini_cb, pending->slots);
+    pending_request_free (pending);
+
+    return entry->headers_cb (req, hdr, entry->headers_arg);
+}
+
+static void
+admission_cb (evhtp_request_t *req, void *arg)
+{
+    AdmissionEntry *entry = arg;
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    Scheduler *sched;
+    PendingRequest *pending;
+    UserQueue *uq;
+
+    if (admitted_by_headers (req, entry)) {
+        if (!req->hooks || req->hooks->on_read != drop_body_read_cb)
+            entry->cb (req, entry->arg);
+        return;
+    }
+
+    sched = get_scheduler (bufferevent_get_base (bev));
+    pending = pending_request_new (req, entry);
+
+    /* Requests of a user are admitted in order. */
+    uq = g_hash_table_lookup (sched->users, pending->user);
+    if (!uq && try_admit (pending)) {
+        run_request (pending);
+        return;
+    }
+
+    if (uq && g_queue_get_length (&uq->requests) >= MAX_QUEUED_PER_USER) {
+        syncw_debug ("Too many requests from %s.\n", pending->user);
+        pending_request_free (pending);
+        evhtp_send_reply (req, SYNCW_HTTP_RES_TOO_MANY_REQUESTS);
+        return;
+    }
+
+    if (!uq) {
+        uq = g_new0 (UserQueue, 1);
+        uq->user = g_strdup (pending->user);
+        g_queue_init (&uq->requests);
+        g_hash_table_insert (sched->users, uq->user, uq);
+        g_queue_push_tail (&sched->ring, uq);
+    }
+
+    pending->uq = uq;
+    pending->saved_read_cb = bev->readcb;
+    pending->saved_write_cb = bev->writecb;
+    pending->saved_event_cb = bev->errorcb;
+    pending->saved_cb_arg = bev->cbarg;
+    bufferevent_setcb (bev,
+                       NULL,
+                       NULL,
+                       queued_request_event_cb,
+                       pending);
+
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
+
+    g_queue_push_tail (&uq->requests, pending);
+    schedule_dispatch (sched);
+}
+
+evhtp_callback_t *
+http_admission_set_regex_cb (evhtp_t *htp, const char *pattern,
+                             evhtp_callback_cb cb, void *arg,
+                             AdmissionClass cls,
+                             AdmissionKeyFunc key_func, void *key_arg)
+{
+    AdmissionEntry *entry = g_new0 (AdmissionEntry, 1);
+
+    entry->cb = cb;
+    entry->arg = arg;
+    entry->cls = cls;
+    entry->key_func = key_func;
+    entry->key_arg = key_arg;
+
+    return evhtp_set_regex_cb (htp, pattern, admission_cb, entry);
+}
+
+void
+http_admission_set_headers_cb (evhtp_callback_t *cb,
+                               evhtp_hook_headers_cb headers_cb, void *arg)
+{
+    AdmissionEntry *entry = cb->cbarg;
+
+    entry->headers_cb = headers_cb;
+    entry->headers_arg = arg;
+
+    evhtp_set_hook (&cb->hooks, evhtp_hook_on_headers, admission_headers_cb, entry);
+}
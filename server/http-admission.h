@@ -0,0 +1,76 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef HTTP_ADMISSION_H
+#define HTTP_ADMISSION_H
+
+#include <evhtp.h>
+
+/*
+ * Admission control in front of http callbacks.
+ *
+ * Every request is charged to its user and repo, each with a token bucket.
+ * A request that finds a bucket empty doesn't take a worker. It's paused
+ * and queued instead. Queued requests are served round-robin by user, with
+ * deficit counters so that expensive requests count for more, and one busy
+ * user can't starve the others. Each worker thread schedules its own
+ * connections; buckets and the expensive request limits are shared.
+ */
+
+/*
+ * Only a few requests of each expensive class are served at once. Each class
+ * has its own limit, so that long zip downloads don't hold up diffs.
+ */
+typedef enum AdmissionClass {
+    ADMISSION_CHEAP,
+    /* Diffs. */
+    ADMISSION_EXPENSIVE,
+    /* Expensive for PUT only, e.g. a head update that may merge. */
+    ADMISSION_EXPENSIVE_PUT,
+    /* Zip downloads, which hold their slot while they're sent. */
+    ADMISSION_ZIP,
+    N_ADMISSION_CLASSES,
+} AdmissionClass;
+
+/*
+ * Set the user and repo a request is charged to, or leave them NULL.
+ * Requests without a user are charged to the client address.
+ */
+typedef void (*AdmissionKeyFunc) (evhtp_request_t *req, void *arg,
+                                  char **user, char **repo_id);
+
+/*
+ * @user_rate and @repo_rate are requests per second, 0 means unlimited.
+ * At most @max_expensive requests of each expensive class and @max_zip zip
+ * downloads are served at once.
+ */
+int
+http_admission_init (int user_rate, int repo_rate, int max_expensive,
+                     int max_zip);
+
+/*
+ * Like evhtp_set_regex_cb(), with @cb called once the request is admitted.
+ * Expensive requests are counted until they're freed, so their callbacks
+ * must not set an on_request_fini hook.
+ */
+evhtp_callback_t *
+http_admission_set_regex_cb (evhtp_t *htp, const char *pattern,
+                             evhtp_callback_cb cb, void *arg,
+                             AdmissionClass cls,
+                             AdmissionKeyFunc key_func, void *key_arg);
+
+/*
+ * Admit PUT requests of @cb, which was returned by
+ * http_admission_set_regex_cb(), as soon as their headers are parsed, and
+ * then call @headers_cb. For handlers that read the body as it arrives.
+ * Such an upload can't be queued, so it's rejected with 429 if it's not
+ * admitted at once, and neither @headers_cb nor the callback is called.
+ */
+void
+http_admission_set_headers_cb (evhtp_callback_t *cb,
+                               evhtp_hook_headers_cb headers_cb, void *arg);
+
+/* Free the buckets of users and repos that have been idle for a while. */
+void
+http_admission_remove_idle (void);
+
+#endif
@@ -0,0 +1,311 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "utils.h"
+#include "log.h"
+
+#include "http-compress.h"
+
+/* Smaller replies barely shrink, and fit in a packet or two anyway. */
+#define MIN_COMPRESS_SIZE 1024
+/* Hex ids compress well even at the fastest levels. */
+#define GZIP_LEVEL 1
+#define ZSTD_LEVEL 1
+#define COMPRESS_BUF_SIZE 16384
+
+typedef enum HttpEncoding {
+    HTTP_ENCODING_IDENTITY,
+    HTTP_ENCODING_GZIP,
+    HTTP_ENCODING_ZSTD,
+} HttpEncoding;
+
+struct HttpCompressor {
+    HttpEncoding encoding;
+    z_stream zstrm;
+#ifdef HAVE_ZSTD
+    ZSTD_CStream *zcs;
+#endif
+};
+
+/* Whether @coding is listed in Accept-Encoding without q=0. */
+static gboolean
+accepts_encoding (const char *accept, const char *coding)
+{
+    char **codings = g_strsplit (accept, ",", 0);
+    char **params;
+    char *q;
+    gboolean ret = FALSE;
+    int i;
+
+    for (i = 0; codings[i] && !ret; ++i) {
+        params = g_strsplit (codings[i], ";", 2);
+        g_strstrip (params[0]);
+        if (g_ascii_strcasecmp (params[0], coding) == 0) {
+            ret = TRUE;
+            if (params[1]) {
+                q = g_strstrip (params[1]);
+                if (g_str_has_prefix (q, "q=") && g_ascii_strtod (q + 2, NULL) <= 0)
+                    ret = FALSE;
+            }
+        }
+        g_strfreev (params);
+    }
+
+    g_strfreev (codings);
+    return ret;
+}
+
+static HttpEncoding
+negotiate_encoding (evhtp_request_t *req)
+{
+    const char *accept = evhtp_kv_find (req->headers_in, "Accept-Encoding");
+
+    if (!accept)
+        return HTTP_ENCODING_IDENTITY;
+#ifdef HAVE_ZSTD
+    if (accepts_encoding (accept, "zstd"))
+        return HTTP_ENCODING_ZSTD;
+#endif
+    if (accepts_encoding (accept, "gzip"))
+        return HTTP_ENCODING_GZIP;
+    return HTTP_ENCODING_IDENTITY;
+}
+
+static HttpCompressor *
+compressor_new (HttpEncoding encoding)
+{
+    HttpCompressor *c = g_new0 (HttpCompressor, 1);
+
+    c->encoding = encoding;
+
+    switch (encoding) {
+    case HTTP_ENCODING_GZIP:
+        /* 16 is added to windowBits for a gzip header. */
+        if (deflateInit2 (&c->zstrm, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                          Z_DEFAULT_STRATEGY) != Z_OK) {
+            syncw_warning ("Failed to init gzip stream.\n");
+            goto error;
+        }
+        break;
+#ifdef HAVE_ZSTD
+    case HTTP_ENCODING_ZSTD:
+        c->zcs = ZSTD_createCStream ();
+        if (!c->zcs || ZSTD_isError (ZSTD_initCStream (c->zcs, ZSTD_LEVEL))) {
+            syncw_warning ("Failed to init zstd stream.\n");
+            goto error;
+        }
+        break;
+#endif
+    default:
+        goto error;
+    }
+
+    return c;
+
+error:
+    http_compressor_free (c);
+    return NULL;
+}
+
+static void
+add_encoding_headers (evhtp_request_t *req, HttpEncoding encoding)
+{
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("Content-Encoding",
+                                                encoding == HTTP_ENCODING_GZIP ?
+                                                "gzip" : "zstd", 1, 1));
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("Vary", "Accept-Encoding", 1, 1));
+}
+
+HttpCompressor *
+http_compressor_start (evhtp_request_t *req)
+{
+    HttpEncoding encoding = negotiate_encoding (req);
+    HttpCompressor *c;
+
+    if (encoding == HTTP_ENCODING_IDENTITY)
+        return NULL;
+
+    c = compressor_new (encoding);
+    if (c)
+        add_encoding_headers (req, encoding);
+    return c;
+}
+
+void
+http_compressor_free (HttpCompressor *c)
+{
+    if (!c)
+        return;
+
+    if (c->encoding == HTTP_ENCODING_GZIP)
+        deflateEnd (&c->zstrm);
+#ifdef HAVE_ZSTD
+    if (c->zcs)
+        ZSTD_freeCStream (c->zcs);
+#endif
+    g_free (c);
+}
+
+static int
+gzip_compress (HttpCompressor *c, const void *data, size_t len,
+               struct evbuffer *out, int flush)
+{
+    unsigned char buf[COMPRESS_BUF_SIZE];
+    int rc;
+
+    c->zstrm.next_in = (unsigned char *)data;
+    c->zstrm.avail_in = len;
+
+    do {
+        c->zstrm.next_out = buf;
+        c->zstrm.avail_out = sizeof(buf);
+        rc = deflate (&c->zstrm, flush);
+        if (rc == Z_STREAM_ERROR) {
+            syncw_warning ("Failed to gzip reply.\n");
+            return -1;
+        }
+        evbuffer_add (out, buf, sizeof(buf) - c->zstrm.avail_out);
+    } while (c->zstrm.avail_out == 0);
+
+    return 0;
+}
+
+#ifdef HAVE_ZSTD
+static int
+zstd_compress (HttpCompressor *c, const void *data, size_t len,
+               struct evbuffer *out)
+{
+    unsigned char buf[COMPRESS_BUF_SIZE];
+    ZSTD_inBuffer input = { data, len, 0 };
+    ZSTD_outBuffer output;
+    size_t rc;
+
+    while (input.pos < input.size) {
+        output.dst = buf;
+        output.size = sizeof(buf);
+        output.pos = 0;
+        rc = ZSTD_compressStream (c->zcs, &output, &input);
+        if (ZSTD_isError (rc)) {
+            syncw_warning ("Failed to zstd compress reply: %s.\n",
+                          ZSTD_getErrorName (rc));
+            return -1;
+        }
+        evbuffer_add (out, buf, output.pos);
+    }
+
+    return 0;
+}
+
+static int
+zstd_flush (HttpCompressor *c, struct evbuffer *out, gboolean finish)
+{
+    unsigned char buf[COMPRESS_BUF_SIZE];
+    ZSTD_outBuffer output;
+    size_t remaining;
+
+    do {
+        output.dst = buf;
+        output.size = sizeof(buf);
+        output.pos = 0;
+        if (finish)
+            remaining = ZSTD_endStream (c->zcs, &output);
+        else
+            remaining = ZSTD_flushStream (c->zcs, &output);
+        if (ZSTD_isError (remaining)) {
+            syncw_warning ("Failed to zstd compress reply: %s.\n",
+                          ZSTD_getErrorName (remaining));
+            return -1;
+        }
+        evbuffer_add (out, buf, output.pos);
+    } while (remaining > 0);
+
+    return 0;
+}
+#endif
+
+/* Compress @in without pulling it up or draining it. */
+static int
+compress_buffer (HttpCompressor *c, struct evbuffer *in, struct evbuffer *out,
+                 gboolean finish)
+{
+    struct evbuffer_iovec *iov;
+    int n_vec, i;
+    int ret = 0;
+
+    n_vec = evbuffer_peek (in, -1, NULL, NULL, 0);
+    iov = g_new (struct evbuffer_iovec, MAX (n_vec, 1));
+    evbuffer_peek (in, -1, NULL, iov, n_vec);
+
+    for (i = 0; i < n_vec; ++i) {
+        if (c->encoding == HTTP_ENCODING_GZIP)
+            ret = gzip_compress (c, iov[i].iov_base, iov[i].iov_len,
+                                 out, Z_NO_FLUSH);
+#ifdef HAVE_ZSTD
+        else
+            ret = zstd_compress (c, iov[i].iov_base, iov[i].iov_len, out);
+#endif
+        if (ret < 0)
+            goto out;
+    }
+
+    if (c->encoding == HTTP_ENCODING_GZIP)
+        ret = gzip_compress (c, NULL, 0, out, finish ? Z_FINISH : Z_SYNC_FLUSH);
+#ifdef HAVE_ZSTD
+    else
+        ret = zstd_flush (c, out, finish);
+#endif
+
+out:
+    g_free (iov);
+    return ret;
+}
+
+int
+http_compressor_process (HttpCompressor *c,
+                         struct evbuffer *in, struct evbuffer *out,
+                         gboolean finish)
+{
+    if (compress_buffer (c, in, out, finish) < 0)
+        return -1;
+
+    evbuffer_drain (in, evbuffer_get_length (in));
+    return 0;
+}
+
+void
+http_compress_reply (evhtp_request_t *req)
+{
+    HttpEncoding encoding;
+    HttpCompressor *c;
+    struct evbuffer *out;
+
+    if (evbuffer_get_length (req->buffer_out) < MIN_COMPRESS_SIZE)
+        return;
+
+    encoding = negotiate_encoding (req);
+    if (encoding == HTTP_ENCODING_IDENTITY)
+        return;
+
+    c = compressor_new (encoding);
+    if (!c)
+        return;
+
+    /* The reply is sent uncompressed if anything goes wrong. */
+    out = evbuffer_new ();
+    if (compress_buffer (c, req->buffer_out, out, TRUE) == 0) {
+        evbuffer_drain (req->buffer_out, evbuffer_get_length (req->buffer_out));
+        evbuffer_add_buffer (req->buffer_out, out);
+        add_encoding_headers (req, encoding);
+    }
+
+    evbuffer_free (out);
+    http_compressor_free (c);
+}
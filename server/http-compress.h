@@ -0,0 +1,44 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef HTTP_COMPRESS_H
+#define HTTP_COMPRESS_H
+
+#include <evhtp.h>
+
+/*
+ * Content-Encoding negotiation for replies of text metadata, like json id
+ * lists. gzip is always supported, zstd if the server is built with it.
+ * fs objects are stored compressed already and are never passed here.
+ */
+
+typedef struct HttpCompressor HttpCompressor;
+
+/*
+ * Start compressing the reply of @req with the best encoding the client
+ * accepts, and set the Content-Encoding header. Returns NULL if the reply
+ * should be sent as is.
+ */
+HttpCompressor *
+http_compressor_start (evhtp_request_t *req);
+
+/*
+ * Compress and drain @in, adding the result to @out. The output is flushed
+ * at every call, so it can be sent as a chunk right away. Set @finish on
+ * the last call to end the stream. Returns -1 on error.
+ */
+int
+http_compressor_process (HttpCompressor *c,
+                         struct evbuffer *in, struct evbuffer *out,
+                         gboolean finish);
+
+void
+http_compressor_free (HttpCompressor *c);
+
+/*
+ * Compress the whole reply body of @req before evhtp_send_reply(), if the
+ * client accepts it and the body is large enough to benefit.
+ */
+void
+http_compress_reply (evhtp_request_t *req);
+
+#endif
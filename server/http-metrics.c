@@ -0,0 +1,327 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <jansson.h>
+
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+#include "utils.h"
+#include "log.h"
+
+#include "http-metrics.h"
+
+#define MAX_ENDPOINTS 64
+
+/*
+ * Log-linear latency buckets in microseconds, as in HDR histograms.
+ * Values below SUB_BUCKETS have a bucket each; every power of 2 above is
+ * split into SUB_BUCKETS buckets, so the error is within 1/SUB_BUCKETS.
+ */
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+/* Latencies are capped at 2^36 us, about 19 hours. */
+#define MAX_MSB 35
+#define N_BUCKETS (SUB_BUCKETS + (MAX_MSB - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+typedef struct EndpointStats {
+    gint64 count;
+    gint64 errors;
+    gint64 bytes_in;
+    gint64 bytes_out;
+    guint32 buckets[N_BUCKETS];
+} EndpointStats;
+
+/* Only written by its own thread. Readers may see slightly stale counts. */
+typedef struct ThreadStats {
+    EndpointStats *endpoints[MAX_ENDPOINTS];
+    /* Requests being timed: evhtp_request_t -> PendingRequest */
+    GHashTable *pending;
+} ThreadStats;
+
+typedef struct PendingRequest {
+    int endpoint;
+    gint64 start;
+    /* Bytes drained from the output buffer of the connection, i.e. sent. */
+    gint64 bytes_out;
+    struct evbuffer *output;
+    struct evbuffer_cb_entry *output_cb;
+} PendingRequest;
+
+static pthread_key_t stats_key;
+
+/* Protects the lists below. Recording never takes it. */
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static GList *all_threads;
+static char *endpoint_names[MAX_ENDPOINTS];
+static int n_endpoints;
+
+static inline int
+bucket_index (guint64 v)
+{
+    int msb, shift;
+
+    if (v < SUB_BUCKETS)
+        return (int)v;
+    if (v >= ((guint64)1 << (MAX_MSB + 1)))
+        v = ((guint64)1 << (MAX_MSB + 1)) - 1;
+
+    msb = 63 - __builtin_clzll (v);
+    shift = msb - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + (int)((v >> shift) - SUB_BUCKETS);
+}
+
+/* Middle of the range covered by a bucket. */
+static guint64
+bucket_value (int index)
+{
+    int shift;
+    guint64 sub;
+
+    if (index < SUB_BUCKETS)
+        return index;
+
+    shift = index / SUB_BUCKETS - 1;
+    sub = index % SUB_BUCKETS + SUB_BUCKETS;
+    return (sub << shift) + (((guint64)1 << shift) >> 1);
+}
+
+int
+http_metrics_init (void)
+{
+    if (pthread_key_create (&stats_key, NULL) != 0) {
+        syncw_warning ("Failed to create http metrics key.\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void
+pending_request_free (gpointer data)
+{
+    PendingRequest *pr = data;
+
+    if (pr->output_cb)
+        evbuffer_remove_cb_entry (pr->output, pr->output_cb);
+    g_free (pr);
+}
+
+static ThreadStats *
+get_thread_stats (void)
+{
+    ThreadStats *ts = pthread_getspecific (stats_key);
+
+    if (ts)
+        return ts;
+
+    ts = g_new0 (ThreadStats, 1);
+    ts->pending = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                         NULL, pending_request_free);
+    pthread_setspecific (stats_key, ts);
+
+    pthread_mutex_lock (&metrics_lock);
+    all_threads = g_list_prepend (all_threads, ts);
+    pthread_mutex_unlock (&metrics_lock);
+
+    return ts;
+}
+
+static gint64
+get_content_length (evhtp_headers_t *headers)
+{
+    const char *len_str = evhtp_kv_find (headers, "Content-Length");
+
+    if (!len_str)
+        return 0;
+    return strtoll (len_str, NULL, 10);
+}
+
+static void
+output_drained_cb (struct evbuffer *buf, const struct evbuffer_cb_info *info,
+                   void *arg)
+{
+    PendingRequest *pr = arg;
+
+    pr->bytes_out += info->n_deleted;
+}
+
+static evhtp_res
+metrics_path_cb (evhtp_request_t *req, evhtp_path_t *path, void *arg)
+{
+    ThreadStats *ts = get_thread_stats ();
+    PendingRequest *pr = g_new0 (PendingRequest, 1);
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+
+    pr->endpoint = GPOINTER_TO_INT (arg) - 1;
+    pr->start = get_current_time ();
+    /* Chunked and streamed replies have no Content-Length, so count what
+     * is actually sent. The bev outlives the request.
+     */
+    if (bev) {
+        pr->output = bufferevent_get_output (bev);
+        pr->output_cb = evbuffer_add_cb (pr->output, output_drained_cb, pr);
+    }
+    g_hash_table_replace (ts->pending, req, pr);
+
+    return EVHTP_RES_OK;
+}
+
+void
+http_metrics_request_fini (evhtp_request_t *req)
+{
+    ThreadStats *ts = get_thread_stats ();
+    PendingRequest *pr;
+    EndpointStats *es;
+    gint64 latency;
+
+    pr = g_hash_table_lookup (ts->pending, req);
+    if (!pr)
+        return;
+
+    es = ts->endpoints[pr->endpoint];
+    if (!es) {
+        es = g_new0 (EndpointStats, 1);
+        g_atomic_pointer_set (&ts->endpoints[pr->endpoint], es);
+    }
+
+    latency = get_current_time () - pr->start;
+    if (latency < 0)
+        latency = 0;
+
+    ++es->count;
+    /* No reply was sent if the client went away. */
+    if (req->status == 0 || req->status >= EVHTP_RES_SERVERR)
+        ++es->errors;
+    /* Chunked uploads have no Content-Length and are not counted. */
+    es->bytes_in += get_content_length (req->headers_in);
+    es->bytes_out += pr->bytes_out;
+    g_atomic_int_inc ((gint *)&es->buckets[bucket_index (latency)]);
+
+    g_hash_table_remove (ts->pending, req);
+}
+
+static evhtp_res
+metrics_fini_cb (evhtp_request_t *req, void *arg)
+{
+    http_metrics_request_fini (req);
+    return EVHTP_RES_OK;
+}
+
+static int
+get_endpoint (const char *name)
+{
+    int i;
+
+    pthread_mutex_lock (&metrics_lock);
+
+    for (i = 0; i < n_endpoints; ++i) {
+        if (strcmp (endpoint_names[i], name) == 0)
+            goto out;
+    }
+
+    if (n_endpoints == MAX_ENDPOINTS) {
+        i = -1;
+        goto out;
+    }
+    endpoint_names[i] = g_strdup (name);
+    ++n_endpoints;
+
+out:
+    pthread_mutex_unlock (&metrics_lock);
+    return i;
+}
+
+void
+http_metrics_watch (evhtp_callback_t *cb, const char *name)
+{
+    int endpoint = get_endpoint (name);
+
+    if (endpoint < 0) {
+        syncw_warning ("Too many http endpoints, %s is not measured.\n", name);
+        return;
+    }
+
+    /* Hooks of the callback are copied to every request it handles. */
+    evhtp_set_hook (&cb->hooks, evhtp_hook_on_path, metrics_path_cb,
+                    GINT_TO_POINTER (endpoint + 1));
+    evhtp_set_hook (&cb->hooks, evhtp_hook_on_request_fini, metrics_fini_cb, NULL);
+}
+
+static gint64
+get_percentile (guint32 *buckets, guint64 total, int percent)
+{
+    guint64 target = (total * percent + 99) / 100;
+    guint64 sum = 0;
+    int i;
+
+    if (total == 0)
+        return 0;
+
+    for (i = 0; i < N_BUCKETS; ++i) {
+        sum += buckets[i];
+        if (sum >= target)
+            return bucket_value (i);
+    }
+    return bucket_value (N_BUCKETS - 1);
+}
+
+char *
+http_metrics_to_json (void)
+{
+    json_t *object = json_object ();
+    json_t *obj;
+    EndpointStats total, *es;
+    ThreadStats *ts;
+    GList *ptr;
+    guint64 n_samples;
+    char *ret;
+    int i, j;
+
+    pthread_mutex_lock (&metrics_lock);
+
+    for (i = 0; i < n_endpoints; ++i) {
+        memset (&total, 0, sizeof(total));
+
+        for (ptr = all_threads; ptr; ptr = ptr->next) {
+            ts = ptr->data;
+            es = g_atomic_pointer_get (&ts->endpoints[i]);
+            if (!es)
+                continue;
+
+            total.count += es->count;
+            total.errors += es->errors;
+            total.bytes_in += es->bytes_in;
+            total.bytes_out += es->bytes_out;
+            for (j = 0; j < N_BUCKETS; ++j)
+                total.buckets[j] += g_atomic_int_get ((gint *)&es->buckets[j]);
+        }
+
+        n_samples = 0;
+        for (j = 0; j < N_BUCKETS; ++j)
+            n_samples += total.buckets[j];
+
+        obj = json_object ();
+        json_object_set_new (obj, "count", json_integer (total.count));
+        json_object_set_new (obj, "errors", json_integer (total.errors));
+        json_object_set_new (obj, "bytes_in", json_integer (total.bytes_in));
+        json_object_set_new (obj, "bytes_out", json_integer (total.bytes_out));
+        json_object_set_new (obj, "p50_us",
+                             json_integer (get_percentile (total.buckets, n_samples, 50)));
+        json_object_set_new (obj, "p95_us",
+                             json_integer (get_percentile (total.buckets, n_samples, 95)));
+        json_object_set_new (obj, "p99_us",
+                             json_integer (get_percentile (total.buckets, n_samples, 99)));
+        json_object_set_new (object, endpoint_names[i], obj);
+    }
+
+    pthread_mutex_unlock (&metrics_lock);
+
+    ret = json_dumps (object, JSON_COMPACT);
+    json_decref (object);
+    return ret;
+}
@@ -0,0 +1,34 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef HTTP_METRICS_H
+#define HTTP_METRICS_H
+
+#include <evhtp.h>
+
+/*
+ * Request counts, bytes and latency histograms of http endpoints.
+ *
+ * Each worker thread records into its own counters, so recording takes no
+ * lock. A request is timed from when its path is parsed until it's freed,
+ * so streamed replies are counted in full.
+ */
+
+int
+http_metrics_init (void);
+
+/* Record metrics of all requests handled by @cb under @name. */
+void
+http_metrics_watch (evhtp_callback_t *cb, const char *name);
+
+/*
+ * Handlers that set their own on_request_fini hook on a request replace the
+ * one set by http_metrics_watch(), and must call this from their hook.
+ */
+void
+http_metrics_request_fini (evhtp_request_t *req);
+
+/* Returns a JSON object with the metrics of each endpoint. */
+char *
+http_metrics_to_json (void);
+
+#endif
@@ -3,8 +3,12 @@
 #include <pthread.h>
 #include <string.h>
 #include <jansson.h>
+#include <openssl/sha.h>
 #include <locale.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
 #include <event2/event.h>
@@ -27,39 +31,80 @@
 #include "fileserver-config.h"
 
 #include "http-status-codes.h"
+#include "sharded-cache.h"
+#include "http-metrics.h"
+#include "head-watch.h"
+#include "http-admission.h"
+#include "thread-waker.h"
+#include "http-compress.h"
 
 #define DEFAULT_BIND_HOST "0.0.0.0"
 #define DEFAULT_BIND_PORT 8082
 #define DEFAULT_WORKER_THREADS 10
+#define DEFAULT_ACCEPTOR_THREADS 1
+#define DEFAULT_LISTEN_BACKLOG 128
+#define DEFAULT_HEAD_POLL_TIMEOUT 50 /* below common proxy read timeouts */
+#define DEFAULT_USER_REQUEST_RATE 0 /* unlimited */
+#define DEFAULT_REPO_REQUEST_RATE 0
 #define DEFAULT_MAX_DOWNLOAD_DIR_SIZE 100 * ((gint64)1 << 20) /* 100MB */
 #define DEFAULT_MAX_INDEXING_THREADS 1
 #define DEFAULT_MAX_INDEX_PROCESSING_THREADS 3
 #define DEFAULT_FIXED_BLOCK_SIZE ((gint64)1 << 23) /* 8MB */
+#define DEFAULT_WEB_CACHE_SIZE 256 /* MB */
+#define DEFAULT_WEB_CACHE_MAX_FILE_SIZE 4 /* MB */
+#define DEFAULT_ZIP_CACHE_SIZE 1024 /* MB */
 
 #define HOST "host"
 #define PORT "port"
 
 #define INIT_INFO "If you see this page, Syncwerk HTTP syncing component works."
-#define PROTO_VERSION "{\"version\": 2}"
+/*
+ * Version 3: check-fs, check-blocks, pack-fs, pack-blocks and fs-id-list
+ * accept and return packed 20-byte object ids, see OBJ_ID_LIST_BINARY_TYPE.
+ */
+#define PROTO_VERSION "{\"version\": 3}"
+
+/* Content type of an object id list sent as packed raw sha1s instead of
+ * a json array of hex strings. Used in Content-Type for request bodies and
+ * in Accept for replies.
+ */
+#define OBJ_ID_LIST_BINARY_TYPE "application/x-syncwerk-obj-ids"
 
 #define CLEANING_INTERVAL_SEC 300	/* 5 minutes */
 #define TOKEN_EXPIRE_TIME 7200	    /* 2 hours */
 #define PERM_EXPIRE_TIME 7200       /* 2 hours */
 #define VIRINFO_EXPIRE_TIME 7200       /* 2 hours */
+#define MAX_FS_ID_LIST_CACHE_NUM 1000
+#define MAX_FS_ID_LIST_CACHE_SIZE (64 << 20) /* 64MB */
+/* Larger lists would evict most of the cache, so they're not cached. */
+#define MAX_FS_ID_LIST_ENTRY_SIZE (MAX_FS_ID_LIST_CACHE_SIZE / 8)
+#define FS_ID_LIST_CHUNK_SIZE (4096 * 20) /* 4096 ids */
+#define FS_ID_LIST_MAX_CHUNKS 8
+#define DEFAULT_FS_ID_LIST_THREADS 4
+/* Seconds the diff thread waits for a client that doesn't read. */
+#define FS_ID_LIST_STALL_TIMEOUT 60
+/* Repos in one head-commits-poll request; clients batch repos the same way
+ * for head-commits-multi. */
+#define MAX_HEAD_POLL_REPOS 1000
 
 struct _HttpServer {
     evbase_t *evbase;
     evhtp_t *evhtp;
     pthread_t thread_id;
 
-    GHashTable *token_cache;
-    pthread_mutex_t token_cache_lock; /* token -> username */
+    ShardedCache *token_cache;  /* token -> TokenInfo */
+    ShardedCache *perm_cache;   /* repo_id:username -> PermInfo */
+    ShardedCache *vir_repo_info_cache; /* repo_id -> VirRepoInfo */
 
-    GHashTable *perm_cache;
-    pthread_mutex_t perm_cache_lock; /* repo_id:username -> permission */
+    GHashTable *fs_id_list_cache;  /* repo_id:server_head:client_head:dir_only -> FsIdListEntry */
+    GQueue *fs_id_list_lru;
+    gsize fs_id_list_cache_size;
+    pthread_mutex_t fs_id_list_cache_lock;
 
-    GHashTable *vir_repo_info_cache;
-    pthread_mutex_t vir_repo_info_cache_lock;
+    GThreadPool *fs_id_list_tpool;  /* Computes streamed fs-id-list replies. */
+    GThreadPool *recv_fs_tpool;     /* Writes uploaded fs objects. */
+
+    HeadWatch *head_watch;      /* Parked head-commits-poll requests. */
 
     uint32_t cevent_id;         /* Used for sending activity events. */
     uint32_t stats_event_id;         /* Used for sending events for statistics. */
@@ -80,17 +125,28 @@ typedef struct _StatsEventData StatsEventData;
 typedef struct TokenInfo {
     char *repo_id;
     char *email;
-    gint64 expire_time;
 } TokenInfo;
 
 typedef struct PermInfo {
     char *perm;
-    gint64 expire_time;
 } PermInfo;
 
+/* An fs-id-list diff result, or a diff being computed. */
+typedef struct FsIdListEntry {
+    char *key;
+    gboolean computing;
+    /* Whether the entry is in the cache, i.e. computed and not evicted. */
+    gboolean cached;
+    /* Threads waiting for or reading this entry. */
+    int n_waiters;
+    pthread_cond_t done_cond;
+    /* Packed raw sha1s. */
+    GByteArray *ids;
+    GList lru_link;
+} FsIdListEntry;
+
 typedef struct VirRepoInfo {
     char *store_id;
-    gint64 expire_time;
 } VirRepoInfo;
 
 typedef struct FsHdr {
@@ -104,10 +160,12 @@ typedef enum CheckExistType {
 } CheckExistType;
 
 const char *GET_PROTO_PATH = "/protocol-version";
+const char *GET_METRICS_PATH = "/metrics";
 const char *OP_PERM_CHECK_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/permission-check/.*";
 const char *GET_CHECK_QUOTA_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/quota-check/.*";
 const char *HEAD_COMMIT_OPER_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/commit/HEAD";
 const char *GET_HEAD_COMMITS_MULTI_REGEX = "^/repo/head-commits-multi";
+const char *HEAD_COMMITS_POLL_REGEX = "^/repo/head-commits-poll";
 const char *COMMIT_OPER_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/commit/[\\da-z]{40}";
 const char *PUT_COMMIT_INFO_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/commit/[\\da-z]{40}";
 const char *GET_FS_OBJ_ID_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/fs-id-list/.*";
@@ -116,6 +174,7 @@ const char *POST_CHECK_FS_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\
 const char *POST_CHECK_BLOCK_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/check-blocks";
 const char *POST_RECV_FS_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/recv-fs";
 const char *POST_PACK_FS_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/pack-fs";
+const char *POST_PACK_BLOCKS_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/pack-blocks";
 const char *GET_BLOCK_MAP_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/block-map/[\\da-z]{40}";
 
 static void
@@ -125,11 +184,24 @@ load_http_config (HttpServerStruct *htp_server, SyncwerkSession *session)
     char *host = NULL;
     int port = 0;
     int worker_threads;
+    int acceptor_threads;
+    int listen_backlog;
+    int head_poll_timeout;
+    int user_request_rate;
+    int repo_request_rate;
+    int max_expensive_requests;
+    int max_zip_requests;
+    int fs_id_list_threads;
     int web_token_expire_time;
     int fixed_block_size_mb;
     char *encoding;
     int max_indexing_threads;
     int max_index_processing_threads;
+    gboolean use_sendfile;
+    int web_cache_size_mb;
+    int web_cache_max_file_size_mb;
+    gboolean stream_zip;
+    int zip_cache_size_mb;
 
     host = fileserver_config_get_string (session->config, HOST, &error);
     if (!error) {
@@ -172,6 +244,129 @@ load_http_config (HttpServerStruct *htp_server, SyncwerkSession *session)
     }
     syncw_message ("fileserver: worker_threads = %d\n", htp_server->worker_threads);
 
+    acceptor_threads = fileserver_config_get_integer (session->config,
+                                                      "acceptor_threads",
+                                                      &error);
+    if (error) {
+        htp_server->acceptor_threads = DEFAULT_ACCEPTOR_THREADS;
+        g_clear_error (&error);
+    } else {
+        if (acceptor_threads <= 0)
+            htp_server->acceptor_threads = DEFAULT_ACCEPTOR_THREADS;
+        else
+            htp_server->acceptor_threads = acceptor_threads;
+    }
+#if !defined HAVE_EVHTP_ACCEPT_SOCKET || !defined SO_REUSEPORT
+    if (htp_server->acceptor_threads > 1) {
+        syncw_warning ("[conf] SO_REUSEPORT is not supported, "
+                      "ignore acceptor_threads.\n");
+        htp_server->acceptor_threads = 1;
+    }
+#endif
+    syncw_message ("fileserver: acceptor_threads = %d\n",
+                  htp_server->acceptor_threads);
+
+    listen_backlog = fileserver_config_get_integer (session->config,
+                                                    "listen_backlog",
+                                                    &error);
+    if (error) {
+        htp_server->listen_backlog = DEFAULT_LISTEN_BACKLOG;
+        g_clear_error (&error);
+    } else {
+        if (listen_backlog <= 0)
+            htp_server->listen_backlog = DEFAULT_LISTEN_BACKLOG;
+        else
+            htp_server->listen_backlog = listen_backlog;
+    }
+    syncw_message ("fileserver: listen_backlog = %d\n",
+                  htp_server->listen_backlog);
+
+    head_poll_timeout = fileserver_config_get_integer (session->config,
+                                                       "head_poll_timeout",
+                                                       &error);
+    if (error) {
+        htp_server->head_poll_timeout = DEFAULT_HEAD_POLL_TIMEOUT;
+        g_clear_error (&error);
+    } else {
+        if (head_poll_timeout <= 0)
+            htp_server->head_poll_timeout = DEFAULT_HEAD_POLL_TIMEOUT;
+        else
+            htp_server->head_poll_timeout = head_poll_timeout;
+    }
+    syncw_message ("fileserver: head_poll_timeout = %d\n",
+                  htp_server->head_poll_timeout);
+
+    user_request_rate = fileserver_config_get_integer (session->config,
+                                                       "user_request_rate",
+                                                       &error);
+    if (error) {
+        htp_server->user_request_rate = DEFAULT_USER_REQUEST_RATE;
+        g_clear_error (&error);
+    } else {
+        if (user_request_rate < 0)
+            htp_server->user_request_rate = DEFAULT_USER_REQUEST_RATE;
+        else
+            htp_server->user_request_rate = user_request_rate;
+    }
+    syncw_message ("fileserver: user_request_rate = %d\n",
+                  htp_server->user_request_rate);
+
+    repo_request_rate = fileserver_config_get_integer (session->config,
+                                                       "repo_request_rate",
+                                                       &error);
+    if (error) {
+        htp_server->repo_request_rate = DEFAULT_REPO_REQUEST_RATE;
+        g_clear_error (&error);
+    } else {
+        if (repo_request_rate < 0)
+            htp_server->repo_request_rate = DEFAULT_REPO_REQUEST_RATE;
+        else
+            htp_server->repo_request_rate = repo_request_rate;
+    }
+    syncw_message ("fileserver: repo_request_rate = %d\n",
+                  htp_server->repo_request_rate);
+
+    /* By default half of the workers are left for cheap requests. */
+    max_expensive_requests = fileserver_config_get_integer (session->config,
+                                                            "max_expensive_requests",
+                                                            &error);
+    if (error || max_expensive_requests <= 0) {
+        htp_server->max_expensive_requests = MAX (htp_server->worker_threads / 2, 1);
+        g_clear_error (&error);
+    } else {
+        htp_server->max_expensive_requests = max_expensive_requests;
+    }
+    syncw_message ("fileserver: max_expensive_requests = %d\n",
+                  htp_server->max_expensive_requests);
+
+    /* Zips are limited separately, as they're held while being sent. */
+    max_zip_requests = fileserver_config_get_integer (session->config,
+                                                      "max_zip_requests",
+                                                      &error);
+    if (error || max_zip_requests <= 0) {
+        htp_server->max_zip_requests = htp_server->max_expensive_requests;
+        g_clear_error (&error);
+    } else {
+        htp_server->max_zip_requests = max_zip_requests;
+    }
+    syncw_message ("fileserver: max_zip_requests = %d\n",
+                  htp_server->max_zip_requests);
+
+    fs_id_list_threads = fileserver_config_get_integer (session->config,
+                                                        "fs_id_list_threads",
+                                                        &error);
+    if (error) {
+        htp_server->fs_id_list_threads = DEFAULT_FS_ID_LIST_THREADS;
+        g_clear_error (&error);
+    } else {
+        if (fs_id_list_threads <= 0)
+            htp_server->fs_id_list_threads = DEFAULT_FS_ID_LIST_THREADS;
+        else
+            htp_server->fs_id_list_threads = fs_id_list_threads;
+    }
+    syncw_message ("fileserver: fs_id_list_threads = %d\n",
+                  htp_server->fs_id_list_threads);
+
     fixed_block_size_mb = fileserver_config_get_integer (session->config,
                                                   "fixed_block_size",
                                                   &error);
@@ -232,6 +427,75 @@ load_http_config (HttpServerStruct *htp_server, SyncwerkSession *session)
     syncw_message ("fileserver: max_index_processing_threads= %d\n",
                   htp_server->max_index_processing_threads);
 
+    use_sendfile = fileserver_config_get_boolean (session->config,
+                                                  "use_sendfile",
+                                                  &error);
+    if (error) {
+        htp_server->use_sendfile = TRUE;
+        g_clear_error (&error);
+    } else {
+        htp_server->use_sendfile = use_sendfile;
+    }
+    syncw_message ("fileserver: use_sendfile = %d\n",
+                  htp_server->use_sendfile);
+
+    web_cache_size_mb = fileserver_config_get_integer (session->config,
+                                                       "web_cache_size",
+                                                       &error);
+    if (error) {
+        web_cache_size_mb = DEFAULT_WEB_CACHE_SIZE;
+        g_clear_error (&error);
+    } else if (web_cache_size_mb < 0) {
+        web_cache_size_mb = DEFAULT_WEB_CACHE_SIZE;
+    }
+    htp_server->web_cache_size = web_cache_size_mb * ((gint64)1 << 20);
+    syncw_message ("fileserver: web_cache_size = %"G_GINT64_FORMAT"\n",
+                  htp_server->web_cache_size);
+
+    web_cache_max_file_size_mb = fileserver_config_get_integer (session->config,
+                                                                "web_cache_max_file_size",
+                                                                &error);
+    if (error) {
+        web_cache_max_file_size_mb = DEFAULT_WEB_CACHE_MAX_FILE_SIZE;
+        g_clear_error (&error);
+    } else if (web_cache_max_file_size_mb <= 0) {
+        web_cache_max_file_size_mb = DEFAULT_WEB_CACHE_MAX_FILE_SIZE;
+    }
+    htp_server->web_cache_max_file_size = web_cache_max_file_size_mb * ((gint64)1 << 20);
+    syncw_message ("fileserver: web_cache_max_file_size = %"G_GINT64_FORMAT"\n",
+                  htp_server->web_cache_max_file_size);
+
+    stream_zip = fileserver_config_get_boolean (session->config,
+                                                "stream_zip",
+                                                &error);
+    if (error) {
+        htp_server->stream_zip = FALSE;
+        g_clear_error (&error);
+    } else {
+        htp_server->stream_zip = stream_zip;
+    }
+    syncw_message ("fileserver: stream_zip = %d\n",
+                  htp_server->stream_zip);
+
+    zip_cache_size_mb = fileserver_config_get_integer (session->config,
+                                                       "zip_cache_size",
+                                                       &error);
+    if (error) {
+        zip_cache_size_mb = DEFAULT_ZIP_CACHE_SIZE;
+        g_clear_error (&error);
+    } else if (zip_cache_size_mb < 0) {
+        zip_cache_size_mb = DEFAULT_ZIP_CACHE_SIZE;
+    } else if (zip_cache_size_mb > 0 && htp_server->stream_zip) {
+        syncw_warning ("fileserver: zip_cache_size is ignored, "
+                       "streamed zip archives are not cached.\n");
+    }
+    /* Streamed archives never reach the disk, so the cache would stay empty. */
+    if (htp_server->stream_zip)
+        zip_cache_size_mb = 0;
+    htp_server->zip_cache_size = zip_cache_size_mb * ((gint64)1 << 20);
+    syncw_message ("fileserver: zip_cache_size = %"G_GINT64_FORMAT"\n",
+                  htp_server->zip_cache_size);
+
     encoding = g_key_file_get_string (session->config,
                                       "zip", "windows_encoding",
                                       &error);
@@ -244,6 +508,15 @@ load_http_config (HttpServerStruct *htp_server, SyncwerkSession *session)
     }
 }
 
+static void
+copy_token_email (gpointer value, gpointer user_data)
+{
+    TokenInfo *token_info = value;
+    char **username = user_data;
+
+    *username = g_strdup (token_info->email);
+}
+
 static int
 validate_token (HttpServer *htp_server, evhtp_request_t *req,
                 const char *repo_id, char **username,
@@ -258,55 +531,50 @@ validate_token (HttpServer *htp_server, evhtp_request_t *req,
         return EVHTP_RES_BADREQ;
     }
 
-    if (!skip_cache) {
-        pthread_mutex_lock (&htp_server->token_cache_lock);
-
-        token_info = g_hash_table_lookup (htp_server->token_cache, token);
-        if (token_info) {
-            if (username)
-                *username = g_strdup(token_info->email);
-            pthread_mutex_unlock (&htp_server->token_cache_lock);
-            return EVHTP_RES_OK;
-        }
-
-        pthread_mutex_unlock (&htp_server->token_cache_lock);
-    }
+    if (!skip_cache &&
+        sharded_cache_lookup (htp_server->token_cache, token, 0,
+                              username ? copy_token_email : NULL, username))
+        return EVHTP_RES_OK;
 
     email = syncw_repo_manager_get_email_by_token (syncw->repo_mgr,
                                                   repo_id, token);
     if (email == NULL) {
-        pthread_mutex_lock (&htp_server->token_cache_lock);
-        g_hash_table_remove (htp_server->token_cache, token);
-        pthread_mutex_unlock (&htp_server->token_cache_lock);
+        sharded_cache_remove (htp_server->token_cache, token);
         return EVHTP_RES_FORBIDDEN;
     }
 
+    if (username)
+        *username = g_strdup(email);
+
     token_info = g_new0 (TokenInfo, 1);
     token_info->repo_id = g_strdup (repo_id);
-    token_info->expire_time = (gint64)time(NULL) + TOKEN_EXPIRE_TIME;
     token_info->email = email;
 
-    pthread_mutex_lock (&htp_server->token_cache_lock);
-    g_hash_table_insert (htp_server->token_cache, g_strdup (token), token_info);
-    pthread_mutex_unlock (&htp_server->token_cache_lock);
+    sharded_cache_insert (htp_server->token_cache, token, token_info,
+                          (gint64)time(NULL) + TOKEN_EXPIRE_TIME);
 
-    if (username)
-        *username = g_strdup(email);
     return EVHTP_RES_OK;
 }
 
-static PermInfo *
+static void
+copy_perm (gpointer value, gpointer user_data)
+{
+    PermInfo *perm_info = value;
+    char **perm = user_data;
+
+    *perm = g_strdup (perm_info->perm);
+}
+
+static char *
 lookup_perm_cache (HttpServer *htp_server, const char *repo_id, const char *username)
 {
-    PermInfo *ret = NULL;
+    char *perm = NULL;
     char *key = g_strdup_printf ("%s:%s", repo_id, username);
 
-    pthread_mutex_lock (&htp_server->perm_cache_lock);
-    ret = g_hash_table_lookup (htp_server->perm_cache, key);
-    pthread_mutex_unlock (&htp_server->perm_cache_lock);
+    sharded_cache_lookup (htp_server->perm_cache, key, 0, copy_perm, &perm);
     g_free (key);
 
-    return ret;
+    return perm;
 }
 
 static void
@@ -316,9 +584,9 @@ insert_perm_cache (HttpServer *htp_server,
 {
     char *key = g_strdup_printf ("%s:%s", repo_id, username);
 
-    pthread_mutex_lock (&htp_server->perm_cache_lock);
-    g_hash_table_insert (htp_server->perm_cache, key, perm);
-    pthread_mutex_unlock (&htp_server->perm_cache_lock);
+    sharded_cache_insert (htp_server->perm_cache, key, perm,
+                          (gint64)time(NULL) + PERM_EXPIRE_TIME);
+    g_free (key);
 }
 
 static void
@@ -327,9 +595,7 @@ remove_perm_cache (HttpServer *htp_server,
 {
     char *key = g_strdup_printf ("%s:%s", repo_id, username);
 
-    pthread_mutex_lock (&htp_server->perm_cache_lock);
-    g_hash_table_remove (htp_server->perm_cache, key);
-    pthread_mutex_unlock (&htp_server->perm_cache_lock);
+    sharded_cache_remove (htp_server->perm_cache, key);
 
     g_free (key);
 }
@@ -339,28 +605,35 @@ check_permission (HttpServer *htp_server, const char *repo_id, const char *usern
                   const char *op, gboolean skip_cache)
 {
     PermInfo *perm_info = NULL;
+    char *perm = NULL;
+    int ret;
 
     if (!skip_cache)
-        perm_info = lookup_perm_cache (htp_server, repo_id, username);
+        perm = lookup_perm_cache (htp_server, repo_id, username);
 
-    if (perm_info) {
-        if (strcmp(perm_info->perm, "r") == 0 && strcmp(op, "upload") == 0)
-            return EVHTP_RES_FORBIDDEN;
-        return EVHTP_RES_OK;
+    if (perm) {
+        if (strcmp(perm, "r") == 0 && strcmp(op, "upload") == 0)
+            ret = EVHTP_RES_FORBIDDEN;
+        else
+            ret = EVHTP_RES_OK;
+        g_free (perm);
+        return ret;
     }
 
-    char *perm = syncw_repo_manager_check_permission (syncw->repo_mgr,
-                                                     repo_id, username, NULL);
+    perm = syncw_repo_manager_check_permission (syncw->repo_mgr,
+                                               repo_id, username, NULL);
     if (perm) {
+        if ((strcmp (perm, "r") == 0 && strcmp (op, "upload") == 0))
+            ret = EVHTP_RES_FORBIDDEN;
+        else
+            ret = EVHTP_RES_OK;
+
         perm_info = g_new0 (PermInfo, 1);
         /* Take the reference of perm. */
         perm_info->perm = perm;
-        perm_info->expire_time = (gint64)time(NULL) + PERM_EXPIRE_TIME;
         insert_perm_cache (htp_server, repo_id, username, perm_info);
 
-        if ((strcmp (perm, "r") == 0 && strcmp (op, "upload") == 0))
-            return EVHTP_RES_FORBIDDEN;
-        return EVHTP_RES_OK;
+        return ret;
     }
 
     /* Invalidate cache if perm not found in db. */
@@ -385,30 +658,31 @@ get_vir_repo_info (SyncwDBRow *row, void *data)
     (*vinfo)->store_id = g_strdup (origin_id);
     if (!(*vinfo)->store_id)
         return FALSE;
-    (*vinfo)->expire_time = time (NULL) + VIRINFO_EXPIRE_TIME;
 
     return TRUE;
 }
 
+static void
+copy_store_id (gpointer value, gpointer user_data)
+{
+    VirRepoInfo *vinfo = value;
+    char **store_id = user_data;
+
+    if (vinfo->store_id)
+        *store_id = g_strdup (vinfo->store_id);
+}
+
 static char *
 get_store_id_from_vir_repo_info_cache (HttpServer *htp_server, const char *repo_id)
 {
     char *store_id = NULL;
-    VirRepoInfo *vinfo = NULL;
-
-    pthread_mutex_lock (&htp_server->vir_repo_info_cache_lock);
-    vinfo = g_hash_table_lookup (htp_server->vir_repo_info_cache, repo_id);
-
-    if (vinfo) {
-        if (vinfo->store_id)
-            store_id = g_strdup (vinfo->store_id);
-        else
-            store_id = g_strdup (repo_id);
 
-        vinfo->expire_time = time (NULL) + VIRINFO_EXPIRE_TIME;
-    }
+    if (!sharded_cache_lookup (htp_server->vir_repo_info_cache, repo_id,
+                               VIRINFO_EXPIRE_TIME, copy_store_id, &store_id))
+        return NULL;
 
-    pthread_mutex_unlock (&htp_server->vir_repo_info_cache_lock);
+    if (!store_id)
+        store_id = g_strdup (repo_id);
 
     return store_id;
 }
@@ -417,9 +691,8 @@ static void
 add_vir_info_to_cache (HttpServer *htp_server, const char *repo_id,
                        VirRepoInfo *vinfo)
 {
-    pthread_mutex_lock (&htp_server->vir_repo_info_cache_lock);
-    g_hash_table_insert (htp_server->vir_repo_info_cache, g_strdup (repo_id), vinfo);
-    pthread_mutex_unlock (&htp_server->vir_repo_info_cache_lock);
+    sharded_cache_insert (htp_server->vir_repo_info_cache, repo_id, vinfo,
+                          (gint64)time(NULL) + VIRINFO_EXPIRE_TIME);
 }
 
 static char *
@@ -443,7 +716,6 @@ get_repo_store_id (HttpServer *htp_server, const char *repo_id)
         vinfo = g_new0 (VirRepoInfo, 1);
         if (!vinfo)
             return NULL;
-        vinfo->expire_time = time (NULL) + VIRINFO_EXPIRE_TIME;
 
         add_vir_info_to_cache (htp_server, repo_id, vinfo);
 
@@ -453,9 +725,11 @@ get_repo_store_id (HttpServer *htp_server, const char *repo_id)
         return NULL;
     }
 
+    /* The cache owns vinfo once it's added. */
+    store_id = g_strdup (vinfo->store_id);
     add_vir_info_to_cache (htp_server, repo_id, vinfo);
 
-    return g_strdup (vinfo->store_id);
+    return store_id;
 }
 
 typedef struct {
@@ -565,6 +839,30 @@ send_statistic_msg (const char *repo_id, char *user, char *operation, guint64 by
     cevent_manager_add_event (syncw->ev_mgr, syncw->http_server->priv->stats_event_id, rdata);
 }
 
+int
+add_file_segment (struct evbuffer *buf, int fd, guint64 size)
+{
+    struct evbuffer_file_segment *seg;
+    int ret;
+
+    seg = evbuffer_file_segment_new (fd, 0, size, EVBUF_FS_CLOSE_ON_FREE);
+    if (!seg) {
+        syncw_warning ("Failed to create file segment.\n");
+        close (fd);
+        return -1;
+    }
+
+    /* The buffer holds its own reference to the segment. If it couldn't be
+     * added, dropping ours closes the fd.
+     */
+    ret = evbuffer_add_file_segment (buf, seg, 0, size);
+    if (ret < 0)
+        syncw_warning ("Failed to add file segment to buffer.\n");
+    evbuffer_file_segment_free (seg);
+
+    return ret;
+}
+
 char *
 get_client_ip_addr (evhtp_request_t *req)
 {
@@ -747,6 +1045,82 @@ get_protocol_cb (evhtp_request_t *req, void *arg)
     evhtp_send_reply (req, EVHTP_RES_OK);
 }
 
+static gboolean
+is_binary_id_list_request (evhtp_request_t *req)
+{
+    const char *type = evhtp_kv_find (req->headers_in, "Content-Type");
+
+    return (type && strcmp (type, OBJ_ID_LIST_BINARY_TYPE) == 0);
+}
+
+static gboolean
+accepts_binary_id_list (evhtp_request_t *req)
+{
+    const char *accept = evhtp_kv_find (req->headers_in, "Accept");
+
+    return (accept && strstr (accept, OBJ_ID_LIST_BINARY_TYPE) != NULL);
+}
+
+/*
+ * Load the object id list in the request body, either a json array of hex
+ * ids or packed raw sha1s. The ids are returned as @n_ids hex strings of
+ * 41 bytes each, in one buffer. Entries that are not strings in the json
+ * array are returned as empty strings, so they fail is_object_id_valid().
+ *
+ * Returns NULL if the body is empty or malformed.
+ */
+static char *
+load_obj_id_list (evhtp_request_t *req, int *n_ids)
+{
+    size_t list_len = evbuffer_get_length (req->buffer_in);
+    unsigned char *raw;
+    char *ids = NULL;
+    json_t *array;
+    json_error_t jerror;
+    const char *id;
+    int i, n;
+
+    if (list_len == 0)
+        return NULL;
+
+    if (is_binary_id_list_request (req)) {
+        if (list_len % 20 != 0) {
+            syncw_warning ("Invalid binary object id list length %zu.\n", list_len);
+            return NULL;
+        }
+
+        n = list_len / 20;
+        raw = evbuffer_pullup (req->buffer_in, list_len);
+        ids = g_new (char, (gsize)n * 41);
+        for (i = 0; i < n; ++i)
+            rawdata_to_hex (raw + i * 20, ids + i * 41, 20);
+        evbuffer_drain (req->buffer_in, list_len);
+
+        *n_ids = n;
+        return ids;
+    }
+
+    array = json_loadb ((const char *)evbuffer_pullup (req->buffer_in, list_len),
+                        list_len, 0, &jerror);
+    evbuffer_drain (req->buffer_in, list_len);
+    if (!array) {
+        syncw_warning ("dump obj_id from json failed, error: %s\n", jerror.text);
+        return NULL;
+    }
+
+    n = json_array_size (array);
+    ids = g_new0 (char, (gsize)n * 41 + 1);
+    for (i = 0; i < n; ++i) {
+        id = json_string_value (json_array_get (array, i));
+        if (id && strlen (id) == 40)
+            memcpy (ids + i * 41, id, 41);
+    }
+    json_decref (array);
+
+    *n_ids = n;
+    return ids;
+}
+
 static void
 get_check_quota_cb (evhtp_request_t *req, void *arg)
 {
@@ -793,73 +1167,46 @@ out:
     g_strfreev (parts);
 }
 
-static gboolean
-get_branch (SyncwDBRow *row, void *vid)
-{
-    char *ret = vid;
-    const char *commit_id;
-
-    commit_id = syncwerk_server_db_row_get_column_text (row, 0);
-    memcpy (ret, commit_id, 41);
-
-    return FALSE;
-}
-
 static void
 get_head_commit_cb (evhtp_request_t *req, void *arg)
 {
     HttpServer *htp_server = arg;
     char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
     char *repo_id = parts[1];
-    gboolean db_err = FALSE, exists = TRUE;
     int token_status;
-    char commit_id[41];
-    char *sql;
-
-    sql = "SELECT 1 FROM Repo WHERE repo_id=?";
-    exists = syncwerk_server_db_statement_exists (syncw->db, sql, &db_err, 1, "string", repo_id);
-    if (!exists) {
-        if (db_err) {
-            syncw_warning ("DB error when check repo existence.\n");
-            evbuffer_add_printf (req->buffer_out,
-                                 "{\"is_corrupted\": 1}");
-            evhtp_send_reply (req, EVHTP_RES_OK);
-            goto out;
-        }
-        evhtp_send_reply (req, SYNCW_HTTP_RES_REPO_DELETED);
-        goto out;
-    }
-
-    token_status = validate_token (htp_server, req, repo_id, NULL, FALSE);
-    if (token_status != EVHTP_RES_OK) {
-        evhtp_send_reply (req, token_status);
-        goto out;
-    }
-
-    commit_id[0] = 0;
+    GHashTable *heads;
+    const char *commit_id;
 
-    sql = "SELECT commit_id FROM Branch WHERE name='master' AND repo_id=?";
-    if (syncwerk_server_db_statement_foreach_row (syncw->db, sql,
-                                       get_branch, commit_id,
-                                       1, "string", repo_id) < 0) {
-        syncw_warning ("DB error when get branch master.\n");
+    /* A repo without master branch has been deleted. */
+    heads = syncw_branch_manager_get_master_heads (syncw->branch_mgr,
+                                                  &repo_id, 1);
+    if (!heads) {
         evbuffer_add_printf (req->buffer_out,
                              "{\"is_corrupted\": 1}");
         evhtp_send_reply (req, EVHTP_RES_OK);
         goto out;
     }
 
-    if (commit_id[0] == 0) {
+    commit_id = g_hash_table_lookup (heads, repo_id);
+    if (!commit_id) {
         evhtp_send_reply (req, SYNCW_HTTP_RES_REPO_DELETED);
         goto out;
     }
 
+    token_status = validate_token (htp_server, req, repo_id, NULL, FALSE);
+    if (token_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, token_status);
+        goto out;
+    }
+
     evbuffer_add_printf (req->buffer_out,
                          "{\"is_corrupted\": 0, \"head_commit_id\": \"%s\"}",
                          commit_id);
     evhtp_send_reply (req, EVHTP_RES_OK);
 
 out:
+    if (heads)
+        g_hash_table_destroy (heads);
     g_strfreev (parts);
 }
 
@@ -1108,16 +1455,44 @@ head_commit_oper_cb (evhtp_request_t *req, void *arg)
    }
 }
 
-static gboolean
-collect_head_commit_ids (SyncwDBRow *row, void *data)
+/* Returns a json object mapping the repo ids to their head commit ids. */
+static json_t *
+query_head_commits (char **repo_ids, int n_ids)
 {
-    json_t *map = (json_t *)data;
-    const char *repo_id = syncwerk_server_db_row_get_column_text (row, 0);
-    const char *commit_id = syncwerk_server_db_row_get_column_text (row, 1);
+    GHashTable *heads;
+    GHashTableIter iter;
+    gpointer key, value;
+    json_t *commit_id_map;
+
+    heads = syncw_branch_manager_get_master_heads (syncw->branch_mgr,
+                                                  repo_ids, n_ids);
+    if (!heads)
+        return NULL;
+
+    commit_id_map = json_object();
+    g_hash_table_iter_init (&iter, heads);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        json_object_set_new (commit_id_map, key, json_string (value));
 
-    json_object_set_new (map, repo_id, json_string(commit_id));
+    g_hash_table_destroy (heads);
+    return commit_id_map;
+}
 
-    return TRUE;
+static void
+send_head_commits (evhtp_request_t *req, json_t *commit_id_map)
+{
+    char *data = json_dumps (commit_id_map, JSON_COMPACT);
+
+    if (!data) {
+        syncw_warning ("failed to dump json.\n");
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        return;
+    }
+
+    evbuffer_add (req->buffer_out, data, strlen(data));
+    http_compress_reply (req);
+    evhtp_send_reply (req, EVHTP_RES_OK);
+    free (data);
 }
 
 static void
@@ -1126,10 +1501,8 @@ head_commits_multi_cb (evhtp_request_t *req, void *arg)
     size_t list_len;
     json_t *repo_id_array = NULL;
     size_t n, i;
-    GString *id_list_str = NULL;
-    char *sql = NULL;
+    char **repo_ids = NULL;
     json_t *commit_id_map = NULL;
-    char *data = NULL;
 
     list_len = evbuffer_get_length (req->buffer_in);
     if (list_len == 0) {
@@ -1162,7 +1535,7 @@ head_commits_multi_cb (evhtp_request_t *req, void *arg)
     }
 
     json_t *id;
-    id_list_str = g_string_new ("");
+    repo_ids = g_new0 (char *, n + 1);
     for (i = 0; i < n; ++i) {
         id = json_array_get (repo_id_array, i);
         if (json_typeof(id) != JSON_STRING) {
@@ -1174,90 +1547,202 @@ head_commits_multi_cb (evhtp_request_t *req, void *arg)
             evhtp_send_reply (req, EVHTP_RES_BADREQ);
             goto out;
         }
-        if (i == 0)
-            g_string_append_printf (id_list_str, "'%s'", json_string_value(id));
-        else
-            g_string_append_printf (id_list_str, ",'%s'", json_string_value(id));
-    }
-
-    if (syncwerk_server_db_type (syncw->db) == SYNCW_DB_TYPE_MYSQL)
-        sql = g_strdup_printf ("SELECT repo_id, commit_id FROM Branch WHERE name='master' AND repo_id IN (%s) LOCK IN SHARE MODE",
-                                id_list_str->str);
-    else
-        sql = g_strdup_printf ("SELECT repo_id, commit_id FROM Branch WHERE name='master' AND repo_id IN (%s)",
-                                id_list_str->str);
-    commit_id_map = json_object();
-    if (syncwerk_server_db_statement_foreach_row (syncw->db, sql,
-                                       collect_head_commit_ids, commit_id_map, 0) < 0) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
+        repo_ids[i] = g_strdup (json_string_value (id));
     }
 
-    data = json_dumps (commit_id_map, JSON_COMPACT);
-    if (!data) {
-        syncw_warning ("failed to dump json.\n");
+    commit_id_map = query_head_commits (repo_ids, n);
+    if (!commit_id_map) {
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
         goto out;
     }
 
-    evbuffer_add (req->buffer_out, data, strlen(data));
-    evhtp_send_reply (req, EVHTP_RES_OK);
+    send_head_commits (req, commit_id_map);
 
 out:
     if (repo_id_array)
         json_decref (repo_id_array);
-    if (id_list_str)
-        g_string_free (id_list_str, TRUE);
-    g_free (sql);
+    g_strfreev (repo_ids);
     if (commit_id_map)
         json_decref (commit_id_map);
-    if (data)
-        free (data);
 }
 
+typedef struct HeadPollData {
+    char **repo_ids;
+    int n_ids;
+    json_t *known_heads;
+} HeadPollData;
+
 static void
-get_commit_info_cb (evhtp_request_t *req, void *arg)
+free_head_poll_data (void *data)
 {
-    HttpServer *htp_server = arg;
-    char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
-    char *repo_id = parts[1];
-    char *commit_id = parts[3];
+    HeadPollData *poll_data = data;
 
-    int token_status = validate_token (htp_server, req, repo_id, NULL, FALSE);
-    if (token_status != EVHTP_RES_OK) {
-        evhtp_send_reply (req, token_status);
-        goto out;
-    }
+    g_strfreev (poll_data->repo_ids);
+    json_decref (poll_data->known_heads);
+    g_free (poll_data);
+}
 
-    char *data = NULL;
-    int len;
+static void
+head_commits_poll_reply (evhtp_request_t *req, gboolean changed, void *data)
+{
+    HeadPollData *poll_data = data;
+    json_t *commit_id_map;
 
-    int ret = syncw_obj_store_read_obj (syncw->commit_mgr->obj_store, repo_id, 1,
-                                       commit_id, (void **)&data, &len);
-    if (ret < 0) {
-        syncw_warning ("Get commit info failed: commit %s is missing.\n", commit_id);
-        evhtp_send_reply (req, EVHTP_RES_NOTFOUND);
-        goto out;
+    /* Any change since the request was parked would have woken it. */
+    if (!changed) {
+        send_head_commits (req, poll_data->known_heads);
+        return;
     }
 
-    evbuffer_add (req->buffer_out, data, len);
-    evhtp_send_reply (req, EVHTP_RES_OK);
-    g_free (data);
-
-out:
-    g_strfreev (parts);
+    commit_id_map = query_head_commits (poll_data->repo_ids, poll_data->n_ids);
+    if (!commit_id_map) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        return;
+    }
+    send_head_commits (req, commit_id_map);
+    json_decref (commit_id_map);
 }
 
+/*
+ * Long-poll version of head-commits-multi. The body maps repo ids to the
+ * head commits the client knows. The reply has the current heads, as soon
+ * as they differ from the known ones, or after head_poll_timeout seconds.
+ * Idle clients cost a parked connection instead of a db query per poll.
+ */
 static void
-put_commit_cb (evhtp_request_t *req, void *arg)
+head_commits_poll_cb (evhtp_request_t *req, void *arg)
 {
-    HttpServer *htp_server = arg;
-    char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
-    char *repo_id = parts[1];
-    char *commit_id = parts[3];
-    char *username = NULL;
-    void *data = NULL;
-
+    HttpServerStruct *server = arg;
+    size_t len;
+    json_t *known_heads = NULL;
+    json_error_t jerror;
+    void *iter;
+    const char *repo_id;
+    json_t *commit_id;
+    char **repo_ids = NULL;
+    int n_ids, i;
+    HeadWaiter *waiter;
+    json_t *commit_id_map = NULL;
+    HeadPollData *poll_data;
+
+    len = evbuffer_get_length (req->buffer_in);
+    if (len == 0) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    known_heads = json_loadb ((const char *)evbuffer_pullup (req->buffer_in, -1),
+                              len, 0, &jerror);
+    if (!known_heads) {
+        syncw_warning ("load head commits to json failed, error: %s\n", jerror.text);
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    n_ids = json_is_object (known_heads) ? json_object_size (known_heads) : 0;
+    if (n_ids == 0 || n_ids > MAX_HEAD_POLL_REPOS) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    repo_ids = g_new0 (char *, n_ids + 1);
+    i = 0;
+    for (iter = json_object_iter (known_heads); iter;
+         iter = json_object_iter_next (known_heads, iter)) {
+        repo_id = json_object_iter_key (iter);
+        commit_id = json_object_iter_value (iter);
+        /* Make sure ids are in UUID format. */
+        if (!is_uuid_valid (repo_id) || !json_is_string (commit_id)) {
+            evhtp_send_reply (req, EVHTP_RES_BADREQ);
+            goto out;
+        }
+        repo_ids[i++] = g_strdup (repo_id);
+    }
+
+    /* Subscribe before reading the heads, so no update is missed. */
+    waiter = head_watch_subscribe (server->priv->head_watch, req,
+                                   repo_ids, n_ids);
+    if (!waiter) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+
+    commit_id_map = query_head_commits (repo_ids, n_ids);
+    if (!commit_id_map) {
+        head_watch_cancel (waiter);
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+
+    /* Deleted repos are missing from the reply, which also returns at once. */
+    if (!json_equal (commit_id_map, known_heads)) {
+        head_watch_cancel (waiter);
+        send_head_commits (req, commit_id_map);
+        goto out;
+    }
+
+    poll_data = g_new0 (HeadPollData, 1);
+    poll_data->repo_ids = repo_ids;
+    poll_data->n_ids = n_ids;
+    repo_ids = NULL;
+    poll_data->known_heads = known_heads;
+    known_heads = NULL;
+
+    head_watch_wait (waiter, server->head_poll_timeout,
+                     head_commits_poll_reply, poll_data,
+                     free_head_poll_data);
+
+out:
+    if (known_heads)
+        json_decref (known_heads);
+    g_strfreev (repo_ids);
+    if (commit_id_map)
+        json_decref (commit_id_map);
+}
+
+static void
+get_commit_info_cb (evhtp_request_t *req, void *arg)
+{
+    HttpServer *htp_server = arg;
+    char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
+    char *repo_id = parts[1];
+    char *commit_id = parts[3];
+
+    int token_status = validate_token (htp_server, req, repo_id, NULL, FALSE);
+    if (token_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, token_status);
+        goto out;
+    }
+
+    char *data = NULL;
+    int len;
+
+    int ret = syncw_obj_store_read_obj (syncw->commit_mgr->obj_store, repo_id, 1,
+                                       commit_id, (void **)&data, &len);
+    if (ret < 0) {
+        syncw_warning ("Get commit info failed: commit %s is missing.\n", commit_id);
+        evhtp_send_reply (req, EVHTP_RES_NOTFOUND);
+        goto out;
+    }
+
+    evbuffer_add (req->buffer_out, data, len);
+    evhtp_send_reply (req, EVHTP_RES_OK);
+    g_free (data);
+
+out:
+    g_strfreev (parts);
+}
+
+static void
+put_commit_cb (evhtp_request_t *req, void *arg)
+{
+    HttpServer *htp_server = arg;
+    char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
+    char *repo_id = parts[1];
+    char *commit_id = parts[3];
+    char *username = NULL;
+    void *data = NULL;
+
     int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
     if (token_status != EVHTP_RES_OK) {
         evhtp_send_reply (req, token_status);
@@ -1321,16 +1806,41 @@ commit_oper_cb (evhtp_request_t *req, void *arg)
     }
 }
 
+typedef struct FsIdListStream FsIdListStream;
+
+typedef struct CollectIdsData {
+    /* Packed raw sha1s. */
+    GByteArray *ids;
+    /* If set, @ids is handed over to the stream whenever it's full. */
+    FsIdListStream *stream;
+} CollectIdsData;
+
+static int
+fs_id_list_stream_push (FsIdListStream *stream, CollectIdsData *cd);
+
+static int
+add_collected_id (CollectIdsData *cd, const char *id)
+{
+    unsigned char sha1[20];
+
+    hex_to_sha1 (id, sha1);
+    g_byte_array_append (cd->ids, sha1, 20);
+
+    if (cd->stream && cd->ids->len >= FS_ID_LIST_CHUNK_SIZE)
+        return fs_id_list_stream_push (cd->stream, cd);
+
+    return 0;
+}
+
 static int
 collect_file_ids (int n, const char *basedir, SyncwDirent *files[], void *data)
 {
     SyncwDirent *file1 = files[0];
     SyncwDirent *file2 = files[1];
-    GList **pret = data;
 
     if (file1 && (!file2 || strcmp(file1->id, file2->id) != 0) &&
         strcmp (file1->id, EMPTY_SHA1) != 0)
-        *pret = g_list_prepend (*pret, g_strdup(file1->id));
+        return add_collected_id (data, file1->id);
 
     return 0;
 }
@@ -1347,28 +1857,28 @@ collect_dir_ids (int n, const char *basedir, SyncwDirent *dirs[], void *data,
 {
     SyncwDirent *dir1 = dirs[0];
     SyncwDirent *dir2 = dirs[1];
-    GList **pret = data;
 
     if (dir1 && (!dir2 || strcmp(dir1->id, dir2->id) != 0) &&
         strcmp (dir1->id, EMPTY_SHA1) != 0)
-        *pret = g_list_prepend (*pret, g_strdup(dir1->id));
+        return add_collected_id (data, dir1->id);
 
     return 0;
 }
 
+/*
+ * The ids are collected into @cd as packed raw sha1s.
+ */
 static int
 calculate_send_object_list (SyncwRepo *repo,
                             const char *server_head,
                             const char *client_head,
                             gboolean dir_only,
-                            GList **results)
+                            CollectIdsData *cd)
 {
     SyncwCommit *remote_head = NULL, *master_head = NULL;
     char *remote_head_root;
     int ret = 0;
 
-    *results = NULL;
-
     master_head = syncw_commit_manager_get_commit (syncw->commit_mgr,
                                                   repo->id, repo->version,
                                                   server_head);
@@ -1393,8 +1903,11 @@ calculate_send_object_list (SyncwRepo *repo,
 
     /* Diff won't traverse the root object itself. */
     if (strcmp (remote_head_root, master_head->root_id) != 0 &&
-        strcmp (master_head->root_id, EMPTY_SHA1) != 0)
-        *results = g_list_prepend (*results, g_strdup(master_head->root_id));
+        strcmp (master_head->root_id, EMPTY_SHA1) != 0 &&
+        add_collected_id (cd, master_head->root_id) < 0) {
+        ret = -1;
+        goto out;
+    }
 
     DiffOptions opts;
     memset (&opts, 0, sizeof(opts));
@@ -1405,7 +1918,7 @@ calculate_send_object_list (SyncwRepo *repo,
     else
         opts.file_cb = collect_file_ids_nop;
     opts.dir_cb = collect_dir_ids;
-    opts.data = results;
+    opts.data = cd;
 
     const char *trees[2];
     trees[0] = master_head->root_id;
@@ -1413,7 +1926,6 @@ calculate_send_object_list (SyncwRepo *repo,
     if (diff_trees (2, trees, &opts) < 0) {
         syncw_warning ("Failed to diff remote and master head for repo %.8s.\n",
                       repo->id);
-        string_list_free (*results);
         ret = -1;
     }
 
@@ -1423,6 +1935,509 @@ out:
     return ret;
 }
 
+static void
+free_fs_id_list_entry (FsIdListEntry *entry)
+{
+    pthread_cond_destroy (&entry->done_cond);
+    if (entry->ids)
+        g_byte_array_unref (entry->ids);
+    g_free (entry->key);
+    g_free (entry);
+}
+
+/* Must be called with fs_id_list_cache_lock held. */
+static void
+evict_fs_id_lists (HttpServer *htp_server)
+{
+    FsIdListEntry *entry;
+
+    while (htp_server->fs_id_list_cache_size > MAX_FS_ID_LIST_CACHE_SIZE ||
+           g_queue_get_length (htp_server->fs_id_list_lru) > MAX_FS_ID_LIST_CACHE_NUM) {
+        entry = g_queue_pop_tail (htp_server->fs_id_list_lru);
+        if (!entry)
+            break;
+        htp_server->fs_id_list_cache_size -= entry->ids->len;
+        g_hash_table_remove (htp_server->fs_id_list_cache, entry->key);
+        entry->cached = FALSE;
+        /* Waiters that haven't woken up yet free it. */
+        if (entry->n_waiters == 0)
+            free_fs_id_list_entry (entry);
+    }
+}
+
+/*
+ * Get the fs objects the client needs to go from @client_head to @server_head.
+ * Diff results are cached, since many clients of the same library fetch
+ * the same head pair right after a commit. If the same pair is being
+ * computed by another thread, wait for its result instead of diffing again.
+ *
+ * Returns packed raw sha1s, or NULL on error.
+ */
+static GByteArray *
+get_fs_id_list (HttpServer *htp_server,
+                SyncwRepo *repo,
+                const char *server_head,
+                const char *client_head,
+                gboolean dir_only)
+{
+    FsIdListEntry *entry;
+    GByteArray *results;
+    GByteArray *ids = NULL;
+    char *key;
+    int rc;
+
+    key = g_strdup_printf ("%s:%s:%s:%d", repo->id, server_head,
+                           client_head ? client_head : EMPTY_SHA1, dir_only);
+
+    pthread_mutex_lock (&htp_server->fs_id_list_cache_lock);
+
+    entry = g_hash_table_lookup (htp_server->fs_id_list_cache, key);
+    if (entry) {
+        ++entry->n_waiters;
+        while (entry->computing)
+            pthread_cond_wait (&entry->done_cond,
+                               &htp_server->fs_id_list_cache_lock);
+        if (entry->ids)
+            ids = g_byte_array_ref (entry->ids);
+        if (entry->cached) {
+            g_queue_unlink (htp_server->fs_id_list_lru, &entry->lru_link);
+            g_queue_push_head_link (htp_server->fs_id_list_lru, &entry->lru_link);
+        }
+        /* Entries no longer in the cache are freed by the last waiter. */
+        if (--entry->n_waiters == 0 && !entry->cached)
+            free_fs_id_list_entry (entry);
+        pthread_mutex_unlock (&htp_server->fs_id_list_cache_lock);
+        g_free (key);
+        return ids;
+    }
+
+    entry = g_new0 (FsIdListEntry, 1);
+    entry->key = key;
+    entry->computing = TRUE;
+    entry->lru_link.data = entry;
+    pthread_cond_init (&entry->done_cond, NULL);
+    g_hash_table_insert (htp_server->fs_id_list_cache, entry->key, entry);
+
+    pthread_mutex_unlock (&htp_server->fs_id_list_cache_lock);
+
+    CollectIdsData cd;
+    memset (&cd, 0, sizeof(cd));
+    cd.ids = results = g_byte_array_new ();
+    rc = calculate_send_object_list (repo, server_head, client_head,
+                                     dir_only, &cd);
+
+    pthread_mutex_lock (&htp_server->fs_id_list_cache_lock);
+
+    entry->computing = FALSE;
+    g_hash_table_remove (htp_server->fs_id_list_cache, entry->key);
+    if (rc == 0) {
+        /* Waiters get the ids even if they're too big to cache. */
+        entry->ids = results;
+        ids = g_byte_array_ref (entry->ids);
+        if (entry->ids->len <= MAX_FS_ID_LIST_ENTRY_SIZE) {
+            entry->cached = TRUE;
+            g_hash_table_insert (htp_server->fs_id_list_cache, entry->key, entry);
+            g_queue_push_head_link (htp_server->fs_id_list_lru, &entry->lru_link);
+            htp_server->fs_id_list_cache_size += entry->ids->len;
+        }
+    } else {
+        g_byte_array_unref (results);
+    }
+
+    if (entry->n_waiters > 0)
+        pthread_cond_broadcast (&entry->done_cond);
+    else if (!entry->cached)
+        free_fs_id_list_entry (entry);
+
+    evict_fs_id_lists (htp_server);
+
+    pthread_mutex_unlock (&htp_server->fs_id_list_cache_lock);
+
+    return ids;
+}
+
+/*
+ * Streaming fs-id-list reply. The diff runs in fs_id_list_tpool and hands
+ * over the ids in chunks of FS_ID_LIST_CHUNK_SIZE bytes. The http worker
+ * thread sends the chunks with chunked encoding as the client reads them.
+ * At most FS_ID_LIST_MAX_CHUNKS chunks are queued. After that the diff
+ * thread waits for the client, so memory use doesn't grow with the size
+ * of the repo. A client that doesn't read for FS_ID_LIST_STALL_TIMEOUT
+ * seconds is dropped, so that it doesn't hold a diff thread.
+ */
+struct FsIdListStream {
+    gint refcnt;
+
+    /* Shared by the diff thread and the http worker thread. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    GQueue *chunks;
+    gboolean finished;
+    int status;
+    gboolean aborted;
+    /* Chunks and the end of the diff wake up the http worker thread. */
+    ThreadWaker *waker;
+    gint wake_pending;
+
+    /* Only used in the diff thread. */
+    SyncwRepo *repo;
+    char server_head[41];
+    gboolean dir_only;
+
+    /* Only used in the http worker thread. */
+    evhtp_request_t *req;
+    gboolean binary;
+    gboolean started;
+    gboolean first_id;
+    /* Json lists are compressed chunk by chunk if the client accepts it. */
+    HttpCompressor *compressor;
+    /* Set while waiting for the diff, with nothing to send. */
+    gboolean idle;
+
+    bufferevent_data_cb saved_read_cb;
+    bufferevent_data_cb saved_write_cb;
+    bufferevent_event_cb saved_event_cb;
+    void *saved_cb_arg;
+};
+
+static void
+fs_id_list_stream_unref (FsIdListStream *stream)
+{
+    GByteArray *chunk;
+
+    if (!g_atomic_int_dec_and_test (&stream->refcnt))
+        return;
+
+    while ((chunk = g_queue_pop_head (stream->chunks)) != NULL)
+        g_byte_array_unref (chunk);
+    g_queue_free (stream->chunks);
+    pthread_mutex_destroy (&stream->lock);
+    pthread_cond_destroy (&stream->cond);
+    syncw_repo_unref (stream->repo);
+    g_free (stream);
+}
+
+static void
+fs_id_list_wake_cb (void *ctx);
+
+/* Called in the diff thread once chunks are queued or the diff is done. */
+static void
+wake_fs_id_list_stream (FsIdListStream *stream)
+{
+    if (!g_atomic_int_compare_and_exchange (&stream->wake_pending, 0, 1))
+        return;
+
+    g_atomic_int_inc (&stream->refcnt);
+    thread_waker_post (stream->waker, fs_id_list_wake_cb, stream);
+}
+
+/*
+ * Called in the diff thread. Blocks while the queue is full, and aborts the
+ * stream if the client doesn't read anything in time.
+ */
+static int
+fs_id_list_stream_push (FsIdListStream *stream, CollectIdsData *cd)
+{
+    struct timespec deadline;
+    int rc = 0;
+
+    clock_gettime (CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += FS_ID_LIST_STALL_TIMEOUT;
+
+    pthread_mutex_lock (&stream->lock);
+
+    while (!stream->aborted && rc != ETIMEDOUT &&
+           g_queue_get_length (stream->chunks) >= FS_ID_LIST_MAX_CHUNKS)
+        rc = pthread_cond_timedwait (&stream->cond, &stream->lock, &deadline);
+
+    if (!stream->aborted &&
+        g_queue_get_length (stream->chunks) >= FS_ID_LIST_MAX_CHUNKS) {
+        syncw_warning ("Client of fs-id-list of repo %.8s stalled, give up.\n",
+                      stream->repo->id);
+        stream->aborted = TRUE;
+    }
+
+    if (stream->aborted) {
+        pthread_mutex_unlock (&stream->lock);
+        return -1;
+    }
+
+    g_queue_push_tail (stream->chunks, cd->ids);
+    cd->ids = g_byte_array_new ();
+
+    pthread_mutex_unlock (&stream->lock);
+
+    wake_fs_id_list_stream (stream);
+    return 0;
+}
+
+static void
+fs_id_list_stream_thread (void *data, void *user_data)
+{
+    FsIdListStream *stream = data;
+    CollectIdsData cd;
+    int rc = -1;
+
+    memset (&cd, 0, sizeof(cd));
+    cd.ids = g_byte_array_new ();
+    cd.stream = stream;
+
+    pthread_mutex_lock (&stream->lock);
+    gboolean aborted = stream->aborted;
+    pthread_mutex_unlock (&stream->lock);
+
+    if (!aborted)
+        rc = calculate_send_object_list (stream->repo, stream->server_head, NULL,
+                                         stream->dir_only, &cd);
+
+    pthread_mutex_lock (&stream->lock);
+    if (rc == 0 && cd.ids->len > 0) {
+        g_queue_push_tail (stream->chunks, cd.ids);
+        cd.ids = NULL;
+    }
+    stream->status = rc;
+    stream->finished = TRUE;
+    pthread_mutex_unlock (&stream->lock);
+
+    wake_fs_id_list_stream (stream);
+
+    if (cd.ids)
+        g_byte_array_unref (cd.ids);
+    fs_id_list_stream_unref (stream);
+}
+
+/* Drop the connection's reference. Called in the http worker thread. */
+static void
+release_fs_id_list_stream (FsIdListStream *stream)
+{
+    stream->req = NULL;
+    http_compressor_free (stream->compressor);
+    stream->compressor = NULL;
+
+    /* Stop the diff thread if it's still running. */
+    pthread_mutex_lock (&stream->lock);
+    stream->aborted = TRUE;
+    pthread_cond_signal (&stream->cond);
+    pthread_mutex_unlock (&stream->lock);
+
+    fs_id_list_stream_unref (stream);
+}
+
+static void
+add_id_chunk_to_buffer (FsIdListStream *stream, struct evbuffer *buf,
+                        GByteArray *chunk)
+{
+    char hex[41];
+    guint i;
+
+    if (stream->binary) {
+        evbuffer_add (buf, chunk->data, chunk->len);
+        return;
+    }
+
+    for (i = 0; i < chunk->len; i += 20) {
+        rawdata_to_hex (chunk->data + i, hex, 20);
+        evbuffer_add_printf (buf, stream->first_id ? "\"%s\"" : ",\"%s\"", hex);
+        stream->first_id = FALSE;
+    }
+}
+
+static void
+fs_id_list_stream_pump (struct bufferevent *bev, FsIdListStream *stream)
+{
+    evhtp_request_t *req = stream->req;
+    struct evbuffer *buf = NULL;
+    GQueue chunks = G_QUEUE_INIT;
+    GByteArray *chunk;
+    gboolean finished;
+    int status;
+
+    stream->idle = FALSE;
+
+    pthread_mutex_lock (&stream->lock);
+    while ((chunk = g_queue_pop_head (stream->chunks)) != NULL)
+        g_queue_push_tail (&chunks, chunk);
+    finished = stream->finished;
+    status = stream->status;
+    pthread_cond_signal (&stream->cond);
+    pthread_mutex_unlock (&stream->lock);
+
+    if (finished && status < 0) {
+        /* Close the connection without terminating the chunked body,
+         * so that the client sees an error.
+         */
+        while ((chunk = g_queue_pop_head (&chunks)) != NULL)
+            g_byte_array_unref (chunk);
+        evhtp_connection_free (evhtp_request_get_connection (req));
+        release_fs_id_list_stream (stream);
+        return;
+    }
+
+    buf = evbuffer_new ();
+    if (!stream->binary && !stream->started)
+        evbuffer_add (buf, "[", 1);
+    stream->started = TRUE;
+
+    while ((chunk = g_queue_pop_head (&chunks)) != NULL) {
+        add_id_chunk_to_buffer (stream, buf, chunk);
+        g_byte_array_unref (chunk);
+    }
+
+    if (finished && !stream->binary)
+        evbuffer_add (buf, "]", 1);
+
+    if (stream->compressor && evbuffer_get_length (buf) > 0) {
+        struct evbuffer *compressed = evbuffer_new ();
+        if (http_compressor_process (stream->compressor, buf, compressed,
+                                     finished) < 0) {
+            evbuffer_free (compressed);
+            evbuffer_free (buf);
+            evhtp_connection_free (evhtp_request_get_connection (req));
+            release_fs_id_list_stream (stream);
+            return;
+        }
+        evbuffer_free (buf);
+        buf = compressed;
+    }
+
+    if (!finished) {
+        if (evbuffer_get_length (buf) > 0) {
+            /* Write callback will be called again when the chunk is sent. */
+            evhtp_send_reply_chunk (req, buf);
+        } else {
+            /* Nothing is ready yet, fs_id_list_wake_cb() pumps again. */
+            stream->idle = TRUE;
+        }
+        evbuffer_free (buf);
+        return;
+    }
+
+    if (evbuffer_get_length (buf) > 0)
+        evhtp_send_reply_chunk (req, buf);
+    evbuffer_free (buf);
+
+    /* Recover evhtp's callbacks */
+    bev->readcb = stream->saved_read_cb;
+    bev->writecb = stream->saved_write_cb;
+    bev->errorcb = stream->saved_event_cb;
+    bev->cbarg = stream->saved_cb_arg;
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (req);
+
+    evhtp_send_reply_chunk_end (req);
+
+    release_fs_id_list_stream (stream);
+}
+
+static void
+fs_id_list_write_cb (struct bufferevent *bev, void *ctx)
+{
+    fs_id_list_stream_pump (bev, ctx);
+}
+
+/* Called in the http worker thread after the diff thread made progress. */
+static void
+fs_id_list_wake_cb (void *ctx)
+{
+    FsIdListStream *stream = ctx;
+    gboolean failed;
+
+    /* Chunks queued from now on wake us up again. */
+    g_atomic_int_set (&stream->wake_pending, 0);
+
+    pthread_mutex_lock (&stream->lock);
+    failed = stream->finished && stream->status < 0;
+    pthread_mutex_unlock (&stream->lock);
+
+    /* A failed diff, e.g. given up on a stalled client, drops the connection
+     * even if a chunk is still being sent. The write callback might never be
+     * called again.
+     */
+    if (stream->req && (stream->idle || failed))
+        fs_id_list_stream_pump (evhtp_request_get_bev (stream->req), stream);
+
+    fs_id_list_stream_unref (stream);
+}
+
+static void
+fs_id_list_event_cb (struct bufferevent *bev, short events, void *ctx)
+{
+    FsIdListStream *stream = ctx;
+
+    stream->saved_event_cb (bev, events, stream->saved_cb_arg);
+
+    release_fs_id_list_stream (stream);
+}
+
+static void
+start_fs_id_list_stream (HttpServer *htp_server,
+                         evhtp_request_t *req,
+                         SyncwRepo *repo,
+                         const char *server_head,
+                         gboolean dir_only)
+{
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    ThreadWaker *waker = thread_waker_get (bufferevent_get_base (bev));
+    FsIdListStream *stream;
+
+    if (!waker) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        return;
+    }
+
+    stream = g_new0 (FsIdListStream, 1);
+    /* One reference for the diff thread, one for the connection. */
+    stream->refcnt = 2;
+    stream->waker = waker;
+    pthread_mutex_init (&stream->lock, NULL);
+    pthread_cond_init (&stream->cond, NULL);
+    stream->chunks = g_queue_new ();
+    syncw_repo_ref (repo);
+    stream->repo = repo;
+    memcpy (stream->server_head, server_head, 41);
+    stream->dir_only = dir_only;
+    stream->req = req;
+    stream->binary = accepts_binary_id_list (req);
+    stream->first_id = TRUE;
+
+    /* Raw sha1s don't compress. */
+    if (stream->binary)
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Type",
+                                                    OBJ_ID_LIST_BINARY_TYPE, 1, 1));
+    else
+        stream->compressor = http_compressor_start (req);
+
+    /* We need to overwrite evhtp's callback functions to
+     * write the ids piece by piece.
+     */
+    stream->saved_read_cb = bev->readcb;
+    stream->saved_write_cb = bev->writecb;
+    stream->saved_event_cb = bev->errorcb;
+    stream->saved_cb_arg = bev->cbarg;
+    bufferevent_setcb (bev,
+                       NULL,
+                       fs_id_list_write_cb,
+                       fs_id_list_event_cb,
+                       stream);
+
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
+
+    evhtp_send_reply_chunk_start (req, EVHTP_RES_OK);
+
+    g_thread_pool_push (htp_server->fs_id_list_tpool, stream, NULL);
+}
+
+static void
+unref_byte_array_cb (const void *data, size_t datalen, void *extra)
+{
+    g_byte_array_unref (extra);
+}
+
 static void
 get_fs_obj_id_cb (evhtp_request_t *req, void *arg)
 {
@@ -1463,7 +2478,10 @@ get_fs_obj_id_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    GList *list = NULL, *ptr;
+    GByteArray *ids = NULL;
+    const unsigned char *raw;
+    gsize len, i;
+    char hex[41];
 
     repo = syncw_repo_manager_get_repo (syncw->repo_mgr, repo_id);
     if (!repo) {
@@ -1472,40 +2490,99 @@ get_fs_obj_id_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    if (calculate_send_object_list (repo, server_head, client_head, dir_only, &list) < 0) {
+    /* Without client head the whole tree is listed, which can be millions
+     * of ids for a large repo. Stream it instead of building the list.
+     */
+    if (!client_head) {
+        start_fs_id_list_stream (htp_server, req, repo, server_head, dir_only);
+        goto out;
+    }
+
+    ids = get_fs_id_list (htp_server, repo, server_head, client_head, dir_only);
+    if (!ids) {
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
         goto out;
     }
 
-    json_t *obj_array = json_array ();
+    raw = ids->data;
+    len = ids->len;
 
-    for (ptr = list; ptr; ptr = ptr->next) {
-        json_array_append_new (obj_array, json_string (ptr->data));
-        g_free (ptr->data);
+    if (accepts_binary_id_list (req)) {
+        /* The cached list is shared, reference it instead of copying. */
+        evbuffer_add_reference (req->buffer_out, raw, len,
+                                unref_byte_array_cb, ids);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Type",
+                                                    OBJ_ID_LIST_BINARY_TYPE, 1, 1));
+        evhtp_send_reply (req, EVHTP_RES_OK);
+        goto out;
     }
-    g_list_free (list);
 
-    char *obj_list = json_dumps (obj_array, JSON_COMPACT);
-    evbuffer_add (req->buffer_out, obj_list, strlen (obj_list));
+    /* Same output as json_dumps() with JSON_COMPACT. */
+    evbuffer_add (req->buffer_out, "[", 1);
+    for (i = 0; i < len; i += 20) {
+        rawdata_to_hex (raw + i, hex, 20);
+        evbuffer_add_printf (req->buffer_out, i == 0 ? "\"%s\"" : ",\"%s\"", hex);
+    }
+    evbuffer_add (req->buffer_out, "]", 1);
+    http_compress_reply (req);
     evhtp_send_reply (req, EVHTP_RES_OK);
 
-    g_free (obj_list);
-    json_decref (obj_array);
+    g_byte_array_unref (ids);
 
 out:
     g_strfreev (parts);
     syncw_repo_unref (repo);
 }
 
-static void
-get_block_cb (evhtp_request_t *req, void *arg)
+/*
+ * Send a block file straight from the page cache to the client socket.
+ * The http headers are written first, then the block is appended to the
+ * connection's output buffer as a file segment, so that libevent drains it
+ * with sendfile() and the block data never passes through user space.
+ *
+ * Returns -1 if the block can't be served this way, in which case nothing
+ * has been sent yet.
+ */
+static int
+send_block_file (evhtp_request_t *req, BlockHandle *handle, guint32 size)
 {
-    const char *repo_id = NULL;
-    char *block_id = NULL;
-    char *store_id = NULL;
-    HttpServer *htp_server = arg;
-    BlockMetadata *blk_meta = NULL;
-    char *username = NULL;
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    char con_len[32];
+    int fd;
+
+    fd = syncw_block_manager_dup_block_fd (syncw->block_mgr, handle);
+    if (fd < 0)
+        return -1;
+
+    snprintf (con_len, sizeof(con_len), "%u", size);
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("Content-Length", con_len, 1, 1));
+
+    evhtp_send_reply_start (req, EVHTP_RES_OK);
+
+    if (add_file_segment (bufferevent_get_output (bev), fd, size) < 0) {
+        /* Headers are already out. Close the connection after them so that
+         * the client sees a short reply instead of waiting for the body.
+         */
+        req->keepalive = 0;
+    }
+
+    evhtp_send_reply_end (req);
+
+    return 0;
+}
+
+static void
+get_block_cb (evhtp_request_t *req, void *arg)
+{
+    const char *repo_id = NULL;
+    char *block_id = NULL;
+    char *store_id = NULL;
+    HttpServer *htp_server = arg;
+    BlockMetadata *blk_meta = NULL;
+    BlockHandle *blk_handle = NULL;
+    char *username = NULL;
 
     char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
     repo_id = parts[1];
@@ -1523,14 +2600,6 @@ get_block_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    blk_meta = syncw_block_manager_stat_block (syncw->block_mgr,
-                                              store_id, 1, block_id);
-    if (blk_meta == NULL || blk_meta->size <= 0) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
-    }
-
-    BlockHandle *blk_handle = NULL;
     blk_handle = syncw_block_manager_open_block(syncw->block_mgr,
                                                store_id, 1, block_id, BLOCK_READ);
     if (!blk_handle) {
@@ -1539,6 +2608,20 @@ get_block_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
+    blk_meta = syncw_block_manager_stat_block_by_handle (syncw->block_mgr,
+                                                        blk_handle);
+    if (blk_meta == NULL || blk_meta->size <= 0) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto free_handle;
+    }
+
+    if (syncw->http_server->use_sendfile &&
+        send_block_file (req, blk_handle, blk_meta->size) == 0) {
+        send_statistic_msg (store_id, username, "sync-file-download",
+                            (guint64)blk_meta->size);
+        goto free_handle;
+    }
+
     void *block_con = g_new0 (char, blk_meta->size);
     if (!block_con) {
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
@@ -1570,31 +2653,251 @@ out:
     g_strfreev (parts);
 }
 
-static void
-put_send_block_cb (evhtp_request_t *req, void *arg)
+#define RECV_BLOCK_MAX_IOVEC 16
+
+/*
+ * State of a block upload. The block is written to disk as the body arrives,
+ * so it's never held in memory as a whole.
+ */
+typedef struct RecvBlockData {
+    HttpServer *htp_server;
+    /* Reply status if the upload is rejected or fails. */
+    int status;
+    char *store_id;
+    char *username;
+    char block_id[41];
+    BlockHandle *handle;
+    SHA_CTX ctx;
+    guint64 size;
+} RecvBlockData;
+
+static evhtp_res
+put_block_read_cb (evhtp_request_t *req, evbuf_t *buf, void *arg)
+{
+    RecvBlockData *data = arg;
+    struct evbuffer_iovec vec[RECV_BLOCK_MAX_IOVEC];
+    int n_vec, i;
+    size_t drained;
+
+    while (data->status == EVHTP_RES_OK && evbuffer_get_length (buf) > 0) {
+        n_vec = evbuffer_peek (buf, -1, NULL, vec, RECV_BLOCK_MAX_IOVEC);
+        if (n_vec > RECV_BLOCK_MAX_IOVEC)
+            n_vec = RECV_BLOCK_MAX_IOVEC;
+
+        drained = 0;
+        for (i = 0; i < n_vec; ++i) {
+            if (syncw_block_manager_write_block (syncw->block_mgr, data->handle,
+                                                vec[i].iov_base,
+                                                vec[i].iov_len) != (int)vec[i].iov_len) {
+                syncw_warning ("Failed to write block %.8s:%s.\n",
+                              data->store_id, data->block_id);
+                data->status = EVHTP_RES_SERVERR;
+                break;
+            }
+            SHA1_Update (&data->ctx, vec[i].iov_base, vec[i].iov_len);
+            drained += vec[i].iov_len;
+        }
+        data->size += drained;
+        evbuffer_drain (buf, drained);
+    }
+
+    /* Drain the buffer so that evhtp don't copy it to another buffer
+     * after this callback returns. Data of a rejected upload is dropped.
+     */
+    evbuffer_drain (buf, evbuffer_get_length (buf));
+
+    return EVHTP_RES_OK;
+}
+
+/* Body of a block upload that was rejected by its headers. */
+static evhtp_res
+drop_block_read_cb (evhtp_request_t *req, evbuf_t *buf, void *arg)
+{
+    evbuffer_drain (buf, evbuffer_get_length (buf));
+    return EVHTP_RES_OK;
+}
+
+static evhtp_res
+put_block_finish_cb (evhtp_request_t *req, void *arg)
+{
+    RecvBlockData *data = arg;
+
+    /* The tmp file of an uncommitted block is removed when the handle is freed. */
+    if (data->handle) {
+        syncw_block_manager_close_block (syncw->block_mgr, data->handle);
+        syncw_block_manager_block_handle_free (syncw->block_mgr, data->handle);
+    }
+    g_free (data->store_id);
+    g_free (data->username);
+    g_free (data);
+
+    /* This hook replaces the one of http metrics. */
+    http_metrics_request_fini (req);
+
+    return EVHTP_RES_OK;
+}
+
+/*
+ * Called when the headers of a block request are parsed. Uploads are
+ * checked and the block is opened for writing before the body is read.
+ */
+static evhtp_res
+block_oper_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
 {
-    const char *repo_id = NULL;
-    char *block_id = NULL;
-    char *store_id = NULL;
-    char *username = NULL;
     HttpServer *htp_server = arg;
-    char **parts = NULL;
-    void *blk_con = NULL;
+    RecvBlockData *data;
+    char **parts;
+    const char *repo_id;
+    int status;
+
+    if (evhtp_request_get_method (req) != htp_method_PUT)
+        return EVHTP_RES_OK;
+
+    data = g_new0 (RecvBlockData, 1);
+    data->htp_server = htp_server;
+    data->status = EVHTP_RES_OK;
+    SHA1_Init (&data->ctx);
 
     parts = g_strsplit (req->uri->path->full + 1, "/", 0);
     repo_id = parts[1];
-    block_id = parts[3];
+    memcpy (data->block_id, parts[3], 40);
+
+    status = validate_token (htp_server, req, repo_id,
+                             &data->username, FALSE);
+    if (status != EVHTP_RES_OK)
+        goto err;
+
+    status = check_permission (htp_server, repo_id, data->username,
+                               "upload", FALSE);
+    if (status == EVHTP_RES_FORBIDDEN)
+        goto err;
+
+    data->store_id = get_repo_store_id (htp_server, repo_id);
+    if (!data->store_id) {
+        status = EVHTP_RES_SERVERR;
+        goto err;
+    }
 
-    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
-    if (token_status != EVHTP_RES_OK) {
-        evhtp_send_reply (req, token_status);
-        goto out;
+    data->handle = syncw_block_manager_open_block (syncw->block_mgr,
+                                                  data->store_id, 1,
+                                                  data->block_id, BLOCK_WRITE);
+    if (!data->handle) {
+        syncw_warning ("Failed to open block %.8s:%s.\n",
+                      data->store_id, data->block_id);
+        status = EVHTP_RES_SERVERR;
+        goto err;
     }
 
-    int perm_status = check_permission (htp_server, repo_id, username,
-                                        "upload", FALSE);
-    if (perm_status == EVHTP_RES_FORBIDDEN) {
-        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
+    /* Set up per-request hooks, so that we can write the block piece by piece. */
+    evhtp_set_hook (&req->hooks, evhtp_hook_on_read, put_block_read_cb, data);
+    evhtp_set_hook (&req->hooks, evhtp_hook_on_request_fini, put_block_finish_cb, data);
+
+    g_strfreev (parts);
+    return EVHTP_RES_OK;
+
+err:
+    /* Reply before the body is read. Setting keepalive to 0 makes evhtp
+     * close the connection after sending the reply, so the rest of the
+     * body is dropped unread. block_oper_cb() finds no data and returns.
+     */
+    req->keepalive = 0;
+    evhtp_send_reply (req, status);
+    evhtp_set_hook (&req->hooks, evhtp_hook_on_read, drop_block_read_cb, NULL);
+
+    g_free (data->store_id);
+    g_free (data->username);
+    g_free (data);
+    g_strfreev (parts);
+    return EVHTP_RES_OK;
+}
+
+/*
+ * The upload state is the arg of the read hook. The cbarg of the request
+ * belongs to the admission layer.
+ */
+static RecvBlockData *
+get_recv_block_data (evhtp_request_t *req)
+{
+    if (!req->hooks || req->hooks->on_read != put_block_read_cb)
+        return NULL;
+    return req->hooks->on_read_arg;
+}
+
+static void
+put_send_block_cb (evhtp_request_t *req, RecvBlockData *data)
+{
+    unsigned char sha1[20];
+    char checksum[41];
+
+    if (data->status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, data->status);
+        return;
+    }
+
+    if (data->size == 0) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
+    }
+
+    if (syncw_block_manager_close_block (syncw->block_mgr, data->handle) < 0) {
+        syncw_warning ("Failed to close block %.8s:%s.\n",
+                      data->store_id, data->block_id);
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        return;
+    }
+
+    SHA1_Final (sha1, &data->ctx);
+    rawdata_to_hex (sha1, checksum, 20);
+    if (strcmp (checksum, data->block_id) != 0) {
+        syncw_warning ("Block %.8s:%s is corrupted, checksum is %s.\n",
+                      data->store_id, data->block_id, checksum);
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
+    }
+
+    if (syncw_block_manager_commit_block (syncw->block_mgr,
+                                         data->handle) < 0) {
+        syncw_warning ("Failed to commit block %.8s:%s.\n",
+                      data->store_id, data->block_id);
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        return;
+    }
+
+    evhtp_send_reply (req, EVHTP_RES_OK);
+
+    send_statistic_msg (data->store_id, data->username, "sync-file-upload",
+                        data->size);
+}
+
+static void
+block_oper_cb (evhtp_request_t *req, void *arg)
+{
+    htp_method req_method = evhtp_request_get_method (req);
+
+    if (req_method == htp_method_GET) {
+        get_block_cb (req, arg);
+    } else if (req_method == htp_method_PUT) {
+        /* Set up by block_oper_headers_cb(), unless it has already
+         * replied with an error.
+         */
+        RecvBlockData *data = get_recv_block_data (req);
+        if (!data)
+            return;
+        put_send_block_cb (req, data);
+    }
+}
+
+static void
+post_check_exist_cb (evhtp_request_t *req, void *arg, CheckExistType type)
+{
+    HttpServer *htp_server = arg;
+    char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
+    char *repo_id = parts[1];
+    char *store_id = NULL;
+
+    int token_status = validate_token (htp_server, req, repo_id, NULL, FALSE);
+    if (token_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, token_status);
         goto out;
     }
 
@@ -1604,86 +2907,630 @@ put_send_block_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    int blk_len = evbuffer_get_length (req->buffer_in);
-    if (blk_len == 0) {
+    int n_ids = 0;
+    char *ids = load_obj_id_list (req, &n_ids);
+    if (!ids) {
         evhtp_send_reply (req, EVHTP_RES_BADREQ);
         goto out;
     }
 
-    blk_con = g_new0 (char, blk_len);
-    if (!blk_con) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        syncw_warning ("Failed to allocate %d bytes memory.\n", blk_len);
-        goto out;
+    gboolean binary = accepts_binary_id_list (req);
+    json_t *needed_objs = NULL;
+    gboolean ret = TRUE;
+    const char *obj_id = NULL;
+    unsigned char sha1[20];
+    int index = 0;
+
+    if (!binary)
+        needed_objs = json_array ();
+
+    for (; index < n_ids; ++index) {
+        obj_id = ids + index * 41;
+        if (!is_object_id_valid (obj_id))
+            continue;
+
+        if (type == CHECK_FS_EXIST) {
+            ret = syncw_fs_manager_object_exists_indexed (syncw->fs_mgr,
+                                                         store_id, 1, obj_id);
+        } else if (type == CHECK_BLOCK_EXIST) {
+            ret = syncw_block_manager_block_exists_indexed (syncw->block_mgr,
+                                                           store_id, 1, obj_id);
+        }
+
+        if (!ret) {
+            if (binary) {
+                hex_to_sha1 (obj_id, sha1);
+                evbuffer_add (req->buffer_out, sha1, 20);
+            } else {
+                json_array_append_new (needed_objs, json_string (obj_id));
+            }
+        }
     }
 
-    evbuffer_remove (req->buffer_in, blk_con, blk_len);
+    if (binary) {
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Type",
+                                                    OBJ_ID_LIST_BINARY_TYPE, 1, 1));
+    } else {
+        char *ret_array = json_dumps (needed_objs, JSON_COMPACT);
+        evbuffer_add (req->buffer_out, ret_array, strlen (ret_array));
+        g_free (ret_array);
+        json_decref (needed_objs);
+        http_compress_reply (req);
+    }
+    evhtp_send_reply (req, EVHTP_RES_OK);
 
-    BlockHandle *blk_handle = NULL;
-    blk_handle = syncw_block_manager_open_block (syncw->block_mgr,
-                                                store_id, 1, block_id, BLOCK_WRITE);
-    if (blk_handle == NULL) {
-        syncw_warning ("Failed to open block %.8s:%s.\n", store_id, block_id);
+    g_free (ids);
+
+out:
+    g_free (store_id);
+    g_strfreev (parts);
+}
+
+static void
+post_check_fs_cb (evhtp_request_t *req, void *arg)
+{
+   post_check_exist_cb (req, arg, CHECK_FS_EXIST);
+}
+
+static void
+post_check_block_cb (evhtp_request_t *req, void *arg)
+{
+   post_check_exist_cb (req, arg, CHECK_BLOCK_EXIST);
+}
+
+#define RECV_FS_BATCH_SIZE 64
+#define RECV_FS_WRITER_THREADS 8
+
+typedef struct RecvFsObj {
+    char obj_id[41];
+    void *data;
+    int len;
+} RecvFsObj;
+
+/*
+ * State of a recv-fs request. The objects are written by the threads of
+ * recv_fs_tpool in batches, while the http worker thread serves other
+ * connections until the last batch wakes it up. Every pending batch holds
+ * a reference, so does the connection until the reply is sent.
+ */
+typedef struct RecvFsJob {
+    gint refcnt;
+    char store_id[37];
+    /* The request body. The objects point into it. */
+    struct evbuffer *body;
+    RecvFsObj *objs;
+    int n_objs;
+
+    gint n_pending_batches;
+    gint failed;
+    /* Set with @failed if an object doesn't match its id. */
+    gint corrupted;
+    ThreadWaker *waker;
+
+    /* Only used in the http worker thread. */
+    evhtp_request_t *req;
+
+    bufferevent_data_cb saved_read_cb;
+    bufferevent_data_cb saved_write_cb;
+    bufferevent_event_cb saved_event_cb;
+    void *saved_cb_arg;
+} RecvFsJob;
+
+typedef struct RecvFsBatch {
+    RecvFsJob *job;
+    int start;
+    int end;
+} RecvFsBatch;
+
+static void
+recv_fs_job_unref (RecvFsJob *job)
+{
+    if (!g_atomic_int_dec_and_test (&job->refcnt))
+        return;
+
+    evbuffer_free (job->body);
+    g_free (job->objs);
+    g_free (job);
+}
+
+/* Drop the connection's reference. Called in the http worker thread. */
+static void
+release_recv_fs_job (RecvFsJob *job)
+{
+    job->req = NULL;
+
+    recv_fs_job_unref (job);
+}
+
+/*
+ * Take over the request body and split it into objects. The whole body is
+ * validated before anything is written.
+ */
+static RecvFsJob *
+recv_fs_job_new (struct evbuffer *buffer_in, const char *store_id)
+{
+    RecvFsJob *job = g_new0 (RecvFsJob, 1);
+    GArray *objs = g_array_new (FALSE, FALSE, sizeof(RecvFsObj));
+    RecvFsObj obj;
+    FsHdr hdr;
+    unsigned char *p;
+    size_t remain;
+
+    job->refcnt = 1;
+    memcpy (job->store_id, store_id, 36);
+    job->body = evbuffer_new ();
+    evbuffer_add_buffer (job->body, buffer_in);
+
+    remain = evbuffer_get_length (job->body);
+    if (remain == 0)
+        goto error;
+    p = evbuffer_pullup (job->body, -1);
+
+    while (remain > 0) {
+        if (remain < sizeof(FsHdr))
+            goto error;
+        memcpy (&hdr, p, sizeof(FsHdr));
+        p += sizeof(FsHdr);
+        remain -= sizeof(FsHdr);
+
+        memcpy (obj.obj_id, hdr.obj_id, 40);
+        obj.obj_id[40] = 0;
+        if (!is_object_id_valid (obj.obj_id))
+            goto error;
+
+        obj.len = ntohl (hdr.obj_size);
+        if (obj.len < 0 || obj.len > remain)
+            goto error;
+        obj.data = p;
+        p += obj.len;
+        remain -= obj.len;
+
+        g_array_append_val (objs, obj);
+    }
+
+    job->n_objs = objs->len;
+    job->objs = (RecvFsObj *)g_array_free (objs, FALSE);
+    return job;
+
+error:
+    g_array_free (objs, TRUE);
+    recv_fs_job_unref (job);
+    return NULL;
+}
+
+static void
+recv_fs_done_cb (void *ctx);
+
+static void
+recv_fs_batch_thread (void *data, void *user_data)
+{
+    RecvFsBatch *batch = data;
+    RecvFsJob *job = batch->job;
+    RecvFsObj *obj;
+    GList *written = NULL;
+    int i;
+
+    for (i = batch->start; i < batch->end; ++i) {
+        if (g_atomic_int_get (&job->failed))
+            break;
+
+        obj = &job->objs[i];
+        if (!syncw_fs_manager_verify_object_data (obj->obj_id, 1,
+                                                 obj->data, obj->len)) {
+            syncw_warning ("Fs object %.8s:%s is corrupted.\n",
+                          job->store_id, obj->obj_id);
+            g_atomic_int_set (&job->corrupted, 1);
+            g_atomic_int_set (&job->failed, 1);
+            break;
+        }
+        if (syncw_obj_store_write_obj (syncw->fs_mgr->obj_store,
+                                      job->store_id, 1, obj->obj_id,
+                                      obj->data, obj->len, FALSE) < 0) {
+            syncw_warning ("Failed to write fs object %.8s to disk.\n",
+                          obj->obj_id);
+            g_atomic_int_set (&job->failed, 1);
+            break;
+        }
+        written = g_list_prepend (written, obj->obj_id);
+    }
+
+    /* Flush the objects of the batch and their dirs at once. */
+    if (!g_atomic_int_get (&job->failed) &&
+        syncw_obj_store_sync_objs (syncw->fs_mgr->obj_store,
+                                  job->store_id, 1, written) < 0) {
+        syncw_warning ("Failed to sync fs objects of %s.\n", job->store_id);
+        g_atomic_int_set (&job->failed, 1);
+    }
+    g_list_free (written);
+
+    g_free (batch);
+
+    /* The last batch hands its reference over to the wakeup. */
+    if (g_atomic_int_dec_and_test (&job->n_pending_batches)) {
+        thread_waker_post (job->waker, recv_fs_done_cb, job);
+        return;
+    }
+
+    recv_fs_job_unref (job);
+}
+
+/* Called in the http worker thread once all objects are written. */
+static void
+recv_fs_done_cb (void *ctx)
+{
+    RecvFsJob *job = ctx;
+    evhtp_request_t *req = job->req;
+    struct bufferevent *bev;
+
+    /* The client has gone away. */
+    if (!req) {
+        recv_fs_job_unref (job);
+        return;
+    }
+
+    /* Recover evhtp's callbacks */
+    bev = evhtp_request_get_bev (req);
+    bev->readcb = job->saved_read_cb;
+    bev->writecb = job->saved_write_cb;
+    bev->errorcb = job->saved_event_cb;
+    bev->cbarg = job->saved_cb_arg;
+
+    evhtp_request_resume (req);
+
+    if (g_atomic_int_get (&job->corrupted))
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+    else if (g_atomic_int_get (&job->failed))
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
+    else
+        evhtp_send_reply (req, EVHTP_RES_OK);
+
+    release_recv_fs_job (job);
+}
+
+static void
+recv_fs_event_cb (struct bufferevent *bev, short events, void *ctx)
+{
+    RecvFsJob *job = ctx;
+
+    job->saved_event_cb (bev, events, job->saved_cb_arg);
+
+    /* No one is waiting for the rest of the objects. */
+    g_atomic_int_set (&job->failed, 1);
+    release_recv_fs_job (job);
+}
+
+/*
+ * The objects are checked against their ids and written by a bounded pool
+ * of writer threads, without an fsync per object. Each thread syncs its batch of objects and their dirs
+ * together once they're written. The http worker thread is free to serve
+ * other connections meanwhile, and is woken up when the last batch is done.
+ */
+static void
+post_recv_fs_cb (evhtp_request_t *req, void *arg)
+{
+    HttpServer *htp_server = arg;
+    char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
+    const char *repo_id = parts[1];
+    char *store_id = NULL;
+    char *username = NULL;
+    RecvFsJob *job;
+    RecvFsBatch *batch;
+    int i;
+
+    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
+    if (token_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, token_status);
         goto out;
     }
 
-    if (syncw_block_manager_write_block (syncw->block_mgr, blk_handle,
-                                        blk_con, blk_len) != blk_len) {
-        syncw_warning ("Failed to write block %.8s:%s.\n", store_id, block_id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        syncw_block_manager_close_block (syncw->block_mgr, blk_handle);
-        syncw_block_manager_block_handle_free (syncw->block_mgr, blk_handle);
+    int perm_status = check_permission (htp_server, repo_id, username,
+                                        "upload", FALSE);
+    if (perm_status == EVHTP_RES_FORBIDDEN) {
+        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
         goto out;
     }
 
-    if (syncw_block_manager_close_block (syncw->block_mgr, blk_handle) < 0) {
-        syncw_warning ("Failed to close block %.8s:%s.\n", store_id, block_id);
+    store_id = get_repo_store_id (htp_server, repo_id);
+    if (!store_id) {
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        syncw_block_manager_block_handle_free (syncw->block_mgr, blk_handle);
         goto out;
     }
 
-    if (syncw_block_manager_commit_block (syncw->block_mgr,
-                                         blk_handle) < 0) {
-        syncw_warning ("Failed to commit block %.8s:%s.\n", store_id, block_id);
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    ThreadWaker *waker = thread_waker_get (bufferevent_get_base (bev));
+    if (!waker) {
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        syncw_block_manager_block_handle_free (syncw->block_mgr, blk_handle);
         goto out;
     }
 
-    syncw_block_manager_block_handle_free (syncw->block_mgr, blk_handle);
-
-    evhtp_send_reply (req, EVHTP_RES_OK);
-
-    send_statistic_msg (store_id, username, "sync-file-upload", (guint64)blk_len);
+    job = recv_fs_job_new (req->buffer_in, store_id);
+    if (!job) {
+        syncw_warning ("Bad fs object content format from %.8s:%s.\n",
+                      repo_id, username);
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+    job->req = req;
+    job->waker = waker;
+
+    job->saved_read_cb = bev->readcb;
+    job->saved_write_cb = bev->writecb;
+    job->saved_event_cb = bev->errorcb;
+    job->saved_cb_arg = bev->cbarg;
+    bufferevent_setcb (bev,
+                       NULL,
+                       NULL,
+                       recv_fs_event_cb,
+                       job);
+
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
+
+    job->n_pending_batches = (job->n_objs + RECV_FS_BATCH_SIZE - 1) / RECV_FS_BATCH_SIZE;
+    for (i = 0; i < job->n_objs; i += RECV_FS_BATCH_SIZE) {
+        batch = g_new0 (RecvFsBatch, 1);
+        batch->job = job;
+        batch->start = i;
+        batch->end = MIN (i + RECV_FS_BATCH_SIZE, job->n_objs);
+        g_atomic_int_inc (&job->refcnt);
+        g_thread_pool_push (htp_server->recv_fs_tpool, batch, NULL);
+    }
 
 out:
-    g_free (username);
     g_free (store_id);
+    g_free (username);
     g_strfreev (parts);
-    g_free (blk_con);
 }
 
+#define MAX_OBJECT_PACK_SIZE (1 << 20) /* 1MB */
+#define PACK_FS_READ_AHEAD 16
+
+typedef struct PackFsObj {
+    char obj_id[41];
+    gboolean success;
+    int len;
+    /* [obj_id][len][data], ready to be sent. */
+    struct evbuffer *buf;
+} PackFsObj;
+
+/*
+ * State of a streaming pack-fs reply. Objects are read by the reader threads
+ * of the fs object store, and the read results are delivered in the main
+ * thread, which wakes up the http worker thread that owns the connection to
+ * write the reply. The two sides only share @results, @refcnt and
+ * @wake_pending; every pending read or wakeup holds a reference, so does
+ * the connection until the reply is done.
+ */
+typedef struct PackFsData {
+    gint refcnt;
+    guint32 reader_id;
+    GAsyncQueue *results;
+    /* Read results wake up the http worker thread. */
+    ThreadWaker *waker;
+    gint wake_pending;
+
+    /* Only used in the http worker thread. */
+    evhtp_request_t *req;
+    char store_id[37];
+    /* n_objs hex ids of 41 bytes each. */
+    char *obj_ids;
+    int n_objs;
+    int next_read;
+    int n_pending;
+    int total_size;
+    gboolean failed;
+    /* Set while waiting for reads, with nothing to send. */
+    gboolean idle;
+
+    bufferevent_data_cb saved_read_cb;
+    bufferevent_data_cb saved_write_cb;
+    bufferevent_event_cb saved_event_cb;
+    void *saved_cb_arg;
+} PackFsData;
+
 static void
-block_oper_cb (evhtp_request_t *req, void *arg)
+free_pack_fs_obj (PackFsObj *obj)
+{
+    if (obj->buf)
+        evbuffer_free (obj->buf);
+    g_free (obj);
+}
+
+static void
+pack_fs_data_unref (PackFsData *data)
+{
+    PackFsObj *obj;
+
+    if (!g_atomic_int_dec_and_test (&data->refcnt))
+        return;
+
+    syncw_obj_store_unregister_async_read (syncw->fs_mgr->obj_store,
+                                          data->reader_id);
+
+    while ((obj = g_async_queue_try_pop (data->results)) != NULL)
+        free_pack_fs_obj (obj);
+    g_async_queue_unref (data->results);
+
+    g_free (data->obj_ids);
+    g_free (data);
+}
+
+/* Drop the connection's reference. Called in the http worker thread. */
+static void
+release_pack_fs_data (PackFsData *data)
+{
+    data->req = NULL;
+
+    pack_fs_data_unref (data);
+}
+
+static void
+pack_fs_wake_cb (void *ctx);
+
+/* Called in the main thread when a read is done. */
+static void
+pack_fs_read_done (OSAsyncResult *res, void *cb_data)
+{
+    PackFsData *data = cb_data;
+    PackFsObj *obj = g_new0 (PackFsObj, 1);
+    guint32 len_net;
+
+    memcpy (obj->obj_id, res->obj_id, 41);
+    obj->success = res->success;
+    if (res->success) {
+        obj->len = res->len;
+        obj->buf = evbuffer_new ();
+        evbuffer_add (obj->buf, res->obj_id, 40);
+        len_net = htonl (res->len);
+        evbuffer_add (obj->buf, &len_net, 4);
+        evbuffer_add (obj->buf, res->data, res->len);
+    }
+
+    g_async_queue_push (data->results, obj);
+
+    /* The reference of the read is handed over to the wakeup. */
+    if (g_atomic_int_compare_and_exchange (&data->wake_pending, 0, 1)) {
+        thread_waker_post (data->waker, pack_fs_wake_cb, data);
+        return;
+    }
+
+    pack_fs_data_unref (data);
+}
+
+static void
+issue_pack_fs_reads (PackFsData *data)
+{
+    while (!data->failed &&
+           data->n_pending < PACK_FS_READ_AHEAD &&
+           data->next_read < data->n_objs &&
+           data->total_size < MAX_OBJECT_PACK_SIZE) {
+        g_atomic_int_inc (&data->refcnt);
+        if (syncw_obj_store_async_read (syncw->fs_mgr->obj_store,
+                                       data->reader_id,
+                                       data->obj_ids + data->next_read * 41) < 0) {
+            /* The connection still holds a reference. */
+            g_atomic_int_add (&data->refcnt, -1);
+            data->failed = TRUE;
+            break;
+        }
+        ++data->next_read;
+        ++data->n_pending;
+    }
+}
+
+static void
+pack_fs_pump (struct bufferevent *bev, PackFsData *data)
+{
+    evhtp_request_t *req = data->req;
+    struct evbuffer *chunk = NULL;
+    PackFsObj *obj;
+
+    data->idle = FALSE;
+
+    while ((obj = g_async_queue_try_pop (data->results)) != NULL) {
+        --data->n_pending;
+        if (!obj->success) {
+            syncw_warning ("Failed to read syncwerk object %s:%s.\n",
+                          data->store_id, obj->obj_id);
+            data->failed = TRUE;
+        } else if (!data->failed) {
+            if (!chunk)
+                chunk = evbuffer_new ();
+            evbuffer_add_buffer (chunk, obj->buf);
+            data->total_size += obj->len;
+        }
+        free_pack_fs_obj (obj);
+    }
+
+    issue_pack_fs_reads (data);
+
+    if (data->failed) {
+        /* Status line is already sent, close the connection without
+         * terminating the chunked body so that the client sees an error.
+         */
+        if (chunk)
+            evbuffer_free (chunk);
+        evhtp_connection_free (evhtp_request_get_connection (req));
+        release_pack_fs_data (data);
+        return;
+    }
+
+    if (chunk) {
+        /* Write callback will be called again when the chunk is sent. */
+        evhtp_send_reply_chunk (req, chunk);
+        evbuffer_free (chunk);
+        return;
+    }
+
+    if (data->n_pending > 0) {
+        /* Nothing is ready yet, pack_fs_wake_cb() pumps again. */
+        data->idle = TRUE;
+        return;
+    }
+
+    /* Recover evhtp's callbacks */
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (req);
+
+    evhtp_send_reply_chunk_end (req);
+
+    release_pack_fs_data (data);
+}
+
+static void
+pack_fs_write_cb (struct bufferevent *bev, void *ctx)
+{
+    pack_fs_pump (bev, ctx);
+}
+
+/* Called in the http worker thread after reads are done. */
+static void
+pack_fs_wake_cb (void *ctx)
+{
+    PackFsData *data = ctx;
+
+    /* Results pushed from now on wake us up again. */
+    g_atomic_int_set (&data->wake_pending, 0);
+
+    if (data->req && data->idle)
+        pack_fs_pump (evhtp_request_get_bev (data->req), data);
+
+    pack_fs_data_unref (data);
+}
+
+static void
+pack_fs_event_cb (struct bufferevent *bev, short events, void *ctx)
 {
-    htp_method req_method = evhtp_request_get_method (req);
+    PackFsData *data = ctx;
 
-    if (req_method == htp_method_GET) {
-        get_block_cb (req, arg);
-    } else if (req_method == htp_method_PUT) {
-        put_send_block_cb (req, arg);
-    }
+    data->saved_event_cb (bev, events, data->saved_cb_arg);
+
+    /* Free aux data. Pending reads keep it alive until they're done. */
+    release_pack_fs_data (data);
 }
 
+/*
+ * The reply is streamed with chunked encoding. Objects are read
+ * asynchronously, up to PACK_FS_READ_AHEAD at a time, and sent as soon as
+ * they're read, so the worker thread doesn't block on disk and the reply
+ * is never built up in memory.
+ */
 static void
-post_check_exist_cb (evhtp_request_t *req, void *arg, CheckExistType type)
+post_pack_fs_cb (evhtp_request_t *req, void *arg)
 {
     HttpServer *htp_server = arg;
     char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
-    char *repo_id = parts[1];
+    const char *repo_id = parts[1];
     char *store_id = NULL;
+    PackFsData *data = NULL;
 
     int token_status = validate_token (htp_server, req, repo_id, NULL, FALSE);
     if (token_status != EVHTP_RES_OK) {
@@ -1697,188 +3544,270 @@ post_check_exist_cb (evhtp_request_t *req, void *arg, CheckExistType type)
         goto out;
     }
 
-    size_t list_len = evbuffer_get_length (req->buffer_in);
-    if (list_len == 0) {
+    int n_ids = 0;
+    char *ids = load_obj_id_list (req, &n_ids);
+    if (!ids) {
         evhtp_send_reply (req, EVHTP_RES_BADREQ);
         goto out;
     }
 
-    char *obj_list_con = g_new0 (char, list_len);
-    if (!obj_list_con) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        syncw_warning ("Failed to allocate %zu bytes memory.\n", list_len);
+    if (n_ids == 0) {
+        g_free (ids);
+        evhtp_send_reply (req, EVHTP_RES_OK);
         goto out;
     }
 
-    json_error_t jerror;
-    evbuffer_remove (req->buffer_in, obj_list_con, list_len);
-    json_t *obj_array = json_loadb (obj_list_con, list_len, 0, &jerror);
-    g_free (obj_list_con);
-
-    if (!obj_array) {
-        syncw_warning ("dump obj_id to json failed, error: %s\n", jerror.text);
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
-        return;
-    }
-
-    json_t *obj = NULL;
-    gboolean ret = TRUE;
     const char *obj_id = NULL;
     int index = 0;
 
-    int array_size = json_array_size (obj_array);
-    json_t *needed_objs = json_array();
-
-    for (; index < array_size; ++index) {
-        obj = json_array_get (obj_array, index);
-        obj_id = json_string_value (obj);
-        if (!is_object_id_valid (obj_id))
-            continue;
+    for (; index < n_ids; ++index) {
+        obj_id = ids + index * 41;
 
-        if (type == CHECK_FS_EXIST) {
-            ret = syncw_fs_manager_object_exists (syncw->fs_mgr, store_id, 1,
-                                                 obj_id);
-        } else if (type == CHECK_BLOCK_EXIST) {
-            ret = syncw_block_manager_block_exists (syncw->block_mgr, store_id, 1,
-                                                   obj_id);
+        if (!is_object_id_valid (obj_id)) {
+            syncw_warning ("Invalid fs id %s.\n", obj_id);
+            evhtp_send_reply (req, EVHTP_RES_BADREQ);
+            g_free (ids);
+            goto out;
         }
+    }
 
-        if (!ret) {
-            json_array_append (needed_objs, obj);
-        }
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    ThreadWaker *waker = thread_waker_get (bufferevent_get_base (bev));
+    if (!waker) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        g_free (ids);
+        goto out;
     }
 
-    char *ret_array = json_dumps (needed_objs, JSON_COMPACT);
-    evbuffer_add (req->buffer_out, ret_array, strlen (ret_array));
-    evhtp_send_reply (req, EVHTP_RES_OK);
+    data = g_new0 (PackFsData, 1);
+    data->waker = waker;
+    data->obj_ids = ids;
+    data->refcnt = 1;
+    data->req = req;
+    data->n_objs = n_ids;
+    memcpy (data->store_id, store_id, 36);
+    data->results = g_async_queue_new ();
+    data->reader_id = syncw_obj_store_register_async_read (syncw->fs_mgr->obj_store,
+                                                          store_id, 1,
+                                                          pack_fs_read_done,
+                                                          data);
+
+    /* We need to overwrite evhtp's callback functions to
+     * write the objects piece by piece.
+     */
+    data->saved_read_cb = bev->readcb;
+    data->saved_write_cb = bev->writecb;
+    data->saved_event_cb = bev->errorcb;
+    data->saved_cb_arg = bev->cbarg;
+    bufferevent_setcb (bev,
+                       NULL,
+                       pack_fs_write_cb,
+                       pack_fs_event_cb,
+                       data);
+
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
 
-    g_free (ret_array);
-    json_decref (needed_objs);
-    json_decref (obj_array);
+    /* Start reading while the headers are being sent. */
+    issue_pack_fs_reads (data);
+
+    evhtp_send_reply_chunk_start (req, EVHTP_RES_OK);
 
 out:
     g_free (store_id);
     g_strfreev (parts);
 }
 
-static void
-post_check_fs_cb (evhtp_request_t *req, void *arg)
-{
-   post_check_exist_cb (req, arg, CHECK_FS_EXIST);
-}
+#define MAX_BLOCK_PACK_SIZE (1 << 25) /* 32MB */
+#define MAX_BLOCK_PACK_NUM 1000
+/* Smaller blocks are copied into the reply, larger ones are sent with sendfile(). */
+#define MIN_SENDFILE_BLOCK_SIZE (1 << 16) /* 64KB */
+
+/* Blocks queued into the reply at once, to bound the open fds. */
+#define PACK_BLOCKS_WINDOW_NUM 16
+#define PACK_BLOCKS_WINDOW_SIZE (8 << 20)
+
+typedef struct PackBlock {
+    char block_id[41];
+    guint32 size;
+} PackBlock;
+
+/*
+ * The blocks are only stat'ed up front. They're opened and queued into the
+ * reply a window at a time, as the connection drains.
+ */
+typedef struct PackBlocksData {
+    evhtp_request_t *req;
+    char store_id[37];
+    char *username;
+    GArray *blocks;
+    guint blk_idx;
+    guint64 total_size;
+
+    bufferevent_data_cb saved_read_cb;
+    bufferevent_data_cb saved_write_cb;
+    bufferevent_event_cb saved_event_cb;
+    void *saved_cb_arg;
+} PackBlocksData;
 
 static void
-post_check_block_cb (evhtp_request_t *req, void *arg)
+free_pack_blocks_data (PackBlocksData *data)
 {
-   post_check_exist_cb (req, arg, CHECK_BLOCK_EXIST);
+    g_array_free (data->blocks, TRUE);
+    g_free (data->username);
+    g_free (data);
 }
 
-static void
-post_recv_fs_cb (evhtp_request_t *req, void *arg)
+static int
+add_block_to_buffer (struct evbuffer *buf, BlockHandle *handle, guint32 size)
 {
-    HttpServer *htp_server = arg;
-    char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
-    const char *repo_id = parts[1];
-    char *store_id = NULL;
-    char *username = NULL;
-    FsHdr *hdr = NULL;
-
-    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
-    if (token_status != EVHTP_RES_OK) {
-        evhtp_send_reply (req, token_status);
-        goto out;
-    }
+    struct evbuffer_iovec vec;
+    int fd;
 
-    int perm_status = check_permission (htp_server, repo_id, username,
-                                        "upload", FALSE);
-    if (perm_status == EVHTP_RES_FORBIDDEN) {
-        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
-        goto out;
-    }
+    if (size == 0)
+        return 0;
 
-    store_id = get_repo_store_id (htp_server, repo_id);
-    if (!store_id) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
+    if (syncw->http_server->use_sendfile && size >= MIN_SENDFILE_BLOCK_SIZE) {
+        fd = syncw_block_manager_dup_block_fd (syncw->block_mgr, handle);
+        if (fd >= 0)
+            return add_file_segment (buf, fd, size);
     }
 
-    int fs_con_len = evbuffer_get_length (req->buffer_in);
-    if (fs_con_len < sizeof(FsHdr)) {
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
-        goto out;
-    }
+    /* Read the block straight into the output buffer. */
+    if (evbuffer_reserve_space (buf, size, &vec, 1) < 1)
+        return -1;
 
-    hdr = g_new0 (FsHdr, 1);
-    if (!hdr) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
-    }
+    if (syncw_block_manager_read_block (syncw->block_mgr, handle,
+                                       vec.iov_base, size) != size)
+        return -1;
 
-    char obj_id[41];
-    void *obj_con = NULL;
-    int con_len;
+    vec.iov_len = size;
+    return evbuffer_commit_space (buf, &vec, 1);
+}
 
-    while (fs_con_len > 0) {
-        if (fs_con_len < sizeof(FsHdr)) {
-            syncw_warning ("Bad fs object content format from %.8s:%s.\n",
-                          repo_id, username);
-            evhtp_send_reply (req, EVHTP_RES_BADREQ);
-            break;
+/* Returns 1 when all blocks are queued, -1 on error. */
+static int
+add_pack_blocks (PackBlocksData *data, struct evbuffer *buf)
+{
+    PackBlock *pb;
+    BlockHandle *handle;
+    guint32 size_net;
+    int n_blocks = 0;
+    int ret;
+
+    while (data->blk_idx < data->blocks->len &&
+           n_blocks < PACK_BLOCKS_WINDOW_NUM &&
+           evbuffer_get_length (buf) < PACK_BLOCKS_WINDOW_SIZE) {
+        pb = &g_array_index (data->blocks, PackBlock, data->blk_idx);
+
+        handle = syncw_block_manager_open_block (syncw->block_mgr,
+                                                data->store_id, 1,
+                                                pb->block_id, BLOCK_READ);
+        if (!handle) {
+            syncw_warning ("Failed to open block %.8s:%s.\n",
+                          data->store_id, pb->block_id);
+            return -1;
         }
 
-        evbuffer_remove (req->buffer_in, hdr, sizeof(FsHdr));
-        con_len = ntohl (hdr->obj_size);
-        memcpy (obj_id, hdr->obj_id, 40);
-        obj_id[40] = 0;
-
-        if (!is_object_id_valid (obj_id)) {
-            evhtp_send_reply (req, EVHTP_RES_BADREQ);
-            break;
+        evbuffer_add (buf, pb->block_id, 40);
+        size_net = htonl (pb->size);
+        evbuffer_add (buf, &size_net, 4);
+
+        ret = add_block_to_buffer (buf, handle, pb->size);
+        syncw_block_manager_close_block (syncw->block_mgr, handle);
+        syncw_block_manager_block_handle_free (syncw->block_mgr, handle);
+        if (ret < 0) {
+            syncw_warning ("Failed to read block %.8s:%s.\n",
+                          data->store_id, pb->block_id);
+            return -1;
         }
 
-        obj_con = g_new0 (char, con_len);
-        if (!obj_con) {
-            evhtp_send_reply (req, EVHTP_RES_SERVERR);
-            break;
-        }
-        evbuffer_remove (req->buffer_in, obj_con, con_len);
+        ++data->blk_idx;
+        ++n_blocks;
+    }
 
-        if (syncw_obj_store_write_obj (syncw->fs_mgr->obj_store,
-                                      store_id, 1, obj_id, obj_con,
-                                      con_len, FALSE) < 0) {
-            syncw_warning ("Failed to write fs object %.8s to disk.\n",
-                          obj_id);
-            g_free (obj_con);
-            evhtp_send_reply (req, EVHTP_RES_SERVERR);
-            break;
+    return data->blk_idx == data->blocks->len ? 1 : 0;
+}
+
+static void
+pack_blocks_write_cb (struct bufferevent *bev, void *ctx)
+{
+    PackBlocksData *data = ctx;
+    struct evbuffer *buf;
+
+    if (data->blk_idx < data->blocks->len) {
+        buf = evbuffer_new ();
+        if (add_pack_blocks (data, buf) < 0) {
+            evbuffer_free (buf);
+            goto err;
         }
 
-        fs_con_len -= (con_len + sizeof(FsHdr));
-        g_free (obj_con);
+        /* This may call pack_blocks_write_cb() recursively (by
+         * libevent_openssl), and data may be free'd in the recursive calls.
+         * So don't use "data" variable after here.
+         */
+        bufferevent_write_buffer (bev, buf);
+        evbuffer_free (buf);
+        return;
     }
 
-    if (fs_con_len == 0) {
-        evhtp_send_reply (req, EVHTP_RES_OK);
-    }
+    /* Recover evhtp's callbacks */
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
 
-out:
-    g_free (store_id);
-    g_free (hdr);
-    g_free (username);
-    g_strfreev (parts);
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
+
+    evhtp_send_reply_end (data->req);
+
+    send_statistic_msg (data->store_id, data->username, "sync-file-download",
+                        data->total_size);
+
+    free_pack_blocks_data (data);
+    return;
+
+err:
+    /* Headers are already out, cut the reply short. */
+    evhtp_connection_free (evhtp_request_get_connection (data->req));
+    free_pack_blocks_data (data);
 }
 
-#define MAX_OBJECT_PACK_SIZE (1 << 20) /* 1MB */
+static void
+pack_blocks_event_cb (struct bufferevent *bev, short events, void *ctx)
+{
+    PackBlocksData *data = ctx;
 
+    data->saved_event_cb (bev, events, data->saved_cb_arg);
+
+    /* Free aux data. */
+    free_pack_blocks_data (data);
+}
+
+/*
+ * Download a batch of blocks in one request. The request body is a list
+ * of block ids, see load_obj_id_list(), and the reply is a sequence of
+ * [40-byte block id][4-byte block size in network order][block data].
+ * Like pack-fs, the reply may contain only a prefix of the requested blocks
+ * if they exceed MAX_BLOCK_PACK_SIZE; the client asks again for the rest.
+ */
 static void
-post_pack_fs_cb (evhtp_request_t *req, void *arg)
+post_pack_blocks_cb (evhtp_request_t *req, void *arg)
 {
     HttpServer *htp_server = arg;
     char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
     const char *repo_id = parts[1];
     char *store_id = NULL;
+    char *username = NULL;
+    char *blk_ids = NULL;
+    int n_ids = 0;
+    GArray *blocks = NULL;
+    PackBlocksData *data;
 
-    int token_status = validate_token (htp_server, req, repo_id, NULL, FALSE);
+    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
     if (token_status != EVHTP_RES_OK) {
         evhtp_send_reply (req, token_status);
         goto out;
@@ -1890,76 +3819,95 @@ post_pack_fs_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    int fs_id_list_len = evbuffer_get_length (req->buffer_in);
-    if (fs_id_list_len == 0) {
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
-        goto out;
-    }
-
-    char *fs_id_list = g_new0 (char, fs_id_list_len);
-    if (!fs_id_list) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        syncw_warning ("Failed to allocate %d bytes memory.\n", fs_id_list_len);
-        goto out;
-    }
-
-    json_error_t jerror;
-    evbuffer_remove (req->buffer_in, fs_id_list, fs_id_list_len);
-    json_t *fs_id_array = json_loadb (fs_id_list, fs_id_list_len, 0, &jerror);
-
-    g_free (fs_id_list);
-
-    if (!fs_id_array) {
-        syncw_warning ("dump fs obj_id from json failed, error: %s\n", jerror.text);
+    blk_ids = load_obj_id_list (req, &n_ids);
+    if (!blk_ids) {
         evhtp_send_reply (req, EVHTP_RES_BADREQ);
         goto out;
     }
 
-    json_t *obj = NULL;
-    const char *obj_id = NULL;
+    const char *blk_id = NULL;
+    BlockMetadata *bmd;
+    PackBlock pb;
+    guint64 total_size = 0;
     int index = 0;
-    void *fs_data = NULL;
-    int data_len;
-    int data_len_net;
-    int total_size = 0;
 
-    int array_size = json_array_size (fs_id_array);
+    blocks = g_array_new (FALSE, TRUE, sizeof(PackBlock));
 
-    for (; index < array_size; ++index) {
-        obj = json_array_get (fs_id_array, index);
-        obj_id = json_string_value (obj);
+    /* Stat all the blocks first, so that the reply size is known and
+     * missing blocks are reported before anything is sent.
+     */
+    for (; index < n_ids; ++index) {
+        blk_id = blk_ids + index * 41;
 
-        if (!is_object_id_valid (obj_id)) {
-            syncw_warning ("Invalid fs id %s.\n", obj_id);
+        if (!is_object_id_valid (blk_id)) {
+            syncw_warning ("Invalid block id %s.\n", blk_id);
             evhtp_send_reply (req, EVHTP_RES_BADREQ);
-            json_decref (fs_id_array);
             goto out;
         }
-        if (syncw_obj_store_read_obj (syncw->fs_mgr->obj_store, store_id, 1,
-                                     obj_id, &fs_data, &data_len) < 0) {
-            syncw_warning ("Failed to read syncwerk object %s:%s.\n", store_id, obj_id);
+
+        bmd = syncw_block_manager_stat_block (syncw->block_mgr,
+                                             store_id, 1, blk_id);
+        if (!bmd) {
+            syncw_warning ("Failed to stat block %.8s:%s.\n", store_id, blk_id);
             evhtp_send_reply (req, EVHTP_RES_SERVERR);
-            json_decref (fs_id_array);
             goto out;
         }
 
-        evbuffer_add (req->buffer_out, obj_id, 40);
-        data_len_net = htonl (data_len);
-        evbuffer_add (req->buffer_out, &data_len_net, 4);
-        evbuffer_add (req->buffer_out, fs_data, data_len);
+        memset (&pb, 0, sizeof(pb));
+        memcpy (pb.block_id, blk_id, 41);
+        pb.size = bmd->size;
+        g_free (bmd);
 
-        total_size += data_len;
-        g_free (fs_data);
+        g_array_append_val (blocks, pb);
+        total_size += pb.size;
 
-        if (total_size >= MAX_OBJECT_PACK_SIZE)
+        if (total_size >= MAX_BLOCK_PACK_SIZE || blocks->len >= MAX_BLOCK_PACK_NUM)
             break;
     }
 
-    evhtp_send_reply (req, EVHTP_RES_OK);
+    char con_len[32];
+    snprintf (con_len, sizeof(con_len), "%"G_GUINT64_FORMAT,
+              total_size + (guint64)blocks->len * 44);
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("Content-Length", con_len, 1, 1));
+
+    data = g_new0 (PackBlocksData, 1);
+    data->req = req;
+    memcpy (data->store_id, store_id, 36);
+    data->username = username;
+    username = NULL;
+    data->blocks = blocks;
+    blocks = NULL;
+    data->total_size = total_size;
+
+    /* We need to overwrite evhtp's callback functions to
+     * write the blocks piece by piece.
+     */
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    data->saved_read_cb = bev->readcb;
+    data->saved_write_cb = bev->writecb;
+    data->saved_event_cb = bev->errorcb;
+    data->saved_cb_arg = bev->cbarg;
+    bufferevent_setcb (bev,
+                       NULL,
+                       pack_blocks_write_cb,
+                       pack_blocks_event_cb,
+                       data);
+
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
+
+    /* The blocks are queued once the headers are written. */
+    evhtp_send_reply_start (req, EVHTP_RES_OK);
 
-    json_decref (fs_id_array);
 out:
+    if (blocks)
+        g_array_free (blocks, TRUE);
+    g_free (blk_ids);
     g_free (store_id);
+    g_free (username);
     g_strfreev (parts);
 }
 
@@ -1971,8 +3919,7 @@ get_block_map_cb (evhtp_request_t *req, void *arg)
     char *store_id = NULL;
     HttpServer *htp_server = arg;
     Syncwerk *file = NULL;
-    char *block_id;
-    BlockMetadata *blk_meta = NULL;
+    guint32 *blk_sizes = NULL;
     json_t *array = NULL;
     char *data = NULL;
 
@@ -1998,29 +3945,26 @@ get_block_map_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
+    blk_sizes = syncw_fs_manager_get_block_sizes (syncw->fs_mgr, store_id, 1, file);
+    if (!blk_sizes) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+
     array = json_array ();
 
     int i;
-    for (i = 0; i < file->n_blocks; ++i) {
-        block_id = file->blk_sha1s[i];
-        blk_meta = syncw_block_manager_stat_block (syncw->block_mgr,
-                                                  store_id, 1, block_id);
-        if (blk_meta == NULL) {
-            syncw_warning ("Failed to find block %s/%s\n", store_id, block_id);
-            evhtp_send_reply (req, EVHTP_RES_SERVERR);
-            g_free (blk_meta);
-            goto out;
-        }
-        json_array_append_new (array, json_integer(blk_meta->size));
-        g_free (blk_meta);
-    }
+    for (i = 0; i < file->n_blocks; ++i)
+        json_array_append_new (array, json_integer(blk_sizes[i]));
 
     data = json_dumps (array, JSON_COMPACT);
     evbuffer_add (req->buffer_out, data, strlen (data));
+    http_compress_reply (req);
     evhtp_send_reply (req, EVHTP_RES_OK);
 
 out:
     g_free (store_id);
+    g_free (blk_sizes);
     syncwerk_unref (file);
     if (array)
         json_decref (array);
@@ -2029,68 +3973,168 @@ out:
     g_strfreev (parts);
 }
 
+/*
+ * Metrics are only served to clients on this host. Requests relayed by a
+ * reverse proxy are refused, as the proxy connects from localhost too.
+ */
 static void
-http_request_init (HttpServerStruct *server)
+get_metrics_cb (evhtp_request_t *req, void *arg)
 {
-    HttpServer *priv = server->priv;
-
-    evhtp_set_cb (priv->evhtp,
-                  GET_PROTO_PATH, get_protocol_cb,
-                  NULL);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        GET_CHECK_QUOTA_REGEX, get_check_quota_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        OP_PERM_CHECK_REGEX, get_check_permission_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        HEAD_COMMIT_OPER_REGEX, head_commit_oper_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        GET_HEAD_COMMITS_MULTI_REGEX, head_commits_multi_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        COMMIT_OPER_REGEX, commit_oper_cb,
-                        priv);
-
-    evhtp_set_regex_cb (priv->evhtp,
-                        GET_FS_OBJ_ID_REGEX, get_fs_obj_id_cb,
-                        priv);
+    struct sockaddr *sa = req->conn->saddr;
+    gboolean local = FALSE;
+    char *metrics;
+
+    if (sa->sa_family == AF_INET) {
+        struct sockaddr_in *addr_in = (struct sockaddr_in *)sa;
+        local = ((ntohl (addr_in->sin_addr.s_addr) >> 24) == 127);
+    } else if (sa->sa_family == AF_INET6) {
+        struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)sa;
+        local = IN6_IS_ADDR_LOOPBACK (&addr_in6->sin6_addr);
+    }
 
-    evhtp_set_regex_cb (priv->evhtp,
-                        BLOCK_OPER_REGEX, block_oper_cb,
-                        priv);
+    if (!local ||
+        evhtp_kv_find (req->headers_in, "X-Forwarded-For") ||
+        evhtp_kv_find (req->headers_in, "X-Real-IP")) {
+        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
+        return;
+    }
 
-    evhtp_set_regex_cb (priv->evhtp,
-                        POST_CHECK_FS_REGEX, post_check_fs_cb,
-                        priv);
+    metrics = http_metrics_to_json ();
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("Content-Type",
+                                                "application/json", 1, 1));
+    evbuffer_add (req->buffer_out, metrics, strlen (metrics));
+    evhtp_send_reply (req, EVHTP_RES_OK);
+    g_free (metrics);
+}
 
-    evhtp_set_regex_cb (priv->evhtp,
-                        POST_CHECK_BLOCK_REGEX, post_check_block_cb,
-                        priv);
+/* Sync requests are charged to the token's user and the repo in the path. */
+static void
+get_admission_key (evhtp_request_t *req, void *arg,
+                   char **user, char **repo_id)
+{
+    HttpServer *htp_server = arg;
+    const char *token = evhtp_kv_find (req->headers_in, "Seafile-Repo-Token");
+    const char *path = req->uri->path->full;
 
-    evhtp_set_regex_cb (priv->evhtp,
-                        POST_RECV_FS_REGEX, post_recv_fs_cb,
-                        priv);
+    /* Don't query db here. Unknown tokens are charged to the client address. */
+    if (token)
+        sharded_cache_lookup (htp_server->token_cache, token, 0,
+                              copy_token_email, user);
 
-    evhtp_set_regex_cb (priv->evhtp,
-                        POST_PACK_FS_REGEX, post_pack_fs_cb,
-                        priv);
+    if (strncmp (path, "/repo/", 6) == 0 &&
+        strlen (path) > 6 + 36 && path[6 + 36] == '/')
+        *repo_id = g_strndup (path + 6, 36);
+}
 
-    evhtp_set_regex_cb (priv->evhtp,
-                        GET_BLOCK_MAP_REGEX, get_block_map_cb,
-                        priv);
+static void
+http_request_init (HttpServerStruct *server, evhtp_t *htp)
+{
+    HttpServer *priv = server->priv;
+    evhtp_callback_t *cb;
+
+    cb = evhtp_set_cb (htp,
+                       GET_PROTO_PATH, get_protocol_cb,
+                       NULL);
+    http_metrics_watch (cb, "protocol-version");
+
+    cb = http_admission_set_regex_cb (htp,
+                                      GET_CHECK_QUOTA_REGEX, get_check_quota_cb,
+                                      priv, ADMISSION_CHEAP,
+                                      get_admission_key, priv);
+    http_metrics_watch (cb, "quota-check");
+
+    cb = http_admission_set_regex_cb (htp,
+                                      OP_PERM_CHECK_REGEX, get_check_permission_cb,
+                                      priv, ADMISSION_CHEAP,
+                                      get_admission_key, priv);
+    http_metrics_watch (cb, "permission-check");
+
+    cb = http_admission_set_regex_cb (htp,
+                                      HEAD_COMMIT_OPER_REGEX, head_commit_oper_cb,
+                                      priv, ADMISSION_EXPENSIVE_PUT,
+                                      get_admission_key, priv);
+    http_metrics_watch (cb, "head-commit");
+
+    cb = http_admission_set_regex_cb (htp,
+                                      GET_HEAD_COMMITS_MULTI_REGEX, head_commits_multi_cb,
+                                      priv, ADMISSION_CHEAP,
+                                      get_admission_key, priv);
+    http_metrics_watch (cb, "head-commits-multi");
+
+    cb = http_admission_set_regex_cb (htp,
+                                      HEAD_COMMITS_POLL_REGEX, head_commits_poll_cb,
+                                      server, ADMISSION_CHEAP,
+                                      get_admission_key, priv);
+    http_metrics_watch (cb, "head-commits-poll");
+
+    cb = http_admission_set_regex_cb (htp,
+                                      COMMIT_OPER_REGEX, commit_oper_cb,
+                                      priv, ADMISSION_CHEAP,
+                                      get_admission_key, priv);
+    http_metrics_watch (cb, "commit");
+
+    cb = http_admission_set_regex_cb (htp,
+                                      GET_FS_OBJ_ID_REGEX, get_fs_obj_id_cb,
+                                      priv, ADMISSION_EXPENSIVE,
+                                      get_admission_key, priv);
+    http_metrics_watch (cb, "fs-id-list");
+
+    cb = http_admission_set_regex_cb (htp,
+                                      BLOCK_OPER_REGEX, block_oper_cb,
+                                      priv, ADMISSION_CHEAP,
+                                      get_admission_key, priv);
+    http_metrics_watch (cb, "block");
+    /* Blocks are written to disk as they're uploaded, so uploads are
+     * admitted before the body is read.
+     */
+    http_admission_set_headers_cb (cb, block_oper_headers_cb, priv);
+
+    cb = http_admission_set_regex_cb (htp,
+                                      POST_CHECK_FS_REGEX, post_check_fs_cb,
+                                      priv, ADMISSION_CHEAP,
+                                      get_admission_key, priv);
+    http_metrics_watch (cb, "check-fs");
+
+    cb = http_admission_set_regex_cb (htp,
+                                      POST_CHECK_BLOCK_REGEX, post_check_block_cb,
+                                      priv, ADMISSION_CHEAP,
+                                      get_admission_key, priv);
+    http_metrics_watch (cb, "check-blocks");
+
+    cb = http_admission_set_regex_cb (htp,
+                                      POST_RECV_FS_REGEX, post_recv_fs_cb,
+                                      priv, ADMISSION_CHEAP,
+                                      get_admission_key, priv);
+    http_metrics_watch (cb, "recv-fs");
+
+    cb = http_admission_set_regex_cb (htp,
+                                      POST_PACK_FS_REGEX, post_pack_fs_cb,
+                                      priv, ADMISSION_CHEAP,
+                                      get_admission_key, priv);
+    http_metrics_watch (cb, "pack-fs");
+
+    cb = http_admission_set_regex_cb (htp,
+                                      POST_PACK_BLOCKS_REGEX, post_pack_blocks_cb,
+                                      priv, ADMISSION_CHEAP,
+                                      get_admission_key, priv);
+    http_metrics_watch (cb, "pack-blocks");
+
+    cb = http_admission_set_regex_cb (htp,
+                                      GET_BLOCK_MAP_REGEX, get_block_map_cb,
+                                      priv, ADMISSION_CHEAP,
+                                      get_admission_key, priv);
+    http_metrics_watch (cb, "block-map");
+
+    evhtp_set_cb (htp,
+                  GET_METRICS_PATH, get_metrics_cb,
+                  NULL);
 
     /* Web access file */
-    access_file_init (priv->evhtp);
+    access_file_init (htp);
 
     /* Web upload file */
-    if (upload_file_init (priv->evhtp, server->http_temp_dir) < 0)
+    if (upload_file_init (htp, server->http_temp_dir) < 0)
         exit(-1);
 }
 
@@ -2105,18 +4149,6 @@ token_cache_value_free (gpointer data)
     }
 }
 
-static gboolean
-is_token_expire (gpointer key, gpointer value, gpointer arg)
-{
-    TokenInfo *token_info = (TokenInfo *)value;
-
-    if(token_info && token_info->expire_time <= (gint64)time(NULL)) {
-        return TRUE;
-    }
-
-    return FALSE;
-}
-
 static void
 perm_cache_value_free (gpointer data)
 {
@@ -2125,30 +4157,6 @@ perm_cache_value_free (gpointer data)
     g_free (perm_info);
 }
 
-static gboolean
-is_perm_expire (gpointer key, gpointer value, gpointer arg)
-{
-    PermInfo *perm_info = (PermInfo *)value;
-
-    if(perm_info && perm_info->expire_time <= (gint64)time(NULL)) {
-        return TRUE;
-    }
-
-    return FALSE;
-}
-
-static gboolean
-is_vir_repo_info_expire (gpointer key, gpointer value, gpointer arg)
-{
-    VirRepoInfo *vinfo = (VirRepoInfo *)value;
-
-    if(vinfo && vinfo->expire_time <= (gint64)time(NULL)) {
-        return TRUE;
-    }
-
-    return FALSE;
-}
-
 static void
 free_vir_repo_info (gpointer data)
 {
@@ -2168,18 +4176,116 @@ remove_expire_cache_cb (evutil_socket_t sock, short type, void *data)
 {
     HttpServer *htp_server = data;
 
-    pthread_mutex_lock (&htp_server->token_cache_lock);
-    g_hash_table_foreach_remove (htp_server->token_cache, is_token_expire, NULL);
-    pthread_mutex_unlock (&htp_server->token_cache_lock);
+    sharded_cache_remove_expired (htp_server->token_cache);
+    sharded_cache_remove_expired (htp_server->perm_cache);
+    sharded_cache_remove_expired (htp_server->vir_repo_info_cache);
+    http_admission_remove_idle ();
+}
+
+#if defined HAVE_EVHTP_ACCEPT_SOCKET && defined SO_REUSEPORT
+/*
+ * Every acceptor loop has its own listening socket on the same address,
+ * so that the kernel spreads incoming connections over them.
+ */
+static evutil_socket_t
+bind_reuseport_socket (HttpServerStruct *server)
+{
+    struct evutil_addrinfo hints, *res = NULL;
+    char port[16];
+    evutil_socket_t fd = -1;
+    int on = 1;
+    int err;
+
+    memset (&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = EVUTIL_AI_PASSIVE;
+    snprintf (port, sizeof(port), "%d", server->bind_port);
+
+    err = evutil_getaddrinfo (server->bind_addr, port, &hints, &res);
+    if (err != 0) {
+        syncw_warning ("Failed to resolve %s: %s.\n",
+                      server->bind_addr, evutil_gai_strerror (err));
+        return -1;
+    }
+
+    fd = socket (res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0) {
+        syncw_warning ("Failed to create socket: %s.\n", strerror(errno));
+        goto out;
+    }
+
+    if (setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+        evutil_make_socket_nonblocking (fd) < 0 ||
+        evutil_make_socket_closeonexec (fd) < 0 ||
+        bind (fd, res->ai_addr, res->ai_addrlen) < 0) {
+        syncw_warning ("Failed to bind socket: %s.\n", strerror(errno));
+        evutil_closesocket (fd);
+        fd = -1;
+    }
+
+out:
+    evutil_freeaddrinfo (res);
+    return fd;
+}
+#endif
+
+static int
+bind_http_socket (HttpServerStruct *server, evhtp_t *htp)
+{
+#if defined HAVE_EVHTP_ACCEPT_SOCKET && defined SO_REUSEPORT
+    if (server->acceptor_threads > 1) {
+        evutil_socket_t fd = bind_reuseport_socket (server);
+        if (fd < 0)
+            return -1;
+        /* evhtp listens on the socket and takes ownership of it. */
+        if (evhtp_accept_socket (htp, fd, server->listen_backlog) < 0) {
+            evutil_closesocket (fd);
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
+    return evhtp_bind_socket (htp,
+                              server->bind_addr,
+                              server->bind_port,
+                              server->listen_backlog);
+}
+
+/*
+ * Each acceptor has its own event loop, listening socket and worker threads.
+ * The first one runs in the http server thread.
+ */
+static int
+setup_acceptor (HttpServerStruct *server, evhtp_t *htp)
+{
+    int n_workers;
+
+    if (bind_http_socket (server, htp) < 0) {
+        syncw_warning ("Could not bind socket: %s\n", strerror (errno));
+        return -1;
+    }
+
+    http_request_init (server, htp);
+
+    /* Worker threads are split among the acceptors. */
+    n_workers = (server->worker_threads + server->acceptor_threads - 1) /
+                server->acceptor_threads;
+    evhtp_use_threads (htp, NULL, n_workers, NULL);
+
+    return 0;
+}
+
+static void *
+acceptor_thread (void *arg)
+{
+    evbase_t *evbase = arg;
 
-    pthread_mutex_lock (&htp_server->perm_cache_lock);
-    g_hash_table_foreach_remove (htp_server->perm_cache, is_perm_expire, NULL);
-    pthread_mutex_unlock (&htp_server->perm_cache_lock);
+    event_base_loop (evbase, 0);
 
-    pthread_mutex_lock (&htp_server->vir_repo_info_cache_lock);
-    g_hash_table_foreach_remove (htp_server->vir_repo_info_cache,
-                                 is_vir_repo_info_expire, NULL);
-    pthread_mutex_unlock (&htp_server->vir_repo_info_cache_lock);
+    return NULL;
 }
 
 static void *
@@ -2187,20 +4293,30 @@ http_server_run (void *arg)
 {
     HttpServerStruct *server = arg;
     HttpServer *priv = server->priv;
+    evbase_t *evbase;
+    evhtp_t *htp;
+    pthread_t tid;
+    int i;
 
     priv->evbase = event_base_new();
     priv->evhtp = evhtp_new(priv->evbase, NULL);
 
-    if (evhtp_bind_socket(priv->evhtp,
-                          server->bind_addr,
-                          server->bind_port, 128) < 0) {
-        syncw_warning ("Could not bind socket: %s\n", strerror (errno));
+    if (setup_acceptor (server, priv->evhtp) < 0)
         exit(-1);
-    }
 
-    http_request_init (server);
+    for (i = 1; i < server->acceptor_threads; ++i) {
+        evbase = event_base_new ();
+        htp = evhtp_new (evbase, NULL);
+
+        if (setup_acceptor (server, htp) < 0)
+            exit(-1);
 
-    evhtp_use_threads (priv->evhtp, NULL, server->worker_threads, NULL);
+        if (pthread_create (&tid, NULL, acceptor_thread, evbase) != 0) {
+            syncw_warning ("Failed to start acceptor thread.\n");
+            exit(-1);
+        }
+        pthread_detach (tid);
+    }
 
     struct timeval tv;
     tv.tv_sec = CLEANING_INTERVAL_SEC;
@@ -2228,17 +4344,39 @@ syncw_http_server_new (struct _SyncwerkSession *session)
 
     load_http_config (server, session);
 
-    priv->token_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                               g_free, token_cache_value_free);
-    pthread_mutex_init (&priv->token_cache_lock, NULL);
+    if (http_metrics_init () < 0 ||
+        http_admission_init (server->user_request_rate,
+                             server->repo_request_rate,
+                             server->max_expensive_requests,
+                             server->max_zip_requests) < 0) {
+        g_free (server);
+        g_free (priv);
+        return NULL;
+    }
+
+    priv->token_cache = sharded_cache_new (token_cache_value_free);
+    priv->perm_cache = sharded_cache_new (perm_cache_value_free);
+
+    priv->vir_repo_info_cache = sharded_cache_new (free_vir_repo_info);
 
-    priv->perm_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                              g_free, perm_cache_value_free);
-    pthread_mutex_init (&priv->perm_cache_lock, NULL);
+    priv->fs_id_list_cache = g_hash_table_new (g_str_hash, g_str_equal);
+    priv->fs_id_list_lru = g_queue_new ();
+    pthread_mutex_init (&priv->fs_id_list_cache_lock, NULL);
 
-    priv->vir_repo_info_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                       g_free, free_vir_repo_info);
-    pthread_mutex_init (&priv->vir_repo_info_cache_lock, NULL);
+    priv->fs_id_list_tpool = g_thread_pool_new (fs_id_list_stream_thread, NULL,
+                                                server->fs_id_list_threads,
+                                                FALSE, NULL);
+
+    priv->recv_fs_tpool = g_thread_pool_new (recv_fs_batch_thread, NULL,
+                                             RECV_FS_WRITER_THREADS,
+                                             FALSE, NULL);
+
+    priv->head_watch = head_watch_new ();
+    if (!priv->head_watch) {
+        g_free (server);
+        g_free (priv);
+        return NULL;
+    }
 
     server->http_temp_dir = "/var/lib/syncwerk/tmp";
 
@@ -2267,17 +4405,22 @@ syncw_http_server_start (HttpServerStruct *server)
    return 0;
 }
 
+void
+syncw_http_server_notify_head_changed (HttpServerStruct *htp_server,
+                                      const char *repo_id)
+{
+    head_watch_notify (htp_server->priv->head_watch, repo_id);
+}
+
 int
 syncw_http_server_invalidate_tokens (HttpServerStruct *htp_server,
                                     const GList *tokens)
 {
     const GList *p;
 
-    pthread_mutex_lock (&htp_server->priv->token_cache_lock);
     for (p = tokens; p; p = p->next) {
         const char *token = (char *)p->data;
-        g_hash_table_remove (htp_server->priv->token_cache, token);
+        sharded_cache_remove (htp_server->priv->token_cache, token);
     }
-    pthread_mutex_unlock (&htp_server->priv->token_cache_lock);
     return 0;
 }
@@ -20,7 +20,20 @@ struct _HttpServerStruct {
     int web_token_expire_time;
     int max_indexing_threads;
     int worker_threads;
+    int acceptor_threads;       /* event loops accepting on SO_REUSEPORT sockets */
+    int listen_backlog;
+    int head_poll_timeout;      /* seconds a head-commits-poll request is parked */
+    int user_request_rate;      /* requests per second, 0 means unlimited */
+    int repo_request_rate;
+    int max_expensive_requests; /* diffs or merges served at once */
+    int max_zip_requests;       /* zip downloads served at once */
+    int fs_id_list_threads;     /* threads computing streamed fs-id-lists */
     int max_index_processing_threads;
+    gboolean use_sendfile;      /* serve block files with sendfile() */
+    gint64 web_cache_size;      /* bytes of small files kept in memory, 0 disables */
+    gint64 web_cache_max_file_size;
+    gboolean stream_zip;        /* pack zip downloads while sending them, no zip cache */
+    gint64 zip_cache_size;      /* bytes of packed zip archives kept on disk, 0 disables */
 };
 
 typedef struct _HttpServerStruct HttpServerStruct;
@@ -35,7 +48,28 @@ int
 syncw_http_server_invalidate_tokens (HttpServerStruct *htp_server,
                                     const GList *tokens);
 
+/* Wake the head-commits-poll requests watching @repo_id. */
+void
+syncw_http_server_notify_head_changed (HttpServerStruct *htp_server,
+                                      const char *repo_id);
+
+struct evhtp_request_s;
+
+/* Address of the client, behind a proxy too. */
+char *
+get_client_ip_addr (struct evhtp_request_s *req);
+
 void
 send_statistic_msg (const char *repo_id, char *user, char *operation, guint64 bytes);
 
+struct evbuffer;
+
+/*
+ * Append @size bytes of @fd to @buf as a file segment, which libevent sends
+ * with sendfile(). The segment takes @fd and closes it once it's sent.
+ * Returns -1 on error, with @fd closed.
+ */
+int
+add_file_segment (struct evbuffer *buf, int fd, guint64 size);
+
 #endif
@@ -12,5 +12,8 @@
 #define SYNCW_HTTP_RES_REPO_CORRUPTED 445
 #define SYNCW_HTTP_RES_BLOCK_MISSING 446
 
+/* Standard codes that evhtp doesn't define. */
+#define SYNCW_HTTP_RES_TOO_MANY_REQUESTS 429
+
 
 #endif
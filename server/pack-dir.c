@@ -13,6 +13,7 @@
 
 #include "syncwerk-session.h"
 #include "pack-dir.h"
+#include "zip-stream.h"
 
 #include <archive.h>
 #include <archive_entry.h>
@@ -26,6 +27,8 @@
 
 typedef struct {
     struct archive *a;
+    /* Set when the archive is streamed instead of saved to a temp file. */
+    ZipStream *zs;
     SyncwerkCrypt *crypt;
     const char *top_dir_name;
     gboolean is_windows;
@@ -65,21 +68,108 @@ do_iconv (char *fromcode, char *tocode, char *in)
     return g_strndup(out, outlen);
 }
 
+static gboolean
+use_windows_encoding (PackDirData *data)
+{
+    return data->is_windows && syncw->http_server->windows_encoding;
+}
+
+/* Name of the entry in the archive, converted for WinRAR if needed. */
+static char *
+get_entry_name (PackDirData *data, const char *pathname)
+{
+    char *win_file_name;
+
+    if (!use_windows_encoding (data))
+        return g_strdup (pathname);
+
+    win_file_name = do_iconv ("UTF-8",
+                              syncw->http_server->windows_encoding,
+                              (char *)pathname);
+    if (!win_file_name)
+        syncw_warning ("Failed to convert file name to %s\n",
+                      syncw->http_server->windows_encoding);
+    return win_file_name;
+}
+
+static int
+write_entry_header (PackDirData *data, const char *pathname,
+                    guint32 mode, gint64 size)
+{
+    struct archive_entry *entry;
+    char *name;
+    int ret = 0;
+
+    name = get_entry_name (data, pathname);
+    if (!name)
+        return -1;
+
+    if (data->zs) {
+        if (S_ISDIR(mode))
+            ret = zip_stream_add_dir (data->zs, name,
+                                      !use_windows_encoding (data),
+                                      data->mtime);
+        else
+            ret = zip_stream_begin_file (data->zs, name,
+                                         !use_windows_encoding (data),
+                                         mode, data->mtime, size);
+        g_free (name);
+        return ret;
+    }
+
+    entry = archive_entry_new ();
+    archive_entry_copy_pathname (entry, name);
+    if (S_ISDIR(mode)) {
+        archive_entry_set_filetype (entry, AE_IFDIR);
+        archive_entry_set_perm (entry, 0755);
+    } else {
+        archive_entry_set_mode (entry, mode);
+        archive_entry_set_size (entry, size);
+    }
+    archive_entry_set_mtime (entry, data->mtime, 0);
+
+    if (archive_write_header (data->a, entry) != ARCHIVE_OK) {
+        syncw_warning ("archive_write_header  error: %s\n", archive_error_string(data->a));
+        ret = -1;
+    }
+
+    archive_entry_free (entry);
+    g_free (name);
+    return ret;
+}
+
+static int
+write_entry_data (PackDirData *data, const char *buf, int len)
+{
+    if (data->zs)
+        return zip_stream_write (data->zs, buf, len);
+
+    if (archive_write_data (data->a, buf, len) <= 0) {
+        syncw_warning ("archive_write_data error: %s\n", archive_error_string(data->a));
+        return -1;
+    }
+    return 0;
+}
+
+static int
+finish_entry (PackDirData *data)
+{
+    if (data->zs)
+        return zip_stream_end_file (data->zs);
+    return 0;
+}
+
 static int
 add_file_to_archive (PackDirData *data,
                      const char *parent_dir,
                      SyncwDirent *dent)
 {
-    struct archive *a = data->a;
     struct SyncwerkCrypt *crypt = data->crypt;
-    gboolean is_windows = data->is_windows;
     const char *top_dir_name = data->top_dir_name;
     
-    struct archive_entry *entry = NULL;
     Syncwerk *file = NULL;
     char *pathname = NULL;
     char buf[64 * 1024];
-    int len = 0;
     int n = 0;
     int idx = 0;
     BlockHandle *handle = NULL;
@@ -102,34 +192,9 @@ add_file_to_archive (PackDirData *data,
         goto out;
     }
 
-    entry = archive_entry_new ();
-
-    /* File name fixup for WinRAR */
-    if (is_windows && syncw->http_server->windows_encoding) {
-        char *win_file_name = do_iconv ("UTF-8",
-                                        syncw->http_server->windows_encoding,
-                                        pathname);
-        if (!win_file_name) {
-            syncw_warning ("Failed to convert file name to %s\n",
-                          syncw->http_server->windows_encoding);
-            ret = -1;
-            goto out;
-        }
-        archive_entry_copy_pathname (entry, win_file_name);
-        g_free (win_file_name);
-
-    } else {
-        archive_entry_set_pathname (entry, pathname);
-    }
-
     /* FIXME: 0644 should be set when upload files in repo-mgr.c */
-    archive_entry_set_mode (entry, dent->mode | 0644);
-    archive_entry_set_size (entry, file->file_size);
-    archive_entry_set_mtime (entry, data->mtime, 0);
-
-    n = archive_write_header (a, entry);
-    if (n != ARCHIVE_OK) {
-        syncw_warning ("archive_write_header  error: %s\n", archive_error_string(a));
+    if (write_entry_header (data, pathname, dent->mode | 0644,
+                            file->file_size) < 0) {
         ret = -1;
         goto out;
     }
@@ -180,9 +245,7 @@ add_file_to_archive (PackDirData *data,
             /* OK, We're read some data of this block  */
             if (crypt == NULL) {
                 /* not encrypted */
-                len = archive_write_data (a, buf, n);
-                if (len <= 0) {
-                    syncw_warning ("archive_write_data error: %s\n", archive_error_string(a));
+                if (write_entry_data (data, buf, n) < 0) {
                     ret = -1;
                     goto out;
                 }
@@ -210,9 +273,7 @@ add_file_to_archive (PackDirData *data,
                 }
 
                 if (dec_out_len > 0) {
-                    len = archive_write_data (a, dec_out, dec_out_len);
-                    if (len <= 0) {
-                        syncw_warning ("archive_write_data error: %s\n", archive_error_string(a));
+                    if (write_entry_data (data, dec_out, dec_out_len) < 0) {
                         ret = -1;
                         goto out;
                     }
@@ -231,9 +292,7 @@ add_file_to_archive (PackDirData *data,
                     }
 
                     if (dec_out_len != 0) {
-                        len = archive_write_data (a, dec_out, dec_out_len);
-                        if (len <= 0) {
-                            syncw_warning ("archive_write_data error: %s\n", archive_error_string(a));
+                        if (write_entry_data (data, dec_out, dec_out_len) < 0) {
                             ret = -1;
                             goto out;
                         }
@@ -253,10 +312,10 @@ add_file_to_archive (PackDirData *data,
         idx++;
     }
 
+    ret = finish_entry (data);
+
 out:
     g_free (pathname);
-    if (entry)
-        archive_entry_free (entry);
     if (file)
         syncwerk_unref (file);
     if (handle) {
@@ -291,36 +350,8 @@ archive_dir (PackDirData *data,
     }
     if (!dir->entries) {
         char *pathname = g_build_filename (data->top_dir_name, dirpath, NULL);
-        struct archive_entry *entry = archive_entry_new ();
-        gboolean is_windows = data->is_windows;
-
-        if (is_windows && syncw->http_server->windows_encoding) {
-            char *win_file_name = do_iconv ("UTF-8",
-                    syncw->http_server->windows_encoding,
-                    pathname);
-            if (!win_file_name) {
-                syncw_warning ("Failed to convert file name to %s\n",
-                              syncw->http_server->windows_encoding);
-                ret = -1;
-                goto out;
-            }
-            archive_entry_copy_pathname (entry, win_file_name);
-            g_free (win_file_name);
-
-        } else {
-            archive_entry_set_pathname (entry, pathname);
-        }
 
-        archive_entry_set_filetype (entry, AE_IFDIR);
-        archive_entry_set_mtime (entry, data->mtime, 0);
-        archive_entry_set_perm (entry, 0755);
-        int n = archive_write_header (data->a, entry);
-        if (n != ARCHIVE_OK) {
-            syncw_warning ("archive_write_header  error: %s\n", archive_error_string(data->a));
-            ret = -1;
-        }
-
-        archive_entry_free (entry);
+        ret = write_entry_header (data, pathname, S_IFDIR | 0755, 0);
         g_free (pathname);
         goto out;
     }
@@ -338,7 +369,7 @@ archive_dir (PackDirData *data,
                 g_atomic_int_inc (&progress->zipped);
             }
         } else if (S_ISLNK(dent->mode)) {
-            if (archive_version_number() >= 3000001) {
+            if (data->zs || archive_version_number() >= 3000001) {
                 /* Symlink in zip arhive is not supported in earlier version
                  * of libarchive */
                 ret = add_file_to_archive (data, dirpath, dent);
@@ -430,27 +461,14 @@ archive_multi (PackDirData *data, GList *dirent_list,
     return 0;
 }
 
-int
-pack_files (const char *store_id,
-            int repo_version,
-            const char *dirname,
-            void *internal,
-            SyncwerkCrypt *crypt,
-            gboolean is_windows,
-            Progress *progress)
+static int
+archive_files (PackDirData *data,
+               const char *store_id,
+               const char *dirname,
+               void *internal,
+               Progress *progress)
 {
     int ret = 0;
-    PackDirData *data = NULL;
-
-    data = pack_dir_data_new (store_id, repo_version, dirname,
-                              crypt, is_windows);
-    if (!data) {
-        syncw_warning ("Failed to create pack dir data for %s.\n",
-                      strcmp (dirname, "")==0 ? "multi files" : dirname);
-        return -1;
-    }
-
-    progress->zip_file_path = data->tmp_zip_file;
 
     if (strcmp (dirname, "") != 0) {
         // Pack dir
@@ -472,6 +490,33 @@ pack_files (const char *store_id,
         }
     }
 
+    return ret;
+}
+
+int
+pack_files (const char *store_id,
+            int repo_version,
+            const char *dirname,
+            void *internal,
+            SyncwerkCrypt *crypt,
+            gboolean is_windows,
+            Progress *progress)
+{
+    int ret = 0;
+    PackDirData *data = NULL;
+
+    data = pack_dir_data_new (store_id, repo_version, dirname,
+                              crypt, is_windows);
+    if (!data) {
+        syncw_warning ("Failed to create pack dir data for %s.\n",
+                      strcmp (dirname, "")==0 ? "multi files" : dirname);
+        return -1;
+    }
+
+    progress->zip_file_path = data->tmp_zip_file;
+
+    ret = archive_files (data, store_id, dirname, internal, progress);
+
     if (archive_write_finish(data->a) < 0) {
         syncw_warning ("Failed to archive write finish for %s in repo %.8s.\n",
                       strcmp (dirname, "")==0 ? "multi files" : dirname, store_id);
@@ -483,3 +528,32 @@ pack_files (const char *store_id,
 
     return ret;
 }
+
+int
+pack_files_to_stream (const char *store_id,
+                      int repo_version,
+                      const char *dirname,
+                      void *internal,
+                      SyncwerkCrypt *crypt,
+                      gboolean is_windows,
+                      Progress *progress,
+                      ZipStream *zs)
+{
+    PackDirData data;
+    int ret;
+
+    memset (&data, 0, sizeof(data));
+    data.zs = zs;
+    data.crypt = crypt;
+    data.is_windows = is_windows;
+    data.top_dir_name = dirname;
+    data.mtime = time(NULL);
+    memcpy (data.store_id, store_id, 36);
+    data.repo_version = repo_version;
+
+    ret = archive_files (&data, store_id, dirname, internal, progress);
+    if (ret == 0)
+        ret = zip_stream_finish (zs);
+
+    return ret;
+}
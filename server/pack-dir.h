@@ -1,6 +1,8 @@
 #ifndef PACK_DIR_H
 #define PACK_DIR_H
 
+#include "zip-stream.h"
+
 /* Pack a syncwerk directory to a zipped archive, saved in a temporary file.
    Return the path of this temporary file.
  */
@@ -11,6 +13,12 @@ typedef struct Progress {
     char *zip_file_path;
     gint64 expire_ts;
     gboolean canceled;
+    /* The archive is packed while it's downloaded, see zip-stream.h. */
+    gboolean streaming;
+    /* The task to run when the download starts. */
+    void *stream_obj;
+    /* Set when the archive is kept in the zip cache, see zip-cache.h. */
+    struct ZipCacheEntry *cache_entry;
 } Progress;
 
 int
@@ -22,4 +30,15 @@ pack_files (const char *store_id,
             gboolean is_windows,
             Progress *progress);
 
+/* Like pack_files(), but the archive is written to @zs while it's packed. */
+int
+pack_files_to_stream (const char *store_id,
+                      int repo_version,
+                      const char *dirname,
+                      void *internal,
+                      SyncwerkCrypt *crypt,
+                      gboolean is_windows,
+                      Progress *progress,
+                      ZipStream *zs);
+
 #endif
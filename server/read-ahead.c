@@ -0,0 +1,500 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#define DEBUG_FLAG SYNCWERK_DEBUG_HTTP
+#include "log.h"
+
+#include "utils.h"
+
+#include "syncwerk-session.h"
+#include "read-ahead.h"
+
+#define READ_AHEAD_THREADS 8
+#define READ_AHEAD_BUF_SIZE (256 * 1024)
+/* Buffers in flight per download. Reading resumes at half of it. */
+#define READ_AHEAD_BUFS 8
+/* Free buffers kept for reuse, the rest are returned to the system. */
+#define READ_AHEAD_POOL_SIZE 64
+/* Buffers in flight across all downloads, 128MB. */
+#define READ_AHEAD_MAX_BUFS 512
+/* Decryption may output up to a cipher block more than its input. */
+#define CRYPT_SLACK 32
+
+extern SyncwerkSession *syncw;
+
+typedef struct ReadAheadBuf {
+    ReadAhead *ra;
+    int len;
+    char data[READ_AHEAD_BUF_SIZE];
+} ReadAheadBuf;
+
+/*
+ * Referenced by the sender until it stops, by the reading task while it's
+ * queued or running, and by every buffer in flight.
+ */
+struct ReadAhead {
+    gint refcnt;
+
+    pthread_mutex_t lock;
+    GQueue *ready;
+    int n_bufs;
+    gboolean reading;
+    gboolean stopped;
+    gboolean failed;
+    gboolean done;
+
+    /* Tells the sender that there's something to fetch. */
+    ThreadWaker *waker;
+    ThreadWakerFunc notify;
+    void *notify_data;
+    gint notify_pending;
+
+    /* Only used by the reading task. */
+    char store_id[37];
+    int version;
+    char **blk_ids;
+    int n_blocks;
+    SyncwerkCrypt *crypt;
+    int blk_idx;
+    BlockHandle *handle;
+    guint32 remain;
+    /* Reused for every block of the download. */
+    EVP_CIPHER_CTX *ctx;
+    char *crypt_buf;
+};
+
+static GThreadPool *read_pool;
+
+/* Protects free_bufs, n_used_bufs and deferred. */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static GQueue free_bufs = G_QUEUE_INIT;
+static int n_used_bufs;
+/* Reading tasks waiting for a buffer, each with the task's reference. */
+static GQueue deferred = G_QUEUE_INIT;
+
+/* Called with pool_lock held. */
+static void
+resume_deferred (void)
+{
+    ReadAhead *ra;
+
+    if (n_used_bufs >= READ_AHEAD_MAX_BUFS)
+        return;
+
+    ra = g_queue_pop_head (&deferred);
+    if (ra)
+        g_thread_pool_push (read_pool, ra, NULL);
+}
+
+/*
+ * Returns NULL if all buffers are in use. The reading task is then
+ * deferred, and pushed to the pool again once a buffer is put back.
+ */
+static ReadAheadBuf *
+get_buf (ReadAhead *ra)
+{
+    ReadAheadBuf *buf;
+
+    pthread_mutex_lock (&pool_lock);
+    if (n_used_bufs >= READ_AHEAD_MAX_BUFS) {
+        g_queue_push_tail (&deferred, ra);
+        pthread_mutex_unlock (&pool_lock);
+        return NULL;
+    }
+    ++n_used_bufs;
+    buf = g_queue_pop_head (&free_bufs);
+    pthread_mutex_unlock (&pool_lock);
+
+    if (!buf)
+        buf = g_new (ReadAheadBuf, 1);
+    buf->ra = ra;
+    buf->len = 0;
+    g_atomic_int_inc (&ra->refcnt);
+
+    return buf;
+}
+
+static void
+put_buf (ReadAheadBuf *buf)
+{
+    pthread_mutex_lock (&pool_lock);
+    --n_used_bufs;
+    if (free_bufs.length < READ_AHEAD_POOL_SIZE) {
+        g_queue_push_head (&free_bufs, buf);
+        buf = NULL;
+    }
+    resume_deferred ();
+    pthread_mutex_unlock (&pool_lock);
+
+    g_free (buf);
+}
+
+static void
+close_block (ReadAhead *ra)
+{
+    if (ra->handle) {
+        syncw_block_manager_close_block (syncw->block_mgr, ra->handle);
+        syncw_block_manager_block_handle_free (syncw->block_mgr, ra->handle);
+        ra->handle = NULL;
+    }
+}
+
+static void
+read_ahead_unref (ReadAhead *ra)
+{
+    if (!g_atomic_int_dec_and_test (&ra->refcnt))
+        return;
+
+    close_block (ra);
+    if (ra->ctx)
+        EVP_CIPHER_CTX_free (ra->ctx);
+    g_queue_free (ra->ready);
+    pthread_mutex_destroy (&ra->lock);
+    g_strfreev (ra->blk_ids);
+    g_free (ra->crypt);
+    g_free (ra->crypt_buf);
+    g_free (ra);
+}
+
+/* Called with ra->lock held. */
+static void
+schedule_read (ReadAhead *ra)
+{
+    if (ra->reading || ra->stopped || ra->failed || ra->done ||
+        ra->n_bufs > READ_AHEAD_BUFS / 2)
+        return;
+
+    ra->reading = TRUE;
+    g_atomic_int_inc (&ra->refcnt);
+
+    /* Don't take up a reading thread while all buffers are in use. */
+    pthread_mutex_lock (&pool_lock);
+    if (n_used_bufs >= READ_AHEAD_MAX_BUFS)
+        g_queue_push_tail (&deferred, ra);
+    else
+        g_thread_pool_push (read_pool, ra, NULL);
+    pthread_mutex_unlock (&pool_lock);
+}
+
+static void
+release_buf (ReadAheadBuf *buf)
+{
+    ReadAhead *ra = buf->ra;
+
+    pthread_mutex_lock (&ra->lock);
+    --ra->n_bufs;
+    schedule_read (ra);
+    pthread_mutex_unlock (&ra->lock);
+
+    put_buf (buf);
+    read_ahead_unref (ra);
+}
+
+/* Called when the output buffer has drained the data of @extra. */
+static void
+buf_cleanup_cb (const void *data, size_t len, void *extra)
+{
+    release_buf (extra);
+}
+
+/* Called in the sender's thread. */
+static void
+notify_cb (void *data)
+{
+    ReadAhead *ra = data;
+    gboolean stopped;
+
+    /* Buffers pushed from now on notify again. */
+    g_atomic_int_set (&ra->notify_pending, 0);
+
+    pthread_mutex_lock (&ra->lock);
+    stopped = ra->stopped;
+    pthread_mutex_unlock (&ra->lock);
+
+    if (!stopped)
+        ra->notify (ra->notify_data);
+
+    read_ahead_unref (ra);
+}
+
+static void
+notify_sender (ReadAhead *ra)
+{
+    if (!g_atomic_int_compare_and_exchange (&ra->notify_pending, 0, 1))
+        return;
+
+    g_atomic_int_inc (&ra->refcnt);
+    thread_waker_post (ra->waker, notify_cb, ra);
+}
+
+static int
+open_block (ReadAhead *ra)
+{
+    const char *blk_id = ra->blk_ids[ra->blk_idx];
+    BlockMetadata *bmd;
+
+    ra->handle = syncw_block_manager_open_block (syncw->block_mgr,
+                                                ra->store_id, ra->version,
+                                                blk_id, BLOCK_READ);
+    if (!ra->handle) {
+        syncw_warning ("Failed to open block %s:%s\n", ra->store_id, blk_id);
+        return -1;
+    }
+
+    bmd = syncw_block_manager_stat_block_by_handle (syncw->block_mgr,
+                                                   ra->handle);
+    if (!bmd) {
+        syncw_warning ("Failed to stat block %s:%s\n", ra->store_id, blk_id);
+        return -1;
+    }
+    ra->remain = bmd->size;
+    g_free (bmd);
+
+    if (ra->crypt && ra->ctx) {
+        if (syncwerk_decrypt_restart (ra->ctx,
+                                     (unsigned char *)ra->crypt->iv) < 0) {
+            syncw_warning ("Failed to init decrypt.\n");
+            return -1;
+        }
+    } else if (ra->crypt) {
+        if (syncwerk_decrypt_init (&ra->ctx,
+                                  ra->crypt->version,
+                                  (unsigned char *)ra->crypt->key,
+                                  (unsigned char *)ra->crypt->iv) < 0) {
+            syncw_warning ("Failed to init decrypt.\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+read_full (ReadAhead *ra, char *buf, int len)
+{
+    int n, done = 0;
+
+    while (done < len) {
+        n = syncw_block_manager_read_block (syncw->block_mgr, ra->handle,
+                                           buf + done, len - done);
+        if (n <= 0) {
+            syncw_warning ("Error when reading from block %s:%s.\n",
+                          ra->store_id, ra->blk_ids[ra->blk_idx]);
+            return -1;
+        }
+        done += n;
+    }
+
+    return 0;
+}
+
+/* Fill @buf from the current position, opening blocks as needed. */
+static int
+fill_buf (ReadAhead *ra, ReadAheadBuf *buf)
+{
+    int len, out_len;
+    char *out;
+
+    while (ra->blk_idx < ra->n_blocks &&
+           buf->len + CRYPT_SLACK < READ_AHEAD_BUF_SIZE) {
+        if (!ra->handle && open_block (ra) < 0)
+            return -1;
+
+        len = MIN (READ_AHEAD_BUF_SIZE - CRYPT_SLACK - buf->len, ra->remain);
+        out = buf->data + buf->len;
+
+        if (!ra->crypt) {
+            if (read_full (ra, out, len) < 0)
+                return -1;
+            buf->len += len;
+        } else {
+            if (read_full (ra, ra->crypt_buf, len) < 0)
+                return -1;
+            if (EVP_DecryptUpdate (ra->ctx, (unsigned char *)out, &out_len,
+                                   (unsigned char *)ra->crypt_buf, len) == 0) {
+                syncw_warning ("Decrypt block %s:%s failed.\n",
+                              ra->store_id, ra->blk_ids[ra->blk_idx]);
+                return -1;
+            }
+            buf->len += out_len;
+        }
+        ra->remain -= len;
+
+        if (ra->remain > 0)
+            continue;
+
+        /* Decrypt the possible partial cipher block at the end. */
+        if (ra->crypt) {
+            if (EVP_DecryptFinal_ex (ra->ctx,
+                                     (unsigned char *)buf->data + buf->len,
+                                     &out_len) == 0) {
+                syncw_warning ("Decrypt block %s:%s failed.\n",
+                              ra->store_id, ra->blk_ids[ra->blk_idx]);
+                return -1;
+            }
+            buf->len += out_len;
+        }
+        close_block (ra);
+        ++ra->blk_idx;
+    }
+
+    return 0;
+}
+
+static void
+read_ahead_thread (gpointer data, gpointer user_data)
+{
+    ReadAhead *ra = data;
+    ReadAheadBuf *buf;
+    gboolean failed, notify;
+
+    while (1) {
+        pthread_mutex_lock (&ra->lock);
+        if (ra->stopped || ra->n_bufs >= READ_AHEAD_BUFS) {
+            ra->reading = FALSE;
+            pthread_mutex_unlock (&ra->lock);
+
+            /* A resumed task may not take the buffer it was woken for. */
+            pthread_mutex_lock (&pool_lock);
+            resume_deferred ();
+            pthread_mutex_unlock (&pool_lock);
+            break;
+        }
+        ++ra->n_bufs;
+        pthread_mutex_unlock (&ra->lock);
+
+        buf = get_buf (ra);
+        if (!buf) {
+            /* Still reading, the deferred task keeps its reference. */
+            pthread_mutex_lock (&ra->lock);
+            --ra->n_bufs;
+            pthread_mutex_unlock (&ra->lock);
+            return;
+        }
+        failed = (fill_buf (ra, buf) < 0);
+
+        pthread_mutex_lock (&ra->lock);
+        if (failed)
+            ra->failed = TRUE;
+        else if (ra->blk_idx == ra->n_blocks)
+            ra->done = TRUE;
+        if (!ra->stopped && buf->len > 0) {
+            g_queue_push_tail (ra->ready, buf);
+            buf = NULL;
+        }
+        if (ra->failed || ra->done)
+            ra->reading = FALSE;
+        notify = (!buf || ra->failed || ra->done);
+        pthread_mutex_unlock (&ra->lock);
+
+        if (buf)
+            release_buf (buf);
+        if (notify)
+            notify_sender (ra);
+        if (failed || ra->blk_idx == ra->n_blocks)
+            break;
+    }
+
+    read_ahead_unref (ra);
+}
+
+int
+read_ahead_init (void)
+{
+    if (read_pool)
+        return 0;
+
+    read_pool = g_thread_pool_new (read_ahead_thread, NULL,
+                                   READ_AHEAD_THREADS, FALSE, NULL);
+    if (!read_pool) {
+        syncw_warning ("Failed to create read ahead thread pool.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+ReadAhead *
+read_ahead_start (const char *store_id, int version,
+                  char **blk_ids, int n_blocks,
+                  SyncwerkCrypt *crypt,
+                  ThreadWaker *waker,
+                  ThreadWakerFunc notify, void *notify_data)
+{
+    ReadAhead *ra = g_new0 (ReadAhead, 1);
+    int i;
+
+    ra->refcnt = 1;
+    pthread_mutex_init (&ra->lock, NULL);
+    ra->ready = g_queue_new ();
+    ra->waker = waker;
+    ra->notify = notify;
+    ra->notify_data = notify_data;
+
+    memcpy (ra->store_id, store_id, 36);
+    ra->version = version;
+    ra->n_blocks = n_blocks;
+    ra->blk_ids = g_new0 (char *, n_blocks + 1);
+    for (i = 0; i < n_blocks; ++i)
+        ra->blk_ids[i] = g_strdup (blk_ids[i]);
+    if (crypt) {
+        ra->crypt = g_memdup (crypt, sizeof(SyncwerkCrypt));
+        ra->crypt_buf = g_malloc (READ_AHEAD_BUF_SIZE);
+    }
+    if (n_blocks == 0)
+        ra->done = TRUE;
+
+    pthread_mutex_lock (&ra->lock);
+    schedule_read (ra);
+    pthread_mutex_unlock (&ra->lock);
+
+    return ra;
+}
+
+int
+read_ahead_fetch (ReadAhead *ra, struct evbuffer *out)
+{
+    ReadAheadBuf *buf;
+    int ret;
+
+    pthread_mutex_lock (&ra->lock);
+
+    /* Buffers are released by buf_cleanup_cb(), not here. */
+    while ((buf = g_queue_pop_head (ra->ready)) != NULL)
+        evbuffer_add_reference (out, buf->data, buf->len, buf_cleanup_cb, buf);
+
+    if (ra->failed)
+        ret = -1;
+    else if (ra->done)
+        ret = 1;
+    else
+        ret = 0;
+
+    pthread_mutex_unlock (&ra->lock);
+
+    return ret;
+}
+
+void
+read_ahead_stop (ReadAhead *ra)
+{
+    ReadAheadBuf *buf;
+    GList *ready = NULL;
+    GList *ptr;
+
+    pthread_mutex_lock (&ra->lock);
+    ra->stopped = TRUE;
+    while ((buf = g_queue_pop_head (ra->ready)) != NULL)
+        ready = g_list_prepend (ready, buf);
+    pthread_mutex_unlock (&ra->lock);
+
+    /* Each buffer takes the lock to give itself back. */
+    for (ptr = ready; ptr; ptr = ptr->next)
+        release_buf (ptr->data);
+    g_list_free (ready);
+
+    read_ahead_unref (ra);
+}
@@ -0,0 +1,54 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef READ_AHEAD_H
+#define READ_AHEAD_H
+
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <event2/buffer.h>
+#else
+#include <event.h>
+#endif
+
+#include "syncwerk-crypt.h"
+#include "thread-waker.h"
+
+/*
+ * Reads the blocks of a file ahead of the http worker thread that sends it.
+ *
+ * Blocks are read, and decrypted if needed, by a small pool of I/O threads.
+ * Each download has a few fixed size buffers in flight, counting those that
+ * are read and those that are queued in the connection's output buffer.
+ * A buffer goes back to the pool once the socket has taken its data, which
+ * lets the I/O threads read the next one. The buffers of all downloads
+ * have a common limit, downloads wait for each other once it's reached.
+ */
+
+typedef struct ReadAhead ReadAhead;
+
+int
+read_ahead_init (void);
+
+/*
+ * Start reading @n_blocks blocks in order. @blk_ids and @crypt are copied,
+ * @crypt may be NULL. @notify is called with @notify_data in the thread of
+ * @waker when data is ready or reading has ended, until reading is stopped.
+ */
+ReadAhead *
+read_ahead_start (const char *store_id, int version,
+                  char **blk_ids, int n_blocks,
+                  SyncwerkCrypt *crypt,
+                  ThreadWaker *waker,
+                  ThreadWakerFunc notify, void *notify_data);
+
+/*
+ * Move the data that's ready into @out without copying. Returns 1 when all
+ * data has been moved, -1 if reading failed, 0 otherwise.
+ */
+int
+read_ahead_fetch (ReadAhead *ra, struct evbuffer *out);
+
+/* Stop reading. Buffers already moved out stay valid until drained. */
+void
+read_ahead_stop (ReadAhead *ra);
+
+#endif
@@ -0,0 +1,238 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Lookup throughput of ShardedCache against a cache behind a single lock,
+ * as the http server's token and permission caches used to be, with
+ * 1 to max_threads threads. Like the http server, a thread keeps removing
+ * expired entries while the others look up.
+ *
+ * Usage: sharded-cache-bench [max_threads] [seconds_per_run]
+ */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "sharded-cache.h"
+
+#define N_KEYS 10000
+/* One lookup in this many inserts the key again, like a cache miss. */
+#define INSERT_INTERVAL 64
+#define EXPIRE_INTERVAL_USEC 10000
+
+typedef struct CacheEntry {
+    char *value;
+    gint64 expire_time;
+} CacheEntry;
+
+typedef struct SingleLockCache {
+    pthread_mutex_t lock;
+    GHashTable *entries;
+} SingleLockCache;
+
+typedef struct BenchCache {
+    gboolean (*lookup) (void *cache, const char *key, char **value);
+    void (*insert) (void *cache, const char *key, const char *value);
+    void (*remove_expired) (void *cache);
+    void *cache;
+} BenchCache;
+
+typedef struct Worker {
+    pthread_t thread;
+    BenchCache *bc;
+    unsigned int seed;
+    guint64 n_ops;
+} Worker;
+
+static char *keys[N_KEYS];
+static volatile gint stop;
+
+static void
+cache_entry_free (gpointer data)
+{
+    CacheEntry *entry = data;
+
+    g_free (entry->value);
+    g_free (entry);
+}
+
+static gboolean
+single_lock_lookup (void *cache, const char *key, char **value)
+{
+    SingleLockCache *slc = cache;
+    CacheEntry *entry;
+    gboolean ret = FALSE;
+
+    pthread_mutex_lock (&slc->lock);
+    entry = g_hash_table_lookup (slc->entries, key);
+    if (entry && entry->expire_time > (gint64)time(NULL)) {
+        *value = g_strdup (entry->value);
+        ret = TRUE;
+    }
+    pthread_mutex_unlock (&slc->lock);
+
+    return ret;
+}
+
+static void
+single_lock_insert (void *cache, const char *key, const char *value)
+{
+    SingleLockCache *slc = cache;
+    CacheEntry *entry = g_new0 (CacheEntry, 1);
+
+    entry->value = g_strdup (value);
+    entry->expire_time = (gint64)time(NULL) + 3600;
+
+    pthread_mutex_lock (&slc->lock);
+    g_hash_table_replace (slc->entries, g_strdup (key), entry);
+    pthread_mutex_unlock (&slc->lock);
+}
+
+static void
+single_lock_remove_expired (void *cache)
+{
+    SingleLockCache *slc = cache;
+    GHashTableIter iter;
+    gpointer key, value;
+    gint64 now = (gint64)time(NULL);
+
+    /* The whole table is scanned under the lock. */
+    pthread_mutex_lock (&slc->lock);
+    g_hash_table_iter_init (&iter, slc->entries);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (((CacheEntry *)value)->expire_time <= now)
+            g_hash_table_iter_remove (&iter);
+    }
+    pthread_mutex_unlock (&slc->lock);
+}
+
+static void
+copy_value (gpointer value, gpointer user_data)
+{
+    *(char **)user_data = g_strdup (value);
+}
+
+static gboolean
+sharded_lookup (void *cache, const char *key, char **value)
+{
+    return sharded_cache_lookup (cache, key, 0, copy_value, value);
+}
+
+static void
+sharded_insert (void *cache, const char *key, const char *value)
+{
+    sharded_cache_insert (cache, key, g_strdup (value),
+                          (gint64)time(NULL) + 3600);
+}
+
+static void
+sharded_remove_expired (void *cache)
+{
+    sharded_cache_remove_expired (cache);
+}
+
+static void *
+worker_thread (void *arg)
+{
+    Worker *w = arg;
+    const char *key;
+    char *value;
+
+    while (!g_atomic_int_get (&stop)) {
+        key = keys[rand_r (&w->seed) % N_KEYS];
+        value = NULL;
+        if (!w->bc->lookup (w->bc->cache, key, &value) ||
+            w->n_ops % INSERT_INTERVAL == 0)
+            w->bc->insert (w->bc->cache, key, "user@example.com");
+        g_free (value);
+        ++w->n_ops;
+    }
+
+    return NULL;
+}
+
+static void *
+expire_thread (void *arg)
+{
+    BenchCache *bc = arg;
+
+    while (!g_atomic_int_get (&stop)) {
+        bc->remove_expired (bc->cache);
+        g_usleep (EXPIRE_INTERVAL_USEC);
+    }
+
+    return NULL;
+}
+
+/* Returns lookups per second. */
+static double
+run (BenchCache *bc, int n_threads, int seconds)
+{
+    Worker *workers = g_new0 (Worker, n_threads);
+    pthread_t expirer;
+    gint64 start, elapsed;
+    guint64 n_ops = 0;
+    int i;
+
+    g_atomic_int_set (&stop, 0);
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < n_threads; ++i) {
+        workers[i].bc = bc;
+        workers[i].seed = i + 1;
+        pthread_create (&workers[i].thread, NULL, worker_thread, &workers[i]);
+    }
+    pthread_create (&expirer, NULL, expire_thread, bc);
+
+    g_usleep ((gulong)seconds * G_USEC_PER_SEC);
+    g_atomic_int_set (&stop, 1);
+
+    for (i = 0; i < n_threads; ++i) {
+        pthread_join (workers[i].thread, NULL);
+        n_ops += workers[i].n_ops;
+    }
+    pthread_join (expirer, NULL);
+    elapsed = g_get_monotonic_time () - start;
+
+    g_free (workers);
+
+    return (double)n_ops * G_USEC_PER_SEC / elapsed;
+}
+
+int
+main (int argc, char **argv)
+{
+    int max_threads = argc > 1 ? atoi (argv[1]) : 64;
+    int seconds = argc > 2 ? atoi (argv[2]) : 2;
+    SingleLockCache slc;
+    BenchCache single = { single_lock_lookup, single_lock_insert,
+                          single_lock_remove_expired, &slc };
+    BenchCache sharded = { sharded_lookup, sharded_insert,
+                           sharded_remove_expired, NULL };
+    double single_ops, sharded_ops;
+    int i, n_threads;
+
+    if (max_threads <= 0 || seconds <= 0) {
+        fprintf (stderr, "Usage: %s [max_threads] [seconds_per_run]\n", argv[0]);
+        return 1;
+    }
+
+    for (i = 0; i < N_KEYS; ++i)
+        keys[i] = g_strdup_printf ("%040x", i);
+
+    pthread_mutex_init (&slc.lock, NULL);
+    slc.entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, cache_entry_free);
+    sharded.cache = sharded_cache_new (g_free);
+
+    printf ("%8s %16s %16s %8s\n", "threads", "single-lock/s", "sharded/s", "speedup");
+    for (n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        single_ops = run (&single, n_threads, seconds);
+        sharded_ops = run (&sharded, n_threads, seconds);
+        printf ("%8d %16.0f %16.0f %7.2fx\n", n_threads,
+                single_ops, sharded_ops, sharded_ops / single_ops);
+        fflush (stdout);
+    }
+
+    return 0;
+}
@@ -0,0 +1,155 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "sharded-cache.h"
+
+/* Power of 2, well above the usual number of http worker threads. */
+#define N_SHARDS 64
+
+typedef struct CacheEntry {
+    gpointer value;
+    gint64 expire_time;
+} CacheEntry;
+
+typedef struct CacheShard {
+    pthread_mutex_t lock;
+    GHashTable *entries;
+} CacheShard;
+
+struct ShardedCache {
+    CacheShard shards[N_SHARDS];
+    GDestroyNotify value_free;
+};
+
+static void
+cache_entry_free (gpointer data, gpointer user_data)
+{
+    CacheEntry *entry = data;
+    GDestroyNotify value_free = user_data;
+
+    if (value_free)
+        value_free (entry->value);
+    g_free (entry);
+}
+
+static inline CacheShard *
+get_shard (ShardedCache *cache, const char *key)
+{
+    return &cache->shards[g_str_hash (key) & (N_SHARDS - 1)];
+}
+
+/* GHashTable can't pass user data to the value destroy function,
+ * so entries are freed explicitly.
+ */
+static void
+shard_remove (ShardedCache *cache, CacheShard *shard, const char *key)
+{
+    gpointer orig_key, value;
+
+    if (g_hash_table_lookup_extended (shard->entries, key, &orig_key, &value)) {
+        g_hash_table_steal (shard->entries, key);
+        g_free (orig_key);
+        cache_entry_free (value, cache->value_free);
+    }
+}
+
+ShardedCache *
+sharded_cache_new (GDestroyNotify value_free)
+{
+    ShardedCache *cache = g_new0 (ShardedCache, 1);
+    int i;
+
+    for (i = 0; i < N_SHARDS; ++i) {
+        pthread_mutex_init (&cache->shards[i].lock, NULL);
+        cache->shards[i].entries = g_hash_table_new (g_str_hash, g_str_equal);
+    }
+    cache->value_free = value_free;
+
+    return cache;
+}
+
+gboolean
+sharded_cache_lookup (ShardedCache *cache,
+                      const char *key,
+                      gint64 extend_time,
+                      ShardedCacheCopyFunc copy,
+                      gpointer user_data)
+{
+    CacheShard *shard = get_shard (cache, key);
+    CacheEntry *entry;
+    gint64 now = (gint64)time(NULL);
+    gboolean ret = FALSE;
+
+    pthread_mutex_lock (&shard->lock);
+
+    entry = g_hash_table_lookup (shard->entries, key);
+    if (entry && entry->expire_time > now) {
+        if (extend_time > 0)
+            entry->expire_time = now + extend_time;
+        if (copy)
+            copy (entry->value, user_data);
+        ret = TRUE;
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+
+    return ret;
+}
+
+void
+sharded_cache_insert (ShardedCache *cache,
+                      const char *key,
+                      gpointer value,
+                      gint64 expire_time)
+{
+    CacheShard *shard = get_shard (cache, key);
+    CacheEntry *entry = g_new0 (CacheEntry, 1);
+
+    entry->value = value;
+    entry->expire_time = expire_time;
+
+    pthread_mutex_lock (&shard->lock);
+    shard_remove (cache, shard, key);
+    g_hash_table_insert (shard->entries, g_strdup (key), entry);
+    pthread_mutex_unlock (&shard->lock);
+}
+
+void
+sharded_cache_remove (ShardedCache *cache, const char *key)
+{
+    CacheShard *shard = get_shard (cache, key);
+
+    pthread_mutex_lock (&shard->lock);
+    shard_remove (cache, shard, key);
+    pthread_mutex_unlock (&shard->lock);
+}
+
+void
+sharded_cache_remove_expired (ShardedCache *cache)
+{
+    CacheShard *shard;
+    GHashTableIter iter;
+    gpointer key, value;
+    CacheEntry *entry;
+    gint64 now = (gint64)time(NULL);
+    int i;
+
+    for (i = 0; i < N_SHARDS; ++i) {
+        shard = &cache->shards[i];
+
+        pthread_mutex_lock (&shard->lock);
+        g_hash_table_iter_init (&iter, shard->entries);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            entry = value;
+            if (entry->expire_time <= now) {
+                g_hash_table_iter_steal (&iter);
+                g_free (key);
+                cache_entry_free (entry, cache->value_free);
+            }
+        }
+        pthread_mutex_unlock (&shard->lock);
+    }
+}
@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SHARDED_CACHE_H
+#define SHARDED_CACHE_H
+
+#include <glib.h>
+
+/*
+ * A string keyed cache with expiring entries, shared by many threads.
+ * Keys are spread over shards, each with its own lock, so that threads
+ * looking up different keys rarely contend. Expired entries are never
+ * returned; they're freed by sharded_cache_remove_expired(), which only
+ * locks one shard at a time.
+ */
+
+typedef struct ShardedCache ShardedCache;
+
+/*
+ * Called with the shard locked, to copy what the caller needs out of
+ * @value. The value may be freed as soon as the shard is unlocked.
+ */
+typedef void (*ShardedCacheCopyFunc) (gpointer value, gpointer user_data);
+
+ShardedCache *
+sharded_cache_new (GDestroyNotify value_free);
+
+/*
+ * Returns TRUE if @key is in the cache and not expired. If @extend_time is
+ * positive, the entry is kept for another @extend_time seconds.
+ */
+gboolean
+sharded_cache_lookup (ShardedCache *cache,
+                      const char *key,
+                      gint64 extend_time,
+                      ShardedCacheCopyFunc copy,
+                      gpointer user_data);
+
+/* The cache takes ownership of @value. */
+void
+sharded_cache_insert (ShardedCache *cache,
+                      const char *key,
+                      gpointer value,
+                      gint64 expire_time);
+
+void
+sharded_cache_remove (ShardedCache *cache, const char *key);
+
+void
+sharded_cache_remove_expired (ShardedCache *cache);
+
+#endif
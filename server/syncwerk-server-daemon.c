@@ -22,6 +22,7 @@
 #include <ccnet/threaded-rpcserver-proc.h>
 #include "log.h"
 #include "utils.h"
+#include "http-metrics.h"
 
 #include "processors/check-tx-slave-v3-proc.h"
 #include "processors/recvfs-proc.h"
@@ -113,6 +114,13 @@ static void register_processors (CcnetClient *client)
 #include "rpcsyncwerk-signature.h"
 #include "rpcsyncwerk-marshal.h"
 
+/* Metrics live in the http server, so the rpc is defined here. */
+static char *
+get_http_metrics (GError **error)
+{
+    return http_metrics_to_json ();
+}
+
 static void start_rpc_service (CcnetClient *client, int cloud_mode)
 {
     rpcsyncwerk_server_init (register_marshals);
@@ -807,6 +815,11 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      "set_server_config_boolean",
                                      rpcsyncwerk_signature_int__string_string_int());
 
+    rpcsyncwerk_server_register_function ("syncwserv-threaded-rpcserver",
+                                     get_http_metrics,
+                                     "get_http_metrics",
+                                     rpcsyncwerk_signature_string__void());
+
 }
 
 static struct event sigusr1;
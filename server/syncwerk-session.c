@@ -192,6 +192,11 @@ syncwerk_session_init (SyncwerkSession *session)
     if (syncw_fs_manager_init (session->fs_mgr) < 0)
         return -1;
 
+    if (syncw_block_manager_enable_exist_index (session->block_mgr) < 0) {
+        syncw_warning ("Failed to create block index.\n");
+        return -1;
+    }
+
     if (syncw_branch_manager_init (session->branch_mgr) < 0) {
         syncw_warning ("Failed to init branch manager.\n");
         return -1;
@@ -215,6 +220,11 @@ syncwerk_session_init (SyncwerkSession *session)
 
     syncw_mq_manager_init (session->mq_mgr);
 
+    if (zip_download_mgr_init (session->zip_download_mgr) < 0) {
+        syncw_warning ("Failed to init zip download manager.\n");
+        return -1;
+    }
+
     return 0;
 }
 
@@ -0,0 +1,110 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "log.h"
+
+#include "thread-waker.h"
+
+typedef struct WakeCall {
+    ThreadWakerFunc func;
+    void *data;
+} WakeCall;
+
+struct ThreadWaker {
+    int fds[2];
+    struct event *read_event;
+
+    pthread_mutex_t lock;
+    GQueue calls;               /* WakeCall */
+    /* Whether a byte is already in the pipe for the queued calls. */
+    gboolean notified;
+};
+
+static pthread_once_t waker_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t waker_key;
+
+static void
+create_waker_key (void)
+{
+    if (pthread_key_create (&waker_key, NULL) != 0)
+        syncw_warning ("Failed to create thread waker key.\n");
+}
+
+static void
+waker_read_cb (evutil_socket_t fd, short what, void *arg)
+{
+    ThreadWaker *waker = arg;
+    GQueue calls = G_QUEUE_INIT;
+    WakeCall *call;
+    char buf[64];
+
+    while (read (fd, buf, sizeof(buf)) > 0)
+        ;
+
+    pthread_mutex_lock (&waker->lock);
+    calls = waker->calls;
+    g_queue_init (&waker->calls);
+    waker->notified = FALSE;
+    pthread_mutex_unlock (&waker->lock);
+
+    while ((call = g_queue_pop_head (&calls)) != NULL) {
+        call->func (call->data);
+        g_free (call);
+    }
+}
+
+ThreadWaker *
+thread_waker_get (struct event_base *evbase)
+{
+    ThreadWaker *waker;
+
+    pthread_once (&waker_key_once, create_waker_key);
+
+    waker = pthread_getspecific (waker_key);
+    if (waker)
+        return waker;
+
+    waker = g_new0 (ThreadWaker, 1);
+    if (pipe (waker->fds) < 0) {
+        syncw_warning ("Failed to create pipe: %s.\n", strerror (errno));
+        g_free (waker);
+        return NULL;
+    }
+    evutil_make_socket_nonblocking (waker->fds[0]);
+    evutil_make_socket_nonblocking (waker->fds[1]);
+    pthread_mutex_init (&waker->lock, NULL);
+    g_queue_init (&waker->calls);
+
+    waker->read_event = event_new (evbase, waker->fds[0], EV_READ | EV_PERSIST,
+                                   waker_read_cb, waker);
+    event_add (waker->read_event, NULL);
+
+    /* Worker threads never exit, so wakers are never freed. */
+    pthread_setspecific (waker_key, waker);
+
+    return waker;
+}
+
+void
+thread_waker_post (ThreadWaker *waker, ThreadWakerFunc func, void *data)
+{
+    WakeCall *call = g_new0 (WakeCall, 1);
+    gboolean notify;
+
+    call->func = func;
+    call->data = data;
+
+    pthread_mutex_lock (&waker->lock);
+    g_queue_push_tail (&waker->calls, call);
+    notify = !waker->notified;
+    waker->notified = TRUE;
+    pthread_mutex_unlock (&waker->lock);
+
+    if (notify && write (waker->fds[1], "x", 1) < 0 && errno != EAGAIN)
+        syncw_warning ("Failed to wake http worker: %s.\n", strerror (errno));
+}
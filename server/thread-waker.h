@@ -0,0 +1,39 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef THREAD_WAKER_H
+#define THREAD_WAKER_H
+
+#include <glib.h>
+
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+/*
+ * Runs callbacks in an http worker thread on behalf of other threads, e.g.
+ * to tell a paused request that the data it waits for is ready. Each worker
+ * thread has one pipe, watched by its event loop.
+ */
+
+typedef struct ThreadWaker ThreadWaker;
+
+typedef void (*ThreadWakerFunc) (void *data);
+
+/*
+ * The waker of the calling thread, whose event loop is @evbase. It's
+ * created on first use and never freed. Returns NULL on error.
+ */
+ThreadWaker *
+thread_waker_get (struct event_base *evbase);
+
+/*
+ * Have @func called with @data in the waker's thread, in the order of the
+ * calls. Can be called from any thread. The caller must keep @data alive
+ * until @func runs.
+ */
+void
+thread_waker_post (ThreadWaker *waker, ThreadWakerFunc func, void *data);
+
+#endif
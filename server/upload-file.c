@@ -26,6 +26,7 @@
 #include "upload-file.h"
 #include "http-status-codes.h"
 #include "http-server.h"
+#include "http-metrics.h"
 
 #include "syncwerk-error.h"
 
@@ -1767,6 +1768,9 @@ upload_finish_cb (evhtp_request_t *req, void *arg)
     RecvFSM *fsm = arg;
     GList *ptr;
 
+    /* This hook replaces the one of http metrics. */
+    http_metrics_request_fini (req);
+
     if (!fsm)
         return EVHTP_RES_OK;
 
@@ -2466,45 +2470,59 @@ upload_file_init (evhtp_t *htp, const char *http_temp_dir)
     cb = evhtp_set_regex_cb (htp, "^/upload/.*", upload_cb, NULL);
     /* upload_headers_cb() will be called after evhtp parsed all http headers. */
     evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    http_metrics_watch (cb, "upload");
 
     cb = evhtp_set_regex_cb (htp, "^/upload-api/.*", upload_api_cb, NULL);
     evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    http_metrics_watch (cb, "upload-api");
 
     cb = evhtp_set_regex_cb (htp, "^/upload-raw-blks-api/.*",
                              upload_raw_blks_api_cb, NULL);
     evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    http_metrics_watch (cb, "upload-raw-blks-api");
 
     cb = evhtp_set_regex_cb (htp, "^/upload-blks-api/.*", upload_blks_api_cb, NULL);
     evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    http_metrics_watch (cb, "upload-blks-api");
 
     /* cb = evhtp_set_regex_cb (htp, "^/upload-blks-aj/.*", upload_blks_ajax_cb, NULL); */
     /* evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL); */
 
     cb = evhtp_set_regex_cb (htp, "^/upload-aj/.*", upload_ajax_cb, NULL);
     evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    http_metrics_watch (cb, "upload-aj");
 
     cb = evhtp_set_regex_cb (htp, "^/update/.*", update_cb, NULL);
     evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    http_metrics_watch (cb, "update");
 
     cb = evhtp_set_regex_cb (htp, "^/update-api/.*", update_api_cb, NULL);
     evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    http_metrics_watch (cb, "update-api");
 
     cb = evhtp_set_regex_cb (htp, "^/update-blks-api/.*", update_blks_api_cb, NULL);
     evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    http_metrics_watch (cb, "update-blks-api");
 
     /* cb = evhtp_set_regex_cb (htp, "^/update-blks-aj/.*", update_blks_ajax_cb, NULL); */
     /* evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL); */
 
     cb = evhtp_set_regex_cb (htp, "^/update-aj/.*", update_ajax_cb, NULL);
     evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
+    http_metrics_watch (cb, "update-aj");
 
-    evhtp_set_regex_cb (htp, "^/upload_progress.*", upload_progress_cb, NULL);
+    cb = evhtp_set_regex_cb (htp, "^/upload_progress.*", upload_progress_cb, NULL);
+    http_metrics_watch (cb, "upload-progress");
 
-    evhtp_set_regex_cb (htp, "^/idx_progress.*", idx_progress_cb, NULL);
+    cb = evhtp_set_regex_cb (htp, "^/idx_progress.*", idx_progress_cb, NULL);
+    http_metrics_watch (cb, "idx-progress");
 
-    upload_progress = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                             g_free, g_free);
-    pthread_mutex_init (&pg_lock, NULL);
+    /* Called once for each acceptor loop. */
+    if (!upload_progress) {
+        upload_progress = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, g_free);
+        pthread_mutex_init (&pg_lock, NULL);
+    }
 
     return 0;
 }
@@ -0,0 +1,145 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#define DEBUG_FLAG SYNCWERK_DEBUG_HTTP
+#include "log.h"
+
+#include "web-file-cache.h"
+
+/*
+ * Referenced by the cache while it's not evicted, and by every output
+ * buffer that still holds its content.
+ */
+typedef struct CachedFile {
+    gint refcnt;
+    /* store_id/file_id */
+    char *key;
+    char *data;
+    gint64 len;
+    GList *lru_link;
+} CachedFile;
+
+struct WebFileCache {
+    gint64 max_bytes;
+    gint64 max_file_size;
+
+    pthread_mutex_t lock;
+    GHashTable *files;          /* key -> CachedFile */
+    GQueue *lru;                /* least recently used first */
+    gint64 n_bytes;
+};
+
+static void
+cached_file_unref (CachedFile *file)
+{
+    if (!g_atomic_int_dec_and_test (&file->refcnt))
+        return;
+
+    g_free (file->key);
+    g_free (file->data);
+    g_free (file);
+}
+
+static void
+cached_file_cleanup_cb (const void *data, size_t len, void *extra)
+{
+    cached_file_unref (extra);
+}
+
+static char *
+make_key (const char *store_id, const char *file_id)
+{
+    return g_strconcat (store_id, "/", file_id, NULL);
+}
+
+WebFileCache *
+web_file_cache_new (gint64 max_bytes, gint64 max_file_size)
+{
+    WebFileCache *cache = g_new0 (WebFileCache, 1);
+
+    cache->max_bytes = max_bytes;
+    cache->max_file_size = MIN (max_file_size, max_bytes);
+    pthread_mutex_init (&cache->lock, NULL);
+    cache->files = g_hash_table_new (g_str_hash, g_str_equal);
+    cache->lru = g_queue_new ();
+
+    return cache;
+}
+
+gboolean
+web_file_cache_can_hold (WebFileCache *cache, gint64 size)
+{
+    return size > 0 && size <= cache->max_file_size;
+}
+
+gboolean
+web_file_cache_get (WebFileCache *cache,
+                    const char *store_id, const char *file_id,
+                    struct evbuffer *out)
+{
+    char *key = make_key (store_id, file_id);
+    CachedFile *file;
+
+    pthread_mutex_lock (&cache->lock);
+    file = g_hash_table_lookup (cache->files, key);
+    if (file) {
+        g_atomic_int_inc (&file->refcnt);
+        g_queue_unlink (cache->lru, file->lru_link);
+        g_queue_push_tail_link (cache->lru, file->lru_link);
+    }
+    pthread_mutex_unlock (&cache->lock);
+
+    g_free (key);
+
+    if (!file)
+        return FALSE;
+
+    evbuffer_add_reference (out, file->data, file->len,
+                            cached_file_cleanup_cb, file);
+    return TRUE;
+}
+
+void
+web_file_cache_add (WebFileCache *cache,
+                    const char *store_id, const char *file_id,
+                    char *data, gint64 len)
+{
+    CachedFile *file, *old;
+
+    if (!web_file_cache_can_hold (cache, len)) {
+        g_free (data);
+        return;
+    }
+
+    file = g_new0 (CachedFile, 1);
+    file->refcnt = 1;
+    file->key = make_key (store_id, file_id);
+    file->data = data;
+    file->len = len;
+
+    pthread_mutex_lock (&cache->lock);
+
+    /* Another download of the same file may have added it meanwhile. */
+    if (g_hash_table_lookup (cache->files, file->key)) {
+        pthread_mutex_unlock (&cache->lock);
+        cached_file_unref (file);
+        return;
+    }
+
+    while (cache->n_bytes + len > cache->max_bytes) {
+        old = g_queue_pop_head (cache->lru);
+        g_hash_table_remove (cache->files, old->key);
+        cache->n_bytes -= old->len;
+        cached_file_unref (old);
+    }
+
+    g_hash_table_insert (cache->files, file->key, file);
+    g_queue_push_tail (cache->lru, file);
+    file->lru_link = cache->lru->tail;
+    cache->n_bytes += len;
+
+    pthread_mutex_unlock (&cache->lock);
+}
@@ -0,0 +1,43 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef WEB_FILE_CACHE_H
+#define WEB_FILE_CACHE_H
+
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <event2/buffer.h>
+#else
+#include <event.h>
+#endif
+
+/*
+ * In-memory LRU cache of small files served over the web, like previews
+ * viewed again and again. Files are keyed by store id and file id. File ids
+ * are content hashes, so entries never go stale and are only evicted to
+ * stay within the byte budget. The content is kept decrypted.
+ */
+
+typedef struct WebFileCache WebFileCache;
+
+WebFileCache *
+web_file_cache_new (gint64 max_bytes, gint64 max_file_size);
+
+/* Whether a file of @size bytes may be cached. */
+gboolean
+web_file_cache_can_hold (WebFileCache *cache, gint64 size);
+
+/*
+ * Add the content of the file to @out by reference, without copying.
+ * Returns FALSE if the file isn't cached.
+ */
+gboolean
+web_file_cache_get (WebFileCache *cache,
+                    const char *store_id, const char *file_id,
+                    struct evbuffer *out);
+
+/* @data is g_malloc()'ed and owned by the cache from now on. */
+void
+web_file_cache_add (WebFileCache *cache,
+                    const char *store_id, const char *file_id,
+                    char *data, gint64 len);
+
+#endif
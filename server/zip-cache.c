@@ -0,0 +1,300 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#define DEBUG_FLAG SYNCWERK_DEBUG_HTTP
+#include "log.h"
+
+#include "utils.h"
+
+#include "zip-cache.h"
+
+typedef enum ZipCacheState {
+    ZIP_CACHE_PACKING,
+    ZIP_CACHE_READY,
+    ZIP_CACHE_FAILED,
+} ZipCacheState;
+
+/*
+ * Owned by the cache while it's in the table, and referenced by every
+ * download and packing task that uses it. Only freed once it's out of the
+ * table and unreferenced.
+ */
+struct ZipCacheEntry {
+    ZipCache *cache;
+    int refcnt;
+    char *key;
+    char *path;
+    ZipCacheState state;
+    gint64 size;
+    gboolean in_cache;
+    /* Packed entries only. */
+    GList *lru_link;
+    Progress progress;
+};
+
+struct ZipCache {
+    char *dir;
+    gint64 max_bytes;
+
+    pthread_mutex_t lock;
+    GHashTable *entries;        /* key -> ZipCacheEntry */
+    GQueue *lru;                /* packed entries, least recently used first */
+    gint64 n_bytes;
+};
+
+static void
+remove_old_archives (const char *dir)
+{
+    GDir *d;
+    const char *name;
+    char *path;
+
+    d = g_dir_open (dir, 0, NULL);
+    if (!d)
+        return;
+
+    while ((name = g_dir_read_name (d)) != NULL) {
+        path = g_build_filename (dir, name, NULL);
+        g_unlink (path);
+        g_free (path);
+    }
+
+    g_dir_close (d);
+}
+
+ZipCache *
+zip_cache_new (const char *dir, gint64 max_bytes)
+{
+    ZipCache *cache;
+
+    if (g_mkdir_with_parents (dir, 0777) < 0) {
+        syncw_warning ("Failed to create zip cache dir %s: %s.\n",
+                      dir, strerror (errno));
+        return NULL;
+    }
+    /* Archives of the last run aren't indexed, start afresh. */
+    remove_old_archives (dir);
+
+    cache = g_new0 (ZipCache, 1);
+    cache->dir = g_strdup (dir);
+    cache->max_bytes = max_bytes;
+    pthread_mutex_init (&cache->lock, NULL);
+    cache->entries = g_hash_table_new (g_str_hash, g_str_equal);
+    cache->lru = g_queue_new ();
+
+    return cache;
+}
+
+static void
+zip_cache_entry_free (ZipCacheEntry *entry)
+{
+    if (entry->state == ZIP_CACHE_READY)
+        g_unlink (entry->path);
+    g_free (entry->key);
+    g_free (entry->path);
+    g_free (entry->progress.zip_file_path);
+    g_free (entry);
+}
+
+/* Called with cache->lock held. */
+static void
+remove_entry (ZipCache *cache, ZipCacheEntry *entry)
+{
+    if (entry->in_cache) {
+        g_hash_table_remove (cache->entries, entry->key);
+        entry->in_cache = FALSE;
+    }
+    if (entry->lru_link) {
+        g_queue_delete_link (cache->lru, entry->lru_link);
+        entry->lru_link = NULL;
+        cache->n_bytes -= entry->size;
+    }
+}
+
+/* Called with cache->lock held. Pinned entries are skipped. */
+static GList *
+evict_entries (ZipCache *cache)
+{
+    GList *ptr, *next;
+    GList *evicted = NULL;
+    ZipCacheEntry *entry;
+
+    for (ptr = cache->lru->head;
+         ptr && cache->n_bytes > cache->max_bytes;
+         ptr = next) {
+        next = ptr->next;
+        entry = ptr->data;
+        if (entry->refcnt > 0)
+            continue;
+        remove_entry (cache, entry);
+        evicted = g_list_prepend (evicted, entry);
+    }
+
+    return evicted;
+}
+
+/* Unlinking the files is left out of the lock. */
+static void
+free_entries (GList *entries)
+{
+    g_list_free_full (entries, (GDestroyNotify)zip_cache_entry_free);
+}
+
+static char *
+make_path (ZipCache *cache, const char *key)
+{
+    char *name = g_strconcat (key, ".zip", NULL);
+    char *path = g_build_filename (cache->dir, name, NULL);
+
+    g_free (name);
+    return path;
+}
+
+ZipCacheEntry *
+zip_cache_get (ZipCache *cache, const char *key, gboolean *pack)
+{
+    ZipCacheEntry *entry;
+
+    *pack = FALSE;
+
+    pthread_mutex_lock (&cache->lock);
+
+    entry = g_hash_table_lookup (cache->entries, key);
+    if (entry) {
+        ++entry->refcnt;
+        if (entry->lru_link) {
+            g_queue_unlink (cache->lru, entry->lru_link);
+            g_queue_push_tail_link (cache->lru, entry->lru_link);
+        }
+        pthread_mutex_unlock (&cache->lock);
+        return entry;
+    }
+
+    entry = g_new0 (ZipCacheEntry, 1);
+    entry->cache = cache;
+    /* One for the caller, one for the packing task. */
+    entry->refcnt = 2;
+    entry->key = g_strdup (key);
+    entry->path = make_path (cache, key);
+    entry->state = ZIP_CACHE_PACKING;
+    entry->in_cache = TRUE;
+    g_hash_table_insert (cache->entries, entry->key, entry);
+
+    pthread_mutex_unlock (&cache->lock);
+
+    *pack = TRUE;
+    return entry;
+}
+
+void
+zip_cache_entry_unref (ZipCacheEntry *entry)
+{
+    ZipCache *cache = entry->cache;
+    GList *evicted;
+
+    pthread_mutex_lock (&cache->lock);
+    if (--entry->refcnt == 0 && !entry->in_cache) {
+        pthread_mutex_unlock (&cache->lock);
+        zip_cache_entry_free (entry);
+        return;
+    }
+    /* Entries pinned over the budget may go now. */
+    evicted = evict_entries (cache);
+    pthread_mutex_unlock (&cache->lock);
+
+    free_entries (evicted);
+}
+
+Progress *
+zip_cache_entry_get_progress (ZipCacheEntry *entry)
+{
+    return &entry->progress;
+}
+
+const char *
+zip_cache_entry_get_path (ZipCacheEntry *entry)
+{
+    ZipCache *cache = entry->cache;
+    const char *path = NULL;
+
+    pthread_mutex_lock (&cache->lock);
+    if (entry->state == ZIP_CACHE_READY)
+        path = entry->path;
+    pthread_mutex_unlock (&cache->lock);
+
+    return path;
+}
+
+gboolean
+zip_cache_entry_is_failed (ZipCacheEntry *entry)
+{
+    ZipCache *cache = entry->cache;
+    gboolean failed;
+
+    pthread_mutex_lock (&cache->lock);
+    failed = (entry->state == ZIP_CACHE_FAILED);
+    pthread_mutex_unlock (&cache->lock);
+
+    return failed;
+}
+
+void
+zip_cache_entry_packed (ZipCacheEntry *entry, gboolean success)
+{
+    ZipCache *cache = entry->cache;
+    char *tmp_path = entry->progress.zip_file_path;
+    SyncwStat st;
+
+    if (success) {
+        if (g_rename (tmp_path, entry->path) < 0) {
+            syncw_warning ("Failed to move %s to zip cache: %s.\n",
+                          tmp_path, strerror (errno));
+            success = FALSE;
+        } else if (syncw_stat (entry->path, &st) < 0) {
+            syncw_warning ("Failed to stat %s: %s.\n",
+                          entry->path, strerror (errno));
+            g_unlink (entry->path);
+            success = FALSE;
+        }
+    }
+    if (!success && tmp_path)
+        g_unlink (tmp_path);
+
+    pthread_mutex_lock (&cache->lock);
+
+    if (success) {
+        entry->state = ZIP_CACHE_READY;
+        entry->size = st.st_size;
+        if (entry->in_cache) {
+            g_queue_push_tail (cache->lru, entry);
+            entry->lru_link = cache->lru->tail;
+            cache->n_bytes += entry->size;
+        }
+    } else {
+        entry->state = ZIP_CACHE_FAILED;
+        remove_entry (cache, entry);
+    }
+
+    pthread_mutex_unlock (&cache->lock);
+
+    /* Drop the reference of the packing task. */
+    zip_cache_entry_unref (entry);
+}
+
+void
+zip_cache_entry_cancel (ZipCacheEntry *entry)
+{
+    ZipCache *cache = entry->cache;
+
+    pthread_mutex_lock (&cache->lock);
+    /* Referenced by the packing task and the canceling download only. */
+    if (entry->state == ZIP_CACHE_PACKING && entry->refcnt <= 2) {
+        entry->progress.canceled = TRUE;
+        /* Don't let new downloads wait for it. */
+        remove_entry (cache, entry);
+    }
+    pthread_mutex_unlock (&cache->lock);
+}
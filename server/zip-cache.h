@@ -0,0 +1,60 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef ZIP_CACHE_H
+#define ZIP_CACHE_H
+
+#include "pack-dir.h"
+
+/*
+ * On-disk LRU cache of packed zip archives, keyed by a hash of what's in
+ * them: the dir id or the selected dirents. Fs object ids are content
+ * hashes, so archives never go stale and are only evicted to stay within
+ * the byte budget.
+ *
+ * Downloads of the same content share one packing task. An entry is pinned
+ * while a download refers to it, pinned entries are never evicted.
+ */
+
+typedef struct ZipCache ZipCache;
+typedef struct ZipCacheEntry ZipCacheEntry;
+
+/* Archives are kept in @dir, which is emptied first. */
+ZipCache *
+zip_cache_new (const char *dir, gint64 max_bytes);
+
+/*
+ * Get the archive with @key, packed or being packed. If there's none, a new
+ * entry is returned and @pack is set: the caller must pack it into the
+ * entry's progress and call zip_cache_entry_packed() when done. The entry
+ * then holds one more reference, which is dropped by
+ * zip_cache_entry_packed().
+ */
+ZipCacheEntry *
+zip_cache_get (ZipCache *cache, const char *key, gboolean *pack);
+
+void
+zip_cache_entry_unref (ZipCacheEntry *entry);
+
+/* Packing progress, shared by all downloads of the archive. */
+Progress *
+zip_cache_entry_get_progress (ZipCacheEntry *entry);
+
+/* Path of the packed archive, NULL until it's packed. */
+const char *
+zip_cache_entry_get_path (ZipCacheEntry *entry);
+
+gboolean
+zip_cache_entry_is_failed (ZipCacheEntry *entry);
+
+/*
+ * Move the packed archive into the cache. If packing failed, the entry is
+ * dropped so that the next download packs again.
+ */
+void
+zip_cache_entry_packed (ZipCacheEntry *entry, gboolean success);
+
+/* Cancel packing, unless another download is waiting for it. */
+void
+zip_cache_entry_cancel (ZipCacheEntry *entry);
+
+#endif
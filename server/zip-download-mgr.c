@@ -9,10 +9,15 @@
 #include "syncwerk-error.h"
 #include "syncwerk-session.h"
 #include "pack-dir.h"
+#include "zip-cache.h"
 #include "web-accesstoken-mgr.h"
 #include "zip-download-mgr.h"
 
 #define MAX_ZIP_THREAD_NUM 5
+/* A streaming task blocks while its client is slow, so it holds a thread
+ * for as long as the download. Downloads are limited by the admission
+ * control of /zip/ requests, this only bounds the threads. */
+#define MAX_ZIP_STREAM_THREAD_NUM 16
 #define SCAN_PROGRESS_INTERVAL 24 * 3600 // 1 day
 #define PROGRESS_TTL 5 * 3600 // 5 hours
 #define DEFAULT_MAX_DOWNLOAD_DIR_SIZE 100 * ((gint64)1 << 20) /* 100MB */
@@ -21,25 +26,14 @@ typedef struct ZipDownloadMgrPriv {
     pthread_mutex_t progress_lock;
     GHashTable *progress_store;
     GThreadPool *zip_tpool;
+    GThreadPool *zip_stream_tpool;
+    ZipCache *zip_cache;
     // Abnormal behavior lead to no download request for the zip finished progress,
     // so related progress will not be removed,
     // this timer is used to scan progress and remove invalid progress.
     CcnetTimer *scan_progress_timer;
 } ZipDownloadMgrPriv;
 
-void
-free_progress (Progress *progress)
-{
-    if (!progress)
-        return;
-
-    if (g_file_test (progress->zip_file_path, G_FILE_TEST_EXISTS)) {
-        g_unlink (progress->zip_file_path);
-    }
-    g_free (progress->zip_file_path);
-    g_free (progress);
-}
-
 typedef enum DownloadType {
     DOWNLOAD_DIR,
     DOWNLOAD_MULTI
@@ -56,6 +50,9 @@ typedef struct DownloadObj {
     // download-dir: obj_id; download-multi: dirent list
     void *internal;
     Progress *progress;
+    ZipStream *zs;
+    /* Set when the archive is packed into the zip cache. */
+    ZipCacheEntry *cache_entry;
 } DownloadObj;
 
 static void
@@ -76,9 +73,28 @@ free_download_obj (DownloadObj *obj)
     g_free (obj);
 }
 
+void
+free_progress (Progress *progress)
+{
+    if (!progress)
+        return;
+
+    if (progress->cache_entry) {
+        zip_cache_entry_unref (progress->cache_entry);
+    } else if (g_file_test (progress->zip_file_path, G_FILE_TEST_EXISTS)) {
+        g_unlink (progress->zip_file_path);
+    }
+    g_free (progress->zip_file_path);
+    free_download_obj (progress->stream_obj);
+    g_free (progress);
+}
+
 static void
 start_zip_task (gpointer data, gpointer user_data);
 
+static void
+stream_zip_task (gpointer data, gpointer user_data);
+
 static int
 scan_progress (void *data);
 
@@ -102,6 +118,22 @@ zip_download_mgr_new ()
         return NULL;
     }
 
+    priv->zip_stream_tpool = g_thread_pool_new (stream_zip_task, priv,
+                                                MAX_ZIP_STREAM_THREAD_NUM,
+                                                FALSE, &error);
+    if (!priv->zip_stream_tpool) {
+        if (error) {
+            syncw_warning ("Failed to create zip stream thread pool: %s.\n", error->message);
+            g_clear_error (&error);
+        } else {
+            syncw_warning ("Failed to create zip stream thread pool.\n");
+        }
+        g_thread_pool_free (priv->zip_tpool, TRUE, FALSE);
+        g_free (priv);
+        g_free (mgr);
+        return NULL;
+    }
+
     pthread_mutex_init (&priv->progress_lock, NULL);
     priv->progress_store = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
                                                   (GDestroyNotify)free_progress);
@@ -112,6 +144,25 @@ zip_download_mgr_new ()
     return mgr;
 }
 
+int
+zip_download_mgr_init (ZipDownloadMgr *mgr)
+{
+    ZipDownloadMgrPriv *priv = mgr->priv;
+    char *cache_dir;
+
+    if (syncw->http_server->zip_cache_size <= 0)
+        return 0;
+
+    cache_dir = g_build_filename (syncw->http_server->http_temp_dir,
+                                  "zip-cache", NULL);
+    /* Archives are packed again each time without the cache. */
+    priv->zip_cache = zip_cache_new (cache_dir,
+                                     syncw->http_server->zip_cache_size);
+    g_free (cache_dir);
+
+    return 0;
+}
+
 static void
 remove_progress_by_token (ZipDownloadMgrPriv *priv, const char *token)
 {
@@ -197,12 +248,43 @@ out:
     if (crypt) {
         g_free (crypt);
     }
+    /* Downloads sharing the archive see the failure in the cache entry. */
+    if (obj->cache_entry) {
+        zip_cache_entry_packed (obj->cache_entry, ret == 0);
+    }
     if (ret == -1) {
         remove_progress_by_token (priv, obj->token);
     }
     free_download_obj (obj);
 }
 
+static void
+stream_zip_task (gpointer data, gpointer user_data)
+{
+    DownloadObj *obj = data;
+    SyncwRepo *repo = obj->repo;
+    SyncwerkCrypt *crypt = NULL;
+    /* The shared progress may be removed while the archive is sent. */
+    Progress progress;
+
+    memset (&progress, 0, sizeof(progress));
+
+    if (repo->encrypted) {
+        crypt = get_syncwerk_crypt (repo, obj->user);
+        if (!crypt)
+            goto out;
+    }
+
+    pack_files_to_stream (repo->store_id, repo->version, obj->dir_name,
+                          obj->internal, crypt, obj->is_windows,
+                          &progress, obj->zs);
+
+out:
+    g_free (crypt);
+    zip_stream_close_writer (obj->zs);
+    free_download_obj (obj);
+}
+
 static int
 parse_download_dir_data (DownloadObj *obj, const char *data)
 {
@@ -465,6 +547,56 @@ get_download_file_count (DownloadObj *obj, GError **error)
     return file_count;
 }
 
+static gint
+compare_dirent_name (gconstpointer a, gconstpointer b)
+{
+    return strcmp (((SyncwDirent *)a)->name, ((SyncwDirent *)b)->name);
+}
+
+/*
+ * Key of the archive in the zip cache. Fs object ids are content hashes,
+ * so the key covers everything that ends up in the archive.
+ */
+static char *
+make_zip_cache_key (DownloadObj *obj)
+{
+    GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA1);
+    SyncwRepo *repo = obj->repo;
+    GList *dirents, *ptr;
+    SyncwDirent *dirent;
+    char buf[64];
+    char *key;
+
+    snprintf (buf, sizeof(buf), "%d:%d", repo->version, obj->is_windows);
+    g_checksum_update (checksum, (guchar *)repo->store_id, 36);
+    /* Strings are hashed with their terminating null as a separator. */
+    g_checksum_update (checksum, (guchar *)buf, strlen(buf) + 1);
+    g_checksum_update (checksum, (guchar *)obj->dir_name,
+                       strlen(obj->dir_name) + 1);
+
+    if (obj->type == DOWNLOAD_DIR) {
+        g_checksum_update (checksum, (guchar *)obj->internal,
+                           strlen((char *)obj->internal) + 1);
+    } else {
+        /* The same selection in another order gives the same content. */
+        dirents = g_list_sort (g_list_copy ((GList *)obj->internal),
+                               compare_dirent_name);
+        for (ptr = dirents; ptr; ptr = ptr->next) {
+            dirent = ptr->data;
+            snprintf (buf, sizeof(buf), "%s:%o", dirent->id, dirent->mode);
+            g_checksum_update (checksum, (guchar *)dirent->name,
+                               strlen(dirent->name) + 1);
+            g_checksum_update (checksum, (guchar *)buf, strlen(buf) + 1);
+        }
+        g_list_free (dirents);
+    }
+
+    key = g_strdup (g_checksum_get_string (checksum));
+    g_checksum_free (checksum);
+
+    return key;
+}
+
 int
 zip_download_mgr_start_zip_task (ZipDownloadMgr *mgr,
                                  const char *token,
@@ -478,6 +610,9 @@ zip_download_mgr_start_zip_task (ZipDownloadMgr *mgr,
     DownloadObj *obj;
     Progress *progress;
     int file_count;
+    char *cache_key = NULL;
+    ZipCacheEntry *cache_entry = NULL;
+    gboolean pack = FALSE;
     int ret = 0;
     ZipDownloadMgrPriv *priv = mgr->priv;
 
@@ -541,16 +676,43 @@ zip_download_mgr_start_zip_task (ZipDownloadMgr *mgr,
     progress->expire_ts = time(NULL) + PROGRESS_TTL;
     obj->progress = progress;
 
+    /* Decrypted archives of encrypted libraries aren't kept on disk.
+     * There's no cache when archives are streamed.
+     */
+    if (priv->zip_cache && !repo->encrypted) {
+        cache_key = make_zip_cache_key (obj);
+        cache_entry = zip_cache_get (priv->zip_cache, cache_key, &pack);
+    }
+
+    if (cache_entry) {
+        progress->cache_entry = cache_entry;
+        if (pack) {
+            obj->cache_entry = cache_entry;
+            obj->progress = zip_cache_entry_get_progress (cache_entry);
+        }
+    } else if (syncw->http_server->stream_zip) {
+        /* The archive is packed when it's downloaded, keep the task until then. */
+        progress->streaming = TRUE;
+        progress->stream_obj = obj;
+        obj->progress = NULL;
+    }
+
     pthread_mutex_lock (&priv->progress_lock);
     g_hash_table_replace (priv->progress_store, g_strdup (token), progress);
     pthread_mutex_unlock (&priv->progress_lock);
 
-    g_thread_pool_push (priv->zip_tpool, obj, NULL);
+    if (progress->streaming)
+        goto out;
+    if (!cache_entry || pack)
+        g_thread_pool_push (priv->zip_tpool, obj, NULL);
+    else
+        free_download_obj (obj);
 
 out:
     if (ret < 0) {
         free_download_obj (obj);
     }
+    g_free (cache_key);
 
     return ret;
 }
@@ -572,6 +734,7 @@ zip_download_mgr_query_zip_progress (ZipDownloadMgr *mgr,
                                      const char *token, GError **error)
 {
     Progress *progress;
+    ZipCacheEntry *entry;
     json_t *obj;
     char *info;
 
@@ -584,8 +747,24 @@ zip_download_mgr_query_zip_progress (ZipDownloadMgr *mgr,
         return NULL;
     }
 
+    entry = progress->cache_entry;
+    if (entry && zip_cache_entry_is_failed (entry)) {
+        syncw_warning ("Zip task for token %s failed.\n", token);
+        g_set_error (error, SYNCWERK_DOMAIN, SYNCW_ERR_GENERAL,
+                     "Zip task failed.");
+        return NULL;
+    }
+
     obj = json_object ();
-    json_object_set_int_member (obj, "zipped", g_atomic_int_get (&progress->zipped));
+    /* A streamed archive is ready to be downloaded right away. */
+    if (progress->streaming || (entry && zip_cache_entry_get_path (entry)))
+        json_object_set_int_member (obj, "zipped", progress->total);
+    else if (entry)
+        /* Packing may have been started by another download. */
+        json_object_set_int_member (obj, "zipped",
+                                    g_atomic_int_get (&zip_cache_entry_get_progress (entry)->zipped));
+    else
+        json_object_set_int_member (obj, "zipped", g_atomic_int_get (&progress->zipped));
     json_object_set_int_member (obj, "total", progress->total);
     info = json_dumps (obj, JSON_COMPACT);
     json_decref (obj);
@@ -603,9 +782,49 @@ zip_download_mgr_get_zip_file_path (struct ZipDownloadMgr *mgr,
     if (!progress) {
         return NULL;
     }
+    if (progress->cache_entry)
+        return (char *)zip_cache_entry_get_path (progress->cache_entry);
     return progress->zip_file_path;
 }
 
+gboolean
+zip_download_mgr_is_streaming (ZipDownloadMgr *mgr, const char *token)
+{
+    Progress *progress;
+
+    progress = get_progress_obj (mgr->priv, token);
+    return progress && progress->streaming;
+}
+
+ZipStream *
+zip_download_mgr_start_zip_stream (ZipDownloadMgr *mgr, const char *token,
+                                   ThreadWaker *waker,
+                                   ThreadWakerFunc notify, void *notify_data)
+{
+    ZipDownloadMgrPriv *priv = mgr->priv;
+    Progress *progress;
+    DownloadObj *obj = NULL;
+
+    pthread_mutex_lock (&priv->progress_lock);
+    progress = g_hash_table_lookup (priv->progress_store, token);
+    if (progress) {
+        obj = progress->stream_obj;
+        progress->stream_obj = NULL;
+    }
+    pthread_mutex_unlock (&priv->progress_lock);
+
+    if (!obj) {
+        syncw_warning ("Zip stream for token %s is not found or already started.\n",
+                      token);
+        return NULL;
+    }
+
+    obj->zs = zip_stream_new (waker, notify, notify_data);
+    g_thread_pool_push (priv->zip_stream_tpool, obj, NULL);
+
+    return obj->zs;
+}
+
 void
 zip_download_mgr_del_zip_progress (ZipDownloadMgr *mgr,
                                    const char *token)
@@ -618,7 +837,9 @@ zip_download_mgr_cancel_zip_task (ZipDownloadMgr *mgr,
                                   const char *token)
 {
     Progress *progress = get_progress_obj (mgr->priv, token);
-    if (progress)
+    if (progress && progress->cache_entry)
+        zip_cache_entry_cancel (progress->cache_entry);
+    else if (progress)
         progress->canceled = TRUE;
 
     return 0;
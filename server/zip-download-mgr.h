@@ -2,6 +2,7 @@
 #define ZIP_DOWNLOAD_MGR_H
 
 #include "syncwerk-object.h"
+#include "zip-stream.h"
 
 struct ZipDownloadMgrPriv;
 
@@ -12,6 +13,9 @@ typedef struct ZipDownloadMgr {
 ZipDownloadMgr *
 zip_download_mgr_new ();
 
+int
+zip_download_mgr_init (ZipDownloadMgr *mgr);
+
 int
 zip_download_mgr_start_zip_task (ZipDownloadMgr *mgr,
                                  const char *token,
@@ -26,6 +30,20 @@ char *
 zip_download_mgr_get_zip_file_path (ZipDownloadMgr *mgr,
                                     const char *token);
 
+/* Whether the archive of @token is packed while it's downloaded. */
+gboolean
+zip_download_mgr_is_streaming (ZipDownloadMgr *mgr, const char *token);
+
+/*
+ * Start packing the archive of @token into a stream. An archive can only be
+ * streamed once, returns NULL otherwise. See zip_stream_new() for @waker,
+ * @notify and @notify_data.
+ */
+ZipStream *
+zip_download_mgr_start_zip_stream (ZipDownloadMgr *mgr, const char *token,
+                                   ThreadWaker *waker,
+                                   ThreadWakerFunc notify, void *notify_data);
+
 void
 zip_download_mgr_del_zip_progress (ZipDownloadMgr *mgr,
                                    const char *token);
@@ -0,0 +1,568 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define DEBUG_FLAG SYNCWERK_DEBUG_HTTP
+#include "log.h"
+
+#include "zip-stream.h"
+
+#define ZIP_CHUNK_SIZE (256 * 1024)
+/* Chunks in flight per archive, counting those in the output buffer. */
+#define ZIP_STREAM_CHUNKS 8
+
+#define ZIP_LOCAL_HEADER_SIG 0x04034b50
+#define ZIP_DATA_DESCRIPTOR_SIG 0x08074b50
+#define ZIP_CENTRAL_HEADER_SIG 0x02014b50
+#define ZIP64_END_RECORD_SIG 0x06064b50
+#define ZIP64_END_LOCATOR_SIG 0x07064b50
+#define ZIP_END_RECORD_SIG 0x06054b50
+
+#define ZIP_FLAG_DATA_DESCRIPTOR 0x0008
+#define ZIP_FLAG_UTF8 0x0800
+#define ZIP_VERSION 20
+#define ZIP64_VERSION 45
+/* High byte of "version made by": the external attributes are unix modes. */
+#define ZIP_MADE_BY_UNIX 0x0300
+#define ZIP_ATTR_DIR 0x10
+
+#define ZIP64_EXTRA_ID 0x0001
+#define ZIP_MAX32 0xffffffffULL
+#define ZIP_MAX16 0xffff
+
+typedef struct ZipChunk {
+    ZipStream *zs;
+    int len;
+    char data[ZIP_CHUNK_SIZE];
+} ZipChunk;
+
+typedef struct ZipEntry {
+    char *name;
+    guint16 flags;
+    guint16 dos_time;
+    guint16 dos_date;
+    guint32 attr;
+    guint32 crc;
+    guint64 size;
+    guint64 offset;
+    gboolean zip64;
+} ZipEntry;
+
+/*
+ * Referenced by the writer until it closes, by the sender until it stops,
+ * by every chunk in flight, and by a pending notification.
+ */
+struct ZipStream {
+    gint refcnt;
+
+    ThreadWaker *waker;
+    ThreadWakerFunc notify;
+    void *notify_data;
+    gint notify_pending;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    GQueue *ready;
+    int n_chunks;
+    gboolean stopped;
+    gboolean closed;
+    gboolean finished;
+
+    /* Only used by the writer. */
+    ZipChunk *chunk;
+    guint64 offset;
+    GPtrArray *entries;
+    ZipEntry *cur;
+};
+
+static void
+zip_entry_free (ZipEntry *entry)
+{
+    g_free (entry->name);
+    g_free (entry);
+}
+
+static void
+zip_stream_unref (ZipStream *zs)
+{
+    if (!g_atomic_int_dec_and_test (&zs->refcnt))
+        return;
+
+    g_queue_free (zs->ready);
+    pthread_cond_destroy (&zs->cond);
+    pthread_mutex_destroy (&zs->lock);
+    g_free (zs);
+}
+
+static void
+release_chunk (ZipChunk *chunk)
+{
+    ZipStream *zs = chunk->zs;
+
+    pthread_mutex_lock (&zs->lock);
+    --zs->n_chunks;
+    pthread_cond_signal (&zs->cond);
+    pthread_mutex_unlock (&zs->lock);
+
+    g_free (chunk);
+    zip_stream_unref (zs);
+}
+
+/* Called when the output buffer has drained the data of @extra. */
+static void
+chunk_cleanup_cb (const void *data, size_t len, void *extra)
+{
+    release_chunk (extra);
+}
+
+/* Wait until the sender has room for another chunk. */
+static ZipChunk *
+get_chunk (ZipStream *zs)
+{
+    ZipChunk *chunk;
+
+    pthread_mutex_lock (&zs->lock);
+    while (!zs->stopped && zs->n_chunks >= ZIP_STREAM_CHUNKS)
+        pthread_cond_wait (&zs->cond, &zs->lock);
+    if (zs->stopped) {
+        pthread_mutex_unlock (&zs->lock);
+        return NULL;
+    }
+    ++zs->n_chunks;
+    pthread_mutex_unlock (&zs->lock);
+
+    chunk = g_new (ZipChunk, 1);
+    chunk->zs = zs;
+    chunk->len = 0;
+    g_atomic_int_inc (&zs->refcnt);
+
+    return chunk;
+}
+
+/* Called in the sender's thread. */
+static void
+notify_cb (void *data)
+{
+    ZipStream *zs = data;
+    gboolean stopped;
+
+    /* Chunks pushed from now on notify again. */
+    g_atomic_int_set (&zs->notify_pending, 0);
+
+    pthread_mutex_lock (&zs->lock);
+    stopped = zs->stopped;
+    pthread_mutex_unlock (&zs->lock);
+
+    if (!stopped)
+        zs->notify (zs->notify_data);
+
+    zip_stream_unref (zs);
+}
+
+static void
+notify_sender (ZipStream *zs)
+{
+    if (!g_atomic_int_compare_and_exchange (&zs->notify_pending, 0, 1))
+        return;
+
+    g_atomic_int_inc (&zs->refcnt);
+    thread_waker_post (zs->waker, notify_cb, zs);
+}
+
+static void
+push_chunk (ZipStream *zs)
+{
+    ZipChunk *chunk = zs->chunk;
+
+    zs->chunk = NULL;
+
+    pthread_mutex_lock (&zs->lock);
+    if (!zs->stopped && chunk->len > 0) {
+        g_queue_push_tail (zs->ready, chunk);
+        chunk = NULL;
+    }
+    pthread_mutex_unlock (&zs->lock);
+
+    if (chunk)
+        release_chunk (chunk);
+    else
+        notify_sender (zs);
+}
+
+static int
+put_bytes (ZipStream *zs, const void *data, size_t len)
+{
+    const char *p = data;
+    size_t n;
+
+    while (len > 0) {
+        if (!zs->chunk) {
+            zs->chunk = get_chunk (zs);
+            if (!zs->chunk)
+                return -1;
+        }
+
+        n = MIN (len, ZIP_CHUNK_SIZE - zs->chunk->len);
+        memcpy (zs->chunk->data + zs->chunk->len, p, n);
+        zs->chunk->len += n;
+        zs->offset += n;
+        p += n;
+        len -= n;
+
+        if (zs->chunk->len == ZIP_CHUNK_SIZE)
+            push_chunk (zs);
+    }
+
+    return 0;
+}
+
+static void
+put_le16 (GByteArray *buf, guint16 v)
+{
+    guint8 b[2] = { v & 0xff, v >> 8 };
+
+    g_byte_array_append (buf, b, 2);
+}
+
+static void
+put_le32 (GByteArray *buf, guint32 v)
+{
+    put_le16 (buf, v & 0xffff);
+    put_le16 (buf, v >> 16);
+}
+
+static void
+put_le64 (GByteArray *buf, guint64 v)
+{
+    put_le32 (buf, v & 0xffffffff);
+    put_le32 (buf, v >> 32);
+}
+
+static int
+put_buf (ZipStream *zs, GByteArray *buf)
+{
+    int ret = put_bytes (zs, buf->data, buf->len);
+
+    g_byte_array_free (buf, TRUE);
+    return ret;
+}
+
+static void
+set_dos_time (ZipEntry *entry, time_t mtime)
+{
+    struct tm tm;
+
+    localtime_r (&mtime, &tm);
+    if (tm.tm_year < 80) {
+        /* 1980-01-01, the earliest time a zip file can hold. */
+        entry->dos_time = 0;
+        entry->dos_date = (1 << 5) | 1;
+        return;
+    }
+
+    entry->dos_time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+    entry->dos_date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) |
+        tm.tm_mday;
+}
+
+static ZipEntry *
+zip_entry_new (ZipStream *zs, const char *name, gboolean utf8, time_t mtime)
+{
+    ZipEntry *entry = g_new0 (ZipEntry, 1);
+
+    entry->name = g_strdup (name);
+    entry->flags = utf8 ? ZIP_FLAG_UTF8 : 0;
+    entry->offset = zs->offset;
+    set_dos_time (entry, mtime);
+
+    return entry;
+}
+
+static int
+write_local_header (ZipStream *zs, ZipEntry *entry)
+{
+    GByteArray *buf = g_byte_array_new ();
+    guint16 name_len = strlen (entry->name);
+
+    put_le32 (buf, ZIP_LOCAL_HEADER_SIG);
+    put_le16 (buf, entry->zip64 ? ZIP64_VERSION : ZIP_VERSION);
+    put_le16 (buf, entry->flags);
+    put_le16 (buf, 0);              /* stored */
+    put_le16 (buf, entry->dos_time);
+    put_le16 (buf, entry->dos_date);
+    /* The crc and sizes follow the data, in the data descriptor. */
+    put_le32 (buf, 0);
+    put_le32 (buf, entry->zip64 ? ZIP_MAX32 : 0);
+    put_le32 (buf, entry->zip64 ? ZIP_MAX32 : 0);
+    put_le16 (buf, name_len);
+    put_le16 (buf, entry->zip64 ? 20 : 0);
+    g_byte_array_append (buf, (guint8 *)entry->name, name_len);
+    if (entry->zip64) {
+        put_le16 (buf, ZIP64_EXTRA_ID);
+        put_le16 (buf, 16);
+        put_le64 (buf, 0);
+        put_le64 (buf, 0);
+    }
+
+    return put_buf (zs, buf);
+}
+
+ZipStream *
+zip_stream_new (ThreadWaker *waker, ThreadWakerFunc notify, void *notify_data)
+{
+    ZipStream *zs = g_new0 (ZipStream, 1);
+
+    /* One for the writer, one for the sender. */
+    zs->refcnt = 2;
+    zs->waker = waker;
+    zs->notify = notify;
+    zs->notify_data = notify_data;
+    pthread_mutex_init (&zs->lock, NULL);
+    pthread_cond_init (&zs->cond, NULL);
+    zs->ready = g_queue_new ();
+    zs->entries = g_ptr_array_new ();
+
+    return zs;
+}
+
+int
+zip_stream_begin_file (ZipStream *zs, const char *name, gboolean utf8,
+                       guint32 mode, time_t mtime, guint64 size)
+{
+    ZipEntry *entry = zip_entry_new (zs, name, utf8, mtime);
+
+    entry->flags |= ZIP_FLAG_DATA_DESCRIPTOR;
+    entry->attr = mode << 16;
+    /* The local header is written before the data, so the size it was
+     * given decides whether the entry needs zip64 records. */
+    entry->zip64 = (size >= ZIP_MAX32);
+    entry->crc = crc32 (0L, Z_NULL, 0);
+    zs->cur = entry;
+
+    return write_local_header (zs, entry);
+}
+
+int
+zip_stream_write (ZipStream *zs, const void *data, size_t len)
+{
+    ZipEntry *entry = zs->cur;
+
+    entry->crc = crc32 (entry->crc, data, len);
+    entry->size += len;
+
+    return put_bytes (zs, data, len);
+}
+
+int
+zip_stream_end_file (ZipStream *zs)
+{
+    ZipEntry *entry = zs->cur;
+    GByteArray *buf;
+
+    zs->cur = NULL;
+    g_ptr_array_add (zs->entries, entry);
+
+    if (!entry->zip64 && entry->size >= ZIP_MAX32) {
+        syncw_warning ("File %s is larger than its size in the zip header.\n",
+                      entry->name);
+        return -1;
+    }
+
+    buf = g_byte_array_new ();
+    put_le32 (buf, ZIP_DATA_DESCRIPTOR_SIG);
+    put_le32 (buf, entry->crc);
+    if (entry->zip64) {
+        put_le64 (buf, entry->size);
+        put_le64 (buf, entry->size);
+    } else {
+        put_le32 (buf, entry->size);
+        put_le32 (buf, entry->size);
+    }
+
+    return put_buf (zs, buf);
+}
+
+int
+zip_stream_add_dir (ZipStream *zs, const char *name, gboolean utf8,
+                    time_t mtime)
+{
+    ZipEntry *entry;
+    char *dir_name;
+
+    if (g_str_has_suffix (name, "/"))
+        dir_name = g_strdup (name);
+    else
+        dir_name = g_strconcat (name, "/", NULL);
+
+    entry = zip_entry_new (zs, dir_name, utf8, mtime);
+    entry->attr = ((S_IFDIR | 0755) << 16) | ZIP_ATTR_DIR;
+    entry->crc = 0;
+    g_ptr_array_add (zs->entries, entry);
+    g_free (dir_name);
+
+    return write_local_header (zs, entry);
+}
+
+static void
+put_central_header (GByteArray *buf, ZipEntry *entry)
+{
+    guint16 name_len = strlen (entry->name);
+    gboolean big_size = (entry->size >= ZIP_MAX32);
+    gboolean big_offset = (entry->offset >= ZIP_MAX32);
+    guint16 extra_len = (big_size ? 16 : 0) + (big_offset ? 8 : 0);
+    guint16 version;
+
+    version = (entry->zip64 || extra_len > 0) ? ZIP64_VERSION : ZIP_VERSION;
+
+    put_le32 (buf, ZIP_CENTRAL_HEADER_SIG);
+    put_le16 (buf, ZIP_MADE_BY_UNIX | version);
+    put_le16 (buf, version);
+    put_le16 (buf, entry->flags);
+    put_le16 (buf, 0);              /* stored */
+    put_le16 (buf, entry->dos_time);
+    put_le16 (buf, entry->dos_date);
+    put_le32 (buf, entry->crc);
+    put_le32 (buf, big_size ? ZIP_MAX32 : entry->size);
+    put_le32 (buf, big_size ? ZIP_MAX32 : entry->size);
+    put_le16 (buf, name_len);
+    put_le16 (buf, extra_len > 0 ? extra_len + 4 : 0);
+    put_le16 (buf, 0);              /* comment */
+    put_le16 (buf, 0);              /* disk */
+    put_le16 (buf, 0);              /* internal attributes */
+    put_le32 (buf, entry->attr);
+    put_le32 (buf, big_offset ? ZIP_MAX32 : entry->offset);
+    g_byte_array_append (buf, (guint8 *)entry->name, name_len);
+
+    if (extra_len > 0) {
+        put_le16 (buf, ZIP64_EXTRA_ID);
+        put_le16 (buf, extra_len);
+        if (big_size) {
+            put_le64 (buf, entry->size);
+            put_le64 (buf, entry->size);
+        }
+        if (big_offset)
+            put_le64 (buf, entry->offset);
+    }
+}
+
+int
+zip_stream_finish (ZipStream *zs)
+{
+    GByteArray *buf = g_byte_array_new ();
+    guint64 cd_offset = zs->offset;
+    guint64 cd_size;
+    guint64 n_entries = zs->entries->len;
+    gboolean zip64;
+    guint i;
+
+    for (i = 0; i < zs->entries->len; ++i)
+        put_central_header (buf, g_ptr_array_index (zs->entries, i));
+    cd_size = buf->len;
+
+    zip64 = (n_entries >= ZIP_MAX16 || cd_offset >= ZIP_MAX32 ||
+             cd_size >= ZIP_MAX32);
+    if (zip64) {
+        guint64 record_offset = cd_offset + cd_size;
+
+        put_le32 (buf, ZIP64_END_RECORD_SIG);
+        put_le64 (buf, 44);         /* size of the rest of the record */
+        put_le16 (buf, ZIP_MADE_BY_UNIX | ZIP64_VERSION);
+        put_le16 (buf, ZIP64_VERSION);
+        put_le32 (buf, 0);
+        put_le32 (buf, 0);
+        put_le64 (buf, n_entries);
+        put_le64 (buf, n_entries);
+        put_le64 (buf, cd_size);
+        put_le64 (buf, cd_offset);
+
+        put_le32 (buf, ZIP64_END_LOCATOR_SIG);
+        put_le32 (buf, 0);
+        put_le64 (buf, record_offset);
+        put_le32 (buf, 1);
+    }
+
+    put_le32 (buf, ZIP_END_RECORD_SIG);
+    put_le16 (buf, 0);
+    put_le16 (buf, 0);
+    put_le16 (buf, zip64 ? ZIP_MAX16 : n_entries);
+    put_le16 (buf, zip64 ? ZIP_MAX16 : n_entries);
+    put_le32 (buf, zip64 ? ZIP_MAX32 : cd_size);
+    put_le32 (buf, zip64 ? ZIP_MAX32 : cd_offset);
+    put_le16 (buf, 0);              /* comment */
+
+    if (put_buf (zs, buf) < 0)
+        return -1;
+
+    zs->finished = TRUE;
+    return 0;
+}
+
+void
+zip_stream_close_writer (ZipStream *zs)
+{
+    if (zs->chunk)
+        push_chunk (zs);
+
+    if (zs->cur)
+        zip_entry_free (zs->cur);
+    g_ptr_array_foreach (zs->entries, (GFunc)zip_entry_free, NULL);
+    g_ptr_array_free (zs->entries, TRUE);
+
+    pthread_mutex_lock (&zs->lock);
+    zs->closed = TRUE;
+    pthread_mutex_unlock (&zs->lock);
+
+    notify_sender (zs);
+    zip_stream_unref (zs);
+}
+
+int
+zip_stream_fetch (ZipStream *zs, struct evbuffer *out)
+{
+    ZipChunk *chunk;
+    int ret;
+
+    pthread_mutex_lock (&zs->lock);
+
+    /* Chunks are released by chunk_cleanup_cb(), not here. */
+    while ((chunk = g_queue_pop_head (zs->ready)) != NULL)
+        evbuffer_add_reference (out, chunk->data, chunk->len,
+                                chunk_cleanup_cb, chunk);
+
+    if (!zs->closed)
+        ret = 0;
+    else if (zs->finished)
+        ret = 1;
+    else
+        ret = -1;
+
+    pthread_mutex_unlock (&zs->lock);
+
+    return ret;
+}
+
+void
+zip_stream_stop (ZipStream *zs)
+{
+    ZipChunk *chunk;
+    GList *ready = NULL;
+    GList *ptr;
+
+    pthread_mutex_lock (&zs->lock);
+    zs->stopped = TRUE;
+    pthread_cond_broadcast (&zs->cond);
+    while ((chunk = g_queue_pop_head (zs->ready)) != NULL)
+        ready = g_list_prepend (ready, chunk);
+    pthread_mutex_unlock (&zs->lock);
+
+    /* Each chunk takes the lock to give itself back. */
+    for (ptr = ready; ptr; ptr = ptr->next)
+        release_chunk (ptr->data);
+    g_list_free (ready);
+
+    zip_stream_unref (zs);
+}
@@ -0,0 +1,75 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef ZIP_STREAM_H
+#define ZIP_STREAM_H
+
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <event2/buffer.h>
+#else
+#include <event.h>
+#endif
+
+#include "thread-waker.h"
+
+/*
+ * A zip archive written by a packing thread while it's sent by an http
+ * worker thread, without a temp file.
+ *
+ * Entries are stored uncompressed, with the crc and sizes in data
+ * descriptors after the data, so nothing has to be seeked back to. Zip64
+ * records are used for large files and archives. Only a few chunks of the
+ * archive are in memory at a time: the writer blocks until the sender has
+ * sent the older ones.
+ */
+
+typedef struct ZipStream ZipStream;
+
+/*
+ * @notify is called with @notify_data in the thread of @waker when data is
+ * ready or the writer has closed, until the sender stops.
+ */
+ZipStream *
+zip_stream_new (ThreadWaker *waker, ThreadWakerFunc notify, void *notify_data);
+
+/*
+ * Writer side, called in the packing thread. All of them return -1 once
+ * the sender has stopped, so packing can give up early.
+ */
+
+/* @name is UTF-8 if @utf8 is set, in the local code page otherwise. */
+int
+zip_stream_begin_file (ZipStream *zs, const char *name, gboolean utf8,
+                       guint32 mode, time_t mtime, guint64 size);
+
+int
+zip_stream_write (ZipStream *zs, const void *data, size_t len);
+
+int
+zip_stream_end_file (ZipStream *zs);
+
+int
+zip_stream_add_dir (ZipStream *zs, const char *name, gboolean utf8,
+                    time_t mtime);
+
+/* Write the central directory. */
+int
+zip_stream_finish (ZipStream *zs);
+
+/* The writer is done with @zs. The archive is cut short unless finished. */
+void
+zip_stream_close_writer (ZipStream *zs);
+
+/*
+ * Sender side, called in the http worker thread.
+ *
+ * Move the archive data that's ready into @out without copying. Returns 1
+ * when the whole archive has been moved, -1 if packing failed, 0 otherwise.
+ */
+int
+zip_stream_fetch (ZipStream *zs, struct evbuffer *out);
+
+/* Stop sending. The writer fails at its next call. */
+void
+zip_stream_stop (ZipStream *zs);
+
+#endif
@@ -7,3 +7,5 @@ ADMIN_PASSWORD = 'adminuser'
 
 INACTIVE_USER = 'inactiveuser@test.syncwerk.com'
 INACTIVE_PASSWORD = 'inactiveuser'
+
+FILESERVER_URL = 'http://127.0.0.1:8082'
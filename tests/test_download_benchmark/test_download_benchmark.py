@@ -0,0 +1,48 @@
+import os
+import tempfile
+import time
+
+import pytest
+from synserv import syncwerk_api as api
+
+from tests.config import USER
+from tests.utils import fileserver_request
+
+file_size = 64 << 20
+n_rounds = 5
+
+# Takes a while, so it only runs when asked for.
+pytestmark = pytest.mark.skipif(not os.environ.get('SYNCWERK_BENCHMARK'),
+                                reason='set SYNCWERK_BENCHMARK to run')
+
+def download_throughput(repo_id, content):
+    file_id = api.get_file_id_by_path(repo_id, '/bench.bin')
+    token = api.get_fileserver_access_token(repo_id, file_id, 'download',
+                                            USER, use_onetime=False)
+    elapsed = 0
+    for i in range(n_rounds):
+        start = time.time()
+        status, headers, body = fileserver_request('/files/%s/bench.bin' % token)
+        elapsed += time.time() - start
+        assert status == 200
+        assert body == content
+    return float(file_size * n_rounds) / elapsed / (1 << 20)
+
+def test_encrypted_vs_plain_download(repo, encrypted_repo):
+    # Encrypted repos need the password to be set for writing and web downloads.
+    api.set_passwd(encrypted_repo.id, USER, '123')
+
+    content = os.urandom(file_size)
+    fd, path = tempfile.mkstemp()
+    try:
+        os.write(fd, content)
+        os.close(fd)
+        api.post_file(repo.id, path, '/', 'bench.bin', USER)
+        api.post_file(encrypted_repo.id, path, '/', 'bench.bin', USER)
+    finally:
+        os.unlink(path)
+
+    plain = download_throughput(repo.id, content)
+    encrypted = download_throughput(encrypted_repo.id, content)
+    print('download throughput: plain %.1f MB/s, encrypted %.1f MB/s (%.0f%%)' %
+          (plain, encrypted, encrypted / plain * 100))
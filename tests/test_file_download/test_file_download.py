@@ -0,0 +1,108 @@
+import json
+import os
+import tempfile
+import time
+import zipfile
+from StringIO import StringIO
+
+from synserv import syncwerk_api as api
+
+from tests.config import USER
+from tests.utils import fileserver_request, randstring
+
+def post_content(repo_id, parent_dir, filename, content):
+    fd, path = tempfile.mkstemp()
+    try:
+        os.write(fd, content)
+        os.close(fd)
+        api.post_file(repo_id, path, parent_dir, filename, USER)
+    finally:
+        os.unlink(path)
+
+def file_url(repo_id, path, op='download'):
+    file_id = api.get_file_id_by_path(repo_id, path)
+    token = api.get_fileserver_access_token(repo_id, file_id, op, USER,
+                                            use_onetime=False)
+    return '/files/%s/%s' % (token, os.path.basename(path)), file_id
+
+def parse_byteranges(content_type, body):
+    boundary = content_type.split('boundary=')[1]
+    assert body.startswith('--%s\r\n' % boundary)
+    assert body.endswith('\r\n--%s--\r\n' % boundary)
+    body = body[len('--%s\r\n' % boundary):-len('\r\n--%s--\r\n' % boundary)]
+
+    parts = []
+    for part in body.split('\r\n--%s\r\n' % boundary):
+        head, data = part.split('\r\n\r\n', 1)
+        fields = dict(line.split(': ', 1) for line in head.split('\r\n'))
+        parts.append((fields['Content-Range'], data))
+    return parts
+
+def test_multipart_byteranges(repo):
+    content = randstring(10000)
+    post_content(repo.id, '/', 'ranges.txt', content)
+    url, file_id = file_url(repo.id, '/ranges.txt')
+
+    status, headers, body = fileserver_request(url, headers={'Range': 'bytes=100-199'})
+    assert status == 206
+    assert headers['Content-Range'] == 'bytes 100-199/10000'
+    assert body == content[100:200]
+
+    status, headers, body = fileserver_request(url,
+                                               headers={'Range': 'bytes=9000-,0-9,5-19'})
+    assert status == 206
+    assert headers['Content-Type'].startswith('multipart/byteranges')
+    assert int(headers['Content-Length']) == len(body)
+    # Ranges are sorted and overlapping ones are merged.
+    assert parse_byteranges(headers['Content-Type'], body) == [
+        ('bytes 0-19/10000', content[0:20]),
+        ('bytes 9000-9999/10000', content[9000:]),
+    ]
+
+def test_etag_not_modified(repo):
+    content = randstring(100)
+    post_content(repo.id, '/', 'etag.txt', content)
+    url, file_id = file_url(repo.id, '/etag.txt', 'view')
+
+    status, headers, body = fileserver_request(url)
+    assert status == 200
+    assert body == content
+    etag = headers['ETag']
+    assert etag == '"%s"' % file_id
+
+    status, headers, body = fileserver_request(url, headers={'If-None-Match': etag})
+    assert status == 304
+    assert body == ''
+
+    status, headers, body = fileserver_request(url,
+                                               headers={'If-None-Match': '"%s"' % ('0' * 40)})
+    assert status == 200
+    assert body == content
+
+def test_zip_download(repo):
+    contents = {}
+    for i in range(5):
+        name = 'file_%d.txt' % i
+        contents['dir1/' + name] = randstring(1000 * (i + 1))
+        post_content(repo.id, '/dir1', name, contents['dir1/' + name])
+
+    dir_id = api.get_dir_id_by_path(repo.id, '/dir1')
+    obj_id = json.dumps({'obj_id': dir_id, 'dir_name': 'dir1', 'is_windows': 0})
+    token = api.get_fileserver_access_token(repo.id, obj_id, 'download-dir', USER)
+
+    # Streamed archives are ready at once, packed ones after a while.
+    for i in range(30):
+        progress = json.loads(api.query_zip_progress(token))
+        if progress['zipped'] == progress['total']:
+            break
+        time.sleep(1)
+    assert progress['zipped'] == progress['total']
+
+    status, headers, body = fileserver_request('/zip/%s' % token)
+    assert status == 200
+
+    archive = zipfile.ZipFile(StringIO(body))
+    assert archive.testzip() is None
+    files = dict((name, archive.read(name)) for name in archive.namelist()
+                 if not name.endswith('/'))
+    assert files == contents
@@ -0,0 +1,165 @@
+import binascii
+import json
+import os
+import struct
+import tempfile
+import threading
+import time
+import zlib
+
+from synserv import syncwerk_api as api
+
+from tests.config import USER
+from tests.utils import fileserver_request, randstring
+
+ID_LIST_TYPE = 'application/x-syncwerk-obj-ids'
+
+def sync_request(repo_id, path, data=None, headers=None):
+    headers = dict(headers or {})
+    headers['Seafile-Repo-Token'] = api.generate_repo_token(repo_id, USER)
+    return fileserver_request('/repo/%s/%s' % (repo_id, path), data, headers)
+
+def post_content(repo_id, parent_dir, filename, content):
+    fd, path = tempfile.mkstemp()
+    try:
+        os.write(fd, content)
+        os.close(fd)
+        api.post_file(repo_id, path, parent_dir, filename, USER)
+    finally:
+        os.unlink(path)
+
+def file_block_ids(repo_id, path):
+    file_id = api.get_file_id_by_path(repo_id, path)
+    blocks = api.list_file_by_file_id(repo_id, file_id)
+    return [b for b in blocks.split('\n') if b]
+
+def pack(ids):
+    return ''.join(binascii.unhexlify(i) for i in ids)
+
+def unpack(raw):
+    assert len(raw) % 20 == 0
+    return [binascii.hexlify(raw[i:i + 20]) for i in range(0, len(raw), 20)]
+
+def parse_pack_blocks(body):
+    blocks = {}
+    pos = 0
+    while pos < len(body):
+        block_id = body[pos:pos + 40]
+        size, = struct.unpack('!I', body[pos + 40:pos + 44])
+        pos += 44
+        blocks[block_id] = body[pos:pos + size]
+        pos += size
+    assert pos == len(body)
+    return blocks
+
+def head_commit(repo_id):
+    return api.get_repo(repo_id).head_cmmt_id
+
+def test_pack_blocks(repo):
+    contents = {}
+    for name in ('a.txt', 'b.txt'):
+        content = randstring(4096)
+        post_content(repo.id, '/', name, content)
+        for block_id in file_block_ids(repo.id, '/' + name):
+            contents[block_id] = content
+
+    ids = contents.keys()
+    status, headers, body = sync_request(repo.id, 'pack-blocks', json.dumps(ids))
+    assert status == 200
+    assert int(headers['Content-Length']) == len(body)
+    assert parse_pack_blocks(body) == contents
+
+    status, headers, body = sync_request(repo.id, 'pack-blocks', pack(ids),
+                                         {'Content-Type': ID_LIST_TYPE})
+    assert status == 200
+    assert parse_pack_blocks(body) == contents
+
+    status, headers, body = sync_request(repo.id, 'pack-blocks',
+                                         json.dumps(ids + ['0' * 40]))
+    assert status == 500
+
+def test_binary_id_lists(repo):
+    server_head = head_commit(repo.id)
+
+    status, headers, body = sync_request(repo.id, 'fs-id-list/?server-head=%s' % server_head)
+    assert status == 200
+    fs_ids = json.loads(body)
+    assert fs_ids
+
+    status, headers, body = sync_request(repo.id, 'fs-id-list/?server-head=%s' % server_head,
+                                         headers={'Accept': ID_LIST_TYPE})
+    assert status == 200
+    assert headers['Content-Type'] == ID_LIST_TYPE
+    assert sorted(unpack(body)) == sorted(fs_ids)
+
+    missing = 'f' * 40
+    status, headers, body = sync_request(repo.id, 'check-fs', pack(fs_ids + [missing]),
+                                         {'Content-Type': ID_LIST_TYPE,
+                                          'Accept': ID_LIST_TYPE})
+    assert status == 200
+    assert headers['Content-Type'] == ID_LIST_TYPE
+    assert unpack(body) == [missing]
+
+    status, headers, body = sync_request(repo.id, 'check-fs', pack(fs_ids)[:-1],
+                                         {'Content-Type': ID_LIST_TYPE})
+    assert status == 400
+
+def test_head_commits_poll(repo):
+    head = head_commit(repo.id)
+    stale = {repo.id: '0' * 40}
+
+    # Known heads that are out of date are answered at once.
+    status, headers, body = fileserver_request('/repo/head-commits-poll',
+                                               json.dumps(stale))
+    assert status == 200
+    assert json.loads(body) == {repo.id: head}
+
+    result = {}
+    def poll():
+        start = time.time()
+        result['reply'] = fileserver_request('/repo/head-commits-poll',
+                                             json.dumps({repo.id: head}))
+        result['elapsed'] = time.time() - start
+
+    poller = threading.Thread(target=poll)
+    poller.start()
+    time.sleep(1)
+    assert poller.is_alive()
+
+    api.post_dir(repo.id, '/', 'new_dir', USER)
+    poller.join(30)
+    assert not poller.is_alive()
+
+    status, headers, body = result['reply']
+    assert status == 200
+    assert json.loads(body) == {repo.id: head_commit(repo.id)}
+    assert result['elapsed'] < 30
+
+    status, headers, body = fileserver_request('/repo/head-commits-poll', '{}')
+    assert status == 400
+    status, headers, body = fileserver_request('/repo/head-commits-poll',
+                                               json.dumps({'not-a-uuid': head}))
+    assert status == 400
+
+def test_gzip_negotiation(repo):
+    # Enough ids for the reply to be worth compressing.
+    for i in range(40):
+        api.post_dir(repo.id, '/', 'dir_%d' % i, USER)
+    path = 'fs-id-list/?server-head=%s' % head_commit(repo.id)
+
+    status, headers, body = sync_request(repo.id, path)
+    assert status == 200
+    assert 'Content-Encoding' not in headers
+    fs_ids = json.loads(body)
+
+    status, headers, body = sync_request(repo.id, path, headers={'Accept-Encoding': 'gzip'})
+    assert status == 200
+    assert headers['Content-Encoding'] == 'gzip'
+    assert 'Accept-Encoding' in headers['Vary']
+    assert json.loads(zlib.decompress(body, 16 + zlib.MAX_WBITS)) == fs_ids
+
+    status, headers, body = sync_request(repo.id, path,
+                                         headers={'Accept-Encoding': 'gzip;q=0'})
+    assert status == 200
+    assert 'Content-Encoding' not in headers
+    assert json.loads(body) == fs_ids
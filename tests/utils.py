@@ -1,8 +1,10 @@
 import os
 import random
 import string
+import urllib2
 
 from synserv import ccnet_api, syncwerk_api
+from tests.config import FILESERVER_URL
 
 
 def create_and_get_repo(*a, **kw):
@@ -25,3 +27,14 @@ def assert_repo_with_permission(r1, r2, permission):
         r2 = r2[0]
     assert r2.id == r1.id
     assert r2.permission == permission
+
+def fileserver_request(path, data=None, headers=None, method=None):
+    """Send a request to the fileserver. Returns (status, headers, body)."""
+    req = urllib2.Request(FILESERVER_URL + path, data=data, headers=headers or {})
+    if method:
+        req.get_method = lambda: method
+    try:
+        resp = urllib2.urlopen(req)
+    except urllib2.HTTPError as e:
+        return e.code, e.info(), e.read()
+    return resp.getcode(), resp.info(), resp.read()